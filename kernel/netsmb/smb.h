@@ -1155,4 +1155,48 @@ enum stream_types {
 	kMsStream = 8
 };
 
+/*
+ * Latency histogram kept for each SMB 2/3 command and each VNOP. Bucket i
+ * counts operations that took [2^i, 2^(i+1)) usecs, except bucket 0 also
+ * gets anything under 1 usec and the last bucket anything longer.
+ */
+#define SMB_LAT_BUCKETS		24
+#define SMB_LAT_NCMDS		19	/* SMB2_NEGOTIATE through SMB2_OPLOCK_BREAK */
+
+struct smb_lat_hist {
+	uint64_t	lh_count;
+	uint64_t	lh_errors;
+	uint64_t	lh_total_usecs;
+	uint64_t	lh_max_usecs;
+	uint64_t	lh_buckets[SMB_LAT_BUCKETS];
+};
+
+/* VNOPs that get a latency histogram, used to index sm_vop_stats */
+enum smbfs_vop_types {
+	SMBFS_VOP_LOOKUP = 0,
+	SMBFS_VOP_GETATTR,
+	SMBFS_VOP_SETATTR,
+	SMBFS_VOP_OPEN,
+	SMBFS_VOP_CLOSE,
+	SMBFS_VOP_READ,
+	SMBFS_VOP_WRITE,
+	SMBFS_VOP_READDIR,
+	SMBFS_VOP_GETATTRLISTBULK,
+	SMBFS_VOP_CREATE,
+	SMBFS_VOP_MKDIR,
+	SMBFS_VOP_REMOVE,
+	SMBFS_VOP_RMDIR,
+	SMBFS_VOP_RENAME,
+	SMBFS_VOP_FSYNC,
+	SMBFS_VOP_PAGEIN,
+	SMBFS_VOP_PAGEOUT,
+	SMBFS_VOP_GETXATTR,
+	SMBFS_VOP_SETXATTR,
+	SMBFS_VOP_LISTXATTR,
+	SMBFS_VOP_REMOVEXATTR,
+	SMBFS_VOP_ACCESS,
+	SMBFS_VOP_COPYFILE,
+	SMBFS_VOP_MAX
+};
+
 #endif /* _NETSMB_SMB_H_ */
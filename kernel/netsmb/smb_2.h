@@ -29,7 +29,11 @@
 
 /*
  * SMB 2/3 Crediting constants
- * kCREDIT_REQUEST_AMT - number of credits to request when client needs more
+ * kCREDIT_REQUEST_AMT - max number of credits to request in one request
+ * kCREDIT_TARGET_MIN - client always tries to have at least this many credits,
+ *                      above that it asks for as many as the requests in
+ *                      flight and waiting for credits use, see
+ *                      smb2_rq_credit_request_amt()
  * kCREDIT_LOW_WATER - If client gets below this number of credits,
  *                     1) Start using only 1 credit at a time instead of multi
  *                     2) If multi credit leaves less than this amount, adjust
@@ -39,10 +43,9 @@
  *                   Be very careful in changing this value as there are times
  *                   when we only have one credit granted to us.
  * kCREDIT_MAX_AMT - maximum of credits that client will try to get.
- *                   Currently as long as below this amount, keep asking for
- *                   more credits until we get this amount.
  */
 #define kCREDIT_REQUEST_AMT 256
+#define kCREDIT_TARGET_MIN 128
 #define kCREDIT_LOW_WATER 10
 #define kCREDIT_MIN_AMT 1
 /* crediting fields are UInt32, but SMB 2/3 Header has UInt16 credit fields */
@@ -54,7 +57,10 @@ typedef enum _SMB2_DURABLE_HANDLE_FLAGS
     SMB2_DURABLE_HANDLE_REQUEST = 0x0001,
     SMB2_DURABLE_HANDLE_RECONNECT = 0x0002,
     SMB2_DURABLE_HANDLE_GRANTED = 0x0004,
-    SMB2_LEASE_GRANTED = 0x0008
+    SMB2_LEASE_GRANTED = 0x0008,
+    SMB2_LEASE_REQUEST = 0x0010,        /* Lease only, no durable handle */
+    SMB2_LEASE_V2 = 0x0020,             /* Version 2 lease context, needed for dirs */
+    SMB2_LEASE_PARENT_KEY = 0x0040      /* parent_lease_key_hi/low are set, V2 only */
 } _SMB2_DURABLE_HANDLE_FLAGS;
 
 struct smb2_durable_handle {
@@ -63,7 +69,10 @@ struct smb2_durable_handle {
     uint64_t lease_key_hi;      /* atomic increment number */
     uint64_t lease_key_low;     /* node hash value */
     uint32_t lease_state;
-    uint32_t pad;
+    uint16_t epoch;             /* only returned in a version 2 lease */
+    uint16_t pad;
+    uint64_t parent_lease_key_hi;   /* lease key of the parent directory */
+    uint64_t parent_lease_key_low;
 };
 
 /* 
@@ -353,6 +362,15 @@ struct finder_info {
 #define SMB2_DIALECT_0210   0x0210
 #define SMB2_DIALECT_0300   0x0300
 #define SMB2_DIALECT_0302   0x0302
+#define SMB2_DIALECT_0311   0x0311
+
+/* SMB 3.1.1 Negotiate Context types, 2.2.3.1 */
+#define SMB2_PREAUTH_INTEGRITY_CAPABILITIES 0x0001
+#define SMB2_ENCRYPTION_CAPABILITIES        0x0002
+
+/* SMB 3.1.1 Preauth Integrity, 2.2.3.1.1 */
+#define SMB2_PREAUTH_INTEGRITY_SHA512   0x0001
+#define SMB2_PREAUTH_SALT_LEN           32
 
 #define	SMB2_TID_UNKNOWN	0xffffffff
 
@@ -417,6 +435,9 @@ struct finder_info {
 #define SMB2_LEASE_HANDLE_CACHING   0x02
 #define SMB2_LEASE_WRITE_CACHING	0x04
 
+/* SMB 2/3 Lease Flags in a create lease context, 2.2.13.2.10 */
+#define SMB2_LEASE_FLAG_PARENT_LEASE_KEY_SET	0x04
+
 /* SMB 2/3 ImpersonationLevel, 2.2.13 */
 #define SMB2_IMPERSONATION_ANONYMOUS	    0x00000000
 #define SMB2_IMPERSONATION_IDENTIFICATION   0x00000001
@@ -654,11 +675,19 @@ struct FILE_STREAM_INFORMATION
 #define SMB3_AES_AUTHDATA_OFF       20
 #define SMB3_AES_AUTHDATA_LEN       32
 #define SMB3_CCM_NONCE_LEN          11
+#define SMB3_GCM_NONCE_LEN          12
 
 /* Transform Header (TF) */
 #define SMB3_AES_TF_HDR_LEN         52
 
+/* Cipher ids, also used in the 3.1.1 Encryption Capabilities context */
 #define SMB2_ENCRYPTION_AES128_CCM  0x0001
+#define SMB2_ENCRYPTION_AES128_GCM  0x0002
+#define SMB2_ENCRYPTION_AES256_CCM  0x0003
+#define SMB2_ENCRYPTION_AES256_GCM  0x0004
+
+/* In 3.1.1 the EncryptionAlgorithm field became Flags */
+#define SMB2_TRANSFORM_FLAG_ENCRYPTED   0x0001
 
 #define SMB3_AES_TF_PROTO_OFF   0
 #define	SMB3_AES_TF_PROTO_STR   "\xFDSMB"
@@ -49,6 +49,7 @@
 #include <netsmb/smb_dev.h>
 #include <netsmb/smb_tran.h>
 #include <netsmb/smb_trantcp.h>
+#include <netsmb/smb_tranloop.h>
 #include <netsmb/smb_gss.h>
 #include <netsmb/netbios.h>
 
@@ -383,6 +384,8 @@ static void smb_vc_free(struct smb_connobj *cp)
 		SMB_FREE(vcp->vc_mackey, M_SMBTEMP);
     }
     
+    smb_crypt_ctx_free(vcp);
+    
     if (vcp->vc_saddr) {
 		SMB_FREE(vcp->vc_saddr, M_SONAME);
     }
@@ -460,10 +463,11 @@ static int smb_vc_create(struct smbioc_negotiate *vcspec,
 	vcp->vc_number = smb_vcnext++;
 	vcp->vc_timo = SMB_DEFRQTIMO;
 	vcp->vc_smbuid = SMB_UID_UNKNOWN;
-	vcp->vc_tdesc = &smb_tran_nbtcp_desc;
+	vcp->vc_tdesc = (smb_tran_loop_addr(saddr)) ? &smb_tran_loop_desc : &smb_tran_nbtcp_desc;
 	vcp->vc_seqno = 0;
 	vcp->vc_mackey = NULL;
 	vcp->vc_mackeylen = 0;
+	vcp->vc_full_mackeylen = 0;
     vcp->vc_smb3_signing_key_len = 0;
     vcp->vc_smb3_encrypt_key_len = 0;
     vcp->vc_smb3_decrypt_key_len = 0;
@@ -489,6 +493,8 @@ static int smb_vc_create(struct smbioc_negotiate *vcspec,
 	vcp->reconnect_wait_time = vcspec->ioc_ssn.ioc_reconnect_wait_time;	
 	
     lck_mtx_init(&vcp->vc_credits_lock, vc_credits_lck_group, vc_credits_lck_attr);
+    TAILQ_INIT(&vcp->vc_credits_metaq);
+    TAILQ_INIT(&vcp->vc_credits_bulkq);
 
 	lck_mtx_init(&vcp->vc_stlock, vcst_lck_group, vcst_lck_attr);
 
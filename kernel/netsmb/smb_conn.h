@@ -118,6 +118,7 @@
 #define SMBV_SERVER_MODE_MASK       0x0000ff00		/* This nible is reserved for special server types */
 
 #define SMBV_NETWORK_SID            0x00010000		/* The user's sid has been set on the vc */
+#define SMBV_SMB311                 0x00020000		/* Using SMB 3.1.1 */
 #define	SMBV_AUTH_DONE              0x00080000		/* Security compeleted successfully */
 #define SMBV_PRIV_GUEST_ACCESS      0x00100000		/* Guest access is private */
 #define SMBV_KERBEROS_ACCESS        0x00200000		/* This VC is using Kerberos */
@@ -154,7 +155,13 @@
  * True if dialect is SMB 2.1 or later (i.e., SMB 2.1, SMB 3.0, SMB 3.1, SMB 3.02, ...)
  * Important: Remember to update this when adding new dialects.
  */
-#define SMBV_SMB21_OR_LATER(vcp) (((vcp)->vc_flags & (SMBV_SMB21 | SMBV_SMB30 | SMBV_SMB302)) != 0)
+#define SMBV_SMB21_OR_LATER(vcp) (((vcp)->vc_flags & (SMBV_SMB21 | SMBV_SMB30 | SMBV_SMB302 | SMBV_SMB311)) != 0)
+
+/*
+ * True if dialect is SMB 3.0 or later, i.e., SMB 3 signing and encryption apply.
+ * Important: Remember to update this when adding new dialects.
+ */
+#define SMBV_SMB3_OR_LATER(vcp) (((vcp)->vc_flags & (SMBV_SMB30 | SMBV_SMB302 | SMBV_SMB311)) != 0)
 
 #define kSMB_64K 65536      /* For the QueryDir and QueryInfo limits */
 #define kSMB_63K 65534      /* <14281932> Max Net App can handle in IOCTL */
@@ -319,8 +326,24 @@ struct smb_gss {
 #define	SMBC_CREDIT_LOCK(vcp)	lck_mtx_lock(&(vcp)->vc_credits_lock)
 #define	SMBC_CREDIT_UNLOCK(vcp)	lck_mtx_unlock(&(vcp)->vc_credits_lock)
 
+/*
+ * A thread waiting in line for SMB 2/3 credits, see smb2_rq_credit_wakeup()
+ */
+struct smb_credit_waiter {
+	TAILQ_ENTRY(smb_credit_waiter) cw_link;
+	int32_t		cw_charge;		/* credits the request expects to use */
+	int			cw_granted;		/* handed credits and taken off the queue */
+};
+TAILQ_HEAD(smb_credit_waitq, smb_credit_waiter);
+
 /* SMB3 Signing/Encrypt Key Length */
 #define SMB3_KEY_LEN 16
+/* AES-256 ciphers use 32 byte encrypt/decrypt keys */
+#define SMB3_MAX_KEY_LEN 32
+/* SMB 3.1.1 Preauth Integrity hash length (SHA-512) */
+#define SMB3_PREAUTH_HASH_LEN 64
+
+struct smb_crypt_ctx;	/* see smb_crypt.c */
 
 struct smb_vc {
 	struct smb_connobj	obj;
@@ -350,10 +373,34 @@ struct smb_vc {
 	uint32_t            vc_credits_granted; /* SMB 2/3 credits granted */
 	uint32_t            vc_credits_ss_granted; /* SMB 2/3 credits granted from session setup replies */
 	uint32_t            vc_credits_max;     /* SMB 2/3 max amount of credits server has granted us */
-	int32_t             vc_credits_wait;    /* SMB 2/3 credit wait */
+	int32_t             vc_credits_wait;    /* SMB 2/3 number of requests waiting for credits */
     uint32_t            vc_req_pending;     /* SMB 2/3 set if there is a pending request */
     uint64_t            vc_oldest_message_id; /* SMB 2/3 oldest pending request message id */
 	lck_mtx_t			vc_credits_lock;
+    struct smb_credit_waitq vc_credits_metaq; /* SMB 2/3 metadata requests waiting for credits */
+    struct smb_credit_waitq vc_credits_bulkq; /* SMB 2/3 read/write requests waiting for credits */
+    int32_t             vc_credits_handed;  /* SMB 2/3 credits handed to waiters that have not run yet */
+    uint64_t            vc_credits_wait_cnt; /* SMB 2/3 number of times a request waited for credits */
+    uint64_t            vc_credits_wait_usecs; /* SMB 2/3 total time spent waiting for credits */
+    uint64_t            vc_credits_wait_max_usecs; /* SMB 2/3 longest wait for credits */
+    uint32_t            vc_credits_wait_charge; /* SMB 2/3 credits wanted by waiting requests */
+    uint32_t            vc_credits_inflight; /* SMB 2/3 credits charged by requests not done yet */
+    uint32_t            vc_credits_asked;   /* SMB 2/3 extra credits asked for by requests not done yet */
+    uint32_t            vc_credits_target;  /* SMB 2/3 credits we are trying to have on hand */
+    uint64_t            vc_credits_total_granted; /* SMB 2/3 credits granted by server */
+    uint64_t            vc_credits_total_consumed; /* SMB 2/3 credits charged by requests */
+    uint64_t            vc_credits_total_requested; /* SMB 2/3 credits asked for in requests */
+    struct smb_lat_hist vc_cmd_stats[SMB_LAT_NCMDS]; /* SMB 2/3 latency by command */
+    uint64_t            vc_bytes_sent;      /* bytes handed to the transport, NetBIOS headers included */
+    uint64_t            vc_bytes_recvd;     /* bytes read from the transport, NetBIOS headers included */
+    uint64_t            vc_msgs_sent;       /* messages sent, a compound chain is one message */
+    uint64_t            vc_msgs_recvd;      /* messages received */
+    uint64_t            vc_send_calls;      /* socket writes, one can carry several messages */
+    int32_t             vc_place_pending;   /* requests with a sr_place_uio, see smb_iod_rq_place */
+    uint32_t            vc_srtt_usecs;      /* SMB 2/3 smoothed round trip time of replies */
+    uint32_t            vc_rtt_min_usecs;   /* SMB 2/3 shortest round trip time seen */
+    uint64_t            vc_reconnect_cnt;   /* reconnects attempted */
+    uint64_t            vc_reconnect_usecs; /* total time spent in reconnect */
 	uint64_t            vc_session_id;      /* SMB 2/3 session id */
 	uint64_t            vc_prev_session_id; /* SMB 2/3 prev sessID for reconnect */
 	uint64_t            vc_misc_flags;      /* SMB 2/3 misc flags */
@@ -361,26 +408,38 @@ struct smb_vc {
 	uint32_t			vc_txmax;			/* max tx/rx packet size */
 	uint32_t			vc_rxmax;			/* max readx data size */
 	uint32_t			vc_wxmax;			/* max writex data size */
+	int32_t				vc_rw_read_window;	/* SMB 2/3 async read window in quanta, see smb_smb_2.c */
+	int32_t				vc_rw_write_window;	/* SMB 2/3 async write window in quanta */
 	struct smbiod		*vc_iod;
 	lck_mtx_t			vc_stlock;
 	uint32_t			vc_seqno;			/* my next sequence number */
 	uint8_t				*vc_mackey;			/* MAC key */
 	uint32_t			vc_mackeylen;		/* length of MAC key */
+	uint32_t			vc_full_mackeylen;	/* length of MAC key before SMB 2/3 truncation */
     
     /* SMB 3 signing key (Session.SessionKey) */
     uint8_t             vc_smb3_signing_key[SMB3_KEY_LEN];
     uint32_t            vc_smb3_signing_key_len;
     
     /* SMB 3 encryption key (Session.EncryptionKey) */
-    /* A 128-bit key used for encrypting messages sent by the client */
-    uint8_t             vc_smb3_encrypt_key[SMB3_KEY_LEN];
+    /* A 128 or 256-bit key used for encrypting messages sent by the client */
+    uint8_t             vc_smb3_encrypt_key[SMB3_MAX_KEY_LEN];
     uint32_t            vc_smb3_encrypt_key_len;
     
     /* SMB 3 decryption key (Session.DecryptionKey) */
-    /* A 128-bit key used for decrypting messages received from the server. */
-    uint8_t             vc_smb3_decrypt_key[SMB3_KEY_LEN];
+    /* A 128 or 256-bit key used for decrypting messages received from the server. */
+    uint8_t             vc_smb3_decrypt_key[SMB3_MAX_KEY_LEN];
     uint32_t            vc_smb3_decrypt_key_len;
     
+    /* SMB 3 cipher (Connection.CipherId), AES-128-CCM before 3.1.1 */
+    uint16_t            vc_smb3_cipher;
+    
+    /* SMB 3.1.1 Preauth integrity hash of the Negotiate/SessionSetup exchanges */
+    uint8_t             vc_preauth_hash[SMB3_PREAUTH_HASH_LEN];
+    
+    /* Keyed signing/cipher contexts, rebuilt when the keys change */
+    struct smb_crypt_ctx *vc_crypt_ctx;
+    
     /* SMB 3 Nonce used for encryption */
     uint64_t            vc_smb3_nonce_high;
     uint64_t            vc_smb3_nonce_low;
@@ -444,6 +503,7 @@ struct smb_share {
 	uint16_t		optionalSupport;
 	uint32_t		maxAccessRights;    /* SMB 1 and SMB 2/3 */
 	uint32_t		maxGuestAccessRights;
+	struct smb_lat_hist	ss_cmd_stats[SMB_LAT_NCMDS];	/* SMB 2/3 latency by command */
 	
 	/* SMB 2/3 FID mapping support */
 	lck_mtx_t		ss_fid_lock;
@@ -566,7 +626,7 @@ int  smb_checkdir(struct smb_share *share, struct smbnode *dnp,
 #define	SMBIOD_EV_SHUTDOWN	0x0002
 #define SMBIOD_EV_FORCE_RECONNECT 0x0003
 #define	SMBIOD_EV_DISCONNECT 0x0004
-/* 0x0005 available for use */
+#define	SMBIOD_EV_LEASE_BREAK 0x0005
 #define	SMBIOD_EV_NEGOTIATE	0x0006
 #define	SMBIOD_EV_SSNSETUP	0x0007
 
@@ -586,6 +646,19 @@ struct smbiod_event {
 #define	SMBIOD_RECONNECT		0x0004
 #define	SMBIOD_START_RECONNECT	0x0008
 #define	SMBIOD_VC_NOTRESP		0x0010
+#define	SMBIOD_RCV_THREAD		0x0020	/* replies are received on a separate thread */
+#define	SMBIOD_RCV_RUNNING		0x0040	/* receive thread is running */
+#define	SMBIOD_RCV_SHUTDOWN		0x0080	/* receive thread should exit */
+#define	SMBIOD_RCV_STALLED		0x0100	/* receive thread hit a fatal error, needs reconnect */
+
+/*
+ * SMB 2/3 message id hash of outstanding requests. Message ids are handed out
+ * sequentially, so the low bits spread the requests evenly over the buckets.
+ */
+#define SMB_IOD_RQHASH_SIZE		1024
+#define SMB_IOD_RQHASH_MASK		(SMB_IOD_RQHASH_SIZE - 1)
+
+LIST_HEAD(smb_rqhash_head, smb_rq);
 
 struct smbiod {
     int                 iod_id;
@@ -600,8 +673,15 @@ struct smbiod {
     struct smb_vc *     iod_vc;
     lck_mtx_t           iod_rqlock;     /* iod_rqlist, iod_muxwant */
     struct smb_rqhead   iod_rqlist;     /* list of outstanding requests */
+    struct smb_rqhash_head iod_rqhash[SMB_IOD_RQHASH_SIZE]; /* SMB 2/3 rqp by message id, protected by iod_rqlock */
+    uint64_t            iod_rqhash_inserted;
+    uint64_t            iod_rqhash_collisions;
+    uint64_t            iod_rqhash_max_iter;
     int                 iod_muxwant;
     vfs_context_t       iod_context;
+    lck_mtx_t           iod_rcvlock;    /* serializes smb_iod_recvall and transport teardown */
+    thread_t            iod_rcv_thread; /* receive thread, if SMBIOD_RCV_THREAD */
+    int                 iod_rcv_workflag;
     lck_mtx_t           iod_evlock;     /* iod_evlist */
     STAILQ_HEAD(,smbiod_event) iod_evlist;
     struct timespec     iod_lastrqsent;
@@ -621,6 +701,11 @@ int  smb_iod_request(struct smbiod *iod, int event, void *ident);
 int  smb_iod_rq_enqueue(struct smb_rq *rqp);
 int  smb_iod_waitrq(struct smb_rq *rqp);
 int  smb_iod_removerq(struct smb_rq *rqp);
+void smb_iod_rq_sendwait(struct smb_rq *rqp);
+struct smb_rq *smb_iod_rq_place(struct smb_vc *vcp, mbuf_t m, uint32_t msg_len,
+                                uio_t *uiop, uint32_t *place_lenp);
+void smb_iod_rq_place_done(struct smb_rq *rqp, uio_t uio, uint32_t place_len,
+                           int error);
 void smb_iod_errorout_share_request(struct smb_share *share, int error);
 
 extern lck_grp_attr_t *co_grp_attr;
@@ -651,6 +736,10 @@ extern lck_grp_attr_t *iodrq_grp_attr;
 extern lck_grp_t *iodrq_lck_group;
 extern lck_attr_t *iodrq_lck_attr;
 
+extern lck_grp_attr_t *iodrcv_grp_attr;
+extern lck_grp_t *iodrcv_lck_group;
+extern lck_attr_t *iodrcv_lck_attr;
+
 extern lck_grp_attr_t *iodev_grp_attr;
 extern lck_grp_t *iodev_lck_group;
 extern lck_attr_t *iodev_lck_attr;
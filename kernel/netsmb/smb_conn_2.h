@@ -54,6 +54,8 @@ int smb2_smb_ioctl(struct smb_share *share, void *arg_ptr,
                    struct smb_rq **compound_rqp, vfs_context_t context);
 int smb2_smb_lease_break_ack(struct smb_share *share, uint64_t lease_key_hi, uint64_t lease_key_low,
                              uint32_t lease_state, uint32_t *ret_lease_state, vfs_context_t context);
+int smb2_smb_lease_init(struct smb_share *share, struct smbnode *np,
+                        uint32_t lease_state, struct smb2_durable_handle *lease);
 int smb2_smb_lock(struct smb_share *share, int op, SMBFID fid,
                   off_t offset, uint64_t length, vfs_context_t context);
 int smb2_smb_negotiate(struct smb_vc *vcp, struct smb_rq *rqp,
@@ -68,8 +70,8 @@ int smb2_smb_parse_create(struct smb_share *share, struct mdchain *mdp,
 int smb2_smb_parse_close(struct mdchain *mdp, struct smb2_close_rq *closep);
 int smb2_smb_parse_ioctl(struct mdchain *mdp, struct smb2_ioctl_rq *ioctlp);
 int smb2_smb_parse_lease_break(struct smbiod *iod, mbuf_t m);
-int smb2_smb_parse_read_one(struct mdchain *mdp, user_ssize_t *rresid,
-                            struct smb2_rw_rq *rwp);
+int smb2_smb_parse_read_one(struct smb_rq *rqp, struct mdchain *mdp,
+                            user_ssize_t *rresid, struct smb2_rw_rq *rwp);
 int smb2_smb_parse_svrmsg_notify(struct smb_rq *rqp,
                                  uint32_t *svr_action,
                                  uint32_t *delay);
@@ -101,6 +103,18 @@ int smb2_smb_read_one(struct smb_share *share,
                       vfs_context_t context);
 int smb2_smb_read(struct smb_share *share, void *arg_ptr, 
                   vfs_context_t context);
+int smb2_smb_rw_async_build(struct smb_share *share,
+                            struct smb2_rw_rq *read_writep,
+                            user_ssize_t *len,
+                            uint32_t do_read,
+                            void (*callback)(void *),
+                            void *callback_args,
+                            struct smb_rq **rqpp,
+                            vfs_context_t context);
+int smb2_smb_rw_async_reply(struct smb_rq *rqp,
+                            struct smb2_rw_rq *read_writep,
+                            uint32_t do_read,
+                            user_ssize_t *rresid);
 int smb_smb_read(struct smb_share *share, SMBFID fid, uio_t uio, 
                  vfs_context_t context);
 int smb2_smb_set_info(struct smb_share *share, void *args_ptr,
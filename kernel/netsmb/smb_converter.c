@@ -260,6 +260,105 @@ ucs2_to_codepage(const uint16_t *convtbl, const uint16_t *src, size_t srclen,
 	*buflen = n;
 }
 
+/*
+ * ASCII fast paths
+ *
+ * Almost every file name on the wire is plain ASCII, which comes out the same
+ * from the utf8 routines apart from a handful of characters they give special
+ * meaning to. For those names just widen or narrow each character, checking
+ * eight bytes at a time for anything that is not ASCII. If any character
+ * needs more care, the name goes through the utf8 routines as before.
+ */
+#if BYTE_ORDER == LITTLE_ENDIAN
+#define SMB_UTF16LE_NOT_ASCII	0xff80ff80ff80ff80ULL
+#else
+#define SMB_UTF16LE_NOT_ASCII	0x80ff80ff80ff80ffULL
+#endif
+#define SMB_UTF8_NOT_ASCII		0x8080808080808080ULL
+
+/*
+ * Characters utf8_decodestr may change with UTF_SFM_CONVERSIONS or otherwise,
+ * so never copy these straight through.
+ */
+static __inline int
+smb_ascii_needs_conversion(uint8_t ch)
+{
+	if ((ch < 0x20) || (ch >= 0x7f))
+		return 1;
+	switch (ch) {
+		case '"': case '*': case '/': case ':':
+		case '<': case '>': case '?': case '\\': case '|':
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Widen an all ASCII UTF-8 name to UTF-16LE. Returns 0 and doesn't touch
+ * *outlen if the name needs the full conversion.
+ */
+static int
+smb_ascii_to_utf16le(const uint8_t *src, size_t srclen, uint8_t *dst,
+					 size_t dstlen, size_t *outlen)
+{
+	uint64_t word;
+	size_t ii;
+	
+	if ((srclen == 0) || ((srclen * 2) > dstlen))
+		return 0;
+	
+	/* Trailing spaces and periods get SFM mappings */
+	if ((src[srclen - 1] == ' ') || (src[srclen - 1] == '.'))
+		return 0;
+	
+	for (ii = 0; (ii + sizeof(word)) <= srclen; ii += sizeof(word)) {
+		memcpy(&word, &src[ii], sizeof(word));
+		if (word & SMB_UTF8_NOT_ASCII)
+			return 0;
+	}
+	
+	for (ii = 0; ii < srclen; ii++) {
+		if (smb_ascii_needs_conversion(src[ii]))
+			return 0;
+		dst[ii * 2] = src[ii];
+		dst[(ii * 2) + 1] = 0;
+	}
+	*outlen = srclen * 2;
+	return 1;
+}
+
+/*
+ * Narrow an all ASCII UTF-16LE name to UTF-8. Returns 0 and doesn't touch
+ * *outlen if the name needs the full conversion.
+ */
+static int
+smb_utf16le_to_ascii(const uint8_t *src, size_t srclen, uint8_t *dst,
+					 size_t dstlen, size_t *outlen)
+{
+	uint64_t word;
+	size_t ii, nchars = srclen / 2;
+	
+	if ((nchars == 0) || (srclen & 1) || (nchars > dstlen))
+		return 0;
+	
+	for (ii = 0; (ii + sizeof(word)) <= srclen; ii += sizeof(word)) {
+		memcpy(&word, &src[ii], sizeof(word));
+		if (word & SMB_UTF16LE_NOT_ASCII)
+			return 0;
+	}
+	
+	for (ii = 0; ii < nchars; ii++) {
+		/* utf8_encodestr changes slashes and nulls */
+		if ((src[ii * 2] & 0x80) || (src[(ii * 2) + 1] != 0) ||
+			(src[ii * 2] == '/') || (src[ii * 2] == 0))
+			return 0;
+		dst[ii] = src[ii * 2];
+	}
+	*outlen = nchars;
+	return 1;
+}
+
 /*
  * smb_convert_to_network
  *
@@ -295,8 +394,12 @@ smb_convert_to_network(const char **inbuf, size_t *inbytesleft, char **outbuf,
 		/* Little endian Unicode over the wire */
 		if (BYTE_ORDER != LITTLE_ENDIAN)
 			flags |= UTF_REVERSE_ENDIAN;
-		error = utf8_decodestr((const uint8_t*)*inbuf, inlen, (uint16_t *)*outbuf, 
-							   &outlen, *outbytesleft, 0, flags);
+		if (smb_ascii_to_utf16le((const uint8_t *)*inbuf, inlen, 
+								 (uint8_t *)*outbuf, *outbytesleft, &outlen))
+			error = 0;
+		else
+			error = utf8_decodestr((const uint8_t*)*inbuf, inlen, (uint16_t *)*outbuf, 
+								   &outlen, *outbytesleft, 0, flags);
 		
 	} else {
 		const uint16_t *cptable = (const uint16_t *)cp437_from_ucs2;
@@ -350,7 +453,11 @@ smb_convert_from_network(const char **inbuf, size_t *inbytesleft, char **outbuf,
 		/* Little endian Unicode over the wire */
 		if (BYTE_ORDER != LITTLE_ENDIAN)
 			flags |= UTF_REVERSE_ENDIAN;
-		error = utf8_encodestr((uint16_t *)*inbuf, inlen, (uint8_t *)*outbuf, &outlen, *outbytesleft, 0, flags);	
+		if (smb_utf16le_to_ascii((const uint8_t *)*inbuf, inlen, 
+								 (uint8_t *)*outbuf, *outbytesleft, &outlen))
+			error = 0;
+		else
+			error = utf8_encodestr((uint16_t *)*inbuf, inlen, (uint8_t *)*outbuf, &outlen, *outbytesleft, 0, flags);	
 	} else {
 		const uint16_t *cptable = (const uint16_t *)cp437_to_ucs2;
 		uint16_t buf[SMB_MAXFNAMELEN*2];	/* When using code pages we only support 256 file names */
@@ -62,6 +62,7 @@
 #include <corecrypto/ccsha2.h>
 #include <corecrypto/cccmac.h>
 #include <corecrypto/ccnistkdf.h>
+#include <corecrypto/ccaes.h>
 
 
 #define SMBSIGLEN (8)
@@ -426,6 +427,8 @@ void smb_reset_sig(struct smb_vc *vcp)
     
     vcp->vc_mackey = NULL;
     vcp->vc_mackeylen = 0;
+    vcp->vc_full_mackeylen = 0;
+    smb_crypt_ctx_invalidate(vcp);
     vcp->vc_smb3_signing_key_len = 0;
     vcp->vc_seqno = 0;
 }
@@ -597,6 +600,207 @@ smb_rq_verify(struct smb_rq *rqp)
 	return (EAUTH);
 }
 
+/*
+ * Keyed signing and cipher state for a VC. The AES key expansion and the
+ * HMAC inner/outer pads are done once when the keys change, and each message
+ * starts from a copy of the keyed context on its own stack. Sign, verify,
+ * encrypt and decrypt run on different threads and a rekey can happen under
+ * them, so cc_lock is held while a template is written or copied.
+ */
+#define SMB_CRYPT_HMAC      0       /* HMAC-SHA256 with vc_mackey, SMB 2.x */
+#define SMB_CRYPT_CMAC      1       /* AES-CMAC with the SMB 3 signing key */
+#define SMB_CRYPT_CCM_ENCRYPT   2   /* AES-CCM with the encrypt key */
+#define SMB_CRYPT_CCM_DECRYPT   3   /* AES-CCM with the decrypt key */
+#define SMB_CRYPT_GCM_ENCRYPT   4   /* AES-GCM with the encrypt key */
+#define SMB_CRYPT_GCM_DECRYPT   5   /* AES-GCM with the decrypt key */
+#define SMB_CRYPT_NCTX          6
+
+struct smb_crypt_ctx {
+    lck_mtx_t   cc_lock;                    /* cc_valid and the templates */
+    uint32_t    cc_valid;                   /* bit per SMB_CRYPT_ context */
+    size_t      cc_size[SMB_CRYPT_NCTX];
+    uint8_t     *cc_ctx[SMB_CRYPT_NCTX];
+};
+
+/*
+ * Save a keyed context as the template for 'which'. Each kind of context has
+ * its own slot and always the same size, so the buffer is allocated once and
+ * only freed with the VC. A reader racing a rekey never sees freed memory.
+ */
+static void
+smb_crypt_ctx_save(struct smb_vc *vcp, int which, const void *ctx, size_t size)
+{
+    struct smb_crypt_ctx *cc = vcp->vc_crypt_ctx;
+    
+    if (cc == NULL) {
+        SMB_MALLOC(cc, struct smb_crypt_ctx *, sizeof(*cc), M_SMBTEMP, M_WAITOK | M_ZERO);
+        if (cc == NULL) {
+            return;
+        }
+        lck_mtx_init(&cc->cc_lock, vcst_lck_group, vcst_lck_attr);
+        vcp->vc_crypt_ctx = cc;
+    }
+    
+    lck_mtx_lock(&cc->cc_lock);
+    cc->cc_valid &= ~(1 << which);
+    
+    if ((cc->cc_ctx[which] != NULL) && (cc->cc_size[which] != size)) {
+        /* Can't happen, leave it invalid and key each message instead */
+        SMBERROR("crypt ctx %d size %zu != %zu\n", which, size, cc->cc_size[which]);
+        goto done;
+    }
+    if (cc->cc_ctx[which] == NULL) {
+        SMB_MALLOC(cc->cc_ctx[which], uint8_t *, size, M_SMBTEMP, M_WAITOK);
+        if (cc->cc_ctx[which] == NULL) {
+            goto done;
+        }
+        cc->cc_size[which] = size;
+    }
+    
+    memcpy(cc->cc_ctx[which], ctx, size);
+    cc->cc_valid |= (1 << which);
+    
+done:
+    lck_mtx_unlock(&cc->cc_lock);
+}
+
+/*
+ * Copy the keyed template for 'which' into ctx. Returns 0 if there is no
+ * template, in which case the caller keys the context itself.
+ */
+static int
+smb_crypt_ctx_copy(struct smb_vc *vcp, int which, void *ctx, size_t size)
+{
+    struct smb_crypt_ctx *cc = vcp->vc_crypt_ctx;
+    int found = 0;
+    
+    if (cc == NULL) {
+        return (0);
+    }
+    
+    lck_mtx_lock(&cc->cc_lock);
+    if ((cc->cc_valid & (1 << which)) &&
+        (cc->cc_size[which] == size)) {
+        memcpy(ctx, cc->cc_ctx[which], size);
+        found = 1;
+    }
+    lck_mtx_unlock(&cc->cc_lock);
+    
+    return (found);
+}
+
+/*
+ * Build the keyed templates from the current keys. Called when the keys are
+ * derived, so the per message paths never redo the key setup.
+ */
+void
+smb_crypt_ctx_init(struct smb_vc *vcp)
+{
+    smb_crypt_ctx_invalidate(vcp);
+    
+    if (vcp->vc_mackey == NULL) {
+        return;
+    }
+    
+    if (!SMBV_SMB3_OR_LATER(vcp)) {
+        /* SMB 2.x signs with HMAC-SHA256 keyed by the session key */
+        const struct ccdigest_info *di = ccsha256_di();
+        cchmac_di_decl(di, hc);
+        
+        cchmac_init(di, hc, vcp->vc_mackeylen, vcp->vc_mackey);
+        smb_crypt_ctx_save(vcp, SMB_CRYPT_HMAC, hc, sizeof(hc));
+        cchmac_di_clear(di, hc);
+        return;
+    }
+    
+    if (vcp->vc_smb3_signing_key_len >= SMB3_KEY_LEN) {
+        const struct ccmode_cbc *ccmode = ccaes_cbc_encrypt_mode();
+        cccmac_mode_decl(ccmode, cmac);
+        
+        cccmac_init(ccmode, cmac, vcp->vc_smb3_signing_key);
+        smb_crypt_ctx_save(vcp, SMB_CRYPT_CMAC, cmac, sizeof(cmac));
+        cc_clear(sizeof(cmac), cmac);
+    }
+    
+    if ((vcp->vc_smb3_cipher == SMB2_ENCRYPTION_AES128_GCM) ||
+        (vcp->vc_smb3_cipher == SMB2_ENCRYPTION_AES256_GCM)) {
+        const struct ccmode_gcm *encmode = ccaes_gcm_encrypt_mode();
+        const struct ccmode_gcm *decmode = ccaes_gcm_decrypt_mode();
+        
+        if (vcp->vc_smb3_encrypt_key_len) {
+            ccgcm_ctx_decl(encmode->size, ctx);
+            
+            ccgcm_init(encmode, ctx, vcp->vc_smb3_encrypt_key_len, vcp->vc_smb3_encrypt_key);
+            smb_crypt_ctx_save(vcp, SMB_CRYPT_GCM_ENCRYPT, ctx, sizeof(ctx));
+            ccgcm_ctx_clear(encmode->size, ctx);
+        }
+        if (vcp->vc_smb3_decrypt_key_len) {
+            ccgcm_ctx_decl(decmode->size, ctx);
+            
+            ccgcm_init(decmode, ctx, vcp->vc_smb3_decrypt_key_len, vcp->vc_smb3_decrypt_key);
+            smb_crypt_ctx_save(vcp, SMB_CRYPT_GCM_DECRYPT, ctx, sizeof(ctx));
+            ccgcm_ctx_clear(decmode->size, ctx);
+        }
+    }
+    else {
+        const struct ccmode_ccm *encmode = ccaes_ccm_encrypt_mode();
+        const struct ccmode_ccm *decmode = ccaes_ccm_decrypt_mode();
+        
+        if (vcp->vc_smb3_encrypt_key_len) {
+            ccccm_ctx_decl(encmode->size, ctx);
+            
+            ccccm_init(encmode, ctx, vcp->vc_smb3_encrypt_key_len, vcp->vc_smb3_encrypt_key);
+            smb_crypt_ctx_save(vcp, SMB_CRYPT_CCM_ENCRYPT, ctx, sizeof(ctx));
+            ccccm_ctx_clear(encmode->size, ctx);
+        }
+        if (vcp->vc_smb3_decrypt_key_len) {
+            ccccm_ctx_decl(decmode->size, ctx);
+            
+            ccccm_init(decmode, ctx, vcp->vc_smb3_decrypt_key_len, vcp->vc_smb3_decrypt_key);
+            smb_crypt_ctx_save(vcp, SMB_CRYPT_CCM_DECRYPT, ctx, sizeof(ctx));
+            ccccm_ctx_clear(decmode->size, ctx);
+        }
+    }
+}
+
+/*
+ * Stop using the keyed templates, the keys are about to change.
+ */
+void
+smb_crypt_ctx_invalidate(struct smb_vc *vcp)
+{
+    struct smb_crypt_ctx *cc = vcp->vc_crypt_ctx;
+    
+    if (cc != NULL) {
+        lck_mtx_lock(&cc->cc_lock);
+        cc->cc_valid = 0;
+        lck_mtx_unlock(&cc->cc_lock);
+    }
+}
+
+/*
+ * Free the keyed templates when the VC goes away.
+ */
+void
+smb_crypt_ctx_free(struct smb_vc *vcp)
+{
+    struct smb_crypt_ctx *cc = vcp->vc_crypt_ctx;
+    int i;
+    
+    if (cc == NULL) {
+        return;
+    }
+    
+    for (i = 0; i < SMB_CRYPT_NCTX; i++) {
+        if (cc->cc_ctx[i] != NULL) {
+            cc_clear(cc->cc_size[i], cc->cc_ctx[i]);
+            SMB_FREE(cc->cc_ctx[i], M_SMBTEMP);
+        }
+    }
+    lck_mtx_destroy(&cc->cc_lock, vcst_lck_group);
+    SMB_FREE(vcp->vc_crypt_ctx, M_SMBTEMP);
+}
+
 /*
  * SMB 2/3 Sign a single request with HMAC-SHA256
  */
@@ -606,7 +810,7 @@ static void smb2_sign(struct smb_rq *rqp)
     struct mbchain *mbp;
     mbuf_t mb;
     const struct ccdigest_info *di = ccsha256_di();
-    u_char *mac;
+    u_char mac[CCSHA256_OUTPUT_SIZE];
     
     if (rqp->sr_rqsig == NULL) {
         SMBDEBUG("sr_rqsig was never allocated.\n");
@@ -619,17 +823,11 @@ static void smb2_sign(struct smb_rq *rqp)
     }
     
     /* make sure ccdigest_info size is reasonable (sha256 output len is 32 bytes) */
-    if (di->output_size > 64) {
+    if (di->output_size > sizeof(mac)) {
         SMBERROR("Unreasonable output size %lu\n", di->output_size);
         return;
     }
     
-    SMB_MALLOC(mac, u_char *, di->output_size, M_SMBTEMP, M_WAITOK);
-    if (mac == NULL) {
-        SMBERROR("Out of memory\n");
-        return;
-    }
-    
     bzero(mac, di->output_size);
     
     /* Initialize 16-byte security signature field to all zeros. */
@@ -640,7 +838,9 @@ static void smb2_sign(struct smb_rq *rqp)
     
     smb_rq_getrequest(rqp, &mbp);
     cchmac_di_decl(di, hc);
-    cchmac_init(di, hc, vcp->vc_mackeylen, vcp->vc_mackey);
+    if (!smb_crypt_ctx_copy(vcp, SMB_CRYPT_HMAC, hc, sizeof(hc))) {
+        cchmac_init(di, hc, vcp->vc_mackeylen, vcp->vc_mackey);
+    }
     
     for (mb = mbp->mb_top; mb != NULL; mb = mbuf_next(mb))
         cchmac_update(di, hc, mbuf_len(mb), mbuf_data(mb));
@@ -649,9 +849,6 @@ static void smb2_sign(struct smb_rq *rqp)
     // Copy first 16 bytes of the HMAC hash into the signature field
     bcopy(mac, rqp->sr_rqsig, SMB2SIGLEN);
     
-    if (mac) {
-        SMB_FREE(mac, M_SMBTEMP);
-    }
 }
 
 /*
@@ -693,7 +890,7 @@ smb2_rq_sign(struct smb_rq *rqp)
     }
     
     /* Check for SMB 3 signing */
-    if (vcp->vc_flags & (SMBV_SMB30 | SMBV_SMB302)) {
+    if (SMBV_SMB3_OR_LATER(vcp)) {
         do_smb3_sign = 1;
     }
 
@@ -721,7 +918,7 @@ static int smb2_verify(struct smb_rq *rqp, struct mdchain *mdp, uint32_t nextCmd
     u_char zero_buf[SMB2SIGLEN];
     int result;
     const struct ccdigest_info *di = ccsha256_di();
-    u_char *mac;
+    u_char mac[CCSHA256_OUTPUT_SIZE];
     
     if (vcp == NULL) {
         SMBERROR("vcp is NULL\n");
@@ -734,17 +931,11 @@ static int smb2_verify(struct smb_rq *rqp, struct mdchain *mdp, uint32_t nextCmd
     }
     
     /* make sure ccdigest_info size is reasonable (sha256 output len is 32 bytes) */
-    if (di->output_size > 64) {
+    if (di->output_size > sizeof(mac)) {
         SMBERROR("Unreasonable output size %lu\n", di->output_size);
         return (EINVAL);
     }
     
-    SMB_MALLOC(mac, u_char *, di->output_size, M_SMBTEMP, M_WAITOK);
-    if (mac == NULL) {
-        SMBERROR("Out of memory\n");
-        return (ENOMEM);
-    }
-    
     mb = mdp->md_cur;
     mb_len = (size_t)mbuf_data(mb) + mbuf_len(mb) - (size_t)mdp->md_pos;
     mb_total_len = mbuf_len(mb);
@@ -753,16 +944,10 @@ static int smb2_verify(struct smb_rq *rqp, struct mdchain *mdp, uint32_t nextCmd
     /* sanity checks */
     if (mb_len < SMB2_HDRLEN) {
         SMBDEBUG("mbuf not pulled up for SMB 2/3 header, mbuf_len: %lu\n", mbuf_len(mb));
-        if (mac) {
-            SMB_FREE(mac, M_SMBTEMP);
-        }
         return (EBADRPC);
     }
     if (mb_off > mb_total_len) {
         SMBDEBUG("mb_off: %lu past end of mbuf, mbuf_len: %lu\n", mb_off, mb_total_len);
-        if (mac) {
-            SMB_FREE(mac, M_SMBTEMP);
-        }
         return (EBADRPC);
     }
     
@@ -785,24 +970,20 @@ static int smb2_verify(struct smb_rq *rqp, struct mdchain *mdp, uint32_t nextCmd
     if (remaining < SMB2_HDRLEN) {
         /* should never happen, but we have to be very careful */
         SMBDEBUG("reply length: %lu too short\n", remaining);
-        if (mac) {
-            SMB_FREE(mac, M_SMBTEMP);
-        }
         return (EBADRPC);
     }
     
     bzero(zero_buf, SMB2SIGLEN);
     bzero(mac, di->output_size);
     cchmac_di_decl(di, hc);
-    cchmac_init(di, hc, vcp->vc_mackeylen, vcp->vc_mackey);
+    if (!smb_crypt_ctx_copy(vcp, SMB_CRYPT_HMAC, hc, sizeof(hc))) {
+        cchmac_init(di, hc, vcp->vc_mackeylen, vcp->vc_mackey);
+    }
     
     /* sanity check */
     if (mb_len < SMB2SIGOFF) {
         /* mb_len would go negative when decremented below */
         SMBDEBUG("mb_len exhausted: mb_len: %lu SMB2SIGOFF: %u\n", mb_len, (uint32_t)SMB2SIGOFF);
-        if (mac) {
-            SMB_FREE(mac, M_SMBTEMP);
-        }
         return (EBADRPC);
     }
     
@@ -816,18 +997,12 @@ static int smb2_verify(struct smb_rq *rqp, struct mdchain *mdp, uint32_t nextCmd
     if (mb_off > mb_total_len) {
         // mb_offset would go past the end of current mbuf, when incremented below */
         SMBDEBUG("mb_off past end, mb_off: %lu mbub_len: %lu\n", mb_off, mb_total_len);
-        if (mac) {
-            SMB_FREE(mac, M_SMBTEMP);
-        }
         return (EBADRPC);
     }
     /* sanity check */
     if (mb_len < SMB2SIGLEN) {
         /* mb_len would go negative when decremented below */
         SMBDEBUG("mb_len exhausted: mb_len: %lu SMB2SIGLEN: %u\n", mb_len, (uint32_t)SMB2SIGLEN);
-        if (mac) {
-            SMB_FREE(mac, M_SMBTEMP);
-        }
         return (EBADRPC);
     }
     
@@ -843,9 +1018,6 @@ static int smb2_verify(struct smb_rq *rqp, struct mdchain *mdp, uint32_t nextCmd
             mb = mbuf_next(mb);
             if (!mb) {
                 SMBDEBUG("mbuf_next didn't return an mbuf\n");
-                if (mac) {
-                    SMB_FREE(mac, M_SMBTEMP);
-                }
                 return EBADRPC;
             }
             mb_len = mbuf_len(mb);
@@ -872,9 +1044,6 @@ static int smb2_verify(struct smb_rq *rqp, struct mdchain *mdp, uint32_t nextCmd
 	 * Finally, verify the signature.
 	 */
     result = bcmp(signature, mac, SMB2SIGLEN);
-    if (mac) {
-        SMB_FREE(mac, M_SMBTEMP);
-    }
 	return (result);
 }
 
@@ -923,7 +1092,7 @@ smb2_rq_verify(struct smb_rq *rqp, struct mdchain *mdp, uint8_t *signature)
 		return (0);
     }
     
-    if (vcp->vc_flags & (SMBV_SMB30 | SMBV_SMB302)) {
+    if (SMBV_SMB3_OR_LATER(vcp)) {
         err = smb3_verify(rqp, mdp, nextCmdOffset, signature);
     } else {
         err = smb2_verify(rqp, mdp, nextCmdOffset, signature);
@@ -956,7 +1125,7 @@ smb3_verify(struct smb_rq *rqp, struct mdchain *mdp,
     size_t n, i, nBlocks, nPartial;
     const struct ccmode_cbc *ccmode = ccaes_cbc_encrypt_mode();
     int result;
-    u_char *mac;
+    u_char mac[CMAC_BLOCKSIZE];
     
     if (vcp == NULL) {
         SMBERROR("vcp is NULL\n");
@@ -970,12 +1139,8 @@ smb3_verify(struct smb_rq *rqp, struct mdchain *mdp,
     
     /* Init the cipher */
     cccmac_mode_decl(ccmode, cmac);
-    cccmac_init(ccmode, cmac, vcp->vc_smb3_signing_key);
-    
-    SMB_MALLOC(mac, u_char *, CMAC_BLOCKSIZE, M_SMBTEMP, M_WAITOK);
-    if (mac == NULL) {
-        SMBERROR("Out of memory\n");
-        return (ENOMEM);
+    if (!smb_crypt_ctx_copy(vcp, SMB_CRYPT_CMAC, cmac, sizeof(cmac))) {
+        cccmac_init(ccmode, cmac, vcp->vc_smb3_signing_key);
     }
     
     mb = mdp->md_cur;
@@ -986,16 +1151,10 @@ smb3_verify(struct smb_rq *rqp, struct mdchain *mdp,
     /* sanity checks */
     if (mb_len < SMB2_HDRLEN) {
         SMBDEBUG("mbuf not pulled up for SMB 3 header, mbuf_len: %lu\n", mbuf_len(mb));
-        if (mac) {
-            SMB_FREE(mac, M_SMBTEMP);
-        }
         return (EBADRPC);
     }
     if (mb_off > mb_total_len) {
         SMBDEBUG("mb_off: %lu past end of mbuf, mbuf_len: %lu\n", mb_off, mb_total_len);
-        if (mac) {
-            SMB_FREE(mac, M_SMBTEMP);
-        }
         return (EBADRPC);
     }
     
@@ -1018,9 +1177,6 @@ smb3_verify(struct smb_rq *rqp, struct mdchain *mdp,
     if (remaining < SMB2_HDRLEN) {
         /* should never happen, but we have to be very careful */
         SMBDEBUG("reply length: %lu too short\n", remaining);
-        if (mac) {
-            SMB_FREE(mac, M_SMBTEMP);
-        }
         return (EBADRPC);
     }
     
@@ -1028,9 +1184,6 @@ smb3_verify(struct smb_rq *rqp, struct mdchain *mdp,
     if (mb_len < SMB2SIGOFF) {
         /* mb_len would go negative when decremented below */
         SMBDEBUG("mb_len exhausted: mb_len: %lu SMB2SIGOFF: %u\n", mb_len, (uint32_t)SMB2SIGOFF);
-        if (mac) {
-            SMB_FREE(mac, M_SMBTEMP);
-        }
         return (EBADRPC);
     }
     
@@ -1044,18 +1197,12 @@ smb3_verify(struct smb_rq *rqp, struct mdchain *mdp,
     if (mb_off > mb_total_len) {
         // mb_offset would go past the end of current mbuf, when incremented below */
         SMBDEBUG("mb_off past end, mb_off: %lu mbub_len: %lu\n", mb_off, mb_total_len);
-        if (mac) {
-            SMB_FREE(mac, M_SMBTEMP);
-        }
         return (EBADRPC);
     }
     /* sanity check */
     if (mb_len < SMB2SIGLEN) {
         /* mb_len would go negative when decremented below */
         SMBDEBUG("mb_len exhausted: mb_len: %lu SMB2SIGLEN: %u\n", mb_len, (uint32_t)SMB2SIGLEN);
-        if (mac) {
-            SMB_FREE(mac, M_SMBTEMP);
-        }
         return (EBADRPC);
     }
     
@@ -1093,9 +1240,6 @@ smb3_verify(struct smb_rq *rqp, struct mdchain *mdp,
         if (!nBlocks) {
             /* Shouldn't ever see this */
             SMBDEBUG("short msg, remaining: %lu\n", remaining);
-            if (mac) {
-                SMB_FREE(mac, M_SMBTEMP);
-            }
             return (EBADRPC);
         }
 
@@ -1107,9 +1251,6 @@ smb3_verify(struct smb_rq *rqp, struct mdchain *mdp,
         n = mbuf_get_nbytes(CMAC_BLOCKSIZE, block, 0, &mb, &mb_len, &mb_off);
         if (n != CMAC_BLOCKSIZE) {
             SMBDEBUG("mbuf chain exhausted at block %lu, exp: 16, got: %lu\n", i, n);
-            if (mac) {
-                SMB_FREE(mac, M_SMBTEMP);
-            }
             return (EBADRPC);
         }
         
@@ -1121,9 +1262,6 @@ smb3_verify(struct smb_rq *rqp, struct mdchain *mdp,
     n = mbuf_get_nbytes(nPartial, block, 0, &mb, &mb_len, &mb_off);
     if (n != nPartial) {
         SMBDEBUG("mbuf chain exhausted, nPartial: %lu, got: %lu\n", nPartial, n);
-        if (mac) {
-            SMB_FREE(mac, M_SMBTEMP);
-        }
         return (EBADRPC);
     }
     
@@ -1151,10 +1289,6 @@ final:
                  signature[12], signature[13], signature[14], signature[15]);
     }
     
-    if (mac) {
-        SMB_FREE(mac, M_SMBTEMP);
-    }
-    
 	return (result);
 }
 
@@ -1170,7 +1304,7 @@ smb3_sign(struct smb_rq *rqp)
     size_t mb_off, remaining, mb_len;
     size_t nBlocks, nPartial, i, n;
     u_char block[CMAC_BLOCKSIZE];
-    u_char *mac;
+    u_char mac[CMAC_BLOCKSIZE];
     const struct ccmode_cbc *ccmode = ccaes_cbc_encrypt_mode();
     
     if (rqp->sr_rqsig == NULL) {
@@ -1185,12 +1319,8 @@ smb3_sign(struct smb_rq *rqp)
     
     /* Init the cipher */
     cccmac_mode_decl(ccmode, cmac);
-    cccmac_init(ccmode, cmac, vcp->vc_smb3_signing_key);
-    
-    SMB_MALLOC(mac, u_char *, CMAC_BLOCKSIZE, M_SMBTEMP, M_WAITOK);
-    if (mac == NULL) {
-        SMBERROR("Out of memory\n");
-        return;
+    if (!smb_crypt_ctx_copy(vcp, SMB_CRYPT_CMAC, cmac, sizeof(cmac))) {
+        cccmac_init(ccmode, cmac, vcp->vc_smb3_signing_key);
     }
     
     /* Initialize 16-byte security signature field to all zeros. */
@@ -1215,7 +1345,7 @@ smb3_sign(struct smb_rq *rqp)
         if (!nBlocks) {
             /* Shouldn't ever see this */
             SMBDEBUG("short msg, remaining: %lu\n", remaining);
-            goto out;
+            return;
         }
         
         nBlocks--;
@@ -1230,7 +1360,7 @@ smb3_sign(struct smb_rq *rqp)
         n = mbuf_get_nbytes(CMAC_BLOCKSIZE, block, 0, &mb, &mb_len, &mb_off);
         if (n != CMAC_BLOCKSIZE) {
             SMBDEBUG("mbuf chain exhausted at block %lu, exp: 16, got: %lu\n", i, n);
-            goto out;
+            return;
         }
         
         /* Sign a block */
@@ -1241,18 +1371,79 @@ smb3_sign(struct smb_rq *rqp)
     n = mbuf_get_nbytes(nPartial, block, 0, &mb, &mb_len, &mb_off);
     if (n != nPartial) {
         SMBDEBUG("mbuf chain exhausted, nPartial: %lu, got: %lu\n", nPartial, n);
-        goto out;
+        return;
     }
     
     cccmac_final(ccmode, cmac, nPartial, block, mac);
     
     // Copy first 16 bytes of the HMAC hash into the signature field
     bcopy(mac, rqp->sr_rqsig, SMB2SIGLEN);
+}
+
+#define SMB3_CIPHER_IS_GCM(cipher) \
+    (((cipher) == SMB2_ENCRYPTION_AES128_GCM) || \
+     ((cipher) == SMB2_ENCRYPTION_AES256_GCM))
+
+/*
+ * AES-GCM for SMB 3.1.1. The nonce is the first 12 bytes of the transform
+ * header nonce field and the authenticated data is the rest of the transform
+ * header after the signature. Encrypts or decrypts the mbuf chain in place.
+ *
+ * On encrypt, the tag is returned in sig. On decrypt, sig must hold the tag
+ * from the transform header and EAUTH is returned if it does not match.
+ */
+static int
+smb3_gcm_crypt(struct smb_vc *vcp, int encrypt,
+               unsigned char *tf_hdr, mbuf_t mb, unsigned char *sig)
+{
+    const struct ccmode_gcm *ccmode;
+    unsigned char tag[SMB3_AES_TF_SIG_LEN];
+    mbuf_t mb_tmp;
+    int error = 0;
     
-out:
-    if (mac) {
-        SMB_FREE(mac, M_SMBTEMP);
+    ccmode = (encrypt) ? ccaes_gcm_encrypt_mode() : ccaes_gcm_decrypt_mode();
+    
+    ccgcm_ctx_decl(ccmode->size, ctx);
+    
+    if (encrypt) {
+        if (!smb_crypt_ctx_copy(vcp, SMB_CRYPT_GCM_ENCRYPT, ctx, sizeof(ctx))) {
+            ccgcm_init(ccmode, ctx, vcp->vc_smb3_encrypt_key_len, vcp->vc_smb3_encrypt_key);
+        }
+    }
+    else {
+        if (!smb_crypt_ctx_copy(vcp, SMB_CRYPT_GCM_DECRYPT, ctx, sizeof(ctx))) {
+            ccgcm_init(ccmode, ctx, vcp->vc_smb3_decrypt_key_len, vcp->vc_smb3_decrypt_key);
+        }
+    }
+    ccgcm_set_iv(ccmode, ctx, SMB3_GCM_NONCE_LEN, tf_hdr + SMB3_AES_TF_NONCE_OFF);
+    ccgcm_aad(ccmode, ctx, SMB3_AES_AUTHDATA_LEN, tf_hdr + SMB3_AES_AUTHDATA_OFF);
+    
+    for (mb_tmp = mb; mb_tmp != NULL; mb_tmp = mbuf_next(mb_tmp)) {
+        if (mbuf_len(mb_tmp)) {
+            ccgcm_update(ccmode, ctx, mbuf_len(mb_tmp), mbuf_data(mb_tmp), mbuf_data(mb_tmp));
+        }
+    }
+    
+    if (encrypt) {
+        ccgcm_finalize(ccmode, ctx, SMB3_AES_TF_SIG_LEN, sig);
+    }
+    else {
+        /*
+         * Depending on the corecrypto version, finalize either checks the tag
+         * passed in or overwrites it with the computed one. Handle both.
+         */
+        memcpy(tag, sig, SMB3_AES_TF_SIG_LEN);
+        if (ccgcm_finalize(ccmode, ctx, SMB3_AES_TF_SIG_LEN, tag) != 0) {
+            error = EAUTH;
+        }
+        else if (bcmp(tag, sig, SMB3_AES_TF_SIG_LEN)) {
+            error = EAUTH;
+        }
     }
+    
+    ccgcm_ctx_clear(ccmode->size, ctx);
+    
+    return (error);
 }
 
 /*
@@ -1315,8 +1506,13 @@ int smb3_rq_encrypt(struct smb_rq *rqp, mbuf_t *mb)
     memcpy(nonce, &vcp->vc_smb3_nonce_high, 8);
     memcpy(&nonce[8], &vcp->vc_smb3_nonce_low, 8);
     
-    // Zero last 5 bytes per spec
-    memset(&nonce[11], 0, 5);
+    // Zero the bytes past the nonce length per spec (5 for CCM, 4 for GCM)
+    if (SMB3_CIPHER_IS_GCM(vcp->vc_smb3_cipher)) {
+        memset(&nonce[SMB3_GCM_NONCE_LEN], 0, 16 - SMB3_GCM_NONCE_LEN);
+    }
+    else {
+        memset(&nonce[SMB3_CCM_NONCE_LEN], 0, 16 - SMB3_CCM_NONCE_LEN);
+    }
     
     memcpy(msgp + SMB3_AES_TF_NONCE_OFF, nonce, SMB3_AES_TF_NONCE_LEN);
     
@@ -1340,8 +1536,13 @@ int smb3_rq_encrypt(struct smb_rq *rqp, mbuf_t *mb)
     memcpy(msgp + SMB3_AES_TF_MSGLEN_OFF, &i32,
            SMB3_AES_TF_MSGLEN_LEN);
     
-    /* Set Encryption Algorithm */
-    i16 = htoles(SMB2_ENCRYPTION_AES128_CCM);
+    /* Set Encryption Algorithm (Flags in 3.1.1, same value) */
+    if (vcp->vc_flags & SMBV_SMB311) {
+        i16 = htoles(SMB2_TRANSFORM_FLAG_ENCRYPTED);
+    }
+    else {
+        i16 = htoles(SMB2_ENCRYPTION_AES128_CCM);
+    }
     memcpy(msgp + SMB3_AES_TF_ENCR_ALG_OFF, &i16,
            SMB3_AES_TF_ENCR_ALG_LEN);
     
@@ -1353,8 +1554,16 @@ int smb3_rq_encrypt(struct smb_rq *rqp, mbuf_t *mb)
     // Set data length of mb_hdr
     mbuf_setlen(mb_hdr, SMB3_AES_TF_HDR_LEN);
     
-    /* Init the cipher */
-    ccccm_init(ccmode, ctx, vcp->vc_smb3_encrypt_key_len, vcp->vc_smb3_encrypt_key);
+    if (SMB3_CIPHER_IS_GCM(vcp->vc_smb3_cipher)) {
+        /* Encrypt msg data in place and set transform header signature */
+        smb3_gcm_crypt(vcp, 1, msgp, *mb, msgp + SMB3_AES_TF_SIG_OFF);
+        goto done;
+    }
+    
+    /* Init the cipher, from the precomputed key schedule if we have one */
+    if (!smb_crypt_ctx_copy(vcp, SMB_CRYPT_CCM_ENCRYPT, ctx, sizeof(ctx))) {
+        ccccm_init(ccmode, ctx, vcp->vc_smb3_encrypt_key_len, vcp->vc_smb3_encrypt_key);
+    }
     
     ccccm_set_iv(ccmode, ctx, nonce_ctx, SMB3_CCM_NONCE_LEN, msgp + SMB3_AES_TF_NONCE_OFF,
                            SMB3_AES_TF_SIG_LEN, SMB3_AES_AUTHDATA_LEN, msglen);
@@ -1371,6 +1580,7 @@ int smb3_rq_encrypt(struct smb_rq *rqp, mbuf_t *mb)
     ccccm_finalize(ccmode, ctx, nonce_ctx, dig);
     memcpy(msgp + SMB3_AES_TF_SIG_OFF, dig, CCAES_BLOCK_SIZE);
     
+done:
     // Ideally, should turn off these flags from original mb:
     // (*mb)->m_flags &= ~(M_PKTHDR | M_EOR);
     
@@ -1452,7 +1662,7 @@ int smb3_msg_decrypt(struct smb_vc *vcp, mbuf_t *mb)
         goto out;
     }
     
-    // Verify the encryption algorithm
+    // Verify the encryption algorithm (Flags in 3.1.1, same value)
     i16 = letohs(tf_hdr->encrypt_algorithm);
     if (i16 != SMB2_ENCRYPTION_AES128_CCM) {
         SMBDEBUG("Unsupported ENCR alg: %u\n", (uint32_t)i16);
@@ -1472,8 +1682,21 @@ int smb3_msg_decrypt(struct smb_vc *vcp, mbuf_t *mb)
     // Need msglen from tf header for cypher init
     msglen = letohl(tf_hdr->orig_msg_size);
     
-    // Init the cipher
-    ccccm_init(ccmode, ctx, vcp->vc_smb3_decrypt_key_len, vcp->vc_smb3_decrypt_key);
+    if (SMB3_CIPHER_IS_GCM(vcp->vc_smb3_cipher)) {
+        // Decrypt msg data in place and check the signature
+        memcpy(sig, tf_hdr->signature, SMB3_AES_TF_SIG_LEN);
+        if (smb3_gcm_crypt(vcp, 0, msgp, mbuf_payload, sig) != 0) {
+            SMBDEBUG("Transform signature mismatch\n");
+            error = EAUTH;
+            goto out;
+        }
+        goto done;
+    }
+    
+    // Init the cipher, from the precomputed key schedule if we have one
+    if (!smb_crypt_ctx_copy(vcp, SMB_CRYPT_CCM_DECRYPT, ctx, sizeof(ctx))) {
+        ccccm_init(ccmode, ctx, vcp->vc_smb3_decrypt_key_len, vcp->vc_smb3_decrypt_key);
+    }
     
     ccccm_set_iv(ccmode, ctx, nonce_ctx, SMB3_CCM_NONCE_LEN, msgp + SMB3_AES_TF_NONCE_OFF,
                  SMB3_AES_TF_SIG_LEN, SMB3_AES_AUTHDATA_LEN, msglen);
@@ -1506,6 +1729,7 @@ int smb3_msg_decrypt(struct smb_vc *vcp, mbuf_t *mb)
         goto out;
     }
     
+done:
     /* And we're done, return plain text */
     m_fixhdr(mbuf_payload);
     *mb = mbuf_payload;
@@ -1571,6 +1795,31 @@ smb_kdf_hmac_sha256(uint8_t *input_key, uint32_t input_keylen,
     return (err);
 }
 
+/*
+ * void smb311_preauth_hash_update(struct smb_vc *vcp, mbuf_t m)
+ *
+ * Folds one SMB 3.1.1 Negotiate or SessionSetup message into the
+ * preauth integrity hash: hash = SHA-512(hash || message)
+ */
+void smb311_preauth_hash_update(struct smb_vc *vcp, mbuf_t m)
+{
+    const struct ccdigest_info *di = ccsha512_di();
+    mbuf_t mb;
+    
+    ccdigest_di_decl(di, dc);
+    
+    ccdigest_init(di, dc);
+    ccdigest_update(di, dc, SMB3_PREAUTH_HASH_LEN, vcp->vc_preauth_hash);
+    for (mb = m; mb != NULL; mb = mbuf_next(mb)) {
+        if (mbuf_len(mb)) {
+            ccdigest_update(di, dc, mbuf_len(mb), mbuf_data(mb));
+        }
+    }
+    ccdigest_final(di, dc, vcp->vc_preauth_hash);
+    
+    ccdigest_di_clear(di, dc);
+}
+
 /*
  * int smb3_derive_keys(struct smb_vc *vcp)
  *
@@ -1581,6 +1830,11 @@ smb_kdf_hmac_sha256(uint8_t *input_key, uint32_t input_keylen,
  * Keys are derived using KDF in Counter Mode
  * from as specified by sp800-108.
  *
+ * SMB 3.1.1 uses different labels and the
+ * preauth integrity hash as the context.
+ * AES-256 ciphers get 32 byte keys derived
+ * from the full session key.
+ *
  * Keys generated:
  *
  * vc_smb3_signing_key
@@ -1591,6 +1845,10 @@ int smb3_derive_keys(struct smb_vc *vcp)
 {
     uint8_t label[16];
     uint8_t context[16];
+    uint8_t *contextp;
+    uint32_t label_len, context_len;
+    uint32_t cipher_keylen, session_keylen;
+    int     smb311 = ((vcp->vc_flags & SMBV_SMB311) != 0);
     int     err;
     
     vcp->vc_smb3_signing_key_len = 0;
@@ -1611,16 +1869,36 @@ int smb3_derive_keys(struct smb_vc *vcp)
                  vcp->vc_mackeylen);
     }
     
+    // AES-256 keys come from Session.FullSessionKey
+    cipher_keylen = SMB3_KEY_LEN;
+    session_keylen = vcp->vc_mackeylen;
+    if ((vcp->vc_smb3_cipher == SMB2_ENCRYPTION_AES256_CCM) ||
+        (vcp->vc_smb3_cipher == SMB2_ENCRYPTION_AES256_GCM)) {
+        cipher_keylen = SMB3_MAX_KEY_LEN;
+        session_keylen = MAX(vcp->vc_full_mackeylen, vcp->vc_mackeylen);
+    }
+    
     // Derive Session.SigningKey (vc_smb3_signing_key)
     memset(label, 0, 16);
     memset(context, 0, 16);
     
-    strncpy((char *)label, "SMB2AESCMAC", 11);
-    strncpy((char *)context, "SmbSign", 7);
+    if (smb311) {
+        memcpy(label, "SMBSigningKey", 13);
+        label_len = 14;     // includes NULL Terminator
+        contextp = vcp->vc_preauth_hash;
+        context_len = SMB3_PREAUTH_HASH_LEN;
+    }
+    else {
+        strncpy((char *)label, "SMB2AESCMAC", 11);
+        strncpy((char *)context, "SmbSign", 7);
+        label_len = 12;     // includes NULL Terminator
+        contextp = context;
+        context_len = 8;    // includes NULL Terminator
+    }
     
     err = smb_kdf_hmac_sha256(vcp->vc_mackey, vcp->vc_mackeylen,
-                              label, 12,  // includes NULL Terminator
-                              context, 8, // includes NULL Terminator
+                              label, label_len,
+                              contextp, context_len,
                               vcp->vc_smb3_signing_key,
                               SMB3_KEY_LEN);
     if (!err) {
@@ -1629,20 +1907,33 @@ int smb3_derive_keys(struct smb_vc *vcp)
         SMBDEBUG("Could not generate smb3 signing key, error: %d\n", err);
     }
     
+    if (smb311 && (vcp->vc_smb3_cipher == 0)) {
+        // No common cipher, so no encryption keys
+        goto out;
+    }
+    
     // Derive Session.EncryptionKey (vc_smb3_encrypt_key)
     memset(label, 0, 16);
     memset(context, 0, 16);
     
-    memcpy(label, "SMB2AESCCM", 10);
-    memcpy(context, "ServerIn ", 9);
+    if (smb311) {
+        memcpy(label, "SMBC2SCipherKey", 15);
+        label_len = 16;     // includes NULL Terminator
+    }
+    else {
+        memcpy(label, "SMB2AESCCM", 10);
+        memcpy(context, "ServerIn ", 9);
+        label_len = 11;     // includes NULL Terminator
+        context_len = 10;   // includes NULL Terminator
+    }
     
-    err = smb_kdf_hmac_sha256(vcp->vc_mackey, vcp->vc_mackeylen,
-                              label, 11,  // includes NULL Terminator
-                              context, 10, // includes NULL Terminator
+    err = smb_kdf_hmac_sha256(vcp->vc_mackey, session_keylen,
+                              label, label_len,
+                              contextp, context_len,
                               vcp->vc_smb3_encrypt_key,
-                              SMB3_KEY_LEN);
+                              cipher_keylen);
     if (!err) {
-        vcp->vc_smb3_encrypt_key_len = SMB3_KEY_LEN;
+        vcp->vc_smb3_encrypt_key_len = cipher_keylen;
     } else {
         SMBDEBUG("Could not generate smb3 encrypt key, error: %d\n", err);
     }
@@ -1651,20 +1942,28 @@ int smb3_derive_keys(struct smb_vc *vcp)
     memset(label, 0, 16);
     memset(context, 0, 16);
     
-    memcpy(label, "SMB2AESCCM", 10);
-    memcpy(context, "ServerOut", 9);
+    if (smb311) {
+        memcpy(label, "SMBS2CCipherKey", 15);
+    }
+    else {
+        memcpy(label, "SMB2AESCCM", 10);
+        memcpy(context, "ServerOut", 9);
+    }
     
-    err = smb_kdf_hmac_sha256(vcp->vc_mackey, vcp->vc_mackeylen,
-                              label, 11,  // includes NULL Terminator
-                              context, 10, // includes NULL Terminator
+    err = smb_kdf_hmac_sha256(vcp->vc_mackey, session_keylen,
+                              label, label_len,
+                              contextp, context_len,
                               vcp->vc_smb3_decrypt_key,
-                              SMB3_KEY_LEN);
+                              cipher_keylen);
     if (!err) {
-        vcp->vc_smb3_decrypt_key_len = SMB3_KEY_LEN;
+        vcp->vc_smb3_decrypt_key_len = cipher_keylen;
     } else {
         SMBDEBUG("Could not generate smb3 decrypt key, error: %d\n", err);
     }
 
 out:
+    // Precompute the key schedules used for every message
+    smb_crypt_ctx_init(vcp);
+    
     return (err);
 }
@@ -65,6 +65,7 @@
 #include <netsmb/smb_dev.h>
 #include <netsmb/smb_dev_2.h>
 #include <netsmb/smb_tran.h>
+#include <smbfs/smbfs.h>
 
 /*
  * Userland code loops through minor #s 0 to 1023, looking for one which opens.
@@ -517,6 +518,150 @@ static int nsmb_dev_ioctl(dev_t dev, u_long cmd, caddr_t data, int flag,
 				properties->attributes  = sharep->ss_attributes;
 			}
 
+			lck_rw_unlock_shared(&sdp->sd_rwlock);
+			break;
+		}
+		case SMBIOC_VC_STATS:
+		{
+			struct smbioc_vc_stats * stats = (struct smbioc_vc_stats *)data;
+			
+			lck_rw_lock_shared(&sdp->sd_rwlock);
+            
+            /* free global lock now since we now have sd_rwlock */
+            lck_rw_unlock_shared(dev_rw_lck);
+
+			if (stats->ioc_version != SMB_IOC_STRUCT_VERSION) {
+				error = EINVAL;
+			} else if (!sdp->sd_vc) {
+				error = ENOTCONN;
+			} else {
+				vcp = sdp->sd_vc;
+                
+                SMBC_CREDIT_LOCK(vcp);
+                stats->credits_granted = vcp->vc_credits_granted;
+                stats->credits_max = vcp->vc_credits_max;
+                stats->credits_target = vcp->vc_credits_target;
+                stats->credits_inflight = vcp->vc_credits_inflight;
+                stats->credits_wait = vcp->vc_credits_wait;
+                stats->credits_total_granted = vcp->vc_credits_total_granted;
+                stats->credits_total_consumed = vcp->vc_credits_total_consumed;
+                stats->credits_total_requested = vcp->vc_credits_total_requested;
+                stats->credits_wait_cnt = vcp->vc_credits_wait_cnt;
+                stats->credits_wait_usecs = vcp->vc_credits_wait_usecs;
+                stats->credits_wait_max_usecs = vcp->vc_credits_wait_max_usecs;
+                SMBC_CREDIT_UNLOCK(vcp);
+                
+                stats->bytes_sent = vcp->vc_bytes_sent;
+                stats->bytes_recvd = vcp->vc_bytes_recvd;
+                stats->msgs_sent = vcp->vc_msgs_sent;
+                stats->msgs_recvd = vcp->vc_msgs_recvd;
+                stats->send_calls = vcp->vc_send_calls;
+                stats->srtt_usecs = vcp->vc_srtt_usecs;
+                stats->rtt_min_usecs = vcp->vc_rtt_min_usecs;
+                stats->reconnect_cnt = vcp->vc_reconnect_cnt;
+                stats->reconnect_usecs = vcp->vc_reconnect_usecs;
+                
+                stats->rqs_inflight = 0;
+                if (vcp->vc_iod != NULL) {
+                    struct smb_rq *rqp;
+                    
+                    SMB_IOD_RQLOCK(vcp->vc_iod);
+                    TAILQ_FOREACH(rqp, &vcp->vc_iod->iod_rqlist, sr_link) {
+                        if (rqp->sr_state == SMBRQ_SENT) {
+                            stats->rqs_inflight++;
+                        }
+                    }
+                    SMB_IOD_RQUNLOCK(vcp->vc_iod);
+                }
+                
+                sharep = sdp->sd_share;
+                if (sharep != NULL) {
+                    lck_mtx_lock(&sharep->ss_shlock);
+                    if (sharep->ss_mount != NULL) {
+                        stats->lease_attr_hits = sharep->ss_mount->sm_lease_attr_hits;
+                        stats->lease_open_hits = sharep->ss_mount->sm_lease_open_hits;
+                        stats->lease_breaks = sharep->ss_mount->sm_lease_breaks;
+                        stats->attr_cache_policy = sharep->ss_mount->sm_attr_policy;
+                        stats->attr_cache_min = (uint32_t) sharep->ss_mount->sm_attr_min;
+                        stats->attr_cache_max = (uint32_t) sharep->ss_mount->sm_attr_max;
+                        stats->attr_cache_rate = sharep->ss_mount->sm_attr_rate;
+                        stats->attr_cache_hits = sharep->ss_mount->sm_attr_hits;
+                        stats->attr_cache_misses = sharep->ss_mount->sm_attr_misses;
+                        stats->attr_cache_expired = sharep->ss_mount->sm_attr_expired;
+                    }
+                    lck_mtx_unlock(&sharep->ss_shlock);
+                }
+			}
+
+			lck_rw_unlock_shared(&sdp->sd_rwlock);
+			break;
+		}
+		case SMBIOC_OP_STATS:
+		{
+			struct smbioc_op_stats * stats = (struct smbioc_op_stats *)data;
+			struct smb_lat_hist *hists = NULL;
+			uint32_t total = 0;
+			int shlocked = 0;
+			
+			lck_rw_lock_shared(&sdp->sd_rwlock);
+            
+            /* free global lock now since we now have sd_rwlock */
+            lck_rw_unlock_shared(dev_rw_lck);
+
+			if (stats->ioc_version != SMB_IOC_STRUCT_VERSION) {
+				error = EINVAL;
+			} else if (!sdp->sd_vc) {
+				error = ENOTCONN;
+			} else {
+				vcp = sdp->sd_vc;
+				sharep = sdp->sd_share;
+				
+				switch (stats->ioc_table) {
+					case SMB_OP_STATS_VC:
+						hists = vcp->vc_cmd_stats;
+						total = SMB_LAT_NCMDS;
+						break;
+					case SMB_OP_STATS_SHARE:
+						if (sharep == NULL) {
+							error = ENOTCONN;
+						} else {
+							hists = sharep->ss_cmd_stats;
+							total = SMB_LAT_NCMDS;
+						}
+						break;
+					case SMB_OP_STATS_VNOP:
+						if (sharep == NULL) {
+							error = ENOTCONN;
+						} else {
+							/* Hold ss_shlock so the mount can't go away while we copy */
+							lck_mtx_lock(&sharep->ss_shlock);
+							shlocked = 1;
+							if (sharep->ss_mount != NULL) {
+								hists = sharep->ss_mount->sm_vop_stats;
+								total = SMBFS_VOP_MAX;
+							}
+						}
+						break;
+					default:
+						error = EINVAL;
+						break;
+				}
+				
+				if (!error) {
+					stats->ioc_count = 0;
+					stats->ioc_total = total;
+					while ((stats->ioc_first + stats->ioc_count < total) &&
+						   (stats->ioc_count < SMB_OP_STATS_MAX_HISTS)) {
+						stats->ioc_hists[stats->ioc_count] = hists[stats->ioc_first + stats->ioc_count];
+						stats->ioc_count++;
+					}
+				}
+				
+				if (shlocked) {
+					lck_mtx_unlock(&sharep->ss_shlock);
+				}
+			}
+
 			lck_rw_unlock_shared(&sdp->sd_rwlock);
 			break;
 		}
@@ -57,7 +57,7 @@
  * correct structure. Only needs to be changed when the
  * structure in this routine are changed.
  */
-#define SMB_IOC_STRUCT_VERSION		170
+#define SMB_IOC_STRUCT_VERSION		171
 
 /*
  * The structure passed into the kernel must be less than or equal to 4K. If the
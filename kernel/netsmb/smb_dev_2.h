@@ -168,6 +168,70 @@ struct smbioc_share_properties {
 	uint32_t    attributes;
 };
 
+/* SMBIOC_VC_STATS to pass statistics kept in struct smb_vc to userland */
+struct smbioc_vc_stats {
+	uint32_t    ioc_version;
+    uint32_t    ioc_reserved;
+    /* SMB 2/3 crediting */
+    uint32_t    credits_granted;        /* credits on hand right now */
+    uint32_t    credits_max;
+    uint32_t    credits_target;         /* credits the client is trying to have on hand */
+    uint32_t    credits_inflight;       /* credits charged by requests not done yet */
+    uint32_t    credits_wait;           /* requests waiting for credits right now */
+    uint32_t    credits_pad;
+    uint64_t    credits_total_granted;
+    uint64_t    credits_total_consumed;
+    uint64_t    credits_total_requested;
+    uint64_t    credits_wait_cnt;
+    uint64_t    credits_wait_usecs;
+    uint64_t    credits_wait_max_usecs;
+    /* SMB 2/3 lease caching on the mounted share */
+    uint64_t    lease_attr_hits;        /* attr lookups answered under a read lease */
+    uint64_t    lease_open_hits;        /* opens that reused a deferred close */
+    uint64_t    lease_breaks;
+    /* Transport */
+    uint64_t    bytes_sent;             /* NetBIOS headers included */
+    uint64_t    bytes_recvd;
+    uint64_t    msgs_sent;              /* a compound chain is one message */
+    uint64_t    msgs_recvd;
+    uint64_t    send_calls;             /* socket writes, see iod_send_batch */
+    uint32_t    rqs_inflight;           /* requests sent and waiting on a reply */
+    uint32_t    srtt_usecs;             /* smoothed round trip time of replies */
+    uint32_t    rtt_min_usecs;
+    uint32_t    transport_pad;
+    uint64_t    reconnect_cnt;
+    uint64_t    reconnect_usecs;        /* total time spent in reconnect */
+    /* Attribute cache on the mounted share */
+    uint32_t    attr_cache_policy;      /* SMBFS_ATTRCACHE_* */
+    uint32_t    attr_cache_min;         /* seconds */
+    uint32_t    attr_cache_max;         /* seconds */
+    uint32_t    attr_cache_rate;        /* smoothed changes per minute */
+    uint64_t    attr_cache_hits;
+    uint64_t    attr_cache_misses;      /* cache was invalidated */
+    uint64_t    attr_cache_expired;     /* cache timed out */
+};
+
+/* SMBIOC_OP_STATS tables, see struct smb_lat_hist in smb.h */
+#define SMB_OP_STATS_VC         1   /* SMB 2/3 commands on the VC, by command */
+#define SMB_OP_STATS_SHARE      2   /* SMB 2/3 commands on the share, by command */
+#define SMB_OP_STATS_VNOP       3   /* VNOPs on the mounted share, by SMBFS_VOP_* */
+
+#define SMB_OP_STATS_MAX_HISTS  16
+
+/*
+ * SMBIOC_OP_STATS to pass latency histograms to userland. The tables are too
+ * big for one ioctl, so ask for ioc_first and keep going until ioc_total.
+ */
+struct smbioc_op_stats {
+	uint32_t    ioc_version;
+    uint32_t    ioc_reserved;
+    uint32_t    ioc_table;              /* SMB_OP_STATS_* */
+    uint32_t    ioc_first;              /* first entry of the table wanted */
+    uint32_t    ioc_count;              /* returned, entries filled in */
+    uint32_t    ioc_total;              /* returned, entries in the table */
+    struct smb_lat_hist ioc_hists[SMB_OP_STATS_MAX_HISTS];
+};
+
 /*
  * Device IOCTLs
  */
@@ -180,6 +244,8 @@ struct smbioc_share_properties {
 #define	SMB2IOC_GET_DFS_REFERRAL    _IOWR('n', 124, struct smb2ioc_get_dfs_referral)
 #define SMBIOC_SHARE_PROPERTIES	_IOWR('n', 125, struct smbioc_share_properties)
 #define	SMB2IOC_QUERY_DIR       _IOWR('n', 126, struct smb2ioc_query_dir)
+#define SMBIOC_VC_STATS         _IOWR('n', 127, struct smbioc_vc_stats)
+#define SMBIOC_OP_STATS         _IOWR('n', 128, struct smbioc_op_stats)
 
 
 #ifdef _KERNEL
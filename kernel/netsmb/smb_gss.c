@@ -374,6 +374,7 @@ retry:
 		/* Free any old key and reset the sequence number */
 		smb_reset_sig(vcp);
 		vcp->vc_mackeylen = keylen;
+		vcp->vc_full_mackeylen = keylen;
 		SMB_MALLOC(vcp->vc_mackey, uint8_t *, vcp->vc_mackeylen, M_SMBTEMP, M_WAITOK);
 		error = gss_mach_vmcopyout((vm_map_copy_t) okey, vcp->vc_mackeylen, vcp->vc_mackey);
 		if (error) {
@@ -395,10 +396,17 @@ retry:
             }
         }
         
-        /* Derive SMB 3 keys from the session key from gssd */
-        if (vcp->vc_flags & (SMBV_SMB30 | SMBV_SMB302)) {
+        /*
+         * Derive SMB 3 keys from the session key from gssd. For SMB 3.1.1 the
+         * iod derives them again once the last SessionSetup request is sent
+         * and the preauth hash is complete.
+         */
+        if (SMBV_SMB3_OR_LATER(vcp)) {
             smb3_derive_keys(vcp);
         }
+        else if (vcp->vc_flags & SMBV_SMB2) {
+            smb_crypt_ctx_init(vcp);
+        }
         
 		SMBDEBUG("%s keylen = %d seqno = %d\n", vcp->vc_srvname, keylen, vcp->vc_seqno);
 		smb_hexdump(__FUNCTION__, "setting vc_mackey = ", vcp->vc_mackey, vcp->vc_mackeylen);
@@ -42,6 +42,7 @@
 #include <sys/unistd.h>
 #include <sys/mount.h>
 #include <sys/vnode.h>
+#include <sys/sysctl.h>
 
 #include <sys/kauth.h>
 
@@ -67,6 +68,25 @@
 
 static int smb_iod_next;
 
+/*
+ * When set, each new iod gets a second thread that receives, decrypts,
+ * verifies and dispatches the replies. The main iod thread is then left
+ * with signing, encrypting and sending requests, timeouts and reconnects.
+ * Zero keeps everything on the single iod thread.
+ */
+static int smb_iod_rcv_thread = 0;
+
+/*
+ * Most SMB 2/3 requests smb_iod_sendall will put out with one socket
+ * write. One or less sends each request on its own.
+ */
+#define SMB_IOD_SEND_BATCH_MAX	32
+static int smb_iod_send_batch = SMB_IOD_SEND_BATCH_MAX;
+
+SYSCTL_DECL(_net_smb_fs);
+SYSCTL_INT(_net_smb_fs, OID_AUTO, iod_rcv_thread, CTLFLAG_RW, &smb_iod_rcv_thread, 0, "");
+SYSCTL_INT(_net_smb_fs, OID_AUTO, iod_send_batch, CTLFLAG_RW, &smb_iod_send_batch, 0, "");
+
 int smb_iod_sendall(struct smbiod *iod);
 
 /*
@@ -98,15 +118,81 @@ static int smb_iod_check_timeout(struct timespec *starttime, int SecondsTillTime
 }
 
 
+/*
+ * Fold one reply's round trip time into vc_srtt_usecs, same 1/8 gain as TCP.
+ * Reads, writes, ioctls and change notifies are left out since their time
+ * depends on the amount of data or on the server waiting for something.
+ * Updates are not locked, a racing update just loses a sample.
+ */
+static void
+smb_iod_update_rtt(struct smb_rq *rqp, uint64_t usecs)
+{
+	struct smb_vc *vcp = rqp->sr_vc;
+	int64_t srtt = vcp->vc_srtt_usecs;
+
+	switch (rqp->sr_command) {
+		case SMB2_READ:
+		case SMB2_WRITE:
+		case SMB2_IOCTL:
+		case SMB2_CHANGE_NOTIFY:
+			return;
+		default:
+			break;
+	}
+
+	/* Got a STATUS_PENDING first, so the server made us wait */
+	if (rqp->sr_rspasyncid != 0) {
+		return;
+	}
+
+	if (usecs > UINT32_MAX) {
+		usecs = UINT32_MAX;
+	}
+	if ((vcp->vc_rtt_min_usecs == 0) || (usecs < vcp->vc_rtt_min_usecs)) {
+		vcp->vc_rtt_min_usecs = (uint32_t) usecs;
+	}
+	if (srtt == 0) {
+		vcp->vc_srtt_usecs = (uint32_t) usecs;
+	}
+	else {
+		vcp->vc_srtt_usecs = (uint32_t) (srtt + (((int64_t) usecs - srtt) / 8));
+	}
+}
+
 static __inline void
 smb_iod_rqprocessed(struct smb_rq *rqp, int error, int flags)
 {
+	uint64_t usecs;
+
 	SMBRQ_SLOCK(rqp);
 	rqp->sr_flags |= flags;
 	rqp->sr_lerror = error;
 	rqp->sr_rpgen++;
 	rqp->sr_state = SMBRQ_NOTIFIED;
-	if (rqp->sr_flags & SMBR_ASYNC) {
+
+	/*
+	 * SMB 2/3 latency from when the request went out until it is done. A
+	 * compound chain is counted once under its first command. Errors here
+	 * are requests that never got a reply, not NT status errors.
+	 */
+	if ((rqp->sr_extflags & SMB2_REQUEST) &&
+	    !(rqp->sr_extflags & SMB2_REQ_TIMED) &&
+	    ((rqp->sr_timesent.tv_sec != 0) || (rqp->sr_timesent.tv_nsec != 0)) &&
+	    (rqp->sr_command < SMB_LAT_NCMDS)) {
+		rqp->sr_extflags |= SMB2_REQ_TIMED;
+		usecs = smb_lat_usecs(&rqp->sr_timesent);
+		smb_lat_hist_add(&rqp->sr_vc->vc_cmd_stats[rqp->sr_command],
+						 usecs, error);
+		if (rqp->sr_share != NULL) {
+			smb_lat_hist_add(&rqp->sr_share->ss_cmd_stats[rqp->sr_command],
+							 usecs, error);
+		}
+		if (error == 0) {
+			smb_iod_update_rtt(rqp, usecs);
+		}
+	}
+
+	if (rqp->sr_flags & (SMBR_ASYNC | SMBR_CALLBACK)) {
 		DBG_ASSERT(rqp->sr_callback);
 		rqp->sr_callback(rqp->sr_callback_args);
 	} else 
@@ -114,6 +200,100 @@ smb_iod_rqprocessed(struct smb_rq *rqp, int error, int flags)
 	SMBRQ_SUNLOCK(rqp);
 }
 
+/*
+ * SMB 2/3 message id hash
+ *
+ * Every SMB 2/3 reply has to be matched back to its smb_rq by message id.
+ * Walking iod_rqlist for each reply gets expensive with lots of outstanding
+ * reads/writes and parked Change Notify requests, so each sent request is
+ * also entered into iod_rqhash keyed by its message id. For compound
+ * requests, every rqp in the chain gets entered with sr_hash_head pointing
+ * back at the first rqp which is the one on iod_rqlist.
+ *
+ * The iod request lock must be held when calling these routines.
+ */
+static void
+smb_iod_rqhash_remove(struct smbiod *iod, struct smb_rq *head_rqp)
+{
+    struct smb_rq *tmp_rqp = head_rqp;
+
+    while (tmp_rqp != NULL) {
+        if (tmp_rqp->sr_hash_head != NULL) {
+            LIST_REMOVE(tmp_rqp, sr_hash_link);
+            tmp_rqp->sr_hash_head = NULL;
+        }
+
+        if (!(head_rqp->sr_flags & SMBR_COMPOUND_RQ)) {
+            break;
+        }
+        tmp_rqp = tmp_rqp->sr_next_rqp;
+    }
+}
+
+static void
+smb_iod_rqhash_insert(struct smbiod *iod, struct smb_rq *head_rqp)
+{
+    struct smb_rqhash_head *slotPtr;
+    struct smb_rq *tmp_rqp = head_rqp;
+
+    /* Message ids change when a request is resent, so drop any old entries */
+    smb_iod_rqhash_remove(iod, head_rqp);
+
+    while (tmp_rqp != NULL) {
+        slotPtr = &iod->iod_rqhash[tmp_rqp->sr_messageid & SMB_IOD_RQHASH_MASK];
+        if (!LIST_EMPTY(slotPtr)) {
+            iod->iod_rqhash_collisions++;
+        }
+        LIST_INSERT_HEAD(slotPtr, tmp_rqp, sr_hash_link);
+        tmp_rqp->sr_hash_head = head_rqp;
+        iod->iod_rqhash_inserted++;
+
+        if (!(head_rqp->sr_flags & SMBR_COMPOUND_RQ)) {
+            break;
+        }
+        tmp_rqp = tmp_rqp->sr_next_rqp;
+    }
+}
+
+static struct smb_rq *
+smb_iod_rqhash_lookup(struct smbiod *iod, uint64_t message_id)
+{
+    struct smb_rq *rqp;
+    uint64_t iter = 0;
+
+    LIST_FOREACH(rqp, &iod->iod_rqhash[message_id & SMB_IOD_RQHASH_MASK],
+                 sr_hash_link) {
+        if (rqp->sr_messageid == message_id) {
+            break;
+        }
+        iter++;
+    }
+
+    if (iter > iod->iod_rqhash_max_iter) {
+        iod->iod_rqhash_max_iter = iter;
+    }
+
+    return (rqp);
+}
+
+/*
+ * All the message ids are about to become invalid, empty out the hash. The
+ * requests will get resent or errored out after the reconnect.
+ */
+static void
+smb_iod_rqhash_reset(struct smbiod *iod)
+{
+    struct smb_rq *rqp, *trqp;
+    uint32_t table_index;
+
+    for (table_index = 0; table_index < SMB_IOD_RQHASH_SIZE; table_index++) {
+        LIST_FOREACH_SAFE(rqp, &iod->iod_rqhash[table_index], sr_hash_link, trqp) {
+            LIST_REMOVE(rqp, sr_hash_link);
+            rqp->sr_hash_head = NULL;
+        }
+    }
+}
+
 /* 
  * Gets called from smb_iod_dead, smb_iod_negotiate and smb_iod_ssnsetup. This routine
  * should never get called while we are in reconnect state. This routine just flushes 
@@ -133,10 +313,58 @@ static void smb_iod_invrq(struct smbiod *iod)
 	SMB_IOD_RQUNLOCK(iod);
 }
 
+/*
+ * The receive thread only handles replies while the session is up. Connect,
+ * negotiate, session setup and reconnect are still done by the main iod
+ * thread which receives its own replies.
+ */
+static int
+smb_iod_rcv_thread_active(struct smbiod *iod)
+{
+	if (!(iod->iod_flags & SMBIOD_RCV_RUNNING))
+		return FALSE;
+	if (iod->iod_state != SMBIOD_ST_VCACTIVE)
+		return FALSE;
+	if (iod->iod_flags & (SMBIOD_RECONNECT | SMBIOD_START_RECONNECT | 
+						  SMBIOD_RCV_STALLED | SMBIOD_RCV_SHUTDOWN))
+		return FALSE;
+	return TRUE;
+}
+
+/*
+ * With a receive thread, smb_iod_recvall can run on either thread so it has
+ * to be serialized, and the transport can not be torn down while its in use.
+ * With a single iod thread there is nothing to serialize against.
+ */
+static __inline void
+smb_iod_rcvlock(struct smbiod *iod)
+{
+	if (iod->iod_flags & SMBIOD_RCV_THREAD)
+		lck_mtx_lock(&iod->iod_rcvlock);
+}
+
+static __inline void
+smb_iod_rcvunlock(struct smbiod *iod)
+{
+	if (iod->iod_flags & SMBIOD_RCV_THREAD)
+		lck_mtx_unlock(&iod->iod_rcvlock);
+}
+
 static void
 smb_iod_sockwakeup(struct smbiod *iod)
 {
 	/* note: called from socket upcall... */
+	if (iod->iod_flags & SMBIOD_RCV_RUNNING) {
+		SMB_IOD_FLAGSLOCK(iod);
+		iod->iod_rcv_workflag = 1;
+		wakeup(&iod->iod_rcv_workflag);
+		SMB_IOD_FLAGSUNLOCK(iod);
+		
+		/* Replies are handled by the receive thread, nothing for the iod */
+		if (smb_iod_rcv_thread_active(iod))
+			return;
+	}
+	
 	iod->iod_workflag = 1;		/* new work to do */
 	
 	wakeup(&(iod)->iod_flags);
@@ -149,8 +377,10 @@ smb_iod_closetran(struct smbiod *iod)
 
 	if (vcp->vc_tdata == NULL)
 		return;
+	smb_iod_rcvlock(iod);
 	SMB_TRAN_DISCONNECT(vcp);
 	SMB_TRAN_DONE(vcp);
+	smb_iod_rcvunlock(iod);
 }
 
 static void
@@ -270,6 +500,8 @@ static void smb_iod_start_reconnect(struct smbiod *iod)
             }
 		}
 	}
+	/* Any message ids handed out so far die with this connection */
+	smb_iod_rqhash_reset(iod);
 	SMB_IOD_RQUNLOCK(iod);
 	
 	/* We are already in reconnect, so we are done */
@@ -418,34 +650,23 @@ smb_iod_disconnect(struct smbiod *iod)
 	return 0;
 }
 
+/*
+ * Get the request ready to go out on the wire: fill in the ids, sign or
+ * encrypt it and hand back the mbufs to send in mp. If mp comes back NULL
+ * the request has already been completed and there is nothing to send.
+ */
 static int
-smb_iod_sendrq(struct smbiod *iod, struct smb_rq *rqp)
+smb_iod_sendrq_prepare(struct smbiod *iod, struct smb_rq *rqp, mbuf_t *mp)
 {
 	struct smb_vc *vcp = iod->iod_vc;
-	mbuf_t m, m2;
+	mbuf_t m = NULL, m2;
 	int error = 0;
     uint32_t do_encrypt;
     struct smb_rq *tmp_rqp;
 	struct mbchain *mbp;
 
-	SMBIODEBUG("iod_state = %d\n", iod->iod_state);
-	switch (iod->iod_state) {
-	    case SMBIOD_ST_NOTCONN:
-            smb_iod_rqprocessed(rqp, ENOTCONN, 0);
-            return 0;
-	    case SMBIOD_ST_DEAD:
-            /* This is what keeps the iod itself from sending more */
-            smb_iod_rqprocessed(rqp, ENOTCONN, 0);
-            return 0;
-	    case SMBIOD_ST_CONNECT:
-            return 0;
-	    case SMBIOD_ST_NEGOACTIVE:
-            SMBERROR("smb_iod_sendrq in unexpected state(%d)\n",
-                     iod->iod_state);
-	    default:
-            break;
-	}
-
+    *mp = NULL;
+    
     if (rqp->sr_extflags & SMB2_REQUEST) {
         /* filled in by smb2_rq_init_internal */
     }
@@ -491,10 +712,15 @@ smb_iod_sendrq(struct smbiod *iod, struct smb_rq *rqp)
         
         SMBSDEBUG("MessageID:%llu\n", rqp->sr_messageid);
         
+        /* Must be in the hash before the reply can possibly arrive */
+        SMB_IOD_RQLOCK(iod);
+        smb_iod_rqhash_insert(iod, rqp);
+        SMB_IOD_RQUNLOCK(iod);
+        
         /* Determine if outgoing request(s) must be encrypted */
         do_encrypt = 0;
         
-        if (vcp->vc_flags & (SMBV_SMB30 | SMBV_SMB302)) {
+        if (SMBV_SMB3_OR_LATER(vcp)) {
             /* Check if session is encrypted */
             if (vcp->vc_sopt.sv_sessflags & SMB2_SESSION_FLAG_ENCRYPT_DATA) {
                 if (rqp->sr_command != SMB2_NEGOTIATE) {
@@ -517,6 +743,21 @@ smb_iod_sendrq(struct smbiod *iod, struct smb_rq *rqp)
             smb2_rq_sign(rqp);
         }
         
+        if (rqp->sr_extflags & SMB2_REQ_PREAUTH) {
+            /* SMB 3.1.1 preauth hash covers the request exactly as sent */
+            smb311_preauth_hash_update(vcp, mbp->mb_top);
+            
+            /*
+             * Once gssd has handed us the session key, this is the last
+             * SessionSetup request and the hash is final, so (re)derive the
+             * keys before the signed reply comes back.
+             */
+            if ((rqp->sr_command == SMB2_SESSION_SETUP) &&
+                (vcp->vc_mackey != NULL)) {
+                smb3_derive_keys(vcp);
+            }
+        }
+        
         if (rqp->sr_flags & SMBR_COMPOUND_RQ) {
             /* 
              * Compound request to send. The first rqp has its sr_next_rq set to 
@@ -590,40 +831,120 @@ smb_iod_sendrq(struct smbiod *iod, struct smb_rq *rqp)
     /* Record the current thread for VFS_CTL_NSTATUS */
     SMB_IOD_RQLOCK(iod);
     rqp->sr_threadId = thread_tid(current_thread());
-    SMB_IOD_RQUNLOCK(iod);
-    
     
-    /* Call SMB_TRAN_SEND to send the mbufs in "m" */
-    error = rqp->sr_lerror = (error) ? error : SMB_TRAN_SEND(vcp, m);
-	if (error == 0) {
+    /*
+     * Once the send starts, the reply can come back and the request be
+     * done before SMB_TRAN_SEND returns, so it has to be marked sent now.
+     * smb_iod_sendrq_done undoes this if the send fails.
+     */
+    SMBRQ_SLOCK(rqp);
+    if (rqp->sr_state == SMBRQ_NOTSENT) {
+        rqp->sr_lerror = 0;
         nanouptime(&rqp->sr_timesent);
         iod->iod_lastrqsent = rqp->sr_timesent;
+        rqp->sr_extflags &= ~SMB2_REQ_TIMED;
         rqp->sr_state = SMBRQ_SENT;
         
         /* 
          * For SMB 2/3, set flag indicating this request was sent. Used for 
          * keeping track of credits.  
          */
-        if (rqp->sr_flags & SMBR_COMPOUND_RQ) {
-            rqp->sr_extflags |= SMB2_REQ_SENT;
-            tmp_rqp = rqp->sr_next_rqp;
-            while (tmp_rqp != NULL) {
-                tmp_rqp->sr_extflags |= SMB2_REQ_SENT;
-                tmp_rqp = tmp_rqp->sr_next_rqp;
+        for (tmp_rqp = rqp; tmp_rqp != NULL; tmp_rqp = tmp_rqp->sr_next_rqp) {
+            tmp_rqp->sr_extflags |= SMB2_REQ_SENT;
+            if (!(rqp->sr_flags & SMBR_COMPOUND_RQ)) {
+                break;
             }
         }
-        else {
-            rqp->sr_extflags |= SMB2_REQ_SENT;
-        }
-        
+    }
+    SMBRQ_SUNLOCK(rqp);
+    SMB_IOD_RQUNLOCK(iod);
+    
+    *mp = m;
+    return (error);
+}
+
+/*
+ * The iod is about to send rqp, keep smb_iod_removerq and smb_rq_done from
+ * pulling it out from under us until smb_iod_rq_sent. Called with the iod
+ * request lock held, so rqp is still on iod_rqlist.
+ */
+static void
+smb_iod_rq_insend(struct smb_rq *rqp)
+{
+	SMBRQ_SLOCK(rqp);
+	rqp->sr_flags |= SMBR_INSEND;
+	SMBRQ_SUNLOCK(rqp);
+}
+
+/*
+ * The iod is done with rqp, it can be freed any time after this.
+ */
+static void
+smb_iod_rq_sent(struct smbiod *iod, struct smb_rq *rqp)
+{
+	SMB_IOD_RQLOCK(iod);
+	SMBRQ_SLOCK(rqp);
+	rqp->sr_flags &= ~SMBR_INSEND;
+	wakeup(&rqp->sr_flags);
+	SMBRQ_SUNLOCK(rqp);
+	SMB_IOD_RQUNLOCK(iod);
+}
+
+/*
+ * Wait for the iod to finish sending rqp. Anyone about to remove or free a
+ * request has to call this first.
+ */
+void
+smb_iod_rq_sendwait(struct smb_rq *rqp)
+{
+	SMBRQ_SLOCK(rqp);
+	while (rqp->sr_flags & SMBR_INSEND) {
+		msleep(&rqp->sr_flags, SMBRQ_SLOCKPTR(rqp), PWAIT,
+			   "smb_iod_rq_sendwait", NULL);
+	}
+	SMBRQ_SUNLOCK(rqp);
+}
+
+/*
+ * The transport is done with the request. smb_iod_sendrq_prepare already
+ * marked it sent, so only a failed send has anything left to do. Returns
+ * ENOTCONN if the connection went down and we need to reconnect.
+ */
+static int
+smb_iod_sendrq_done(struct smbiod *iod, struct smb_rq *rqp, int error)
+{
+	struct smb_vc *vcp = iod->iod_vc;
+    struct smb_rq *tmp_rqp;
+    int unsent = 0;
+
+	if (error == 0) {
 		return 0;
 	}
     
+    /* Nothing went out, unless someone already finished it off */
+    SMB_IOD_RQLOCK(iod);
+    SMBRQ_SLOCK(rqp);
+    if (rqp->sr_state == SMBRQ_SENT) {
+        rqp->sr_lerror = error;
+        rqp->sr_state = SMBRQ_NOTSENT;
+        rqp->sr_timesent.tv_sec = 0;
+        rqp->sr_timesent.tv_nsec = 0;
+        for (tmp_rqp = rqp; tmp_rqp != NULL; tmp_rqp = tmp_rqp->sr_next_rqp) {
+            tmp_rqp->sr_extflags &= ~SMB2_REQ_SENT;
+            if (!(rqp->sr_flags & SMBR_COMPOUND_RQ)) {
+                break;
+            }
+        }
+        unsent = 1;
+    }
+    SMBRQ_SUNLOCK(rqp);
+    SMB_IOD_RQUNLOCK(iod);
+    
 	/* Did the connection go down, we may need to reconnect. */
 	if (SMB_TRAN_FATAL(vcp, error)) {
 		return ENOTCONN;
     }
-	else if (error) {	/* Either the send failed or the mbuf_copym? */
+	else if (unsent) {	/* Either the send failed or the mbuf_copym? */
 		SMBERROR("TRAN_SEND returned non-fatal error %d sr_cmd = 0x%x\n", 
                  error, rqp->sr_cmd);
 		error = EIO; /* Couldn't send not much else we can do */
@@ -632,6 +953,314 @@ smb_iod_sendrq(struct smbiod *iod, struct smb_rq *rqp)
 	return 0;
 }
 
+/*
+ * The caller marked rqp with smb_iod_rq_insend, the mark comes off when we
+ * are done with it.
+ */
+static int
+smb_iod_sendrq(struct smbiod *iod, struct smb_rq *rqp)
+{
+	struct smb_vc *vcp = iod->iod_vc;
+	mbuf_t m;
+	int error = 0;
+
+	SMBIODEBUG("iod_state = %d\n", iod->iod_state);
+	switch (iod->iod_state) {
+	    case SMBIOD_ST_NOTCONN:
+            smb_iod_rqprocessed(rqp, ENOTCONN, 0);
+            goto out;
+	    case SMBIOD_ST_DEAD:
+            /* This is what keeps the iod itself from sending more */
+            smb_iod_rqprocessed(rqp, ENOTCONN, 0);
+            goto out;
+	    case SMBIOD_ST_CONNECT:
+            goto out;
+	    case SMBIOD_ST_NEGOACTIVE:
+            SMBERROR("smb_iod_sendrq in unexpected state(%d)\n",
+                     iod->iod_state);
+	    default:
+            break;
+	}
+
+    error = smb_iod_sendrq_prepare(iod, rqp, &m);
+    if ((error == 0) && (m == NULL)) {
+        /* Already completed */
+        goto out;
+    }
+    
+    /* Call SMB_TRAN_SEND to send the mbufs in "m" */
+    if (error == 0) {
+        error = SMB_TRAN_SEND(vcp, m);
+    }
+    error = smb_iod_sendrq_done(iod, rqp, error);
+    
+out:
+    smb_iod_rq_sent(iod, rqp);
+    return (error);
+}
+
+/*
+ * Send several SMB 2/3 requests with one socket write. Each one gets
+ * prepared (and signed or encrypted) on its own, then the transport puts
+ * them all out together. A metadata storm of small requests ends up in a
+ * few TCP segments instead of one per request.
+ */
+static int
+smb_iod_sendrq_batch(struct smbiod *iod, struct smb_rq **rqps, int count)
+{
+	struct smb_vc *vcp = iod->iod_vc;
+	struct smb_rq *sent[SMB_IOD_SEND_BATCH_MAX];
+	mbuf_t m, head = NULL, tail = NULL;
+	int error, i, nsend = 0;
+    int reconnect = 0;
+
+    if ((count == 1) || (iod->iod_state != SMBIOD_ST_VCACTIVE)) {
+        /* Let smb_iod_sendrq deal with the connection state */
+        for (i = 0; i < count; i++) {
+            if (reconnect) {
+                /* Leave the rest for after the reconnect */
+                smb_iod_rq_sent(iod, rqps[i]);
+            }
+            else if (smb_iod_sendrq(iod, rqps[i]) != 0) {
+                reconnect = 1;
+            }
+        }
+        return (reconnect ? ENOTCONN : 0);
+    }
+    
+    for (i = 0; i < count; i++) {
+        sent[i] = rqps[i];
+        (void) smb_iod_sendrq_prepare(iod, rqps[i], &m);
+        if (m == NULL) {
+            /* Already completed, leave it out */
+            rqps[i] = NULL;
+            continue;
+        }
+        
+        /* Messages are linked by their packet headers */
+        if (head == NULL) {
+            head = m;
+        }
+        else {
+            mbuf_setnextpkt(tail, m);
+        }
+        tail = m;
+        nsend++;
+    }
+    
+    if (nsend != 0) {
+        error = SMB_TRAN_SENDBATCH(vcp, head);
+        
+        for (i = 0; i < count; i++) {
+            if ((rqps[i] != NULL) &&
+                (smb_iod_sendrq_done(iod, rqps[i], error) != 0)) {
+                reconnect = 1;
+            }
+        }
+    }
+    
+    /* The caller marked all of them with smb_iod_rq_insend */
+    for (i = 0; i < count; i++) {
+        smb_iod_rq_sent(iod, sent[i]);
+    }
+    
+    return (reconnect ? ENOTCONN : 0);
+}
+
+/*
+ * Find the smb_rq that matches this SMB 2/3 reply. If the reply is for a
+ * compound request from a server that does not send compound replies, then
+ * cmpd_rqpp is set to the first rqp in the chain. The iod request lock must
+ * be held.
+ */
+static struct smb_rq *
+smb_iod_smb2_findrq(struct smbiod *iod, struct smb2_header *smb2_hdr,
+                    uint64_t message_id, uint8_t cmd, struct smb_rq **cmpd_rqpp)
+{
+	struct smb_vc *vcp = iod->iod_vc;
+    struct smb_rq *rqp, *head_rqp;
+    
+    *cmpd_rqpp = NULL;
+    
+    rqp = smb_iod_rqhash_lookup(iod, message_id);
+    if (rqp != NULL) {
+        head_rqp = rqp->sr_hash_head;
+    }
+    else {
+        if (cmd != SMB2_NEGOTIATE) {
+            return (NULL);
+        }
+        
+        /*
+         * For SMB 2/3, client sends out a SMB 1 Negotiate request, but the
+         * server replies with a SMB 2/3 Negotiate response. The SMB 1 request
+         * never got a message id assigned so its not in the hash, just match
+         * it to any Negotiate request waiting for a response.
+         */
+        TAILQ_FOREACH(rqp, &iod->iod_rqlist, sr_link) {
+            if (rqp->sr_messageid == message_id) {
+                break;
+            }
+        }
+        if (rqp == NULL) {
+            return (NULL);
+        }
+        head_rqp = rqp;
+    }
+    
+    if (rqp == head_rqp) {
+        /*
+         * Matched non compound rqp or matched first rqp in a
+         * compound rqp.
+         */
+        
+        /*
+         * If sent compound req, and this is not an
+         * Async/STATUS_PENDING reply, then we should have gotten
+         * a compound response
+         */
+        if ((rqp->sr_flags & SMBR_COMPOUND_RQ) &&
+            (smb2_hdr->next_command == 0) &&
+            !((smb2_hdr->flags & SMBR_ASYNC) && (smb2_hdr->status == STATUS_PENDING))) {
+            
+            if (!(vcp->vc_misc_flags & SMBV_NON_COMPOUND_REPLIES)) {
+                /*
+                 * <14227703> Some NetApp servers send back non
+                 * compound replies to compound requests. Sigh.
+                 */
+                SMBWARNING("Non compound reply to compound req. message_id %lld, cmd %d\n", message_id, cmd);
+                
+                /* Once set, this remains set forever */
+                vcp->vc_misc_flags |= SMBV_NON_COMPOUND_REPLIES;
+            }
+            
+            /*
+             * Must be first non compound reply to a compound
+             * request, thus there must be more replies pending.
+             */
+            *cmpd_rqpp = rqp;   /* save start of compound rqp */
+        }
+    }
+    else {
+        /*
+         * Matched a middle or last rqp in a compound rqp. Only servers
+         * using non compound replies answer those individually.
+         */
+        if (!(vcp->vc_misc_flags & SMBV_NON_COMPOUND_REPLIES)) {
+            return (NULL);
+        }
+        
+        /* <14227703> save start of compound rqp */
+        *cmpd_rqpp = head_rqp;
+    }
+    
+    /* Verify that found smb_rq is a SMB 2/3 request */
+    if (!(rqp->sr_extflags & SMB2_REQUEST) &&
+        (cmd != SMB2_NEGOTIATE)) {
+        SMBERROR("Found non SMB 2/3 request? message_id %lld, cmd %d\n", message_id, cmd);
+    }
+    
+    rqp->sr_extflags |= SMB2_RESPONSE;
+    return (rqp);
+}
+
+/*
+ * Called by the transport once it has read the SMB 2/3 header and the fixed
+ * part of what could be a Read response, m holds just those bytes and
+ * msg_len is the size of the whole message. If it is the reply to a Read
+ * that registered a sr_place_uio, return that rqp with *uiop and *place_lenp
+ * set to where the data goes and how much of it there is. The transport then
+ * reads the data straight into *uiop instead of into mbufs, and must call
+ * smb_iod_rq_place_done() when it is done, good or bad. *uiop is a copy of
+ * sr_place_uio, so a failed attempt leaves nothing behind in the rqp.
+ *
+ * Only a plain successful reply with the data right after the response
+ * qualifies. Anything signed, compounded or laid out differently returns
+ * NULL and gets read the usual way.
+ */
+struct smb_rq *
+smb_iod_rq_place(struct smb_vc *vcp, mbuf_t m, uint32_t msg_len,
+                 uio_t *uiop, uint32_t *place_lenp)
+{
+	struct smbiod *iod = vcp->vc_iod;
+	struct smb_rq *rqp;
+	struct smb2_header *smb2_hdr;
+	uint8_t hdr[SMB2_HDRLEN + SMB2_READ_RSP_HDRLEN];
+	uint8_t *rspp = &hdr[SMB2_HDRLEN];
+	uint32_t data_len;
+
+	if ((iod == NULL) ||
+	    (msg_len <= sizeof(hdr)) ||
+	    (mbuf_copydata(m, 0, sizeof(hdr), hdr) != 0)) {
+		return (NULL);
+	}
+
+	smb2_hdr = (struct smb2_header *) hdr;
+	if ((bcmp(hdr, SMB2_SIGNATURE, SMB2_SIGLEN) != 0) ||
+	    (letohs(smb2_hdr->command) != SMB2_READ) ||
+	    (letohl(smb2_hdr->status) != 0) ||
+	    (letohl(smb2_hdr->flags) & SMB2_FLAGS_SIGNED) ||
+	    (smb2_hdr->next_command != 0)) {
+		return (NULL);
+	}
+
+	/* Struct size 17, data offset, reserved, data length */
+	data_len = letohl(*(uint32_t *) &rspp[4]);
+	if ((letohs(*(uint16_t *) rspp) != 17) ||
+	    (rspp[2] != sizeof(hdr)) ||
+	    (data_len != msg_len - sizeof(hdr))) {
+		return (NULL);
+	}
+
+	SMB_IOD_RQLOCK(iod);
+	rqp = smb_iod_rqhash_lookup(iod, letohq(smb2_hdr->message_id));
+	if ((rqp == NULL) ||
+	    (rqp->sr_hash_head != rqp) ||
+	    (rqp->sr_place_uio == NULL) ||
+	    (rqp->sr_command != SMB2_READ) ||
+	    (data_len > uio_resid(rqp->sr_place_uio))) {
+		SMB_IOD_RQUNLOCK(iod);
+		return (NULL);
+	}
+
+	/* Keeps smb_rq_done from freeing the rqp until we are done */
+	SMBRQ_SLOCK(rqp);
+	rqp->sr_flags |= SMBR_PLACING;
+	rqp->sr_place_len = 0;
+	SMBRQ_SUNLOCK(rqp);
+	SMB_IOD_RQUNLOCK(iod);
+
+	*uiop = uio_duplicate(rqp->sr_place_uio);
+	if (*uiop == NULL) {
+		smb_iod_rq_place_done(rqp, NULL, 0, ENOMEM);
+		return (NULL);
+	}
+	*place_lenp = data_len;
+	return (rqp);
+}
+
+/*
+ * The transport is done reading data for smb_iod_rq_place(). On error the
+ * reply will never show up, the rqp gets errored out with the connection.
+ */
+void
+smb_iod_rq_place_done(struct smb_rq *rqp, uio_t uio, uint32_t place_len,
+                      int error)
+{
+	if (uio != NULL) {
+		uio_free(uio);
+	}
+
+	SMBRQ_SLOCK(rqp);
+	if (error == 0) {
+		rqp->sr_place_len = place_len;
+	}
+	rqp->sr_flags &= ~SMBR_PLACING;
+	SMBRQ_SUNLOCK(rqp);
+
+	wakeup(&rqp->sr_place_uio);
+}
+
 /*
  * Process incoming packets
  */
@@ -639,7 +1268,7 @@ static int
 smb_iod_recvall(struct smbiod *iod)
 {
 	struct smb_vc *vcp = iod->iod_vc;
-	struct smb_rq *rqp, *trqp, *temp_rqp, *cmpd_rqp;
+	struct smb_rq *rqp, *temp_rqp, *cmpd_rqp;
 	mbuf_t m;
 	u_char *hp;
 	uint16_t mid = 0;
@@ -653,6 +1282,7 @@ smb_iod_recvall(struct smbiod *iod)
     boolean_t smb1_allowed = true;
 	struct mdchain *mdp = NULL;
     int skip_wakeup = 0;
+    int start_reconnect = 0;
 
 	switch (iod->iod_state) {
 	    case SMBIOD_ST_NOTCONN:
@@ -663,6 +1293,14 @@ smb_iod_recvall(struct smbiod *iod)
             break;
 	}
 
+	smb_iod_rcvlock(iod);
+	if ((current_thread() == iod->iod_rcv_thread) &&
+		!smb_iod_rcv_thread_active(iod)) {
+		/* Main iod thread owns the connection right now */
+		smb_iod_rcvunlock(iod);
+		return 0;
+	}
+
 	for (;;) {
         m = NULL;
         smb2_packet = false;
@@ -677,7 +1315,8 @@ smb_iod_recvall(struct smbiod *iod)
         }
 		if (SMB_TRAN_FATAL(vcp, error)) {
             SMBDEBUG("SMB_TRAN_FATAL failed %d\n", error);
-            smb_iod_start_reconnect(iod);
+            /* Can't reconnect while holding the receive lock */
+            start_reconnect = 1;
             break;
 		}
 		if (error) {
@@ -795,92 +1434,16 @@ smb_iod_recvall(struct smbiod *iod)
         }
 
         /*
-         * Search queue of smb_rq to find a match
+         * Search for the matching smb_rq. SMB 2/3 replies are looked up by
+         * message id, SMB 1 still has to search the queue.
          */
         SMB_IOD_RQLOCK(iod);
 		nanouptime(&iod->iod_lastrecv);
-		TAILQ_FOREACH_SAFE(rqp, &iod->iod_rqlist, sr_link, trqp) {
-            if (smb2_packet) {
-                if (rqp->sr_messageid == message_id) {
-                    /*
-                     * Matched non compound rqp or matched first rqp in a
-                     * compound rqp.
-                     */
-                    
-                    /*
-                     * If sent compound req, and this is not an 
-                     * Async/STATUS_PENDING reply, then we should have gotten 
-                     * a compound response
-                     */
-                    if ((rqp->sr_flags & SMBR_COMPOUND_RQ) &&
-                        (smb2_hdr->next_command == 0) &&
-                        !((smb2_hdr->flags & SMBR_ASYNC) && (smb2_hdr->status == STATUS_PENDING))) {
-                        
-                        if (!(vcp->vc_misc_flags & SMBV_NON_COMPOUND_REPLIES)) {
-                            /*
-                             * <14227703> Some NetApp servers send back non
-                             * compound replies to compound requests. Sigh.
-                             */
-                            SMBWARNING("Non compound reply to compound req. message_id %lld, cmd %d\n", message_id, cmd);
-                            
-                            /* Once set, this remains set forever */
-                            vcp->vc_misc_flags |= SMBV_NON_COMPOUND_REPLIES;
-                        }
-                        
-                        /*
-                         * Must be first non compound reply to a compound 
-                         * request, thus there must be more replies pending.
-                         */
-                        cmpd_rqp = rqp; /* save start of compound rqp */
-                    }
-                }
-                else {
-                    /* 
-                     * Did not match non compound rqp or did not match
-                     * first rqp in a compound rqp
-                     */
-                    if (!(rqp->sr_flags & SMBR_COMPOUND_RQ) ||
-                        !(vcp->vc_misc_flags & SMBV_NON_COMPOUND_REPLIES)) {
-                        /* 
-                         * Not a compound request or server supports compound 
-                         * replies, go check next rqp 
-                         */
-                        continue;
-                    }
-                    
-                    /* 
-                     * <14227703> Server is using non compound replies, so have
-                     * to search each request chain to see if this reply matches 
-                     * a middle or last request in the chain.
-                     */
-                    cmpd_rqp = rqp;     /* save start of compound rqp */
-                    
-                    temp_rqp = rqp->sr_next_rqp;
-                    while (temp_rqp != NULL) {
-                        if (temp_rqp->sr_messageid == message_id) {
-                            /* Matches a rqp in this chain */
-                            rqp = temp_rqp;
-                            break;
-                        }
-                        temp_rqp = temp_rqp->sr_next_rqp;
-                    }
-                    
-                    if (temp_rqp == NULL) {
-                        /* Not found in this compound rqp */
-                        cmpd_rqp = NULL;
-                        continue;
-                    }
-                }
-                
-                /* Verify that found smb_rq is a SMB 2/3 request */
-                if (!(rqp->sr_extflags & SMB2_REQUEST) &&
-                    (cmd != SMB2_NEGOTIATE)) {
-                    SMBERROR("Found non SMB 2/3 request? message_id %lld, cmd %d\n", message_id, cmd);
-                }
-                
-                rqp->sr_extflags |= SMB2_RESPONSE;
-            }
-            else {
+        if (smb2_packet) {
+            rqp = smb_iod_smb2_findrq(iod, smb2_hdr, message_id, cmd, &cmpd_rqp);
+        }
+        else {
+            TAILQ_FOREACH(rqp, &iod->iod_rqlist, sr_link) {
                 /* 
                  * <12071582>
                  * We now use the mid and the low pid as a single mid, this gives
@@ -890,14 +1453,16 @@ smb_iod_recvall(struct smbiod *iod)
                  *
                  * NOTE: SMB 2/3 does not have this issue.
                  */
-                if ((rqp->sr_mid != mid) ||
-                    (rqp->sr_cmd != cmd) ||
-                    (rqp->sr_pidHigh != pidHigh) ||
-                    (rqp->sr_pidLow != pidLow)) {
-                    continue;
+                if ((rqp->sr_mid == mid) &&
+                    (rqp->sr_cmd == cmd) &&
+                    (rqp->sr_pidHigh == pidHigh) &&
+                    (rqp->sr_pidLow == pidLow)) {
+                    break;
                 }
             }
-            
+        }
+        
+        if (rqp != NULL) {
             /*
              * Found a matching smb_rq
              */
@@ -928,7 +1493,7 @@ smb_iod_recvall(struct smbiod *iod)
                     /* Get granted credits from this response */
                     smb2_rq_credit_increment(rqp);
                     rqp = NULL;
-                    break;
+                    goto rqlist_done;
                 }
             } 
 
@@ -959,7 +1524,7 @@ smb_iod_recvall(struct smbiod *iod)
                 else {
                     SMBRQ_SUNLOCK(rqp);
                     SMBERROR("duplicate response %d (ignored)\n", mid);
-                    break;
+                    goto rqlist_done;
                 }
             }
             
@@ -994,9 +1559,8 @@ smb_iod_recvall(struct smbiod *iod)
                     smb_iod_rqprocessed(rqp, 0, 0);
                 }
             }
-
-            break;
 		}
+rqlist_done:
 		SMB_IOD_RQUNLOCK(iod);
 
 		if (rqp == NULL) {		
@@ -1007,7 +1571,16 @@ smb_iod_recvall(struct smbiod *iod)
                     (smb2_hdr->sync.tree_id == 0) &&
                     (smb2_hdr->session_id == 0))
                 {
-                    (void) smb2_smb_parse_lease_break(iod, m);
+                    if (iod->iod_flags & SMBIOD_RCV_THREAD) {
+                        /*
+                         * Acking the break has to send a request and wait
+                         * for its reply, leave that to the main iod thread.
+                         */
+                        smb_iod_request(iod, SMBIOD_EV_LEASE_BREAK, m);
+                    }
+                    else {
+                        (void) smb2_smb_parse_lease_break(iod, m);
+                    }
                     continue;
                 }
                 
@@ -1029,6 +1602,21 @@ smb_iod_recvall(struct smbiod *iod)
 			mbuf_freem(m);
 		}
 	}
+	smb_iod_rcvunlock(iod);
+
+	if (start_reconnect) {
+		if (current_thread() == iod->iod_rcv_thread) {
+			/* Reconnect is always done from the main iod thread */
+			SMB_IOD_FLAGSLOCK(iod);
+			iod->iod_flags |= SMBIOD_RCV_STALLED;
+			SMB_IOD_FLAGSUNLOCK(iod);
+			iod->iod_workflag = 1;
+			smb_iod_wakeup(iod);
+		}
+		else {
+			smb_iod_start_reconnect(iod);
+		}
+	}
 
 	return 0;
 }
@@ -1071,12 +1659,13 @@ smb_iod_rq_enqueue(struct smb_rq *rqp)
     int return_error = 0;
 
 	if (rqp->sr_context == iod->iod_context) {
-		DBG_ASSERT((rqp->sr_flags & SMBR_ASYNC) != SMBR_ASYNC);
+		DBG_ASSERT(!(rqp->sr_flags & (SMBR_ASYNC | SMBR_CALLBACK)));
 		rqp->sr_flags |= SMBR_INTERNAL;
 		SMB_IOD_RQLOCK(iod);
 		TAILQ_INSERT_HEAD(&iod->iod_rqlist, rqp, sr_link);
 		SMB_IOD_RQUNLOCK(iod);
 		for (;;) {
+			smb_iod_rq_insend(rqp);
 			if (smb_iod_sendrq(iod, rqp) != 0) {
 				smb_iod_start_reconnect(iod);
 				break;
@@ -1237,8 +1826,13 @@ smb_iod_removerq(struct smb_rq *rqp)
 	struct smbiod *iod = vcp->vc_iod;
 
 	SMBIODEBUG("\n");
+	/* Can't take it off the list while the iod is still sending it */
+	smb_iod_rq_sendwait(rqp);
+	
 	SMB_IOD_RQLOCK(iod);
     
+	smb_iod_rqhash_remove(iod, rqp);
+
 	if (rqp->sr_flags & SMBR_INTERNAL) {
 		TAILQ_REMOVE(&iod->iod_rqlist, rqp, sr_link);
 		SMB_IOD_RQUNLOCK(iod);
@@ -1369,9 +1963,10 @@ int
 smb_iod_sendall(struct smbiod *iod)
 {
 	struct smb_vc *vcp = iod->iod_vc;
-	struct smb_rq *rqp, *trqp;
+	struct smb_rq *rqp, *trqp, *brqp;
+	struct smb_rq *batch[SMB_IOD_SEND_BATCH_MAX];
 	struct timespec now, ts, uetimeout;
-	int herror, echo, drop_req_lock;
+	int herror, echo, drop_req_lock, nbatch;
 	uint64_t oldest_message_id = 0;
 	struct timespec oldest_timesent = {0, 0};
     uint32_t pending_reply = 0;
@@ -1472,10 +2067,31 @@ retry:
                 
                 /* Fall through here and send it */
 			case SMBRQ_NOTSENT:
+                /*
+                 * Pick up any other SMB 2/3 requests waiting to go out so
+                 * they can all share one socket write.
+                 */
+                batch[0] = rqp;
+                nbatch = 1;
+                smb_iod_rq_insend(rqp);
+                if ((smb_iod_send_batch > 1) &&
+                    (rqp->sr_extflags & SMB2_REQUEST) &&
+                    !(iod->iod_flags & SMBIOD_RECONNECT)) {
+                    for (brqp = TAILQ_NEXT(rqp, sr_link);
+                         (brqp != NULL) && (nbatch < MIN(smb_iod_send_batch, SMB_IOD_SEND_BATCH_MAX));
+                         brqp = TAILQ_NEXT(brqp, sr_link)) {
+                        if ((brqp->sr_state == SMBRQ_NOTSENT) &&
+                            (brqp->sr_extflags & SMB2_REQUEST) &&
+                            !((brqp->sr_share) && (isShareGoingAway(brqp->sr_share)))) {
+                            smb_iod_rq_insend(brqp);
+                            batch[nbatch++] = brqp;
+                        }
+                    }
+                }
 				SMB_IOD_RQUNLOCK(iod);
                 /* Indicate that we are not holding the lock */
                 drop_req_lock = 0;
-				herror = smb_iod_sendrq(iod, rqp);
+				herror = smb_iod_sendrq_batch(iod, batch, nbatch);
                 if (herror == 0)
                     /*
                      * We will need to go back and reaquire the request queue lock 
@@ -1649,10 +2265,9 @@ retry:
             }
         }
 
-        /* Wake up any requests waiting for more credits */
+        /* Send window may have opened, hand out credits to any waiters */
         if ((need_wakeup == 1) && (vcp->vc_credits_wait)) {
-            OSAddAtomic(-1, &vcp->vc_credits_wait);
-            wakeup(&vcp->vc_credits_wait);
+            smb2_rq_credit_wakeup(vcp);
         }
 
         SMBC_CREDIT_UNLOCK(vcp);
@@ -1783,6 +2398,9 @@ static void smb_iod_reconnect(struct smbiod *iod)
 	}
 
 	SMBWARNING("Starting reconnect with %s\n", vcp->vc_srvname);
+	/* Receive thread sees SMBIOD_RECONNECT, wait for it to leave the transport */
+	smb_iod_rcvlock(iod);
+	smb_iod_rcvunlock(iod);
 	SMB_TRAN_DISCONNECT(vcp); /* Make sure the connection is close first */
 	iod->iod_state = SMBIOD_ST_CONNECT;
 	/* Start the reconnect timers */
@@ -1981,6 +2599,10 @@ static void smb_iod_reconnect(struct smbiod *iod)
 	}
 
 exit:	
+	/* For statshares, time spent is from the start of this attempt */
+	vcp->vc_reconnect_cnt++;
+	vcp->vc_reconnect_usecs += smb_lat_usecs(&iod->reconnectStartTime);
+
 	/*
 	 * We only want to wake up the shares if we are not trying to do another
 	 * reconnect. So if we have no error or the reconnect time is pass the
@@ -2094,6 +2716,10 @@ smb_iod_main(struct smbiod *iod)
 		    case SMBIOD_EV_FORCE_RECONNECT:
                 smb_iod_start_reconnect(iod);
 				break;
+		    case SMBIOD_EV_LEASE_BREAK:
+				/* Posted by the receive thread, frees the mbuf */
+				(void) smb2_smb_parse_lease_break(iod, (mbuf_t) evp->ev_ident);
+				break;
 			default:
 				break;
 		}
@@ -2104,8 +2730,18 @@ smb_iod_main(struct smbiod *iod)
 		} else
 			SMB_FREE(evp, M_SMBIOD);
 	}
+	
+	/* The receive thread lost the connection, start the reconnect for it */
+	if (iod->iod_flags & SMBIOD_RCV_STALLED) {
+		smb_iod_start_reconnect(iod);
+		SMB_IOD_FLAGSLOCK(iod);
+		iod->iod_flags &= ~SMBIOD_RCV_STALLED;
+		SMB_IOD_FLAGSUNLOCK(iod);
+	}
+	
 	smb_iod_sendall(iod);
-	smb_iod_recvall(iod);
+	if (!smb_iod_rcv_thread_active(iod))
+		smb_iod_recvall(iod);
 	return;
 }
 
@@ -2166,12 +2802,70 @@ static void smb_iod_thread(void *arg)
 	vfs_context_rele(context);
 }
 
+/*
+ * Receive thread, only used when SMBIOD_RCV_THREAD is set. 
+ */
+static void smb_iod_rcvthread(void *arg)
+{
+	struct smbiod *iod = arg;
+
+	iod->iod_rcv_thread = current_thread();
+
+	while ((iod->iod_flags & SMBIOD_RCV_SHUTDOWN) == 0) {
+		SMB_IOD_FLAGSLOCK(iod);
+		iod->iod_rcv_workflag = 0;
+		SMB_IOD_FLAGSUNLOCK(iod);
+		
+		if (smb_iod_rcv_thread_active(iod))
+			smb_iod_recvall(iod);
+		
+		/* The socket upcall sets iod_rcv_workflag under the flags lock */
+		SMB_IOD_FLAGSLOCK(iod);
+		if ((iod->iod_rcv_workflag == 0) &&
+			!(iod->iod_flags & SMBIOD_RCV_SHUTDOWN)) {
+			msleep(&iod->iod_rcv_workflag, SMB_IOD_FLAGSLOCKPTR(iod), 
+				   PWAIT | PDROP, "iod rcv idle", &iod->iod_sleeptimespec);
+		}
+		else {
+			SMB_IOD_FLAGSUNLOCK(iod);
+		}
+	}
+
+	/*
+	 * Clear the running flag, and wake up anybody waiting for us to quit.
+	 */
+	SMB_IOD_FLAGSLOCK(iod);
+	iod->iod_flags &= ~SMBIOD_RCV_RUNNING;
+	wakeup(&iod->iod_rcv_thread);
+	SMB_IOD_FLAGSUNLOCK(iod);
+}
+
+/*
+ * Tell the receive thread to quit and wait for it to exit.
+ */
+static void
+smb_iod_rcvthread_stop(struct smbiod *iod)
+{
+	if (!(iod->iod_flags & SMBIOD_RCV_THREAD))
+		return;
+
+	SMB_IOD_FLAGSLOCK(iod);
+	iod->iod_flags |= SMBIOD_RCV_SHUTDOWN;
+	wakeup(&iod->iod_rcv_workflag);
+	while (iod->iod_flags & SMBIOD_RCV_RUNNING) {
+		msleep(&iod->iod_rcv_thread, SMB_IOD_FLAGSLOCKPTR(iod), PWAIT,
+		    "iod-rcv-exit", 0);
+	}
+	SMB_IOD_FLAGSUNLOCK(iod);
+}
+
 int
 smb_iod_create(struct smb_vc *vcp)
 {
 	struct smbiod	*iod;
 	kern_return_t	result;
 	thread_t		thread;
+	uint32_t		i;
 
 	SMB_MALLOC(iod, struct smbiod *, sizeof(*iod), M_SMBIOD, M_WAITOK | M_ZERO);
 	iod->iod_id = smb_iod_next++;
@@ -2184,8 +2878,26 @@ smb_iod_create(struct smb_vc *vcp)
 	vcp->vc_iod = iod;
 	lck_mtx_init(&iod->iod_rqlock, iodrq_lck_group, iodrq_lck_attr);
 	TAILQ_INIT(&iod->iod_rqlist);
+	for (i = 0; i < SMB_IOD_RQHASH_SIZE; i++) {
+		LIST_INIT(&iod->iod_rqhash[i]);
+	}
+	lck_mtx_init(&iod->iod_rcvlock, iodrcv_lck_group, iodrcv_lck_attr);
 	lck_mtx_init(&iod->iod_evlock, iodev_lck_group, iodev_lck_attr);
 	STAILQ_INIT(&iod->iod_evlist);
+
+	/* Start the receive thread first, the mode can't change once running */
+	if (smb_iod_rcv_thread) {
+		iod->iod_flags |= (SMBIOD_RCV_THREAD | SMBIOD_RCV_RUNNING);
+		result = kernel_thread_start((thread_continue_t)smb_iod_rcvthread, iod, &thread);
+		if (result != KERN_SUCCESS) {
+			SMBERROR("can't start smbiod receive thread result = %d, using one thread\n", result);
+			iod->iod_flags &= ~(SMBIOD_RCV_THREAD | SMBIOD_RCV_RUNNING);
+		}
+		else {
+			thread_deallocate(thread);
+		}
+	}
+
 	/* 
 	 * The IOCreateThread routine has been depricated. Just copied
 	 * that code here
@@ -2193,6 +2905,7 @@ smb_iod_create(struct smb_vc *vcp)
 	result = kernel_thread_start((thread_continue_t)smb_iod_thread, iod, &thread);
 	if (result != KERN_SUCCESS) {
 		SMBERROR("can't start smbiod result = %d\n", result);
+		smb_iod_rcvthread_stop(iod);
 		SMB_FREE(iod, M_SMBIOD);
 		return (ENOMEM); 
 	}
@@ -2203,6 +2916,14 @@ smb_iod_create(struct smb_vc *vcp)
 int
 smb_iod_destroy(struct smbiod *iod)
 {
+	struct smbiod_event *evp;
+
+	/*
+	 * The receive thread has to go first, it may be using the transport
+	 * and it can still post lease breaks to the iod.
+	 */
+	smb_iod_rcvthread_stop(iod);
+
 	/*
 	 * We don't post this synchronously, as that causes a wakeup
 	 * when the SMBIOD_SHUTDOWN flag is set, but that happens
@@ -2224,8 +2945,28 @@ smb_iod_destroy(struct smbiod *iod)
 		msleep(iod, SMB_IOD_FLAGSLOCKPTR(iod), PWAIT | PDROP,
 		    "iod-exit", 0);
 	}
+
+	/* Throw away any events that came in behind the shutdown */
+	SMB_IOD_EVLOCK(iod);
+	while ((evp = STAILQ_FIRST(&iod->iod_evlist)) != NULL) {
+		STAILQ_REMOVE_HEAD(&iod->iod_evlist, ev_link);
+		if ((evp->ev_type & SMBIOD_EV_MASK) == SMBIOD_EV_LEASE_BREAK) {
+			mbuf_freem((mbuf_t) evp->ev_ident);
+		}
+		if (evp->ev_type & SMBIOD_EV_SYNC) {
+			/* The poster frees it */
+			evp->ev_error = ENOTCONN;
+			wakeup(evp);
+		}
+		else {
+			SMB_FREE(evp, M_SMBIOD);
+		}
+	}
+	SMB_IOD_EVUNLOCK(iod);
+
 	lck_mtx_destroy(&iod->iod_flagslock, iodflags_lck_group);
 	lck_mtx_destroy(&iod->iod_rqlock, iodrq_lck_group);
+	lck_mtx_destroy(&iod->iod_rcvlock, iodrcv_lck_group);
 	lck_mtx_destroy(&iod->iod_evlock, iodev_lck_group);
 	SMB_FREE(iod, M_SMBIOD);
 	return 0;
@@ -29,6 +29,7 @@
 #define	SMB2_SIGNATURE			"\xFESMB"
 #define	SMB2_SIGLEN				4
 #define	SMB2_HDRLEN				64
+#define	SMB2_READ_RSP_HDRLEN	16	/* Read response up to its data */
 
 typedef uint32_t DWORD;
 
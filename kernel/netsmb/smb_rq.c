@@ -270,6 +270,9 @@ smb_rq_done(struct smb_rq *rqp)
     smb_rq_getrequest(rqp, &mbp);
     smb_rq_getreply(rqp, &mdp);
 
+    /* The iod may still be in the middle of sending it */
+    smb_iod_rq_sendwait(rqp);
+
     /* 
      * For SMB 2/3, if the request was never sent, then recover the unused credits 
      * If the request was not sent due to reconnect, then no need to recover
@@ -282,8 +285,29 @@ smb_rq_done(struct smb_rq *rqp)
             rqp->sr_rspcreditsgranted = rqp->sr_creditcharge;
             smb2_rq_credit_increment(rqp);
         }
+        
+        smb2_rq_credit_done(rqp);
     }
-    
+
+    if (rqp->sr_place_uio != NULL) {
+        /*
+         * The iod may still be reading Read data into the caller's buffer,
+         * even if we gave up on the reply. Let it finish first.
+         */
+        SMBRQ_SLOCK(rqp);
+        while (rqp->sr_flags & SMBR_PLACING) {
+            msleep(&rqp->sr_place_uio, SMBRQ_SLOCKPTR(rqp), PWAIT,
+                   "smb_rq_done", NULL);
+        }
+        SMBRQ_SUNLOCK(rqp);
+
+        uio_free(rqp->sr_place_uio);
+        rqp->sr_place_uio = NULL;
+        if (rqp->sr_vc) {
+            OSDecrementAtomic(&rqp->sr_vc->vc_place_pending);
+        }
+    }
+
     if (rqp->sr_share) {
 		smb_share_rele(rqp->sr_share, rqp->sr_context);
 	}
@@ -311,8 +335,11 @@ smb_rq_reply(struct smb_rq *rqp)
 	uint8_t tb;
 	int error = 0, rperror = 0;
 
-	/* If an async call then just remove it from the queue, no waiting required */
-	if (rqp->sr_flags & SMBR_ASYNC) {
+	/*
+	 * If an async call or its callback already fired then just remove it
+	 * from the queue, no waiting required
+	 */
+	if (rqp->sr_flags & (SMBR_ASYNC | SMBR_CALLBACK)) {
 		smb_iod_removerq(rqp);
 		error = rqp->sr_lerror;
 	} else {
@@ -51,6 +51,9 @@
 #define	SMBR_NO_TIMEOUT     0x0200  /* Do not timeout, long-running request (i.e. Mac-to-Mac COPYCHUNK IOCTL) */
                                     /* Note: we need to remove this in Sarah */
 #define	SMBR_SIGNED         0x0400	/* SMB 2/3 sign this packet */
+#define	SMBR_PLACING		0x0800	/* iod is reading reply data into sr_place_uio */
+#define	SMBR_INSEND			0x1000	/* iod is sending it, see smb_iod_sendrq */
+#define	SMBR_CALLBACK		0x2000	/* complete through sr_callback, otherwise an ordinary request */
 #define	SMBR_MOREDATA		0x8000	/* our buffer was too small */
 
 /* smb_t2rq t2_flags and smb_ntrq nt_flags */
@@ -152,8 +155,12 @@ struct smb_rq {
 	lck_mtx_t		sr_slock;		/* short term locks */
 	struct smb_t2rq *sr_t2;
 	TAILQ_ENTRY(smb_rq)	sr_link;
+	LIST_ENTRY(smb_rq)	sr_hash_link;	/* SMB 2/3 message id hash, see smb_iod.c */
+	struct smb_rq	*sr_hash_head;	/* rqp on iod_rqlist that owns this entry, NULL if not hashed */
 	void *sr_callback_args;
 	void (*sr_callback)(void *);
+	uio_t			sr_place_uio;	/* SMB 2/3 Read data may go straight here, see smb_iod_rq_place */
+	uint32_t		sr_place_len;	/* Read data bytes the iod placed */
 };
 
 struct smb_t2rq {
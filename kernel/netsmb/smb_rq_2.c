@@ -179,8 +179,12 @@ smb2_rq_credit_check(struct smb_rq *rqp, uint32_t len)
         return ret_len;
     }
     
-    /* How many credits do we have? */
+    /*
+     * How many credits do we have? Credits already handed to the waiters
+     * ahead of us are theirs, dont spend them on a bigger request.
+     */
     curr_credits = OSAddAtomic(0, &rqp->sr_vc->vc_credits_granted);
+    curr_credits -= rqp->sr_vc->vc_credits_handed;
     
     if (curr_credits <= kCREDIT_LOW_WATER) {
         /* 
@@ -208,6 +212,189 @@ smb2_rq_credit_check(struct smb_rq *rqp, uint32_t len)
     return ret_len;
 }
 
+/*
+ * How long ago was start, in microseconds
+ */
+static uint64_t
+smb2_rq_elapsed_usecs(struct timespec *start)
+{
+    struct timespec now;
+    
+    nanouptime(&now);
+    timespecsub(&now, start);
+    
+    return (((uint64_t) now.tv_sec * 1000000) + (now.tv_nsec / 1000));
+}
+
+/*
+ * How many credits can be used right now? Two ways to run out of credits.
+ * 1) Just have no credits left
+ * 2) (curr message ID) - (oldest pending message ID) > current credits
+ * Credits already handed to woken up waiters that have not run yet do not
+ * count.
+ *
+ * VC Credit lock must be held before calling this function
+ */
+static int32_t
+smb2_rq_credit_avail(struct smb_vc *vcp)
+{
+    int32_t curr_credits;
+    uint64_t message_id_diff = 0;
+    
+    curr_credits = OSAddAtomic(0, &vcp->vc_credits_granted);
+    curr_credits -= vcp->vc_credits_handed;
+    if (curr_credits < kCREDIT_MIN_AMT) {
+        return 0;
+    }
+    
+    if (vcp->vc_req_pending == 0) {
+        /* Have enough credits and no pending reqs */
+        return curr_credits;
+    }
+    
+    /* Have a pending request, see if send window is open */
+    if (vcp->vc_message_id > vcp->vc_oldest_message_id) {
+        message_id_diff = vcp->vc_message_id - vcp->vc_oldest_message_id;
+    }
+    else {
+        /* Must have wrapped around */
+        message_id_diff = UINT64_MAX - vcp->vc_oldest_message_id;
+        message_id_diff += vcp->vc_message_id;
+    }
+    
+    if (message_id_diff > (uint64_t) OSAddAtomic(0, &vcp->vc_credits_granted)) {
+        /* Send window is closed */
+        return 0;
+    }
+    
+    return curr_credits;
+}
+
+/*
+ * How many credits to ask for in a request that is charged credit_charge.
+ *
+ * The demand is everything in flight plus everything waiting for credits.
+ * Try to have that many credits on hand again, so a read/write pipeline can
+ * send its next round without waiting, and never less than kCREDIT_TARGET_MIN.
+ * Credits already asked for by requests in flight count as on hand, otherwise
+ * every request in a pipeline would ask for the whole shortfall.
+ *
+ * Once we have enough, only ask for one credit. The server then gives back
+ * less than multi credit requests charge, so an idle connection slowly gives
+ * back what it does not need instead of hoarding kCREDIT_MAX_AMT credits.
+ *
+ * VC Credit lock must be held before calling this function
+ */
+static uint16_t
+smb2_rq_credit_request_amt(struct smb_vc *vcp, int32_t curr_credits,
+                           int16_t credit_charge)
+{
+    int64_t target, have;
+    
+    target = (int64_t) vcp->vc_credits_inflight + vcp->vc_credits_wait_charge;
+    target = MAX(target, kCREDIT_TARGET_MIN);
+    target = MIN(target, kCREDIT_MAX_AMT);
+    vcp->vc_credits_target = (uint32_t) target;
+    
+    have = (int64_t) curr_credits + vcp->vc_credits_asked;
+    if (have >= target) {
+        return (1);
+    }
+    
+    /* Replace what this request uses, plus the shortfall */
+    return ((uint16_t) MIN(credit_charge + (target - have), kCREDIT_REQUEST_AMT));
+}
+
+/*
+ * Request is done, its credits are no longer in flight
+ */
+void
+smb2_rq_credit_done(struct smb_rq *rqp)
+{
+    struct smb_vc *vcp = rqp->sr_vc;
+    
+    if (!(rqp->sr_extflags & SMB2_REQ_CREDITED) || (vcp == NULL)) {
+        return;
+    }
+    rqp->sr_extflags &= ~SMB2_REQ_CREDITED;
+    
+    /* Reconnect already reset the counters */
+    if (rqp->sr_flags & SMBR_RECONNECTED) {
+        return;
+    }
+    
+    SMBC_CREDIT_LOCK(vcp);
+    vcp->vc_credits_inflight -= MIN(vcp->vc_credits_inflight,
+                                    (uint32_t) rqp->sr_creditcharge);
+    if (rqp->sr_creditsrequested > rqp->sr_creditcharge) {
+        vcp->vc_credits_asked -= MIN(vcp->vc_credits_asked,
+                                     (uint32_t) (rqp->sr_creditsrequested - rqp->sr_creditcharge));
+    }
+    SMBC_CREDIT_UNLOCK(vcp);
+}
+
+/*
+ * Hand out the credits we have to the threads waiting for them, in order.
+ * Metadata requests are all served before any reads or writes, so a stat or
+ * an open does not get stuck behind a stream of large IO. Each waiter woken
+ * up is handed the credits it expects to use, so we only wake up as many
+ * threads as the credits can pay for.
+ *
+ * VC Credit lock must be held before calling this function
+ */
+void
+smb2_rq_credit_wakeup(struct smb_vc *vcp)
+{
+    struct smb_credit_waiter *waiterp;
+    int32_t credits;
+    
+    credits = smb2_rq_credit_avail(vcp);
+    
+    while (credits > 0) {
+        waiterp = TAILQ_FIRST(&vcp->vc_credits_metaq);
+        if (waiterp != NULL) {
+            TAILQ_REMOVE(&vcp->vc_credits_metaq, waiterp, cw_link);
+        }
+        else {
+            waiterp = TAILQ_FIRST(&vcp->vc_credits_bulkq);
+            if (waiterp == NULL) {
+                break;
+            }
+            TAILQ_REMOVE(&vcp->vc_credits_bulkq, waiterp, cw_link);
+        }
+        
+        waiterp->cw_granted = 1;
+        vcp->vc_credits_wait_charge -= waiterp->cw_charge;
+        vcp->vc_credits_handed += waiterp->cw_charge;
+        credits -= waiterp->cw_charge;
+        
+        OSAddAtomic(-1, &vcp->vc_credits_wait);
+        wakeup(waiterp);
+    }
+}
+
+/*
+ * Take a waiter out of line. If it was already handed credits, pass them on
+ * to the next one in line.
+ *
+ * VC Credit lock must be held before calling this function
+ */
+static void
+smb2_rq_credit_dequeue(struct smb_vc *vcp, struct smb_credit_waitq *waitq,
+                       struct smb_credit_waiter *waiterp)
+{
+    if (waiterp->cw_granted) {
+        waiterp->cw_granted = 0;
+        vcp->vc_credits_handed -= MIN(vcp->vc_credits_handed, waiterp->cw_charge);
+        smb2_rq_credit_wakeup(vcp);
+    }
+    else {
+        TAILQ_REMOVE(waitq, waiterp, cw_link);
+        vcp->vc_credits_wait_charge -= waiterp->cw_charge;
+        OSAddAtomic(-1, &vcp->vc_credits_wait);
+    }
+}
+
 /*
  * Decrement vc_credits_granted by number of credits charged in request
  * See smb2_rq_credit_check() for longer description
@@ -217,12 +404,15 @@ smb2_rq_credit_decrement(struct smb_rq *rqp, uint32_t *rq_len)
 {
     int32_t curr_credits;
     int16_t credit_charge;
-    struct timespec ts;
+    struct timespec ts, wait_start;
     int ret;
     int error = 0;
     struct smb_vc *vcp;
-    uint32_t sleep_cnt, i;
-    uint64_t message_id_diff = 0;
+    uint32_t sleep_cnt;
+    struct smb_credit_waiter waiter;
+    struct smb_credit_waitq *waitq;
+    int bulk, queued = 0, waited = 0;
+    uint64_t wait_usecs;
     
 	if (rqp == NULL) {
         SMBERROR("rqp is NULL\n");
@@ -251,6 +441,9 @@ smb2_rq_credit_decrement(struct smb_rq *rqp, uint32_t *rq_len)
             vcp->vc_credits_granted = 0;
             vcp->vc_credits_ss_granted = 0;
             vcp->vc_credits_max = 0;
+            vcp->vc_credits_handed = 0;
+            vcp->vc_credits_inflight = 0;
+            vcp->vc_credits_asked = 0;
             
             goto out;
             
@@ -297,124 +490,141 @@ smb2_rq_credit_decrement(struct smb_rq *rqp, uint32_t *rq_len)
     }
     
     /*
-     * Check to see if need to pause sending until we get more credits 
-     * Two ways to run out of credits.
-     * 1) Just have no credits left
-     * 2) (curr message ID) - (oldest pending message ID) > current credits
+     * Check to see if need to pause sending until we get more credits.
+     * Waiters are served in order by smb2_rq_credit_wakeup(), reads and
+     * writes wait in their own line behind any metadata requests.
      */
+    bulk = ((rqp->sr_command == SMB2_READ) || (rqp->sr_command == SMB2_WRITE));
+    waitq = (bulk) ? &vcp->vc_credits_bulkq : &vcp->vc_credits_metaq;
+    
+    bzero(&waiter, sizeof(waiter));
+    if ((rq_len != NULL) && (*rq_len > (64 * 1024))) {
+        waiter.cw_charge = ((*rq_len - 1) / (64 * 1024)) + 1;
+    }
+    else {
+        waiter.cw_charge = 1;
+    }
+    
+    /* Only wait a max of 60 seconds waiting for credits */
+    sleep_cnt = 60;
+    
  	for (;;) {
-        curr_credits = OSAddAtomic(0, &vcp->vc_credits_granted);
-        if (curr_credits >= kCREDIT_MIN_AMT) {
-            if (vcp->vc_req_pending == 0) {
-                /* Have enough credits and no pending reqs, so go send it */
+        if (waiter.cw_granted) {
+            /* We were handed credits and taken off the queue */
+            waiter.cw_granted = 0;
+            queued = 0;
+            vcp->vc_credits_handed -= MIN(vcp->vc_credits_handed, waiter.cw_charge);
+            
+            if (smb2_rq_credit_avail(vcp) > 0) {
                 break;
             }
-        
-            /* Have a pending request, see if send window is open */
-            if (vcp->vc_message_id > vcp->vc_oldest_message_id) {
-                message_id_diff = vcp->vc_message_id - vcp->vc_oldest_message_id;
-            }
-            else {
-                /* Must have wrapped around */
-                message_id_diff = UINT64_MAX - vcp->vc_oldest_message_id;
-                message_id_diff += vcp->vc_message_id;
+            
+            /* Lost them, most likely to a reconnect. Keep our place in line */
+            TAILQ_INSERT_HEAD(waitq, &waiter, cw_link);
+            vcp->vc_credits_wait_charge += waiter.cw_charge;
+            OSAddAtomic(1, &vcp->vc_credits_wait);
+            queued = 1;
+        }
+        else if (!queued) {
+            /* Dont cut in front of anyone already waiting for credits */
+            if (TAILQ_EMPTY(&vcp->vc_credits_metaq) &&
+                (!bulk || TAILQ_EMPTY(&vcp->vc_credits_bulkq)) &&
+                (smb2_rq_credit_avail(vcp) > 0)) {
+                break;
             }
             
-            if (message_id_diff <= (uint64_t) curr_credits) {
-                /* Send window still open, so go send it */
+            if (rqp->sr_command == SMB2_ECHO) {
+                /* 
+                 * Can not block waiting here for credits for an Echo request.
+                 * Echo request is sent by smb_iod_sendall() and that is the same
+                 * function that times out requests that have not gotten their
+                 * replies. Just skip sending the Echo request and return an error.
+                 */
+                error = ENOBUFS;
                 break;
             }
-        }
-        
-        if (rqp->sr_command == SMB2_ECHO) {
-            /* 
-             * Can not block waiting here for credits for an Echo request.
-             * Echo request is sent by smb_iod_sendall() and that is the same
-             * function that times out requests that have not gotten their
-             * replies. Just skip sending the Echo request and return an error.
-             */
-            SMBC_CREDIT_UNLOCK(vcp);
-            return ENOBUFS;
+            
+            TAILQ_INSERT_TAIL(waitq, &waiter, cw_link);
+            vcp->vc_credits_wait_charge += waiter.cw_charge;
+            OSAddAtomic(1, &vcp->vc_credits_wait);
+            queued = 1;
+            
+            if (!waited) {
+                waited = 1;
+                vcp->vc_credits_wait_cnt++;
+                nanouptime(&wait_start);
+            }
         }
         
         /* If the share is going away, just return immediately */
         if ((rqp->sr_share) &&
             (rqp->sr_share->ss_going_away) &&
             (rqp->sr_share->ss_going_away(rqp->sr_share))) {
-            SMBC_CREDIT_UNLOCK(vcp);
-            return ENXIO;
+            smb2_rq_credit_dequeue(vcp, waitq, &waiter);
+            queued = 0;
+            error = ENXIO;
+            break;
         }
 
-        /* Block until we get more credits */
+        /* Block until we get handed credits */
         SMBDEBUG("Wait for credits curr %d max %d curr ID %lld pending ID %lld vc_credits_wait %d\n",
-                 curr_credits, vcp->vc_credits_max,
+                 OSAddAtomic(0, &vcp->vc_credits_granted), vcp->vc_credits_max,
                  vcp->vc_message_id, vcp->vc_oldest_message_id,
                  vcp->vc_credits_wait);
                 
-        /* Only wait a max of 60 seconds waiting for credits */
-        sleep_cnt = 60;
         ts.tv_sec = 1;
         ts.tv_nsec = 0;
+        ret = msleep(&waiter, SMBC_CREDIT_LOCKPTR(vcp), PWAIT,
+                     "vc-credits-wait", &ts);
+        if ((ret != EWOULDBLOCK) || (waiter.cw_granted)) {
+            sleep_cnt = 60;
+            continue;
+        }
         
-        for (i = 1; i <= sleep_cnt; i++) {
-            /* Indicate that we are sleeping by incrementing wait counter */
-            OSAddAtomic(1, &vcp->vc_credits_wait);
-            
-            ret = msleep(&vcp->vc_credits_wait, SMBC_CREDIT_LOCKPTR(vcp),
-                         PWAIT, "vc-credits-wait", &ts);
-            
-            if (ret == EWOULDBLOCK) {
-                /* Timed out, so decrement wait counter */
-                if (vcp->vc_credits_wait) {
-                    OSAddAtomic(-1, &vcp->vc_credits_wait);
-                }
-
-                /* If the share is going away, just return immediately */
-                if ((rqp->sr_share) &&
-                    (rqp->sr_share->ss_going_away) &&
-                    (rqp->sr_share->ss_going_away(rqp->sr_share))) {
-                    SMBC_CREDIT_UNLOCK(vcp);
-                    return ENXIO;
-                }
-                
-                /* If have credits, go and check to see if we can send now */
-                curr_credits = OSAddAtomic(0, &vcp->vc_credits_granted);
-                if (curr_credits > 0) {
-                    ret = 0;
-                    break;
-                }
-                
-                /* Loop again and wait some more */
-            }
-            else {
-                /* 
-                 * If we are woken up and its not EWOULDBLOCK, then must
-                 * have credits now, go and check.
-                 */
-                break;
-            }
+        /*
+         * Timed out. Arriving credits always get handed out, so this is just
+         * a safety net in case some path forgot to call smb2_rq_credit_wakeup.
+         */
+        smb2_rq_credit_wakeup(vcp);
+        if ((waiter.cw_granted) || (--sleep_cnt > 0)) {
+            continue;
         }
+        
+        /* 
+         * Something really went wrong here. We should not have to wait
+         * this long to get any credits. Force a reconnect.
+         */
+        smb2_rq_credit_dequeue(vcp, waitq, &waiter);
+        queued = 0;
+        sleep_cnt = 60;
+        
+        curr_credits = OSAddAtomic(0, &vcp->vc_credits_granted);
+        SMBERROR("Timed out waiting for credits curr %d max %d curr ID %lld pending ID %lld vc_credits_wait %d\n",
+        curr_credits, vcp->vc_credits_max,
+        vcp->vc_message_id, vcp->vc_oldest_message_id,
+        vcp->vc_credits_wait);
+        
+        /* Reconnect requests will need the credit lock so free it */
+        SMBC_CREDIT_UNLOCK(vcp);
 
-        if (ret == EWOULDBLOCK) {
-            /* 
-             * Something really went wrong here. We should not have to wait
-             * this long to get any credits. Force a reconnect.
-             */
-            curr_credits = OSAddAtomic(0, &vcp->vc_credits_granted);
-            SMBERROR("Timed out waiting for credits curr %d max %d curr ID %lld pending ID %lld vc_credits_wait %d\n",
-            curr_credits, vcp->vc_credits_max,
-            vcp->vc_message_id, vcp->vc_oldest_message_id,
-            vcp->vc_credits_wait);
-            
-            /* Reconnect requests will need the credit lock so free it */
-            SMBC_CREDIT_UNLOCK(vcp);
-
-            (void) smb_vc_force_reconnect(vcp);
-            
-            /* Reconnect is done now, reacquire credit lock and try again */
-            SMBC_CREDIT_LOCK(vcp);
-        }
+        (void) smb_vc_force_reconnect(vcp);
+        
+        /* Reconnect is done now, reacquire credit lock and try again */
+        SMBC_CREDIT_LOCK(vcp);
 	}
+    
+    if (waited) {
+        /* Keep track of how long requests have to wait for credits */
+        wait_usecs = smb2_rq_elapsed_usecs(&wait_start);
+        vcp->vc_credits_wait_usecs += wait_usecs;
+        if (wait_usecs > vcp->vc_credits_wait_max_usecs) {
+            vcp->vc_credits_wait_max_usecs = wait_usecs;
+        }
+    }
+    
+    if (error) {
+        goto out;
+    }
    
     if (rq_len != NULL) {
         /* Possible multi credit request */
@@ -433,22 +643,27 @@ smb2_rq_credit_decrement(struct smb_rq *rqp, uint32_t *rq_len)
      */
     curr_credits = OSAddAtomic(0, &vcp->vc_credits_granted);
 
-    if (curr_credits < kCREDIT_MAX_AMT) {
-        /*
-         * Currently the client keeps trying to get more and more credits
-         * until get kCREDIT_MAX_AMT. Essentially its up to the server to 
-         * throttle back our client.
-         * Optionally, we could change kCREDIT_MAX_AMT to be kCREDIT_LOW_WATER 
-         * so that we only request more credits when we need them. 
-         */
-        rqp->sr_creditsrequested = kCREDIT_REQUEST_AMT;
-
-        /* Dont access sr_creditreqp as its not set up yet */
+    /* Dont access sr_creditreqp as its not set up yet */
+    rqp->sr_creditsrequested = smb2_rq_credit_request_amt(vcp, curr_credits,
+                                                          credit_charge);
+    
+    /* Released again in smb_rq_done() */
+    rqp->sr_extflags |= SMB2_REQ_CREDITED;
+    vcp->vc_credits_inflight += credit_charge;
+    if (rqp->sr_creditsrequested > credit_charge) {
+        vcp->vc_credits_asked += rqp->sr_creditsrequested - credit_charge;
     }
+    vcp->vc_credits_total_consumed += credit_charge;
+    vcp->vc_credits_total_requested += rqp->sr_creditsrequested;
 
     if (curr_credits < 0) {
         SMBERROR("credit count %d < 0 \n", curr_credits);
     }
+    
+    /* Expected to use more credits than we did, pass the rest on */
+    if (vcp->vc_credits_wait) {
+        smb2_rq_credit_wakeup(vcp);
+    }
 
 out:
     SMBC_CREDIT_UNLOCK(vcp);
@@ -519,6 +734,7 @@ smb2_rq_credit_increment(struct smb_rq *rqp)
     SMBC_CREDIT_LOCK(vcp);
 
     OSAddAtomic(rqp->sr_rspcreditsgranted, &vcp->vc_credits_granted);
+    vcp->vc_credits_total_granted += rqp->sr_rspcreditsgranted;
 
     /* Keep track of max number of credits that server has granted us */
     curr_credits = OSAddAtomic(0, &vcp->vc_credits_granted);
@@ -531,10 +747,9 @@ smb2_rq_credit_increment(struct smb_rq *rqp)
         }
     }
     
-	/* Wake up any requests waiting for more credits */
+	/* Hand the new credits to any requests waiting for them */
     if (vcp->vc_credits_wait) {
-        OSAddAtomic(-1, &vcp->vc_credits_wait);
-        wakeup(&vcp->vc_credits_wait);
+        smb2_rq_credit_wakeup(vcp);
 	}
     
     SMBC_CREDIT_UNLOCK(vcp);
@@ -597,10 +812,9 @@ smb2_rq_credit_start(struct smb_vc *vcp, uint16_t credits)
     vcp->vc_req_pending = 0;
     vcp->vc_oldest_message_id = 0;
 
-	/* Wake up any requests waiting for more credits */
+	/* Hand the new credits to any requests waiting for them */
     if (vcp->vc_credits_wait) {
-        OSAddAtomic(-1, &vcp->vc_credits_wait);
-        wakeup(&vcp->vc_credits_wait);
+        smb2_rq_credit_wakeup(vcp);
 	}
 
     SMBC_CREDIT_UNLOCK(vcp);
@@ -1021,7 +1235,7 @@ smb2_rq_parse_header(struct smb_rq *rqp, struct mdchain **mdp)
     /* Can skip signature verification if we're encrypting */
     encryption_on = 0;
     
-    if (rqp->sr_vc->vc_flags & (SMBV_SMB30 | SMBV_SMB302)) {
+    if (SMBV_SMB3_OR_LATER(rqp->sr_vc)) {
         /* Check if session is encrypted */
         if (rqp->sr_vc->vc_sopt.sv_sessflags & SMB2_SESSION_FLAG_ENCRYPT_DATA) {
             if (rqp->sr_command != SMB2_NEGOTIATE) {
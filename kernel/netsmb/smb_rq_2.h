@@ -29,6 +29,9 @@
 #define SMB2_REQUEST		0x0001	/* smb_rq is for SMB 2/3 request */
 #define SMB2_RESPONSE		0x0002	/* smb_rq received SMB 2/3 response */
 #define SMB2_REQ_SENT		0x0004	/* smb_rq is for SMB 2/3 request */
+#define SMB2_REQ_CREDITED	0x0008	/* smb_rq credits counted in vc_credits_inflight */
+#define SMB2_REQ_PREAUTH	0x0010	/* smb_rq goes into the SMB 3.1.1 preauth hash when sent */
+#define SMB2_REQ_TIMED		0x0020	/* smb_rq latency already recorded for this send */
 
 
 /*
@@ -38,8 +41,8 @@
 /* 
  * smb2_create_rq flags 
  *
- * SMB2_CREATE_AAPL_RESOLVE_ID and SMB2_CREATE_DUR_HANDLE use the 
- * createp->create_contextp
+ * SMB2_CREATE_AAPL_RESOLVE_ID, SMB2_CREATE_DUR_HANDLE and SMB2_CREATE_LEASE
+ * use the createp->create_contextp
  */
 typedef enum _SMB2_CREATE_RQ_FLAGS
 {
@@ -51,7 +54,8 @@ typedef enum _SMB2_CREATE_RQ_FLAGS
     SMB2_CREATE_AAPL_RESOLVE_ID = 0x0020,
     SMB2_CREATE_DUR_HANDLE = 0x0040,
     SMB2_CREATE_DUR_HANDLE_RECONNECT = 0x0080,
-    SMB2_CREATE_ASSUME_DELETE = 0x0100
+    SMB2_CREATE_ASSUME_DELETE = 0x0100,
+    SMB2_CREATE_LEASE = 0x0200
 } _SMB2_CREATE_RQ_FLAGS;
 
 /* smb2_cmpd_position flags */
@@ -273,6 +277,7 @@ struct smb2_rw_rq {
 	SMBFID fid;
     uio_t auio;
     user_ssize_t io_len;
+    struct mb_extref *extref;   /* writes may attach auio's pages, see smb2_smb_write_one */
     
     /* return values */
 	uint32_t ret_ntstatus;
@@ -337,6 +342,8 @@ void smb2_rq_align8(struct smb_rq *rqp);
 int smb2_rq_credit_increment(struct smb_rq *rqp);
 uint32_t smb2_rq_credit_check(struct smb_rq *rqp, uint32_t len);
 void smb2_rq_credit_start(struct smb_vc *vcp, uint16_t credits);
+void smb2_rq_credit_wakeup(struct smb_vc *vcp);
+void smb2_rq_credit_done(struct smb_rq *rqp);
 int smb2_rq_message_id_increment(struct smb_rq *rqp);
 int smb2_rq_next_command(struct smb_rq *rqp, size_t *next_cmd_offset,
                          struct mdchain *mdp);
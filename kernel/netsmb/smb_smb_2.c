@@ -22,6 +22,7 @@
  */
 
 #include <sys/msfscc.h>
+#include <sys/random.h>
 #include <sys/smb_apple.h>
 #include <libkern/OSAtomic.h>
 
@@ -42,18 +43,50 @@
 #include <smbfs/smbfs.h>
 #include <smbclient/ntstatus.h>
 
-#define kMAX_READ_BLOCKS 4      /* Must be larger than Write number of blocks */
-#define kMAX_WRITE_BLOCKS 2
+/*
+ * Async read/write in-flight window, counted in vc_rxmax/vc_wxmax sized
+ * quanta. A new vc starts with the INIT windows, after that each read/write
+ * starts with the window the last one on the vc ended with.
+ */
+#define kRW_READ_WINDOW_INIT 4
+#define kRW_WRITE_WINDOW_INIT 2
+#define kRW_WINDOW_HEADROOM 2   /* Quanta above the BDP estimate, to probe for more */
+#define kRW_WINDOW_LIMIT 64     /* Largest allowed net.smb.fs.rw_max_window */
+
+struct smb2_rw_quantum {
+    struct smb2_rw_rq *read_writep;
+    struct smb_rq *rqp;
+    int pending;
+    user_ssize_t resid;
+    struct timespec sent;       /* When the request was queued */
+    uint64_t delivered;         /* Bytes completed when the request was queued */
+};
 
 #include <sys/sysctl.h>
 
 
 static uint32_t smb_maxwrite = 512 * 1024;	/* Default max write size */
 static uint32_t smb_maxread = 1024 * 1024;	/* Default max read size */
+static uint32_t smb_rw_max_window = 16;	/* Max async read/write quanta in flight */
+static uint32_t smb_aes_gcm = 1;	/* Offer AES-GCM ciphers in SMB 3.1.1 Negotiate */
+static uint32_t smb_write_zero_copy = 1;	/* Send kernel write buffers without copying them */
+static uint64_t smb_write_zero_copy_bytes = 0;
+static uint64_t smb_write_copy_bytes = 0;
+static uint32_t smb_read_direct = 1;	/* Let the iod read kernel buffer Read data in place */
+static uint64_t smb_read_direct_bytes = 0;
+static uint64_t smb_read_copy_bytes = 0;
 
 SYSCTL_DECL(_net_smb_fs);
 SYSCTL_INT(_net_smb_fs, OID_AUTO, maxwrite, CTLFLAG_RW, &smb_maxwrite, 0, "");
 SYSCTL_INT(_net_smb_fs, OID_AUTO, maxread, CTLFLAG_RW, &smb_maxread, 0, "");
+SYSCTL_INT(_net_smb_fs, OID_AUTO, rw_max_window, CTLFLAG_RW, &smb_rw_max_window, 0, "");
+SYSCTL_INT(_net_smb_fs, OID_AUTO, aes_gcm, CTLFLAG_RW, &smb_aes_gcm, 0, "");
+SYSCTL_INT(_net_smb_fs, OID_AUTO, write_zero_copy, CTLFLAG_RW, &smb_write_zero_copy, 0, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, write_zero_copy_bytes, CTLFLAG_RD, &smb_write_zero_copy_bytes, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, write_copy_bytes, CTLFLAG_RD, &smb_write_copy_bytes, "");
+SYSCTL_INT(_net_smb_fs, OID_AUTO, read_direct, CTLFLAG_RW, &smb_read_direct, 0, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, read_direct_bytes, CTLFLAG_RD, &smb_read_direct_bytes, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, read_copy_bytes, CTLFLAG_RD, &smb_read_copy_bytes, "");
 
 /*
  * Note:  The _smb_ in the function name indicates that these functions are 
@@ -134,7 +167,8 @@ smb2_smb_add_create_contexts(struct smb_share *share, struct smb2_create_rq *cre
                             SMB2_CREATE_AAPL_QUERY |
                             SMB2_CREATE_AAPL_RESOLVE_ID |
                             SMB2_CREATE_DUR_HANDLE |
-                            SMB2_CREATE_DUR_HANDLE_RECONNECT))) {
+                            SMB2_CREATE_DUR_HANDLE_RECONNECT |
+                            SMB2_CREATE_LEASE))) {
         /* No contexts to add */
         context_len = 0;
         *context_len_ptr = htolel(context_len);
@@ -254,7 +288,8 @@ smb2_smb_add_create_contexts(struct smb_share *share, struct smb2_create_rq *cre
         }
 
         if ((createp->flags & SMB2_CREATE_DUR_HANDLE) ||
-            (createp->flags & SMB2_CREATE_DUR_HANDLE_RECONNECT)) {
+            (createp->flags & SMB2_CREATE_DUR_HANDLE_RECONNECT) ||
+            (createp->flags & SMB2_CREATE_LEASE)) {
             dur_handlep = createp->create_contextp;
             if (dur_handlep == NULL) {
                 SMBERROR("dur_handlep is NULL \n");
@@ -263,7 +298,7 @@ smb2_smb_add_create_contexts(struct smb_share *share, struct smb2_create_rq *cre
             }
 
             /*
-             * Both of these calls need a lease context
+             * All of these calls need a lease context
              * Add Lease Request
              */
             /* Lease State */
@@ -271,6 +306,10 @@ smb2_smb_add_create_contexts(struct smb_share *share, struct smb2_create_rq *cre
                 /* Reconnect, have to request exact same lease */
                 lease_state = dur_handlep->lease_state;
             }
+            else if (createp->flags & SMB2_CREATE_LEASE) {
+                /* Caching lease, caller picked the lease state */
+                lease_state = dur_handlep->lease_state;
+            }
             else {
                 /* New lease, so lways want Read and Handle lease */
                 lease_state = SMB2_LEASE_READ_CACHING | SMB2_LEASE_HANDLE_CACHING;
@@ -281,8 +320,15 @@ smb2_smb_add_create_contexts(struct smb_share *share, struct smb2_create_rq *cre
                 *next_context_ptr = htolel(prev_content_size);
             }
             
-            context_len += 56;
-            prev_content_size = 56;
+            if (dur_handlep->flags & SMB2_LEASE_V2) {
+                /* Version 2 lease, servers only grant directory leases with it */
+                context_len += 80;
+                prev_content_size = 80;
+            }
+            else {
+                context_len += 56;
+                prev_content_size = 56;
+            }
             
             next_context_ptr = mb_reserve(mbp, sizeof(uint32_t));   /* Next */
             *next_context_ptr = htolel(0);  /* Assume we are last context */
@@ -290,15 +336,34 @@ smb2_smb_add_create_contexts(struct smb_share *share, struct smb2_create_rq *cre
             mb_put_uint16le(mbp, 4);        /* Name Length */
             mb_put_uint16le(mbp, 0);        /* Reserved */
             mb_put_uint16le(mbp, 24);       /* Data Offset */
-            mb_put_uint32le(mbp, 32);       /* Data Length */
+            if (dur_handlep->flags & SMB2_LEASE_V2) {
+                mb_put_uint32le(mbp, 52);   /* Data Length */
+            }
+            else {
+                mb_put_uint32le(mbp, 32);   /* Data Length */
+            }
             /* Name is a string constant and thus its not byte swapped uint32 */
             mb_put_uint32be(mbp, SMB2_CREATE_REQUEST_LEASE);
             mb_put_uint32le(mbp, 0);        /* Pad to 8 byte boundary */
             mb_put_uint64le(mbp, dur_handlep->lease_key_hi);  /* Lease Key High */
             mb_put_uint64le(mbp, dur_handlep->lease_key_low); /* Lease Key Low */
             mb_put_uint32le(mbp, lease_state);  /* Lease State */
-            mb_put_uint32le(mbp, 0);        /* Lease Flags */
+            if ((dur_handlep->flags & SMB2_LEASE_V2) &&
+                (dur_handlep->flags & SMB2_LEASE_PARENT_KEY)) {
+                /* Our own changes in the parent won't break its lease */
+                mb_put_uint32le(mbp, SMB2_LEASE_FLAG_PARENT_LEASE_KEY_SET); /* Lease Flags */
+            }
+            else {
+                mb_put_uint32le(mbp, 0);    /* Lease Flags */
+            }
             mb_put_uint64le(mbp, 0);        /* Lease Duration */
+            if (dur_handlep->flags & SMB2_LEASE_V2) {
+                mb_put_uint64le(mbp, dur_handlep->parent_lease_key_hi);  /* Parent Lease Key High */
+                mb_put_uint64le(mbp, dur_handlep->parent_lease_key_low); /* Parent Lease Key Low */
+                mb_put_uint16le(mbp, 0);    /* Epoch */
+                mb_put_uint16le(mbp, 0);    /* Reserved */
+                mb_put_uint32le(mbp, 0);    /* Pad to 8 byte boundary */
+            }
         }
         
         if (createp->flags & SMB2_CREATE_DUR_HANDLE) {
@@ -793,6 +858,62 @@ smb2_smb_dur_handle_init(struct smb_share *share, struct smbnode *np,
     return error;
 }
 
+/*
+ * Set up a lease only request (no durable handle) for the shared open of a 
+ * file or for a directory. All opens of a node have to use the same lease key 
+ * or the server will break our own lease, so the key is made once and kept in 
+ * the node until the lease goes away. For the same reason, if the parent has
+ * a directory lease its key goes in the request too, which takes a version 2
+ * lease context.
+ */
+int
+smb2_smb_lease_init(struct smb_share *share, struct smbnode *np,
+                    uint32_t lease_state, struct smb2_durable_handle *lease)
+{
+    int error = 0;
+    uint64_t lease_key_hi, lease_key_low;
+    struct smbnode *dnp;
+    int is_dir = vnode_isdir(np->n_vnode);
+    
+    if (is_dir) {
+        lease_key_hi = np->d_leaseKeyHi;
+        lease_key_low = np->d_leaseKeyLow;
+    }
+    else {
+        lease_key_hi = np->f_leaseKeyHi;
+        lease_key_low = np->f_leaseKeyLow;
+    }
+    
+    if (lease_key_hi == 0) {
+        error = smb2_smb_dur_handle_init(share, np, lease);
+        if (error) {
+            return error;
+        }
+    }
+    else {
+        memset(lease, 0, sizeof(*lease));
+        lease->lease_key_hi = lease_key_hi;
+        lease->lease_key_low = lease_key_low;
+    }
+    
+    lease->flags = SMB2_LEASE_REQUEST;
+    if (is_dir) {
+        lease->flags |= SMB2_LEASE_V2;
+    }
+    lease->lease_state = lease_state;
+    
+    lck_rw_lock_shared(&np->n_parent_rwlock);
+    dnp = np->n_parent;
+    if ((dnp != NULL) && (dnp->d_leaseState != 0) && (dnp->d_leaseKeyHi != 0)) {
+        lease->flags |= (SMB2_LEASE_V2 | SMB2_LEASE_PARENT_KEY);
+        lease->parent_lease_key_hi = dnp->d_leaseKeyHi;
+        lease->parent_lease_key_low = dnp->d_leaseKeyLow;
+    }
+    lck_rw_unlock_shared(&np->n_parent_rwlock);
+    
+    return error;
+}
+
 void
 smb2_smb_dur_handle_parse_lease_key(uint64_t lease_key_hi, uint64_t lease_key_low,
                                     uint32_t *tree_id, uint64_t *hash_val)
@@ -1001,8 +1122,8 @@ smb2_smb_get_client_dialects(struct smb_vc *vcp, int inReconnect,
 {
     uint32_t error = 0;
     
-    /* We have a max of 4 dialects at this time */
-    if (max_dialects_size < (sizeof(uint16_t) * 4)) {
+    /* We have a max of 5 dialects at this time */
+    if (max_dialects_size < (sizeof(uint16_t) * 5)) {
         SMBERROR("Not enough space for dialects %ld \n", max_dialects_size);
         return (ENOMEM);
     }
@@ -1012,11 +1133,12 @@ smb2_smb_get_client_dialects(struct smb_vc *vcp, int inReconnect,
          * Not in reconnect
          */
         if (vcp->vc_misc_flags & SMBV_NEG_SMB3_ONLY) {
-            /* only support two dialects of SMB 3 */
-            *dialect_cnt = 2;
+            /* only support three dialects of SMB 3 */
+            *dialect_cnt = 3;
             
             dialects[0] = SMB2_DIALECT_0300;        /* 3.0 Dialect */
             dialects[1] = SMB2_DIALECT_0302;        /* 3.02 Dialect */
+            dialects[2] = SMB2_DIALECT_0311;        /* 3.1.1 Dialect */
         }
         else if (vcp->vc_misc_flags & SMBV_NEG_SMB2_ONLY) {
             /* only support two dialects of SMB 2 */
@@ -1026,13 +1148,14 @@ smb2_smb_get_client_dialects(struct smb_vc *vcp, int inReconnect,
             dialects[1] = SMB2_DIALECT_0210;        /* 2.1 Dialect */
         }
         else {
-            /* SMB 2/3 - four dialects at this time */
-            *dialect_cnt = 4;
+            /* SMB 2/3 - five dialects at this time */
+            *dialect_cnt = 5;
 
             dialects[0] = SMB2_DIALECT_0202;        /* 2.002 Dialect */
             dialects[1] = SMB2_DIALECT_0210;        /* 2.1 Dialect */
             dialects[2] = SMB2_DIALECT_0300;        /* 3.0 Dialect */
             dialects[3] = SMB2_DIALECT_0302;        /* 3.02 Dialect */
+            dialects[4] = SMB2_DIALECT_0311;        /* 3.1.1 Dialect */
         }
     }
     else {
@@ -1044,7 +1167,10 @@ smb2_smb_get_client_dialects(struct smb_vc *vcp, int inReconnect,
         /*
          * In reconnect, stay with whatever version we had before.
          */
-        if (vcp->vc_flags & SMBV_SMB302) {
+        if (vcp->vc_flags & SMBV_SMB311) {
+            dialects[0] = SMB2_DIALECT_0311;        /* 3.1.1 Dialect */
+        }
+        else if (vcp->vc_flags & SMBV_SMB302) {
             dialects[0] = SMB2_DIALECT_0302;        /* 3.02 Dialect */
         }
         else if (vcp->vc_flags & SMBV_SMB30) {
@@ -1125,6 +1251,11 @@ smb2_smb_gss_session_setup(struct smb_vc *vcp, uint16_t *session_flags,
             break;
         }
         
+        /* SMB 3.1.1 keys depend on every SessionSetup request we send */
+        if (vcp->vc_flags & SMBV_SMB311) {
+            rqp->sr_extflags |= SMB2_REQ_PREAUTH;
+        }
+        
         /* 
          * Fill in Session Setup part 
          * Cant use a struct ptr due to var length security blob that
@@ -1153,6 +1284,11 @@ smb2_smb_gss_session_setup(struct smb_vc *vcp, uint16_t *session_flags,
         /* Send the request and check for reply */
         error = smb_rq_simple_timed(rqp, SMBSSNSETUPTIMO);
         
+        /* All but the final SessionSetup response go in the preauth hash */
+        if ((error == EAGAIN) && (vcp->vc_flags & SMBV_SMB311)) {
+            smb311_preauth_hash_update(vcp, rqp->sr_rp.md_top);
+        }
+        
         if ((error) && (rqp->sr_flags & SMBR_RECONNECTED)) {
             /* Rebuild and try sending again */
             continue;
@@ -1897,6 +2033,53 @@ smb_smb_ssnclose(struct smb_vc *vcp, vfs_context_t context)
     return (error);
 }
 
+/*
+ * Add the SMB 3.1.1 Negotiate Contexts to the end of a Negotiate request.
+ * Caller has already padded the request to an 8 byte boundary.
+ */
+static void
+smb2_smb_add_negotiate_contexts(struct smb_vc *vcp, struct mbchain *mbp)
+{
+    uint16_t ciphers[4];
+    uint16_t cipher_cnt = 0;
+    uint8_t *saltp;
+    int i;
+    
+    /* Preauth Integrity Capabilities, always SHA-512 */
+    mb_put_uint16le(mbp, SMB2_PREAUTH_INTEGRITY_CAPABILITIES);  /* ContextType */
+    mb_put_uint16le(mbp, 6 + SMB2_PREAUTH_SALT_LEN);            /* DataLength */
+    mb_put_uint32le(mbp, 0);                                    /* Reserved */
+    mb_put_uint16le(mbp, 1);                                    /* HashAlgorithmCount */
+    mb_put_uint16le(mbp, SMB2_PREAUTH_SALT_LEN);                /* SaltLength */
+    mb_put_uint16le(mbp, SMB2_PREAUTH_INTEGRITY_SHA512);        /* HashAlgorithms */
+    saltp = (uint8_t *) mb_reserve(mbp, SMB2_PREAUTH_SALT_LEN); /* Salt */
+    read_random(saltp, SMB2_PREAUTH_SALT_LEN);
+    
+    /* Pad 8 + 38 bytes out to the next context */
+    mb_put_uint16le(mbp, 0);
+    
+    /*
+     * Encryption Capabilities, in order of preference. GCM is much cheaper
+     * than CCM on current CPUs, net.smb.fs.aes_gcm=0 only offers CCM.
+     */
+    if (smb_aes_gcm) {
+        ciphers[cipher_cnt++] = SMB2_ENCRYPTION_AES128_GCM;
+    }
+    ciphers[cipher_cnt++] = SMB2_ENCRYPTION_AES128_CCM;
+    if (smb_aes_gcm) {
+        ciphers[cipher_cnt++] = SMB2_ENCRYPTION_AES256_GCM;
+    }
+    ciphers[cipher_cnt++] = SMB2_ENCRYPTION_AES256_CCM;
+    
+    mb_put_uint16le(mbp, SMB2_ENCRYPTION_CAPABILITIES);         /* ContextType */
+    mb_put_uint16le(mbp, 2 + (cipher_cnt * 2));                 /* DataLength */
+    mb_put_uint32le(mbp, 0);                                    /* Reserved */
+    mb_put_uint16le(mbp, cipher_cnt);                           /* CipherCount */
+    for (i = 0; i < cipher_cnt; i++) {
+        mb_put_uint16le(mbp, ciphers[i]);                       /* Ciphers */
+    }
+}
+
 int
 smb2_smb_negotiate(struct smb_vc *vcp, struct smb_rq *in_rqp, int inReconnect,
                    vfs_context_t user_context, vfs_context_t context)
@@ -1911,6 +2094,7 @@ smb2_smb_negotiate(struct smb_vc *vcp, struct smb_rq *in_rqp, int inReconnect,
     uint16_t security_mode = 0;
     uint16_t dialect_cnt = 0;
     uint16_t dialects[8] = {0};     /* Space for 8 dialects */
+    uint32_t ctx_offset;
     int i;
     
     /*
@@ -1980,6 +2164,14 @@ resend:
         return error;
     }
 
+    /* SMB 3.1.1 Negotiate Contexts follow the dialects, 8 byte aligned */
+    ctx_offset = 0;
+    for (i = 0; i < dialect_cnt; i++) {
+        if (dialects[i] == SMB2_DIALECT_0311) {
+            ctx_offset = roundup(SMB2_HDRLEN + 36 + (dialect_cnt * 2), 8);
+        }
+    }
+
     mb_put_uint16le(mbp, dialect_cnt);                      /* Dialect Count */
 
 	/* Security Mode */
@@ -1997,12 +2189,34 @@ resend:
     guidp = (uint8_t *) mb_reserve(mbp, 16);                /* Client GUID */
     memcpy(guidp, vcp->vc_client_guid, 16);
     
-	mb_put_uint64le(mbp, 0);                                /* Start Time */
+    if (ctx_offset) {
+        mb_put_uint32le(mbp, ctx_offset);                   /* NegotiateContextOffset */
+        mb_put_uint16le(mbp, 2);                            /* NegotiateContextCount */
+        mb_put_uint16le(mbp, 0);                            /* Reserved2 */
+    }
+    else {
+        mb_put_uint64le(mbp, 0);                            /* Start Time */
+    }
 
     for (i = 0; i < dialect_cnt; i++) {                     /* Dialects */
         mb_put_uint16le(mbp, dialects[i]);
     }
     
+    if (ctx_offset) {
+        mb_put_mem(mbp, NULL,
+                   ctx_offset - (SMB2_HDRLEN + 36 + (dialect_cnt * 2)),
+                   MB_MZERO);                               /* Padding */
+        smb2_smb_add_negotiate_contexts(vcp, mbp);
+        
+        /*
+         * The preauth hash starts over with this Negotiate and then covers
+         * every Negotiate and SessionSetup message up to the final
+         * SessionSetup response. The iod adds the request as it is sent.
+         */
+        bzero(vcp->vc_preauth_hash, sizeof(vcp->vc_preauth_hash));
+        rqp->sr_extflags |= SMB2_REQ_PREAUTH;
+    }
+    
     /* Send the Negotiate Request */
     error = smb_rq_simple(rqp);
     if (error) {
@@ -2025,6 +2239,10 @@ resend:
         goto bad;
     }
     
+    if (vcp->vc_flags & SMBV_SMB311) {
+        smb311_preauth_hash_update(vcp, rqp->sr_rp.md_top);
+    }
+    
 do_session_setup:
     /* Client requires signing, make sure Server supports signing */
     if ((vcp->vc_misc_flags & SMBV_CLIENT_SIGNING_REQUIRED) &&
@@ -2697,7 +2915,8 @@ smb2_smb_parse_create_contexts(struct smb_share *share, struct mdchain *mdp,
                     goto bad;
                 }
 
-                if (rsp_context_data_len != 32) {
+                if ((rsp_context_data_len != 32) &&
+                    (rsp_context_data_len != 52)) {
                     SMBERROR("Illegal RqLs data len: %u\n",
                              rsp_context_data_len);
                     error = EBADRPC;
@@ -2743,6 +2962,21 @@ smb2_smb_parse_create_contexts(struct smb_share *share, struct mdchain *mdp,
                     goto bad;
                 }
                 
+                if (rsp_context_data_len == 52) {
+                    /* Version 2 lease, skip the Parent Lease Key */
+                    error = md_get_mem(&md_context_shadow, NULL, 16, MB_MSYSTEM);
+                    if (error) {
+                        goto bad;
+                    }
+                    
+                    /* Get Epoch */
+                    error = md_get_uint16le(&md_context_shadow,
+                                            &dur_handlep->epoch);
+                    if (error) {
+                        goto bad;
+                    }
+                }
+                
                 dur_handlep->flags |= SMB2_LEASE_GRANTED;
                 
                 break;
@@ -4485,7 +4719,12 @@ smb2_smb_parse_lease_break(struct smbiod *iod, mbuf_t m)
 
     /* Try to find the vnode and upates its lease state */
     error = smbfs_handle_lease_break(smp, lease_key_hi, lease_key_low,
-                                     new_lease_state);
+                                     flags, new_lease_state);
+    if (error == EJUSTRETURN) {
+        /* The notify change thread will do the ack when it is done */
+        error = 0;
+        goto bad;
+    }
     if (error) {
         goto bad;
     }
@@ -4504,6 +4743,141 @@ bad:
     return error;
 }
 
+/*
+ * Parse the SMB 3.1.1 Negotiate Contexts in a Negotiate response. The server
+ * picks exactly one hash algorithm and at most one cipher.
+ * cur_offset is how far into the response we have parsed so far.
+ */
+static int
+smb2_smb_parse_negotiate_contexts(struct smb_vc *vcp, struct mdchain *mdp,
+                                  uint32_t cur_offset, uint32_t ctx_offset,
+                                  uint16_t ctx_count)
+{
+    uint16_t ctx_type, data_len, count, value;
+    uint32_t reserved, used;
+    int found_preauth = 0;
+    int error = 0;
+    
+    vcp->vc_smb3_cipher = 0;
+    
+    if (ctx_offset < cur_offset) {
+        SMBERROR("Bad NegotiateContextOffset %u < %u\n", ctx_offset, cur_offset);
+        return (EBADRPC);
+    }
+    
+    if (ctx_offset > cur_offset) {
+        error = md_get_mem(mdp, NULL, ctx_offset - cur_offset, MB_MSYSTEM);
+        if (error) {
+            return (error);
+        }
+    }
+    cur_offset = ctx_offset;
+    
+    while (ctx_count--) {
+        error = md_get_uint16le(mdp, &ctx_type);
+        if (error) {
+            return (error);
+        }
+        error = md_get_uint16le(mdp, &data_len);
+        if (error) {
+            return (error);
+        }
+        error = md_get_uint32le(mdp, &reserved);
+        if (error) {
+            return (error);
+        }
+        cur_offset += 8 + data_len;
+        used = 0;
+        
+        switch (ctx_type) {
+            case SMB2_PREAUTH_INTEGRITY_CAPABILITIES:
+                /* HashAlgorithmCount, SaltLength, HashAlgorithms[0] */
+                if (data_len < 6) {
+                    return (EBADRPC);
+                }
+                error = md_get_uint16le(mdp, &count);
+                if (!error) {
+                    error = md_get_uint16le(mdp, &value);   /* SaltLength */
+                }
+                if (!error) {
+                    error = md_get_uint16le(mdp, &value);
+                }
+                if (error) {
+                    return (error);
+                }
+                used = 6;
+                
+                if ((count != 1) || (value != SMB2_PREAUTH_INTEGRITY_SHA512)) {
+                    SMBERROR("Unsupported preauth hash 0x%x, count %u\n",
+                             value, count);
+                    return (EBADRPC);
+                }
+                found_preauth = 1;
+                break;
+                
+            case SMB2_ENCRYPTION_CAPABILITIES:
+                /* CipherCount, Ciphers[0] */
+                if (data_len < 4) {
+                    return (EBADRPC);
+                }
+                error = md_get_uint16le(mdp, &count);
+                if (!error) {
+                    error = md_get_uint16le(mdp, &value);
+                }
+                if (error) {
+                    return (error);
+                }
+                used = 4;
+                
+                if (count != 1) {
+                    SMBERROR("Server picked %u ciphers\n", count);
+                    return (EBADRPC);
+                }
+                
+                switch (value) {
+                    case 0:
+                        /* No common cipher, encryption is not available */
+                        SMBWARNING("No common SMB 3.1.1 cipher\n");
+                        break;
+                    case SMB2_ENCRYPTION_AES128_CCM:
+                    case SMB2_ENCRYPTION_AES128_GCM:
+                    case SMB2_ENCRYPTION_AES256_CCM:
+                    case SMB2_ENCRYPTION_AES256_GCM:
+                        vcp->vc_smb3_cipher = value;
+                        SMBDEBUG("SMB 3.1.1 cipher 0x%x\n", value);
+                        break;
+                    default:
+                        SMBERROR("Server picked unknown cipher 0x%x\n", value);
+                        return (EBADRPC);
+                }
+                break;
+                
+            default:
+                /* Ignore contexts we did not ask for */
+                break;
+        }
+        
+        /* Skip rest of this context and pad to the next one */
+        if (ctx_count && (cur_offset & 7)) {
+            data_len += 8 - (cur_offset & 7);
+            cur_offset = roundup(cur_offset, 8);
+        }
+        if (data_len > used) {
+            error = md_get_mem(mdp, NULL, data_len - used, MB_MSYSTEM);
+            if (error) {
+                return (error);
+            }
+        }
+    }
+    
+    if (!found_preauth) {
+        SMBERROR("No preauth integrity context in SMB 3.1.1 Negotiate\n");
+        error = EBADRPC;
+    }
+    
+    return (error);
+}
+
 static int
 smb2_smb_parse_negotiate(struct smb_vc *vcp, struct smb_rq *rqp, int smb1_req)
 {
@@ -4513,6 +4887,7 @@ smb2_smb_parse_negotiate(struct smb_vc *vcp, struct smb_rq *rqp, int smb1_req)
 	uint8_t curr_time[8], boot_time[8];
 	uint16_t reserved16;
 	uint32_t reserved;
+	uint32_t cur_offset;
 	struct smb_sopt *sp = &vcp->vc_sopt;
 	struct mdchain *mdp;
 	int error;
@@ -4569,12 +4944,19 @@ smb2_smb_parse_negotiate(struct smb_vc *vcp, struct smb_rq *rqp, int smb1_req)
     }
     
     /* What dialect did we get? */
+    vcp->vc_smb3_cipher = 0;
     switch (sp->sv_dialect) {
+        case SMB2_DIALECT_0311:
+            /* Cipher comes from the Encryption Capabilities context */
+            vcp->vc_flags |= SMBV_SMB2 | SMBV_SMB311;
+            break;
         case SMB2_DIALECT_0302:
             vcp->vc_flags |= SMBV_SMB2 | SMBV_SMB302;
+            vcp->vc_smb3_cipher = SMB2_ENCRYPTION_AES128_CCM;
             break;
         case SMB2_DIALECT_0300:
             vcp->vc_flags |= SMBV_SMB2 | SMBV_SMB30;
+            vcp->vc_smb3_cipher = SMB2_ENCRYPTION_AES128_CCM;
             break;
         case SMB2_DIALECT_0210:
             vcp->vc_flags |= SMBV_SMB2 | SMBV_SMB21;
@@ -4620,7 +5002,7 @@ smb2_smb_parse_negotiate(struct smb_vc *vcp, struct smb_rq *rqp, int smb1_req)
         goto bad;
     }
     
-    /* Get UInt16 Reserved bytes */
+    /* Get UInt16 Reserved bytes, NegotiateContextCount in 3.1.1 */
     error = md_get_uint16le(mdp, &reserved16);
     if (error) {
         goto bad;
@@ -4702,12 +5084,15 @@ smb2_smb_parse_negotiate(struct smb_vc *vcp, struct smb_rq *rqp, int smb1_req)
         goto bad;
     }
     
-    /* Get Reserved bytes */
+    /* Get Reserved bytes, NegotiateContextOffset in 3.1.1 */
     error = md_get_uint32le(mdp, &reserved);
     if (error) {
         goto bad;
     }
     
+    /* Where the security buffer ends, for finding the Negotiate Contexts */
+    cur_offset = MAX(sec_buf_offset, SMB2_HDRLEN + 64) + sec_buf_len;
+    
     /*
      * Security buffer offset is from the beginning of SMB 2/3 Header
      * Calculate how much further we have to go to get to it.
@@ -4737,6 +5122,15 @@ smb2_smb_parse_negotiate(struct smb_vc *vcp, struct smb_rq *rqp, int smb1_req)
         }
         else {
             error = ENOMEM;
+            goto bad;
+        }
+    }
+    
+    if (sp->sv_dialect == SMB2_DIALECT_0311) {
+        error = smb2_smb_parse_negotiate_contexts(vcp, mdp, cur_offset,
+                                                  reserved, reserved16);
+        if (error) {
+            SMBERROR("Bad SMB 3.1.1 Negotiate Contexts %d\n", error);
         }
     }
     
@@ -5382,8 +5776,46 @@ bad:
     return error;
 }
 
+/*
+ * Can Read/Write data go between the wire and the caller's buffer without
+ * passing through mbufs of our own? Not if the message gets signed or
+ * encrypted, that needs all of it in one place.
+ */
+static int
+smb2_rw_direct_ok(struct smb_share *share, struct smb_rq *rqp)
+{
+    struct smb_vc *vcp = SSTOVC(share);
+    
+    return (!(rqp->sr_flags & SMBR_SIGNED) &&
+            !(vcp->vc_hflags2 & SMB_FLAGS2_SECURITY_SIGNATURE) &&
+            !(vcp->vc_sopt.sv_sessflags & SMB2_SESSION_FLAG_ENCRYPT_DATA) &&
+            !(share->ss_share_flags & SMB2_SHAREFLAG_ENCRYPT_DATA));
+}
+
+/*
+ * Let the iod read the data of this Read's reply straight into the caller's
+ * buffer, see smb_iod_rq_place(). The iod does the receive, so only for
+ * kernel buffers. rqp must not be part of a compound request.
+ */
+static void
+smb2_smb_read_place(struct smb_share *share, struct smb_rq *rqp,
+                    struct smb2_rw_rq *readp)
+{
+    if (!smb_read_direct ||
+        uio_isuserspace(readp->auio) ||
+        !smb2_rw_direct_ok(share, rqp)) {
+        return;
+    }
+    
+    rqp->sr_place_uio = uio_duplicate(readp->auio);
+    if (rqp->sr_place_uio != NULL) {
+        OSIncrementAtomic(&rqp->sr_vc->vc_place_pending);
+    }
+}
+
 int
-smb2_smb_parse_read_one(struct mdchain *mdp,
+smb2_smb_parse_read_one(struct smb_rq *rqp,
+                        struct mdchain *mdp,
                         user_ssize_t *rresid,
                         struct smb2_rw_rq *readp)
 {
@@ -5458,11 +5890,23 @@ smb2_smb_parse_read_one(struct mdchain *mdp,
         /* no data returned */
         *rresid = 0;
     }
+    else if (rqp->sr_place_len != 0) {
+        /* The iod already read the data into the buffer */
+        if (rqp->sr_place_len != readp->ret_len) {
+            SMBERROR("Placed %u but got %u\n", rqp->sr_place_len, readp->ret_len);
+            error = EBADRPC;
+            goto bad;
+        }
+        uio_update(readp->auio, readp->ret_len);
+        *rresid = readp->ret_len;
+        OSAddAtomic64(readp->ret_len, (SInt64 *) &smb_read_direct_bytes);
+    }
     else {
         /* read data into the buffer pointed at by the uio */
 		error = md_get_uio(mdp, readp->auio, readp->ret_len);
 		if (!error) {
             *rresid = readp->ret_len;
+            OSAddAtomic64(readp->ret_len, (SInt64 *) &smb_read_copy_bytes);
         }
     }
     
@@ -6154,6 +6598,8 @@ resend:
         return (0);
     }
 
+    smb2_smb_read_place(share, rqp, readp);
+
     error = smb_rq_simple(rqp);
     readp->ret_ntstatus = rqp->sr_ntstatus;
     if (error) {
@@ -6172,7 +6618,7 @@ resend:
     /* Now get pointer to response data */
     smb_rq_getreply(rqp, &mdp);
     
-    error = smb2_smb_parse_read_one(mdp, rresid, readp);
+    error = smb2_smb_parse_read_one(rqp, mdp, rresid, readp);
     if (error) {
         goto bad;
     }
@@ -6215,6 +6661,105 @@ smb2_smb_read_uio(struct smb_share *share, SMBFID fid, uio_t uio,
 	return error;
 }
 
+/*
+ * How long ago was start, in microseconds
+ */
+static uint64_t
+smb2_rw_elapsed_usec(struct timespec *start)
+{
+    struct timespec now;
+    
+    nanouptime(&now);
+    timespecsub(&now, start);
+    
+    return (((uint64_t) now.tv_sec * 1000000) + (now.tv_nsec / 1000));
+}
+
+/*
+ * Pick the async read/write window, in quanta.
+ *
+ * bdp is the estimated bandwidth-delay product in bytes, or 0 if there is no
+ * estimate yet and the current window should be kept. The headroom on top of
+ * the estimate is what lets the window grow while the pipe is not yet full.
+ *
+ * Never use more quanta than the credits we have can pay for.
+ */
+static int
+smb2_rw_window(struct smb_vc *vcp, uint32_t quantum, int window, int max_window,
+               uint64_t bdp)
+{
+    int32_t curr_credits;
+    uint32_t credit_charge;
+    int credit_window;
+    
+    if ((bdp != 0) && (quantum != 0)) {
+        window = (int) MIN(bdp / quantum, (uint64_t) max_window);
+        window += kRW_WINDOW_HEADROOM;
+    }
+    
+    /* See smb2_rq_credit_check() for how a quantum gets charged */
+    credit_charge = (quantum > (64 * 1024)) ? ((quantum - 1) / (64 * 1024)) + 1 : 1;
+    curr_credits = OSAddAtomic(0, &vcp->vc_credits_granted);
+    if (curr_credits > kCREDIT_LOW_WATER) {
+        credit_window = (curr_credits - kCREDIT_LOW_WATER) / credit_charge;
+    }
+    else {
+        credit_window = 1;
+    }
+    
+    window = MIN(window, credit_window);
+    window = MIN(window, max_window);
+    window = MAX(window, 1);
+    
+    return (window);
+}
+
+/*
+ * Fill in one read/write quantum and send it
+ */
+static int
+smb2_rw_quantum_send(struct smb_share *share, struct smb2_rw_rq *master_read_writep,
+                     struct smb2_rw_quantum *quantump, uint64_t delivered,
+                     uint32_t do_read, vfs_context_t context)
+{
+    int error;
+    
+    if (quantump->read_writep == NULL) {
+        SMB_MALLOC(quantump->read_writep,
+                   struct smb2_rw_rq *,
+                   sizeof(struct smb2_rw_rq),
+                   M_SMBTEMP,
+                   M_WAITOK | M_ZERO);
+        if (quantump->read_writep == NULL) {
+            SMBERROR("SMB_MALLOC failed\n");
+            return (ENOMEM);
+        }
+    }
+    
+    /*
+     * Fill in the Read/Write request
+     */
+    error = smb2_smb_read_write_fill(share, master_read_writep,
+                                     quantump->read_writep, &quantump->rqp,
+                                     do_read, context);
+    if ((error) && (error != ENOBUFS)) {
+        /* Being low on credits is ok, it just sends a smaller request */
+        SMBERROR("smb2_smb_fillin_read/write failed %d\n", error);
+        return (error);
+    }
+    
+    quantump->delivered = delivered;
+    nanouptime(&quantump->sent);
+    error = smb_iod_rq_enqueue(quantump->rqp);
+    if (error) {
+        SMBERROR("smb_iod_rq_enqueue failed %d\n", error);
+        return (error);
+    }
+    quantump->pending = 1;
+    
+    return (0);
+}
+
 static int
 smb2_smb_read_write_async(struct smb_share *share,
                           struct smb2_rw_rq *in_read_writep,
@@ -6225,19 +6770,15 @@ smb2_smb_read_write_async(struct smb_share *share,
 {
 	int error;
 	struct mdchain *mdp;
+    struct smb_vc *vcp = SSTOVC(share);
     int i, j;
-    struct quantum {
-        struct smb2_rw_rq *read_writep;
-        struct smb_rq *rqp;
-        int pending;
-        user_ssize_t resid;
-    };
-    struct quantum rw_pb[kMAX_READ_BLOCKS]; /* This should be the larger nbr */
-    int done = 0;
+    struct smb2_rw_quantum *rw_pb = NULL;
     int reconnect = 0;
     struct smb2_rw_rq tmp_read_write;
     user_ssize_t saved_len, saved_rresid;
-    int max_pb;
+    int max_pb, window, in_flight, max_in_flight = 0, replies, first_window;
+    uint32_t quantum;
+    uint64_t rtt, min_rtt, bytes, rate, max_rate;
         
     SMB_LOG_KTRACE(SMB_DBG_SMB_RW_ASYNC | DBG_FUNC_START,
                    *len, *rresid, 0, 0, 0);
@@ -6252,8 +6793,13 @@ smb2_smb_read_write_async(struct smb_share *share,
     
     /* Is there enough data to warrent a compound read/write? */
     if (do_read) {
-        max_pb = kMAX_READ_BLOCKS;
-        if ((*len <= SSTOVC(share)->vc_rxmax) ||
+        quantum = vcp->vc_rxmax;
+        window = vcp->vc_rw_read_window;
+        if (window == 0) {
+            window = kRW_READ_WINDOW_INIT;
+        }
+        
+        if ((*len <= vcp->vc_rxmax) ||
             (in_read_writep->flags & SMB2_SYNC_IO)) {
             /* Only need single read */
             error = smb2_smb_read_one(share, in_read_writep, len, rresid, NULL,
@@ -6262,8 +6808,13 @@ smb2_smb_read_write_async(struct smb_share *share,
         }
     }
     else {
-        max_pb = kMAX_WRITE_BLOCKS;
-        if ((*len <= SSTOVC(share)->vc_wxmax) ||
+        quantum = vcp->vc_wxmax;
+        window = vcp->vc_rw_write_window;
+        if (window == 0) {
+            window = kRW_WRITE_WINDOW_INIT;
+        }
+        
+        if ((*len <= vcp->vc_wxmax) ||
             (in_read_writep->flags & SMB2_SYNC_IO)) {
             /* Only need single write */
             error = smb2_smb_write_one(share, in_read_writep, len, rresid, NULL,
@@ -6272,172 +6823,154 @@ smb2_smb_read_write_async(struct smb_share *share,
         }
     }
     
+    /* No point in more quanta than it takes to do the whole request */
+    max_pb = (int) MIN(smb_rw_max_window, (uint32_t) kRW_WINDOW_LIMIT);
+    max_pb = MIN(max_pb, (int) (((*len - 1) / quantum) + 1));
+    max_pb = MAX(max_pb, 1);
+    
+    SMB_MALLOC(rw_pb,
+               struct smb2_rw_quantum *,
+               max_pb * sizeof(struct smb2_rw_quantum),
+               M_SMBTEMP,
+               M_WAITOK | M_ZERO);
+    if (rw_pb == NULL) {
+        SMBERROR("SMB_MALLOC failed\n");
+        error = ENOMEM;
+        goto done;
+    }
+    
     /* Use a temp smb2_rw_rq instead of in_read_writep */
     bzero(&tmp_read_write, sizeof(tmp_read_write));
     tmp_read_write.remaining = in_read_writep->remaining;
     tmp_read_write.write_flags = in_read_writep->write_flags;
     tmp_read_write.fid = in_read_writep->fid;
     tmp_read_write.io_len = in_read_writep->io_len;
+    tmp_read_write.extref = in_read_writep->extref;
     tmp_read_write.auio = uio_duplicate(in_read_writep->auio);
     
-    /* Zero out param blocks */
-    for (i = 0; i < max_pb; i++) {
-        rw_pb[i].read_writep = NULL;
-        rw_pb[i].rqp = NULL;
-        rw_pb[i].pending = 0;
-        rw_pb[i].resid = 0;
-    }
-    
 resend:
-    
-    /* Fill in initial requests */
-    for (i = 0; i < max_pb; i++) {
-        /* Malloc the read_writep */
-        SMB_MALLOC(rw_pb[i].read_writep,
-                   struct smb2_rw_rq *,
-                   sizeof(struct smb2_rw_rq),
-                   M_SMBTEMP,
-                   M_WAITOK | M_ZERO);
-        if (rw_pb[i].read_writep == NULL) {
-            SMBERROR("SMB_MALLOC failed\n");
-            error = ENOMEM;
-            goto bad;
-        }
-        
-        /*
-         * Fill in the Read/Write request
-         */
-        error = smb2_smb_read_write_fill(share, &tmp_read_write,
-                                         rw_pb[i].read_writep, &rw_pb[i].rqp,
-                                         do_read, context);
-        
+    min_rtt = UINT64_MAX;
+    max_rate = 0;
+    bytes = 0;
+    in_flight = 0;
+    replies = 0;
+    window = smb2_rw_window(vcp, quantum, window, max_pb, 0);
+    
+    /* Fill in and send initial requests */
+    for (i = 0; (i < window) && (uio_resid(tmp_read_write.auio)); i++) {
+        error = smb2_rw_quantum_send(share, &tmp_read_write, &rw_pb[i],
+                                     bytes, do_read, context);
         if (error) {
-            if (error == ENOBUFS) {
-                /* Running out of credits, clear error and send what we have */
-                SMBDEBUG("low on credits %d\n", error);
-                error = 0;
-                
-                /* i equals number of initial rw_pb's filled in */
-                i += 1;
-                break;
-            }
-            else {
-                SMBERROR("smb2_smb_fillin_read/write failed %d\n", error);
-                goto bad;
-            }
-        }
-        
-        /* Any more to read or write? If not, then send what we have */
-        if (uio_resid(tmp_read_write.auio) == 0) {
-            /* i equals number of initial rw_pb's filled in */
-            i += 1;
-            break;
-        }
-    }
-    
-    SMB_LOG_KTRACE(SMB_DBG_SMB_RW_ASYNC | DBG_FUNC_NONE, 0xabc001, i, 0, 0, 0);
-
-    /*
-     * Send initial requests
-     */
-    for (j = 0; j < i; j++) {
-        error = smb_iod_rq_enqueue(rw_pb[j].rqp);
-        if (error) {
-            SMBERROR("smb_iod_rq_enqueue failed %d\n", error);
             goto bad;
         }
-        rw_pb[j].pending = 1;
+        in_flight++;
     }
+    first_window = in_flight;
+    max_in_flight = MAX(max_in_flight, in_flight);
     
+    SMB_LOG_KTRACE(SMB_DBG_SMB_RW_ASYNC | DBG_FUNC_NONE, 0xabc001, i, window, max_pb, 0);
+
     /* Wait for replies and refill requests as needed */
-    while (!done) {
-        /* Assume we are done */
-        done = 1;
-        
-        for (j = 0; j < i; j++) {
-            if (rw_pb[j].pending == 1) {
-                error = smb_rq_reply(rw_pb[j].rqp);
-                
-                SMB_LOG_KTRACE(SMB_DBG_SMB_RW_ASYNC | DBG_FUNC_NONE,
-                               0xabc002, error, j, 0, 0);
+    while (in_flight > 0) {
+        for (j = 0; j < max_pb; j++) {
+            if (rw_pb[j].pending == 0) {
+                continue;
+            }
+            
+            error = smb_rq_reply(rw_pb[j].rqp);
+            
+            SMB_LOG_KTRACE(SMB_DBG_SMB_RW_ASYNC | DBG_FUNC_NONE,
+                           0xabc002, error, j, in_flight, window);
 
-                rw_pb[j].pending = 0;
-                if (error) {
-                    if (rw_pb[j].rqp->sr_flags & SMBR_RECONNECTED) {
-                        SMBDEBUG("reconnected on read/write[%d]\n", j);
-                        reconnect = 1;
-                    }
-                    else {
-                        SMBERROR("smb_rq_reply failed %d\n", error);
-                    }
-                    
-                    goto bad;
+            rw_pb[j].pending = 0;
+            in_flight--;
+            if (error) {
+                if (rw_pb[j].rqp->sr_flags & SMBR_RECONNECTED) {
+                    SMBDEBUG("reconnected on read/write[%d]\n", j);
+                    reconnect = 1;
                 }
-                
-                if (!tmp_read_write.ret_ntstatus) {
-                    tmp_read_write.ret_ntstatus = rw_pb[j].rqp->sr_ntstatus;
+                else {
+                    SMBERROR("smb_rq_reply failed %d\n", error);
                 }
                 
-                /* Now get pointer to response data */
-                smb_rq_getreply(rw_pb[j].rqp, &mdp);
-                
-                if (do_read) {
-                    error = smb2_smb_parse_read_one(mdp,
-                                                    &rw_pb[j].resid,
-                                                    rw_pb[j].read_writep);
-                }
-                else {
-                    error = smb2_smb_parse_write_one(mdp,
-                                                     &rw_pb[j].resid,
-                                                     rw_pb[j].read_writep);
+                goto bad;
+            }
+            
+            /* Replies are reaped in slot order, so this is an upper bound */
+            rtt = smb2_rw_elapsed_usec(&rw_pb[j].sent);
+            rtt = MAX(rtt, 1);
+            min_rtt = MIN(min_rtt, rtt);
+            replies++;
+            
+            if (!tmp_read_write.ret_ntstatus) {
+                tmp_read_write.ret_ntstatus = rw_pb[j].rqp->sr_ntstatus;
+            }
+            
+            /* Now get pointer to response data */
+            smb_rq_getreply(rw_pb[j].rqp, &mdp);
+            
+            if (do_read) {
+                error = smb2_smb_parse_read_one(rw_pb[j].rqp, mdp,
+                                                &rw_pb[j].resid,
+                                                rw_pb[j].read_writep);
+            }
+            else {
+                error = smb2_smb_parse_write_one(mdp,
+                                                 &rw_pb[j].resid,
+                                                 rw_pb[j].read_writep);
+            }
+            
+            if (error) {
+                SMBERROR("parse failed %d\n", error);
+                goto bad;
+            }
+            
+            /*
+             * Make sure resid is same as actual amt of data we asked
+             * for.  If we are reading from a named pipe (i.e. svrsvc),
+             * this can actually happen (read less from the pipe
+             * than we requested).
+             */
+            if (rw_pb[j].resid != rw_pb[j].read_writep->io_len) {
+                SMBERROR("IO Mismatched. Requested %lld but got %lld\n",
+                         rw_pb[j].read_writep->io_len, rw_pb[j].resid);
+            }
+            
+            /* Add up amount of IO that we have done so far */
+            *rresid += rw_pb[j].resid;
+            tmp_read_write.ret_len += rw_pb[j].resid;
+            bytes += rw_pb[j].resid;
+            
+            /*
+             * Everything delivered while this quantum was in flight over its
+             * round trip is a delivery rate sample. The best rate seen times
+             * the smallest round trip, the one least inflated by queueing, is
+             * the bandwidth-delay product. Until the first window of replies
+             * is back, the samples only cover part of it so keep the window.
+             */
+            rate = ((bytes - rw_pb[j].delivered) * 1000000) / rtt;
+            max_rate = MAX(max_rate, rate);
+            if (replies >= first_window) {
+                window = smb2_rw_window(vcp, quantum, window, max_pb,
+                                        (max_rate * min_rtt) / 1000000);
+            }
+            
+            /* Refill this quantum, plus any more the window now allows */
+            for (i = j; (i < j + max_pb) && (in_flight < window) &&
+                 (uio_resid(tmp_read_write.auio)); i++) {
+                if (rw_pb[i % max_pb].pending == 1) {
+                    continue;
                 }
                 
+                error = smb2_rw_quantum_send(share, &tmp_read_write,
+                                             &rw_pb[i % max_pb], bytes,
+                                             do_read, context);
                 if (error) {
-                    SMBERROR("parse failed %d\n", error);
                     goto bad;
                 }
-                
-                /*
-                 * Make sure resid is same as actual amt of data we asked
-                 * for.  If we are reading from a named pipe (i.e. svrsvc),
-                 * this can actually happen (read less from the pipe
-                 * than we requested).
-                 */
-                if (rw_pb[j].resid != rw_pb[j].read_writep->io_len) {
-                    SMBERROR("IO Mismatched. Requested %lld but got %lld\n",
-                             rw_pb[j].read_writep->io_len, rw_pb[j].resid);
-                }
-                
-                /* Add up amount of IO that we have done so far */
-                *rresid += rw_pb[j].resid;
-                tmp_read_write.ret_len += rw_pb[j].resid;
-                
-                if (uio_resid(tmp_read_write.auio)) {
-                    /* More data to request */
-                    error = smb2_smb_read_write_fill(share,
-                                                     &tmp_read_write,
-                                                     rw_pb[j].read_writep,
-                                                     &rw_pb[j].rqp,
-                                                     do_read,
-                                                     context);
-                    
-                    if ((error) && !(error == ENOBUFS)) {
-                        /* Being low on credits is ok to ignore */
-                        SMBERROR("smb2_smb_fillin_read/write2 failed %d\n", error);
-                        goto bad;
-                    }
-                    
-                    error = smb_iod_rq_enqueue(rw_pb[j].rqp);
-                    if (error) {
-                        SMBERROR("smb_iod_rq_enqueue failed %d\n", error);
-                        goto bad;
-                    }
-                    rw_pb[j].pending = 1;
-                    
-                    /* Not done yet */
-                    done = 0;
-                }
+                in_flight++;
             }
+            max_in_flight = MAX(max_in_flight, in_flight);
         }
     }
     
@@ -6482,12 +7015,29 @@ bad:
         tmp_read_write.write_flags = in_read_writep->write_flags;
         tmp_read_write.fid = in_read_writep->fid;
         tmp_read_write.io_len = in_read_writep->io_len;
+        tmp_read_write.extref = in_read_writep->extref;
         tmp_read_write.auio = uio_duplicate(in_read_writep->auio);
         
+        /* Start over carefully, the new connection may be very different */
+        if (do_read) {
+            window = kRW_READ_WINDOW_INIT;
+        }
+        else {
+            window = kRW_WRITE_WINDOW_INIT;
+        }
+        
         reconnect = 0;
         goto resend;
     }
     
+    /* Next read/write on this vc starts where we left off */
+    if (do_read) {
+        vcp->vc_rw_read_window = window;
+    }
+    else {
+        vcp->vc_rw_write_window = window;
+    }
+    
     /* Always update the ret_ntstatus */
     in_read_writep->ret_ntstatus = tmp_read_write.ret_ntstatus;
     
@@ -6509,8 +7059,12 @@ bad:
         uio_free(tmp_read_write.auio);
     }
 
+    SMB_FREE(rw_pb, M_SMBTEMP);
+
 done:
-    SMB_LOG_KTRACE(SMB_DBG_SMB_RW_ASYNC | DBG_FUNC_END, error, *rresid, 0, 0, 0);
+    /* arg3 is the largest window actually achieved, arg4 the final window */
+    SMB_LOG_KTRACE(SMB_DBG_SMB_RW_ASYNC | DBG_FUNC_END, error, *rresid,
+                   max_in_flight, window, 0);
 	return error;
 }
 
@@ -6555,6 +7109,7 @@ smb2_smb_read_write_fill(struct smb_share *share,
     read_writep->remaining = master_read_writep->remaining;
     read_writep->write_flags = master_read_writep->write_flags;
     read_writep->fid = master_read_writep->fid;
+    read_writep->extref = master_read_writep->extref;
     read_writep->auio = uio_duplicate(master_read_writep->auio);
     read_writep->ret_ntstatus = 0;
     read_writep->ret_len = 0;
@@ -6583,6 +7138,10 @@ smb2_smb_read_write_fill(struct smb_share *share,
     /* In this situation, its not a compound request */
     (*rqp)->sr_flags &= ~SMBR_COMPOUND_RQ;
     
+    if (do_read) {
+        smb2_smb_read_place(share, *rqp, read_writep);
+    }
+    
     if (do_read == 0) {
         (*rqp)->sr_timo = SMBWRTTIMO;
     }
@@ -6599,6 +7158,108 @@ bad:
     return (error);
 }
 
+/*
+ * Build a single Read/Write request that completes through a callback
+ * instead of having a thread wait on it. The request is not sent, the caller
+ * does that with smb_iod_rq_enqueue() and reaps the reply with
+ * smb2_smb_rw_async_reply() once the callback has fired.
+ *
+ * Available credits may shrink the request, *len returns the amount actually
+ * being asked for. The callback is called from the iod thread with the
+ * request lock held so it must not block.
+ */
+int
+smb2_smb_rw_async_build(struct smb_share *share,
+                        struct smb2_rw_rq *read_writep,
+                        user_ssize_t *len,
+                        uint32_t do_read,
+                        void (*callback)(void *),
+                        void *callback_args,
+                        struct smb_rq **rqpp,
+                        vfs_context_t context)
+{
+    int error;
+    user_ssize_t resid = 0;
+    struct smb_rq *rqp = NULL;
+    
+    read_writep->ret_ntstatus = 0;
+    read_writep->ret_len = 0;
+    
+    if (do_read) {
+        *len = MIN(SSTOVC(share)->vc_rxmax, *len);
+        error = smb2_smb_read_one(share, read_writep, len, &resid, &rqp,
+                                  context);
+    }
+    else {
+        *len = MIN(SSTOVC(share)->vc_wxmax, *len);
+        error = smb2_smb_write_one(share, read_writep, len, &resid, &rqp,
+                                   context);
+    }
+    
+    if (error) {
+        SMBERROR("smb2_smb_read/write_one failed %d\n", error);
+        return (error);
+    }
+    
+    read_writep->io_len = *len;
+    
+    /* Not really a compound request, just one we send ourselves */
+    rqp->sr_flags &= ~SMBR_COMPOUND_RQ;
+    rqp->sr_flags |= SMBR_CALLBACK;
+    rqp->sr_callback = callback;
+    rqp->sr_callback_args = callback_args;
+    
+    if (do_read) {
+        smb2_smb_read_place(share, rqp, read_writep);
+    }
+    
+    if (do_read == 0) {
+        rqp->sr_timo = SMBWRTTIMO;
+    }
+    else {
+        rqp->sr_timo = rqp->sr_vc->vc_timo;
+    }
+	rqp->sr_state = SMBRQ_NOTSENT;
+    
+    *rqpp = rqp;
+    return (0);
+}
+
+/*
+ * Reap the reply of a request built by smb2_smb_rw_async_build(). Must only
+ * be called after its callback has fired. *rresid returns how much was
+ * actually read or written.
+ */
+int
+smb2_smb_rw_async_reply(struct smb_rq *rqp,
+                        struct smb2_rw_rq *read_writep,
+                        uint32_t do_read,
+                        user_ssize_t *rresid)
+{
+    int error;
+    struct mdchain *mdp;
+    
+    *rresid = 0;
+    
+    error = smb_rq_reply(rqp);
+    read_writep->ret_ntstatus = rqp->sr_ntstatus;
+    if (error) {
+        return (error);
+    }
+    
+    /* Now get pointer to response data */
+    smb_rq_getreply(rqp, &mdp);
+    
+    if (do_read) {
+        error = smb2_smb_parse_read_one(rqp, mdp, rresid, read_writep);
+    }
+    else {
+        error = smb2_smb_parse_write_one(mdp, rresid, read_writep);
+    }
+    
+    return (error);
+}
+
 /*
  * The calling routine must hold a reference on the share
  */
@@ -7244,7 +7905,21 @@ resend:
     mb_put_uint32le(mbp, remaining);                /* Remaining */
     mb_put_uint32le(mbp, 0);                        /* Channel offset/len */
     mb_put_uint32le(mbp, writep->write_flags);      /* Write flags */
-    error = mb_put_uio(mbp, writep->auio, (int)*len); /* Write data */
+    
+    /*
+     * If the caller says the data is in kernel memory that stays put until
+     * the write is done, like the pages strategy and pageout hand us, hang
+     * the pages off the request instead of copying them. Signing and
+     * encryption need the data in our own buffers, so not then.
+     */
+    if ((writep->extref != NULL) && smb2_rw_direct_ok(share, rqp)) {
+        error = mb_put_uio_extref(mbp, writep->auio, (size_t)*len, writep->extref);
+        OSAddAtomic64(*len, (SInt64 *) &smb_write_zero_copy_bytes);
+    }
+    else {
+        error = mb_put_uio(mbp, writep->auio, (int)*len); /* Write data */
+        OSAddAtomic64(*len, (SInt64 *) &smb_write_copy_bytes);
+    }
     if (error) {
         goto bad;
     }
@@ -7292,6 +7967,36 @@ bad:
     return error;
 }
 
+/*
+ * Wait for the socket to let go of the mbufs that point at the caller's
+ * write buffer. They are freed once the data is acked, so with the reply in
+ * hand that should be right away. If they are still out after
+ * SMB_DEFRQTIMO, the connection is stuck, so force a reconnect. Closing
+ * the socket frees them, which bounds the wait by the life of the
+ * connection.
+ */
+static void
+smb2_smb_extref_wait(struct smb_share *share, struct mb_extref *extref)
+{
+    struct timespec ts;
+    int reconnected = 0;
+    
+    for (;;) {
+        ts.tv_sec = SMB_DEFRQTIMO;
+        ts.tv_nsec = 0;
+        if (mb_extref_wait(extref, &ts) == 0) {
+            break;
+        }
+        
+        if (!reconnected) {
+            SMBERROR("write buffer still held by the socket after %d secs, reconnecting\n",
+                     SMB_DEFRQTIMO);
+            (void) smb_vc_force_reconnect(SSTOVC(share));
+            reconnected = 1;
+        }
+    }
+}
+
 static int
 smb2_smb_write_uio(struct smb_share *share, SMBFID fid, uio_t uio, int ioflag,
                    vfs_context_t context)
@@ -7302,6 +8007,9 @@ smb2_smb_write_uio(struct smb_share *share, SMBFID fid, uio_t uio, int ioflag,
     int attempts = 0;
     uio_t temp_uio = NULL;
     user_size_t write_count = 0;
+    struct mb_extref extref;
+    
+    bzero(&extref, sizeof(extref));
     
     temp_uio = uio_duplicate(uio);
     if (temp_uio == NULL) {
@@ -7328,15 +8036,24 @@ smb2_smb_write_uio(struct smb_share *share, SMBFID fid, uio_t uio, int ioflag,
         return error;
     }
     
+    lck_mtx_init(&extref.er_lock, srs_lck_group, srs_lck_attr);
+    
 again:
     writep->flags = 0;
     writep->remaining = 0;
     writep->write_flags = write_mode;
     writep->fid = fid;
     writep->auio = temp_uio;
+    if (smb_write_zero_copy && !uio_isuserspace(temp_uio)) {
+        /* Kernel buffer, the pages can go out as is */
+        writep->extref = &extref;
+    }
     
     error = smb2_smb_write(share, writep, context);
     
+    /* Our caller gets the buffer back once the socket is done with it */
+    smb2_smb_extref_wait(share, &extref);
+    
     /* Handle servers that dislike write through mode */
     if ((error == EINVAL) &&
         (writep->ret_ntstatus == STATUS_INVALID_PARAMETER) &&
@@ -7372,6 +8089,8 @@ again:
     }
     
 done:
+    lck_mtx_destroy(&extref.er_lock, srs_lck_group);
+    
     if (writep != NULL) {
         SMB_FREE(writep, M_SMBTEMP);
         writep = NULL;
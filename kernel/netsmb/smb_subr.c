@@ -41,6 +41,7 @@
 #include <sys/socket.h>
 #include <sys/kpi_mbuf.h>
 #include <sys/vnode.h>
+#include <libkern/OSAtomic.h>
 
 #include <sys/smb_apple.h>
 #include <netsmb/smb.h>
@@ -322,6 +323,53 @@ smb_memdup(const void *umem, int len)
 	return p;
 }
 
+/*
+ * Microseconds since start, which came from nanouptime.
+ */
+uint64_t
+smb_lat_usecs(struct timespec *start)
+{
+	struct timespec now;
+
+	nanouptime(&now);
+	if (!timespeccmp(&now, start, >)) {
+		return (0);
+	}
+	timespecsub(&now, start);
+	return ((uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000);
+}
+
+/*
+ * Record one operation in a latency histogram. Everything is updated with
+ * atomics so the histogram can be shared without a lock; a reader may see
+ * the counts of an operation that is only partly recorded.
+ */
+void
+smb_lat_hist_add(struct smb_lat_hist *hist, uint64_t usecs, int error)
+{
+	uint64_t old_max;
+	uint32_t bucket = 0;
+
+	/* floor(log2(usecs)) */
+	while ((bucket < SMB_LAT_BUCKETS - 1) && (usecs >> (bucket + 1))) {
+		bucket++;
+	}
+
+	OSIncrementAtomic64((SInt64 *) &hist->lh_count);
+	if (error) {
+		OSIncrementAtomic64((SInt64 *) &hist->lh_errors);
+	}
+	OSAddAtomic64(usecs, (SInt64 *) &hist->lh_total_usecs);
+	OSIncrementAtomic64((SInt64 *) &hist->lh_buckets[bucket]);
+
+	do {
+		old_max = hist->lh_max_usecs;
+		if (usecs <= old_max) {
+			break;
+		}
+	} while (!OSCompareAndSwap64(old_max, usecs, (volatile UInt64 *) &hist->lh_max_usecs));
+}
+
 #ifdef SMB_SOCKETDATA_DEBUG
 void
 m_dumpm(mbuf_t m) {
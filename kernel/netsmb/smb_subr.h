@@ -197,6 +197,7 @@ struct mbchain;
 struct mdchain;
 struct smb_vc;
 struct smb_rq;
+struct smb_lat_hist;
 
 #ifdef SMB_DEBUG
 void smb_hexdump(const char *func, const char *s, unsigned char *buf, size_t inlen);
@@ -206,6 +207,8 @@ void smb_hexdump(const char *func, const char *s, unsigned char *buf, size_t inl
 char *smb_strndup(const char *s, size_t maxlen);
 void *smb_memdup(const void *umem, int len);
 void *smb_memdupin(user_addr_t umem, int len);
+uint64_t smb_lat_usecs(struct timespec *start);
+void smb_lat_hist_add(struct smb_lat_hist *hist, uint64_t usecs, int error);
 
 void smb_reset_sig(struct smb_vc *vcp);
 
@@ -236,4 +239,8 @@ int  smb2_rq_verify(struct smb_rq *rqp, struct mdchain *mdp, uint8_t *signature)
 int  smb3_derive_keys(struct smb_vc *vcp);
 int  smb3_rq_encrypt(struct smb_rq *rqp, mbuf_t *m);
 int  smb3_msg_decrypt(struct smb_vc *vcp, mbuf_t *m);
+void smb311_preauth_hash_update(struct smb_vc *vcp, mbuf_t m);
+void smb_crypt_ctx_init(struct smb_vc *vcp);
+void smb_crypt_ctx_invalidate(struct smb_vc *vcp);
+void smb_crypt_ctx_free(struct smb_vc *vcp);
 #endif /* !_NETSMB_SMB_SUBR_H_ */
@@ -42,6 +42,7 @@
  * Known transports
  */
 #define	SMBT_NBTCP	1
+#define	SMBT_LOOP	2		/* in kernel responder, see smb_tranloop.c */
 
 /*
  * Transport parameters
@@ -62,6 +63,7 @@ struct smb_tran_desc {
 	int	(*tr_connect)(struct smb_vc *vcp, struct sockaddr *sap);	/* smb_nbst_connect */
 	int	(*tr_disconnect)(struct smb_vc *vcp);						/* smb_nbst_disconnect */
 	int	(*tr_send)(struct smb_vc *vcp, mbuf_t m0);					/* smb_nbst_send */
+	int	(*tr_sendbatch)(struct smb_vc *vcp, mbuf_t m0);				/* smb_nbst_sendbatch */
 	int	(*tr_recv)(struct smb_vc *vcp, mbuf_t *mpp);				/* smb_nbst_recv */
 	void (*tr_timo)(struct smb_vc *vcp);							/* smb_nbst_timo */
 	int	(*tr_getparam)(struct smb_vc *vcp, int param, void *data);	/* smb_nbst_getparam */
@@ -76,6 +78,7 @@ struct smb_tran_desc {
 #define	SMB_TRAN_CONNECT(vcp,sap)	(vcp)->vc_tdesc->tr_connect(vcp,sap)
 #define	SMB_TRAN_DISCONNECT(vcp)	(vcp)->vc_tdesc->tr_disconnect(vcp)
 #define	SMB_TRAN_SEND(vcp,m0)		(vcp)->vc_tdesc->tr_send(vcp,m0)
+#define	SMB_TRAN_SENDBATCH(vcp,m0)	(vcp)->vc_tdesc->tr_sendbatch(vcp,m0)
 #define	SMB_TRAN_RECV(vcp,m)		(vcp)->vc_tdesc->tr_recv(vcp,m)
 #define	SMB_TRAN_TIMO(vcp)		(vcp)->vc_tdesc->tr_timo(vcp)
 #define	SMB_TRAN_GETPARAM(vcp,par,data)	(vcp)->vc_tdesc->tr_getparam(vcp, par, data)
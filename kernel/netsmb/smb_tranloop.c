@@ -0,0 +1,849 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Loopback transport. Instead of going out on a socket, requests are handed
+ * to a small SMB 2.1 responder right here, whose replies show up for the iod
+ * after a simulated network delay. It exists so that credits, compounding and
+ * pipelining can be measured the same way every time, without a server or a
+ * network in the way.
+ *
+ * Only a vc to the reserved address 192.0.2.1 port 445 uses it, so it has
+ * to be asked for by name, smb://user@192.0.2.1:445/share. Give the port,
+ * otherwise mount_smbfs also tries port 139 and goes looking for a real
+ * host. Nothing else ever sees the fake server. The net.smb.fs.loop_*
+ * sysctls set the latency, the bandwidth, how many credits each reply
+ * grants, how far replies may pass each other and whether compound requests
+ * get compound replies.
+ *
+ * The responder answers Negotiate, Session Setup, Tree Connect, Create,
+ * Close, Flush, Read, Write and Echo, anything else gets
+ * STATUS_NOT_SUPPORTED. Session Setup does just enough raw NTLMSSP for the
+ * client's gss exchange to finish, any user and password are accepted. It
+ * never signs or encrypts, files are all net.smb.fs.loop_file_size bytes of
+ * zeroes, and writes are dropped.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/malloc.h>
+#include <sys/kpi_mbuf.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/sysctl.h>
+#include <sys/random.h>
+#include <libkern/OSAtomic.h>
+#include <kern/clock.h>
+
+#include <sys/smb_apple.h>
+
+#include <sys/mchain.h>
+
+#include <netsmb/smb.h>
+#include <netsmb/smb_2.h>
+#include <netsmb/smb_conn.h>
+#include <netsmb/smb_rq.h>
+#include <netsmb/smb_tran.h>
+#include <netsmb/smb_trantcp.h>
+#include <netsmb/smb_tranloop.h>
+#include <netsmb/smb_subr.h>
+#include <netsmb/smb_packets_2.h>
+#include <smbfs/smbfs_subr.h>
+#include <smbclient/ntstatus.h>
+
+#define M_LBDATA	M_PCB
+
+static uint32_t smb_loop_latency = 500;		/* usecs from request to reply */
+static uint32_t smb_loop_bandwidth = 0;		/* bytes per sec both ways, 0 is no limit */
+static uint32_t smb_loop_credits = 0;		/* credits per reply, 0 grants what was asked */
+static uint32_t smb_loop_reorder = 0;		/* percent of latency added at random */
+static uint32_t smb_loop_compound = 1;		/* compound requests get compound replies */
+static uint32_t smb_loop_maxio = 1024 * 1024;	/* max read/write size in the Negotiate */
+static uint64_t smb_loop_file_size = 1024 * 1024 * 1024;
+
+SYSCTL_DECL(_net_smb_fs);
+SYSCTL_INT(_net_smb_fs, OID_AUTO, loop_latency, CTLFLAG_RW, &smb_loop_latency, 0, "");
+SYSCTL_INT(_net_smb_fs, OID_AUTO, loop_bandwidth, CTLFLAG_RW, &smb_loop_bandwidth, 0, "");
+SYSCTL_INT(_net_smb_fs, OID_AUTO, loop_credits, CTLFLAG_RW, &smb_loop_credits, 0, "");
+SYSCTL_INT(_net_smb_fs, OID_AUTO, loop_reorder, CTLFLAG_RW, &smb_loop_reorder, 0, "");
+SYSCTL_INT(_net_smb_fs, OID_AUTO, loop_compound, CTLFLAG_RW, &smb_loop_compound, 0, "");
+SYSCTL_INT(_net_smb_fs, OID_AUTO, loop_maxio, CTLFLAG_RW, &smb_loop_maxio, 0, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, loop_file_size, CTLFLAG_RW, &smb_loop_file_size, "");
+
+static int smb_loop_disconnect(struct smb_vc *vcp);
+
+/*
+ * Does this vc go to the loopback responder?
+ */
+int
+smb_tran_loop_addr(struct sockaddr *sap)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *)(void *)sap;
+
+	if ((sap == NULL) || (sap->sa_family != AF_INET) ||
+		(sap->sa_len < sizeof(*sin))) {
+		return (FALSE);
+	}
+	return ((sin->sin_addr.s_addr == htonl(LB_SERVER_ADDR)) &&
+			(sin->sin_port == htons(SMB_TCP_PORT_445)));
+}
+
+static uint64_t
+smb_loop_now(void)
+{
+	struct timespec ts;
+
+	nanouptime(&ts);
+	return (((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+}
+
+/*
+ * Same as the socket upcall in smb_trantcp.c. Called with lbp_lock held.
+ */
+static void
+smb_loop_upcall(struct lbpcb *lbp)
+{
+	if (lbp->lbp_upcall) {
+		lbp->lbp_upcall(lbp->lbp_selectid);
+	} else if (lbp->lbp_selectid) {
+		wakeup(lbp->lbp_selectid);
+	}
+}
+
+static void
+smb_loop_timer(thread_call_param_t arg0, thread_call_param_t arg1)
+{
+#pragma unused(arg1)
+	struct lbpcb *lbp = arg0;
+
+	lck_mtx_lock(&lbp->lbp_lock);
+	if (lbp->lbp_connected) {
+		smb_loop_upcall(lbp);
+	}
+	lck_mtx_unlock(&lbp->lbp_lock);
+}
+
+/*
+ * Make sure the iod hears about the first reply once it has arrived.
+ * Called with lbp_lock held.
+ */
+static void
+smb_loop_schedule(struct lbpcb *lbp, uint64_t now)
+{
+	struct lbreply *lrp = TAILQ_FIRST(&lbp->lbp_replies);
+	uint64_t deadline;
+
+	if (lrp == NULL) {
+		return;
+	}
+
+	if (lrp->lr_ready <= now) {
+		smb_loop_upcall(lbp);
+		return;
+	}
+
+	clock_interval_to_deadline((uint32_t) MIN(lrp->lr_ready - now, UINT32_MAX),
+							   NSEC_PER_USEC, &deadline);
+	thread_call_enter_delayed(lbp->lbp_call, deadline);
+}
+
+/*
+ * Queue a reply to arrive once the simulated link has carried the request
+ * and the reply, plus the latency. req_len is the part of the request this
+ * reply pays for, a compound request is only paid for once.
+ */
+static void
+smb_loop_queue(struct lbpcb *lbp, mbuf_t m, size_t req_len)
+{
+	struct lbreply *lrp, *next_lrp;
+	uint64_t now, start, jitter = 0;
+	size_t rsp_len = m_fixhdr(m);
+
+	SMB_MALLOC(lrp, struct lbreply *, sizeof(*lrp), M_LBDATA, M_WAITOK | M_ZERO);
+	if (lrp == NULL) {
+		mbuf_freem(m);
+		return;
+	}
+	lrp->lr_m = m;
+
+	if (smb_loop_reorder) {
+		/* Lets later replies get ahead of this one */
+		jitter = ((uint64_t) smb_loop_latency * MIN(smb_loop_reorder, 100)) / 100;
+		jitter = random() % (jitter + 1);
+	}
+
+	lck_mtx_lock(&lbp->lbp_lock);
+	if (!lbp->lbp_connected) {
+		lck_mtx_unlock(&lbp->lbp_lock);
+		mbuf_freem(m);
+		SMB_FREE(lrp, M_LBDATA);
+		return;
+	}
+
+	now = smb_loop_now();
+	start = MAX(now, lbp->lbp_link_free);
+	if (smb_loop_bandwidth) {
+		lbp->lbp_link_free = start + (((uint64_t) (req_len + rsp_len) * 1000000) /
+									  smb_loop_bandwidth);
+	}
+	else {
+		lbp->lbp_link_free = start;
+	}
+	lrp->lr_ready = lbp->lbp_link_free + smb_loop_latency + jitter;
+
+	/* Keep the queue sorted by arrival, ties in the order sent */
+	TAILQ_FOREACH_REVERSE(next_lrp, &lbp->lbp_replies, lbreplyq, lr_link) {
+		if (next_lrp->lr_ready <= lrp->lr_ready) {
+			break;
+		}
+	}
+	if (next_lrp == NULL) {
+		TAILQ_INSERT_HEAD(&lbp->lbp_replies, lrp, lr_link);
+	}
+	else {
+		TAILQ_INSERT_AFTER(&lbp->lbp_replies, next_lrp, lrp, lr_link);
+	}
+
+	smb_loop_schedule(lbp, now);
+	lck_mtx_unlock(&lbp->lbp_lock);
+}
+
+/*
+ * Put LB_NAME in UTF-16LE
+ */
+static void
+smb_loop_put_name(struct mbchain *mbp)
+{
+	const char *cp;
+
+	for (cp = LB_NAME; *cp != '\0'; cp++) {
+		mb_put_uint16le(mbp, *cp);
+	}
+}
+
+/*
+ * The NTLMSSP CHALLENGE_MESSAGE, MS-NLMP 2.2.1.2. The target info carries
+ * the names and the time an NTLMv2 client needs to build its response.
+ * Always LB_NTLM_CHALLENGE_LEN bytes.
+ */
+static void
+smb_loop_ntlm_challenge(struct mbchain *mbp, uint64_t nt_time)
+{
+	mb_put_mem(mbp, "NTLMSSP", 8, MB_MSYSTEM);		/* Signature, with the NUL */
+	mb_put_uint32le(mbp, LB_NTLM_CHALLENGE);		/* Message type */
+	mb_put_uint16le(mbp, LB_NAME_LEN);				/* Target name length */
+	mb_put_uint16le(mbp, LB_NAME_LEN);				/* Target name max length */
+	mb_put_uint32le(mbp, LB_NTLM_HDRLEN);			/* Target name offset */
+	mb_put_uint32le(mbp, LB_NTLM_FLAGS);
+	mb_put_mem(mbp, "loopback", 8, MB_MSYSTEM);	/* Server challenge */
+	mb_put_uint64le(mbp, 0);						/* Reserved */
+	mb_put_uint16le(mbp, LB_NTLM_INFO_LEN);			/* Target info length */
+	mb_put_uint16le(mbp, LB_NTLM_INFO_LEN);			/* Target info max length */
+	mb_put_uint32le(mbp, LB_NTLM_HDRLEN + LB_NAME_LEN); /* Target info offset */
+
+	smb_loop_put_name(mbp);							/* Target name */
+
+	mb_put_uint16le(mbp, 2);						/* MsvAvNbDomainName */
+	mb_put_uint16le(mbp, LB_NAME_LEN);
+	smb_loop_put_name(mbp);
+	mb_put_uint16le(mbp, 1);						/* MsvAvNbComputerName */
+	mb_put_uint16le(mbp, LB_NAME_LEN);
+	smb_loop_put_name(mbp);
+	mb_put_uint16le(mbp, 7);						/* MsvAvTimestamp */
+	mb_put_uint16le(mbp, 8);
+	mb_put_uint64le(mbp, nt_time);
+	mb_put_uint16le(mbp, 0);						/* MsvAvEOL */
+	mb_put_uint16le(mbp, 0);
+}
+
+static uint16_t
+smb_loop_credits_granted(struct smb2_header *req_hdr)
+{
+	if (smb_loop_credits) {
+		return ((uint16_t) MIN(smb_loop_credits, UINT16_MAX));
+	}
+	return (MAX(letohs(req_hdr->credit_reqrsp), 1));
+}
+
+/*
+ * Build the reply to the request whose header is req_hdr and whose body
+ * starts at body_off in m. Returns where the reply's next command field is
+ * so a compound reply can be chained up, or NULL if out of mbufs.
+ */
+static uint32_t *
+smb_loop_command(struct lbpcb *lbp, mbuf_t m, size_t body_off,
+				 struct smb2_header *req_hdr, int smb1_negotiate,
+				 struct mbchain *mbp)
+{
+	struct smb2_header *rsp_hdr;
+	uint16_t command = letohs(req_hdr->command);
+	uint32_t status = STATUS_SUCCESS;
+	uint16_t dialect = 0, dialect_count = 0, name_len = 0, sec_off = 0, i;
+	uint32_t io_len = 0, ntlm_type = 0;
+	uint64_t io_offset = 0, fid, nt_time;
+	struct timespec ts;
+
+	rsp_hdr = mb_reserve(mbp, SMB2_HDRLEN);
+	if (rsp_hdr == NULL) {
+		return (NULL);
+	}
+	bzero(rsp_hdr, SMB2_HDRLEN);
+	bcopy(SMB2_SIGNATURE, rsp_hdr->protocol_id, SMB2_SIGLEN);
+	rsp_hdr->structure_size = htoles(SMB2_HDRLEN);
+	rsp_hdr->credit_charge = req_hdr->credit_charge;
+	rsp_hdr->command = req_hdr->command;
+	rsp_hdr->credit_reqrsp = htoles(smb_loop_credits_granted(req_hdr));
+	rsp_hdr->flags = htolel(SMB2_FLAGS_SERVER_TO_REDIR |
+							(letohl(req_hdr->flags) & SMB2_FLAGS_RELATED_OPERATIONS));
+	rsp_hdr->message_id = req_hdr->message_id;
+	rsp_hdr->sync.process_id = req_hdr->sync.process_id;
+	rsp_hdr->sync.tree_id = req_hdr->sync.tree_id;
+	rsp_hdr->session_id = req_hdr->session_id;
+
+	nanotime(&ts);
+	smb_time_local2NT(&ts, &nt_time, FALSE);
+
+	switch (command) {
+		case SMB2_NEGOTIATE:
+			if (smb1_negotiate) {
+				/* Multi protocol negotiate, ask for a real SMB 2 one */
+				dialect = SMB2_DIALECT_02ff;
+			}
+			else if (mbuf_copydata(m, body_off + 2, 2, &dialect_count) == 0) {
+				dialect_count = letohs(dialect_count);
+				for (i = 0; i < dialect_count; i++) {
+					uint16_t offered;
+
+					if (mbuf_copydata(m, body_off + 36 + (i * 2), 2, &offered)) {
+						break;
+					}
+					offered = letohs(offered);
+					/* No signing, so no SMB 3, it needs a signed validate */
+					if ((offered == SMB2_DIALECT_0210) ||
+						((offered == SMB2_DIALECT_0202) && (dialect == 0))) {
+						dialect = offered;
+					}
+				}
+			}
+			if (dialect == 0) {
+				status = STATUS_NOT_SUPPORTED;
+				break;
+			}
+			mb_put_uint16le(mbp, 65);				/* Struct size */
+			mb_put_uint16le(mbp, SMB2_NEGOTIATE_SIGNING_ENABLED);
+			mb_put_uint16le(mbp, dialect);
+			mb_put_uint16le(mbp, 0);				/* Reserved */
+			mb_put_mem(mbp, "smb loopback    ", 16, MB_MSYSTEM); /* Server GUID */
+			mb_put_uint32le(mbp, SMB2_GLOBAL_CAP_LARGE_MTU);
+			mb_put_uint32le(mbp, smb_loop_maxio);	/* Max transact */
+			mb_put_uint32le(mbp, smb_loop_maxio);	/* Max read */
+			mb_put_uint32le(mbp, smb_loop_maxio);	/* Max write */
+			mb_put_uint64le(mbp, nt_time);			/* System time */
+			mb_put_uint64le(mbp, 0);				/* Start time */
+			mb_put_uint16le(mbp, SMB2_HDRLEN + 64);	/* Security buffer offset */
+			mb_put_uint16le(mbp, 0);				/* Security buffer length */
+			mb_put_uint32le(mbp, 0);				/* Reserved2 */
+			break;
+
+		case SMB2_SESSION_SETUP:
+			/*
+			 * The Negotiate had no security blob, so the client does raw
+			 * NTLMSSP. Answer its NEGOTIATE_MESSAGE with a challenge and
+			 * take whatever AUTHENTICATE_MESSAGE comes back.
+			 */
+			rsp_hdr->session_id = htoleq(LB_SESSION_ID);
+			mb_put_uint16le(mbp, 9);				/* Struct size */
+			mb_put_uint16le(mbp, 0);				/* Session flags */
+			mb_put_uint16le(mbp, SMB2_HDRLEN + 8);	/* Security buffer offset */
+			if ((mbuf_copydata(m, body_off + 12, 2, &sec_off) == 0) &&
+				(mbuf_copydata(m, body_off - SMB2_HDRLEN + letohs(sec_off) + 8,
+							   4, &ntlm_type) == 0) &&
+				(letohl(ntlm_type) == LB_NTLM_NEGOTIATE)) {
+				status = STATUS_MORE_PROCESSING_REQUIRED;
+				mb_put_uint16le(mbp, LB_NTLM_CHALLENGE_LEN); /* Security buffer length */
+				smb_loop_ntlm_challenge(mbp, nt_time);
+			}
+			else {
+				mb_put_uint16le(mbp, 0);			/* Security buffer length */
+			}
+			break;
+
+		case SMB2_TREE_CONNECT:
+			rsp_hdr->sync.tree_id = htolel(LB_TREE_ID);
+			mb_put_uint16le(mbp, 16);				/* Struct size */
+			mb_put_uint8(mbp, SMB2_SHARE_TYPE_DISK);
+			mb_put_uint8(mbp, 0);					/* Reserved */
+			mb_put_uint32le(mbp, 0);				/* Share flags */
+			mb_put_uint32le(mbp, 0);				/* Capabilities */
+			mb_put_uint32le(mbp, 0x001f01ff);		/* Maximal access */
+			break;
+
+		case SMB2_CREATE:
+			/* An empty name is the share root, everything else is a file */
+			if (mbuf_copydata(m, body_off + 46, 2, &name_len)) {
+				status = STATUS_NOT_SUPPORTED;
+				break;
+			}
+			name_len = letohs(name_len);
+			fid = OSIncrementAtomic64((SInt64 *) &lbp->lbp_fid) + 1;
+
+			mb_put_uint16le(mbp, 89);				/* Struct size */
+			mb_put_uint8(mbp, 0);					/* Oplock level */
+			mb_put_uint8(mbp, 0);					/* Flags */
+			mb_put_uint32le(mbp, 1);				/* Create action, opened */
+			for (i = 0; i < 4; i++) {
+				mb_put_uint64le(mbp, nt_time);		/* Create/access/write/change */
+			}
+			mb_put_uint64le(mbp, (name_len) ? smb_loop_file_size : 0); /* Alloc */
+			mb_put_uint64le(mbp, (name_len) ? smb_loop_file_size : 0); /* EOF */
+			mb_put_uint32le(mbp, (name_len) ? SMB_EFA_NORMAL : SMB_EFA_DIRECTORY);
+			mb_put_uint32le(mbp, 0);				/* Reserved2 */
+			mb_put_uint64le(mbp, fid);				/* FID */
+			mb_put_uint64le(mbp, fid);				/* FID */
+			mb_put_uint32le(mbp, 0);				/* Create contexts offset */
+			mb_put_uint32le(mbp, 0);				/* Create contexts length */
+			break;
+
+		case SMB2_CLOSE:
+			mb_put_uint16le(mbp, 60);				/* Struct size */
+			mb_put_uint16le(mbp, 0);				/* Flags, no attributes */
+			mb_put_mem(mbp, NULL, 56, MB_MZERO);	/* Reserved, times, sizes, attrs */
+			break;
+
+		case SMB2_READ:
+			if (mbuf_copydata(m, body_off + 4, 4, &io_len) ||
+				mbuf_copydata(m, body_off + 8, 8, &io_offset)) {
+				status = STATUS_NOT_SUPPORTED;
+				break;
+			}
+			io_len = letohl(io_len);
+			io_offset = letohq(io_offset);
+			if (io_offset >= smb_loop_file_size) {
+				status = STATUS_END_OF_FILE;
+				break;
+			}
+			io_len = (uint32_t) MIN(io_len, smb_loop_file_size - io_offset);
+
+			mb_put_uint16le(mbp, 17);				/* Struct size */
+			mb_put_uint8(mbp, SMB2_HDRLEN + 16);	/* Data offset */
+			mb_put_uint8(mbp, 0);					/* Reserved */
+			mb_put_uint32le(mbp, io_len);			/* Data length */
+			mb_put_uint32le(mbp, 0);				/* Data remaining */
+			mb_put_uint32le(mbp, 0);				/* Reserved2 */
+			mb_put_mem(mbp, NULL, io_len, MB_MZERO);
+			break;
+
+		case SMB2_WRITE:
+			if (mbuf_copydata(m, body_off + 4, 4, &io_len)) {
+				status = STATUS_NOT_SUPPORTED;
+				break;
+			}
+			mb_put_uint16le(mbp, 17);				/* Struct size */
+			mb_put_uint16le(mbp, 0);				/* Reserved */
+			mb_put_uint32le(mbp, letohl(io_len));	/* Count */
+			mb_put_uint32le(mbp, 0);				/* Remaining */
+			mb_put_uint16le(mbp, 0);				/* Channel info offset */
+			mb_put_uint16le(mbp, 0);				/* Channel info length */
+			break;
+
+		case SMB2_LOGOFF:
+		case SMB2_TREE_DISCONNECT:
+		case SMB2_FLUSH:
+		case SMB2_ECHO:
+			mb_put_uint16le(mbp, 4);				/* Struct size */
+			mb_put_uint16le(mbp, 0);				/* Reserved */
+			break;
+
+		default:
+			status = STATUS_NOT_SUPPORTED;
+			break;
+	}
+
+	if ((status != STATUS_SUCCESS) &&
+		(status != STATUS_MORE_PROCESSING_REQUIRED)) {
+		/* Error response */
+		mb_put_uint16le(mbp, 9);					/* Struct size */
+		mb_put_uint8(mbp, 0);						/* Error context count */
+		mb_put_uint8(mbp, 0);						/* Reserved */
+		mb_put_uint32le(mbp, 0);					/* Byte count */
+		mb_put_uint8(mbp, 0);						/* Error data */
+	}
+	rsp_hdr->status = htolel(status);
+
+	return (&rsp_hdr->next_command);
+}
+
+/*
+ * Answer one message, which can be a compound request. Replies to a compound
+ * request go back as one compound reply, or with smb_loop_compound clear,
+ * one message each like some NetApp servers do. Consumes m.
+ */
+static void
+smb_loop_respond(struct lbpcb *lbp, mbuf_t m)
+{
+	struct mbchain mb;
+	struct smb2_header req_hdr;
+	size_t msg_len, off = 0, rsp_start = 0, req_start = 0;
+	uint32_t *next_cmdp = NULL;
+	uint8_t smb1_hdr[SMB_HDRLEN];
+	int have_reply = 0;
+
+	msg_len = m_fixhdr(m);
+	if (mb_init(&mb)) {
+		mbuf_freem(m);
+		return;
+	}
+
+	/* The SMB 1 Negotiate of a multi protocol negotiate */
+	if ((msg_len >= SMB_HDRLEN) &&
+		(mbuf_copydata(m, 0, SMB_HDRLEN, smb1_hdr) == 0) &&
+		(bcmp(smb1_hdr, SMB_SIGNATURE, SMB_SIGLEN) == 0)) {
+		bzero(&req_hdr, sizeof(req_hdr));
+		req_hdr.command = htoles(SMB2_NEGOTIATE);
+		if ((SMB_HDRCMD(smb1_hdr) == SMB_COM_NEGOTIATE) &&
+			(smb_loop_command(lbp, m, 0, &req_hdr, TRUE, &mb) != NULL)) {
+			smb_loop_queue(lbp, mb_detach(&mb), msg_len);
+		}
+		mb_done(&mb);
+		mbuf_freem(m);
+		return;
+	}
+
+	for (;;) {
+		if ((off + SMB2_HDRLEN > msg_len) ||
+			(mbuf_copydata(m, off, SMB2_HDRLEN, &req_hdr) != 0) ||
+			(bcmp(req_hdr.protocol_id, SMB2_SIGNATURE, SMB2_SIGLEN) != 0)) {
+			SMBERROR("dropping bad request at %zu\n", off);
+			break;
+		}
+
+		if (letohs(req_hdr.command) != SMB2_CANCEL) {
+			if (have_reply) {
+				if (smb_loop_compound) {
+					/* Chain this reply on, 8 byte aligned */
+					while ((mb.mb_count - rsp_start) % 8) {
+						mb_put_uint8(&mb, 0);
+					}
+					*next_cmdp = htolel((uint32_t) (mb.mb_count - rsp_start));
+				}
+				else {
+					smb_loop_queue(lbp, mb_detach(&mb), off - req_start);
+					req_start = off;
+					if (mb_init(&mb)) {
+						have_reply = 0;
+						break;
+					}
+				}
+			}
+
+			rsp_start = mb.mb_count;
+			next_cmdp = smb_loop_command(lbp, m, off + SMB2_HDRLEN, &req_hdr,
+										 FALSE, &mb);
+			if (next_cmdp == NULL) {
+				/* Same as a reply lost on the wire */
+				have_reply = 0;
+				break;
+			}
+			have_reply = 1;
+		}
+
+		if (req_hdr.next_command == 0) {
+			break;
+		}
+		off += letohl(req_hdr.next_command);
+	}
+
+	if (have_reply) {
+		smb_loop_queue(lbp, mb_detach(&mb), msg_len - req_start);
+	}
+	mb_done(&mb);
+	mbuf_freem(m);
+}
+
+/*
+ * SMB transport interface
+ */
+static int
+smb_loop_create(struct smb_vc *vcp)
+{
+	struct lbpcb *lbp;
+
+	SMB_MALLOC(lbp, struct lbpcb *, sizeof *lbp, M_LBDATA, M_WAITOK | M_ZERO);
+	if (lbp == NULL) {
+		return (ENOMEM);
+	}
+	lbp->lbp_vc = vcp;
+	TAILQ_INIT(&lbp->lbp_replies);
+	lbp->lbp_call = thread_call_allocate(smb_loop_timer, lbp);
+	if (lbp->lbp_call == NULL) {
+		SMB_FREE(lbp, M_LBDATA);
+		return (ENOMEM);
+	}
+	lck_mtx_init(&lbp->lbp_lock, nbp_lck_group, nbp_lck_attr);
+	vcp->vc_tdata = lbp;
+	return (0);
+}
+
+static int
+smb_loop_done(struct smb_vc *vcp)
+{
+	struct lbpcb *lbp = vcp->vc_tdata;
+
+	if (lbp == NULL)
+		return (ENOTCONN);
+	smb_loop_disconnect(vcp);
+	thread_call_cancel_wait(lbp->lbp_call);
+	thread_call_free(lbp->lbp_call);
+	/* The vc_tdata is no longer valid */
+	vcp->vc_tdata = NULL;
+	lck_mtx_destroy(&lbp->lbp_lock, nbp_lck_group);
+	SMB_FREE(lbp, M_LBDATA);
+	return (0);
+}
+
+static int
+smb_loop_bind(struct smb_vc *vcp, struct sockaddr *sap)
+{
+#pragma unused(vcp, sap)
+	/* Nothing to bind to */
+	return (0);
+}
+
+static int
+smb_loop_connect(struct smb_vc *vcp, struct sockaddr *sap)
+{
+#pragma unused(sap)
+	struct lbpcb *lbp = vcp->vc_tdata;
+
+	if (lbp == NULL)
+		return (EINVAL);
+	lck_mtx_lock(&lbp->lbp_lock);
+	if (lbp->lbp_connected) {
+		lck_mtx_unlock(&lbp->lbp_lock);
+		return (EISCONN);
+	}
+	lbp->lbp_connected = 1;
+	lbp->lbp_link_free = 0;
+	lck_mtx_unlock(&lbp->lbp_lock);
+	return (0);
+}
+
+static int
+smb_loop_disconnect(struct smb_vc *vcp)
+{
+	struct lbpcb *lbp = vcp->vc_tdata;
+	struct lbreply *lrp;
+
+	if ((lbp == NULL) || !lbp->lbp_connected)
+		return (ENOTCONN);
+
+	lck_mtx_lock(&lbp->lbp_lock);
+	lbp->lbp_connected = 0;
+	/* Replies still on the wire are lost */
+	while ((lrp = TAILQ_FIRST(&lbp->lbp_replies)) != NULL) {
+		TAILQ_REMOVE(&lbp->lbp_replies, lrp, lr_link);
+		mbuf_freem(lrp->lr_m);
+		SMB_FREE(lrp, M_LBDATA);
+	}
+	lck_mtx_unlock(&lbp->lbp_lock);
+
+	thread_call_cancel_wait(lbp->lbp_call);
+	return (0);
+}
+
+static int
+smb_loop_send(struct smb_vc *vcp, mbuf_t m0)
+{
+	struct lbpcb *lbp = vcp->vc_tdata;
+	size_t len;
+
+	if ((lbp == NULL) || !lbp->lbp_connected) {
+		mbuf_freem(m0);
+		return (ENOTCONN);
+	}
+
+	len = m_fixhdr(m0);
+	OSAddAtomic64(len, (SInt64 *) &vcp->vc_bytes_sent);
+	OSIncrementAtomic64((SInt64 *) &vcp->vc_msgs_sent);
+	OSIncrementAtomic64((SInt64 *) &vcp->vc_send_calls);
+
+	smb_loop_respond(lbp, m0);
+	return (0);
+}
+
+/*
+ * The messages come in linked by mbuf_nextpkt, see smb_nbst_sendbatch
+ */
+static int
+smb_loop_sendbatch(struct smb_vc *vcp, mbuf_t m0)
+{
+	struct lbpcb *lbp = vcp->vc_tdata;
+	mbuf_t m, next;
+	size_t len;
+
+	for (m = m0; m != NULL; m = next) {
+		next = mbuf_nextpkt(m);
+		mbuf_setnextpkt(m, NULL);
+
+		if ((lbp == NULL) || !lbp->lbp_connected) {
+			mbuf_freem(m);
+			continue;
+		}
+
+		len = m_fixhdr(m);
+		OSAddAtomic64(len, (SInt64 *) &vcp->vc_bytes_sent);
+		OSIncrementAtomic64((SInt64 *) &vcp->vc_msgs_sent);
+
+		smb_loop_respond(lbp, m);
+	}
+
+	if ((lbp == NULL) || !lbp->lbp_connected)
+		return (ENOTCONN);
+	OSIncrementAtomic64((SInt64 *) &vcp->vc_send_calls);
+	return (0);
+}
+
+static int
+smb_loop_recv(struct smb_vc *vcp, mbuf_t *mpp)
+{
+	struct lbpcb *lbp = vcp->vc_tdata;
+	struct lbreply *lrp;
+	uint64_t now;
+
+	*mpp = NULL;
+	if (lbp == NULL)
+		return (ENOTCONN);
+
+	now = smb_loop_now();
+	lck_mtx_lock(&lbp->lbp_lock);
+	if (!lbp->lbp_connected) {
+		lck_mtx_unlock(&lbp->lbp_lock);
+		return (ENOTCONN);
+	}
+	lrp = TAILQ_FIRST(&lbp->lbp_replies);
+	if ((lrp == NULL) || (lrp->lr_ready > now)) {
+		/* Nothing has arrived yet */
+		smb_loop_schedule(lbp, now);
+		lck_mtx_unlock(&lbp->lbp_lock);
+		return (EWOULDBLOCK);
+	}
+	TAILQ_REMOVE(&lbp->lbp_replies, lrp, lr_link);
+	lck_mtx_unlock(&lbp->lbp_lock);
+
+	*mpp = lrp->lr_m;
+	SMB_FREE(lrp, M_LBDATA);
+
+	OSAddAtomic64(m_fixhdr(*mpp), (SInt64 *) &vcp->vc_bytes_recvd);
+	OSIncrementAtomic64((SInt64 *) &vcp->vc_msgs_recvd);
+	return (0);
+}
+
+static void
+smb_loop_timo(struct smb_vc *vcp)
+{
+	#pragma unused(vcp)
+	return;
+}
+
+static int
+smb_loop_getparam(struct smb_vc *vcp, int param, void *data)
+{
+	struct lbpcb *lbp = vcp->vc_tdata;
+
+	if (lbp == NULL)
+		return (EINVAL);
+	switch (param) {
+	    case SMBTP_SNDSZ:
+	    case SMBTP_RCVSZ:
+		*(uint32_t*)data = LB_SOCKBUF;
+		break;
+	    case SMBTP_TIMEOUT:
+		((struct timespec*)data)->tv_sec = SMB_NBTIMO;
+		((struct timespec*)data)->tv_nsec = 0;
+		break;
+	    case SMBTP_SELECTID:
+		*(void **)data = lbp->lbp_selectid;
+		break;
+	    case SMBTP_UPCALL:
+		*(void **)data = lbp->lbp_upcall;
+		break;
+	    default:
+		return (EINVAL);
+	}
+	return (0);
+}
+
+static int
+smb_loop_setparam(struct smb_vc *vcp, int param, void *data)
+{
+	struct lbpcb *lbp = vcp->vc_tdata;
+
+	if (lbp == NULL)
+		return (EINVAL);
+	switch (param) {
+	    case SMBTP_SELECTID:
+		lbp->lbp_selectid = data;
+		break;
+	    case SMBTP_UPCALL:
+		lbp->lbp_upcall = data;
+		break;
+	    default:
+		return (EINVAL);
+	}
+	return (0);
+}
+
+/*
+ * Check for fatal errors
+ */
+static int
+smb_loop_fatal(struct smb_vc *vcp, int error)
+{
+	struct lbpcb *lbp;
+
+	switch (error) {
+	    case ENOTCONN:
+	    case ENETRESET:
+	    case ECONNABORTED:
+	    case EPIPE:
+		return 1;
+	}
+	DBG_ASSERT(vcp);
+	lbp = vcp->vc_tdata;
+	if ((lbp == NULL) || !lbp->lbp_connected)
+		return 1;
+
+	return (0);
+}
+
+struct smb_tran_desc smb_tran_loop_desc = {
+	SMBT_LOOP,
+	smb_loop_create, smb_loop_done,
+	smb_loop_bind, smb_loop_connect, smb_loop_disconnect,
+	smb_loop_send, smb_loop_sendbatch, smb_loop_recv,
+	smb_loop_timo,
+	smb_loop_getparam, smb_loop_setparam,
+	smb_loop_fatal,
+	{NULL, NULL}
+};
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+#ifndef _NETSMB_SMB_TRANLOOP_H_
+#define	_NETSMB_SMB_TRANLOOP_H_
+
+#include <kern/thread_call.h>
+
+/*
+ * A reply from the loopback responder, waiting for its simulated arrival
+ */
+struct lbreply {
+	TAILQ_ENTRY(lbreply)	lr_link;
+	uint64_t		lr_ready;	/* uptime in usecs it can be received at */
+	mbuf_t			lr_m;
+};
+
+TAILQ_HEAD(lbreplyq, lbreply);
+
+/*
+ * loopback specific data
+ */
+struct lbpcb {
+	struct smb_vc *	lbp_vc;
+	int		lbp_connected;
+	struct lbreplyq	lbp_replies;	/* sorted by lr_ready */
+	uint64_t	lbp_link_free;	/* uptime in usecs the simulated link goes idle */
+	uint64_t	lbp_fid;	/* last file id the responder handed out */
+	thread_call_t	lbp_call;	/* tells the iod the next reply has arrived */
+	void *		lbp_selectid;
+	void		(* lbp_upcall)(void *);
+	lck_mtx_t	lbp_lock;
+};
+
+#define LB_SOCKBUF		(4 * 1024 * 1024)	/* what we claim the socket buffers are */
+#define LB_SESSION_ID	0x0000100000000001ULL
+#define LB_TREE_ID		1
+#define LB_SERVER_ADDR	0xc0000201	/* 192.0.2.1, TEST-NET-1 is never a real host */
+#define LB_NAME			"LOOPBACK"	/* NTLMSSP target and computer name */
+#define LB_NAME_LEN		(2 * (sizeof(LB_NAME) - 1))	/* in UTF-16 */
+
+/* Just enough NTLMSSP, MS-NLMP 2.2.1 */
+#define LB_NTLM_NEGOTIATE	1
+#define LB_NTLM_CHALLENGE	2
+#define LB_NTLM_HDRLEN		48	/* CHALLENGE_MESSAGE without a Version */
+#define LB_NTLM_INFO_LEN	((4 * 4) + (2 * LB_NAME_LEN) + 8)	/* 4 AV pairs */
+#define LB_NTLM_CHALLENGE_LEN	(LB_NTLM_HDRLEN + LB_NAME_LEN + LB_NTLM_INFO_LEN)
+#define LB_NTLM_FLAGS		(0x00000001 |	/* NEGOTIATE_UNICODE */ \
+							 0x00000004 |	/* REQUEST_TARGET */ \
+							 0x00000010 |	/* NEGOTIATE_SIGN */ \
+							 0x00000200 |	/* NEGOTIATE_NTLM */ \
+							 0x00008000 |	/* NEGOTIATE_ALWAYS_SIGN */ \
+							 0x00020000 |	/* TARGET_TYPE_SERVER */ \
+							 0x00080000 |	/* NEGOTIATE_EXTENDED_SESSIONSECURITY */ \
+							 0x00800000 |	/* NEGOTIATE_TARGET_INFO */ \
+							 0x20000000 |	/* NEGOTIATE_128 */ \
+							 0x40000000 |	/* NEGOTIATE_KEY_EXCH */ \
+							 0x80000000)	/* NEGOTIATE_56 */
+
+extern struct smb_tran_desc smb_tran_loop_desc;
+
+int smb_tran_loop_addr(struct sockaddr *sap);
+
+#endif /* !_NETSMB_SMB_TRANLOOP_H_ */
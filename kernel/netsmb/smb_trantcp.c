@@ -42,6 +42,7 @@
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <sys/sysctl.h>
+#include <libkern/OSAtomic.h>
 
 #include <net/if.h>
 #include <net/route.h>
@@ -62,6 +63,7 @@
 #include <netsmb/smb_tran.h>
 #include <netsmb/smb_trantcp.h>
 #include <netsmb/smb_subr.h>
+#include <netsmb/smb_packets_2.h>
 
 #include <netsmb/smb_sleephandler.h>
 
@@ -74,6 +76,14 @@ SYSCTL_DECL(_net_smb_fs);
 SYSCTL_INT(_net_smb_fs, OID_AUTO, tcpsndbuf, CTLFLAG_RW, &smb_tcpsndbuf, 0, "");
 SYSCTL_INT(_net_smb_fs, OID_AUTO, tcprcvbuf, CTLFLAG_RW, &smb_tcprcvbuf, 0, "");
 
+/* 0 means always read message bodies in nbp_rcvchunk slices */
+static int smb_tcp_rcv_adaptive = 1;
+static uint64_t smb_tcp_rcv_calls = 0;	/* sock_receivembuf calls for message bodies */
+static uint64_t smb_tcp_rcv_sleeps = 0;	/* times we waited on the upcall for more */
+SYSCTL_INT(_net_smb_fs, OID_AUTO, tcp_rcv_adaptive, CTLFLAG_RW, &smb_tcp_rcv_adaptive, 0, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, tcp_rcv_calls, CTLFLAG_RD, &smb_tcp_rcv_calls, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, tcp_rcv_sleeps, CTLFLAG_RD, &smb_tcp_rcv_sleeps, "");
+
 static int nbssn_recv(struct nbpcb *nbp, mbuf_t *mpp, int *lenp, uint8_t *rpcodep, 
 					  struct timespec *wait_time);
 static int  smb_nbst_disconnect(struct smb_vc *vcp);
@@ -104,6 +114,9 @@ nb_upcall(socket_t so, void *arg, int waitflag)
 	lck_mtx_lock(&nbp->nbp_lock);
 
 	nbp->nbp_flags |= NBF_UPCALLED;
+	/* nbssn_recv is waiting for the rest of a message */
+	if (nbp->nbp_flags & NBF_RCVWAIT)
+		wakeup(&nbp->nbp_flags);
 	/*
 	 * If there's an upcall, pass it the selectid,
 	 * otherwise wakeup on the selectid
@@ -167,6 +180,7 @@ static int tcp_connect(struct nbpcb *nbp, struct sockaddr *to)
 		return (error);
     
 	nbp->nbp_tso = so;
+	nbp->nbp_rcvtotal = 0;	/* New connection, back to slow start */
 	tv.tv_sec = SMBSBTIMO;
 	tv.tv_usec = 0;
 	error = sock_setsockopt(so, SOL_SOCKET, SO_RCVTIMEO, &tv, (int)sizeof(tv));
@@ -458,16 +472,175 @@ static int nbssn_recvhdr(struct nbpcb *nbp, uint32_t *lenp, uint8_t *rpcodep,
 	return (0);
 }
 
+/*
+ * sock_receivembuf, or if there is a uio, sock_receive straight into the
+ * uio's current iovec. *recvdlenp is the most to read going in and what was
+ * read coming out.
+ */
+static int
+nbssn_receive(socket_t so, mbuf_t *mp, uio_t uio, int flags, size_t *recvdlenp)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	int error;
+
+	if (uio == NULL)
+		return (sock_receivembuf(so, NULL, mp, flags, recvdlenp));
+
+	/* A 0 byte sock_receive would look like the other end closing */
+	while ((uio_resid(uio) > 0) && (uio_curriovlen(uio) == 0))
+		uio_update(uio, 0);
+
+	bzero(&msg, sizeof(msg));
+	iov.iov_base = CAST_DOWN(void *, uio_curriovbase(uio));
+	iov.iov_len = MIN(*recvdlenp, (size_t)uio_curriovlen(uio));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	*recvdlenp = 0;
+	error = sock_receive(so, &msg, flags, recvdlenp);
+	if (*recvdlenp != 0) {
+		/* Got some, any error will show up again on the next call */
+		uio_update(uio, *recvdlenp);
+		error = 0;
+	}
+	return (error);
+}
+
+/*
+ * Read the next len bytes of the message nbssn_recv is working on. They get
+ * glued on the end of *mpp, or if uio is not NULL, copied straight into the
+ * buffer it describes. See nbssn_recv for adaptive.
+ */
+static int
+nbssn_recvdata(struct nbpcb *nbp, size_t len, mbuf_t *mpp, uio_t uio,
+			   int adaptive)
+{
+	socket_t so = nbp->nbp_tso;
+	mbuf_t tm;
+	size_t recvdlen, resid;
+	int32_t error = 0;
+
+	resid = len;
+	while (resid != 0) {
+		struct timespec tstart, tend;
+		tm = NULL;
+		/*
+		 * We use to spin until we got a hard error, we no longer wait forever.
+		 * We now limit how long we will block receiving any message. This timer only 
+		 * starts after we have read the 4 byte header length field. We then try to read
+		 * the data in 8K chunks, if any read takes longer that 15 seconds we break the
+		 * connection and give up. If we went to sleep then we reset our start timer to when we
+		 * woke up. Now for the reason behind the fix. We have the message length, but looks 
+		 * like only part of the message has made it in. We went to sleep and the server 
+		 * broke the connect while we were still a sleep. Looks like we got the first 
+		 * ethernet packet but not the rest. We are in a loop waiting for the rest of the 
+		 * message. Since we can't send in this state there is no way for us to know that 
+		 * the connect is really down. 
+		 */
+		nanouptime(&tstart);
+		do {
+			OSIncrementAtomic64((SInt64 *) &smb_tcp_rcv_calls);
+			if (adaptive) {
+				lck_mtx_lock(&nbp->nbp_lock);
+				nbp->nbp_flags &= ~NBF_UPCALLED;
+				lck_mtx_unlock(&nbp->nbp_lock);
+				
+				recvdlen = resid;
+				error = nbssn_receive(so, &tm, uio, MSG_DONTWAIT, &recvdlen);
+				if (error == EWOULDBLOCK) {
+					/* Nothing queued, wait for the upcall or SMBSBTIMO */
+					struct timespec sleep_time = {SMBSBTIMO, 0};
+					
+					lck_mtx_lock(&nbp->nbp_lock);
+					if (!(nbp->nbp_flags & NBF_UPCALLED)) {
+						OSIncrementAtomic64((SInt64 *) &smb_tcp_rcv_sleeps);
+						nbp->nbp_flags |= NBF_RCVWAIT;
+						msleep(&nbp->nbp_flags, &nbp->nbp_lock, PWAIT, 
+							   "nbssn_recv", &sleep_time);
+						nbp->nbp_flags &= ~NBF_RCVWAIT;
+					}
+					lck_mtx_unlock(&nbp->nbp_lock);
+					
+					if (!sock_isconnected(so)) {
+						nbp->nbp_state = NBST_CLOSED;
+						error = EPIPE;
+						break;
+					}
+					error = EAGAIN;
+				}
+			}
+			else {
+				recvdlen = MIN(resid, nbp->nbp_rcvchunk);
+				error = nbssn_receive(so, &tm, uio, MSG_WAITALL, &recvdlen);
+			}
+			if (error == EAGAIN) {
+				nanouptime(&tend);
+				/* We fell asleep reset our timer to the wake up timer */
+				if (tstart.tv_sec < gWakeTime.tv_sec)
+					tstart.tv_sec = gWakeTime.tv_sec;
+					/* Ok we have tried hard enough just break the connection and give up. */
+				if (tend.tv_sec > (tstart.tv_sec + SMB_SB_RCVTIMEO)) {
+					error = EPIPE;					
+					SMBERROR("Breaking connection, sock_receivembuf blocked for %d\n", (int)(tend.tv_sec - tstart.tv_sec));
+				}
+			}
+		} while ((error == EAGAIN) || (error == EINTR) || (error == ERESTART));
+		/*
+		 * If we didn't get an error and recvdlen is zero then we have reached
+		 * EOF. So the socket has the SS_CANTRCVMORE flag set. This means the other 
+		 * side has closed their side of the connection.
+		 */
+		if ((error == 0) && (recvdlen == 0) && resid) {
+			SMBWARNING("Server closed their side of the connection.\n");
+			error = EPIPE;
+		}
+		/*
+		 * This should never happen, someday should we make it just
+		 * a debug assert.
+		 */
+		if ((error == 0) && (recvdlen > resid)) {
+			SMBERROR("Got more data than we asked for!\n");
+			if (tm)
+				mbuf_freem(tm);
+			error = EPIPE;
+		}
+		if (error)
+			return (error);
+		
+		resid -= recvdlen;
+		nbp->nbp_rcvtotal += recvdlen;
+		if (uio != NULL) {
+			/* Already in the caller's buffer */
+			continue;
+		}
+		/*
+		 * Append received chunk to previous chunk. Just glue 
+		 * the new chain on the end. Consumer will pullup as required.
+		 */
+		if (!*mpp) {
+			*mpp = (mbuf_t )tm;
+            m_fixhdr(*mpp); /* Work around <15114764> */
+		} else if (tm) {
+			mbuf_cat_internal(*mpp, (mbuf_t )tm);
+            m_fixhdr(*mpp); /* Work around <15114764> */
+		}
+	}
+	return (0);
+}
+
 static int nbssn_recv(struct nbpcb *nbp, mbuf_t *mpp, int *lenp, uint8_t *rpcodep, 
 					  struct timespec *wait_time)
 {
 	socket_t so = nbp->nbp_tso;
 	mbuf_t m;
-	mbuf_t tm;
 	uint8_t rpcode;
 	uint32_t len;
 	int32_t error;
-	size_t recvdlen, resid;
+	size_t resid;
+	int adaptive;
+	struct smb_rq *rqp;
+	uio_t uio;
+	uint32_t place_len;
 
 	if (so == NULL)
 		return (ENOTCONN);
@@ -497,76 +670,51 @@ static int nbssn_recv(struct nbpcb *nbp, mbuf_t *mpp, int *lenp, uint8_t *rpcode
 		 * Instead, we never request more than NB_SORECEIVE_CHUNK
 		 * bytes at a time, resulting in an ack being pushed by
 		 * the TCP code at the completion of each call.
+		 *
+		 * Once the connection is past slow start (NB_RCV_WARMUP) we
+		 * stop blocking in each slice. We take everything the socket
+		 * has queued up to the rest of the message in one call, and when
+		 * it runs dry sleep until nb_upcall says more has arrived. Reading
+		 * as soon as data shows up keeps the window open without the
+		 * small slices, so an 8 MB read is a handful of calls.
 		 */
+		adaptive = (smb_tcp_rcv_adaptive && (nbp->nbp_rcvtotal >= NB_RCV_WARMUP));
 		resid = len;
-		while (resid != 0) {
-			struct timespec tstart, tend;
-			tm = NULL;
-			/*
-			 * We use to spin until we got a hard error, we no longer wait forever.
-			 * We now limit how long we will block receiving any message. This timer only 
-			 * starts after we have read the 4 byte header length field. We then try to read
-			 * the data in 8K chunks, if any read takes longer that 15 seconds we break the
-			 * connection and give up. If we went to sleep then we reset our start timer to when we
-			 * woke up. Now for the reason behind the fix. We have the message length, but looks 
-			 * like only part of the message has made it in. We went to sleep and the server 
-			 * broke the connect while we were still a sleep. Looks like we got the first 
-			 * ethernet packet but not the rest. We are in a loop waiting for the rest of the 
-			 * message. Since we can't send in this state there is no way for us to know that 
-			 * the connect is really down. 
-			 */
-			nanouptime(&tstart);
-			do {
-				recvdlen = MIN(resid, nbp->nbp_rcvchunk);
-				error = sock_receivembuf(so, NULL, &tm, MSG_WAITALL, &recvdlen);
-				if (error == EAGAIN) {
-					nanouptime(&tend);
-					/* We fell asleep reset our timer to the wake up timer */
-					if (tstart.tv_sec < gWakeTime.tv_sec)
-						tstart.tv_sec = gWakeTime.tv_sec;
-						/* Ok we have tried hard enough just break the connection and give up. */
-					if (tend.tv_sec > (tstart.tv_sec + SMB_SB_RCVTIMEO)) {
-						error = EPIPE;					
-						SMBERROR("Breaking connection, sock_receivembuf blocked for %d\n", (int)(tend.tv_sec - tstart.tv_sec));
-					}
-				}
-			} while ((error == EAGAIN) || (error == EINTR) || (error == ERESTART));
-			/*
-			 * If we didn't get an error and recvdlen is zero then we have reached
-			 * EOF. So the socket has the SS_CANTRCVMORE flag set. This means the other 
-			 * side has closed their side of the connection.
-			 */
-			if ((error == 0) && (recvdlen == 0) && resid) {
-				SMBWARNING("Server closed their side of the connection.\n");
-				error = EPIPE;
-			}
-			/*
-			 * This should never happen, someday should we make it just
-			 * a debug assert.
-			 */
-			if ((error == 0) && (recvdlen > resid)) {
-				SMBERROR("Got more data than we asked for!\n");
-				if (tm)
-					mbuf_freem(tm);
-				error = EPIPE;
-			}
+
+		/*
+		 * While some Read is set up to have its data go straight to its
+		 * buffer, read the SMB 2/3 header and the Read response header on
+		 * their own first. If it is the reply to that Read, the data goes
+		 * into the buffer instead of into mbufs, and only the headers go
+		 * up to the iod. See smb_iod_rq_place.
+		 */
+		if ((rpcode == NB_SSN_MESSAGE) &&
+		    (nbp->nbp_state == NBST_SESSION) &&
+		    (nbp->nbp_vc != NULL) &&
+		    (nbp->nbp_vc->vc_place_pending > 0) &&
+		    (len > SMB2_HDRLEN + SMB2_READ_RSP_HDRLEN)) {
+			error = nbssn_recvdata(nbp, SMB2_HDRLEN + SMB2_READ_RSP_HDRLEN,
+								   &m, NULL, adaptive);
 			if (error)
 				goto out;
-			
-			resid -= recvdlen;
-			/*
-			 * Append received chunk to previous chunk. Just glue 
-			 * the new chain on the end. Consumer will pullup as required.
-			 */
-			if (!m) {
-				m = (mbuf_t )tm;
-                m_fixhdr(m); /* Work around <15114764> */
-			} else if (tm) {
-				mbuf_cat_internal(m, (mbuf_t )tm);
-                m_fixhdr(m); /* Work around <15114764> */
+			resid -= SMB2_HDRLEN + SMB2_READ_RSP_HDRLEN;
+
+			rqp = smb_iod_rq_place(nbp->nbp_vc, m, len, &uio, &place_len);
+			if (rqp != NULL) {
+				error = nbssn_recvdata(nbp, place_len, NULL, uio, adaptive);
+				smb_iod_rq_place_done(rqp, uio, place_len, error);
+				if (error)
+					goto out;
+				resid -= place_len;
 			}
 		}
 
+		if (resid != 0) {
+			error = nbssn_recvdata(nbp, resid, &m, NULL, adaptive);
+			if (error)
+				goto out;
+		}
+
 		/*
 		 * If it's a keepalive, discard any data in it
 		 * (there's not supposed to be any, but that
@@ -798,6 +946,7 @@ static int
 smb_nbst_send(struct smb_vc *vcp, mbuf_t m0)
 {
 	struct nbpcb *nbp = vcp->vc_tdata;
+	size_t len;
 	int error;
 
 	/* Should never happen, but just in case */
@@ -810,8 +959,14 @@ smb_nbst_send(struct smb_vc *vcp, mbuf_t m0)
     /* Add in the NetBIOS 4 byte header */
 	if (mbuf_prepend(&m0, 4, MBUF_WAITOK))
 		return (ENOBUFS);
-	nb_sethdr(nbp, m0, NB_SSN_MESSAGE, (uint32_t)(m_fixhdr(m0) - 4));
+	len = m_fixhdr(m0);
+	nb_sethdr(nbp, m0, NB_SSN_MESSAGE, (uint32_t)(len - 4));
 	error = sock_sendmbuf(nbp->nbp_tso, NULL, (mbuf_t)m0, 0, NULL);
+	if (!error) {
+		OSAddAtomic64(len, (SInt64 *) &vcp->vc_bytes_sent);
+		OSIncrementAtomic64((SInt64 *) &vcp->vc_msgs_sent);
+		OSIncrementAtomic64((SInt64 *) &vcp->vc_send_calls);
+	}
 	return (error);
 abort:
 	if (m0)
@@ -819,6 +974,70 @@ abort:
 	return (error);
 }
 
+/*
+ * Send several messages with one socket write. The messages come in linked
+ * by mbuf_nextpkt, each one gets its own NetBIOS header and they all go
+ * out as one chain.
+ */
+static int
+smb_nbst_sendbatch(struct smb_vc *vcp, mbuf_t m0)
+{
+	struct nbpcb *nbp = vcp->vc_tdata;
+	mbuf_t m, next, chain = NULL;
+	size_t len, total = 0;
+	int64_t nmsgs = 0;
+	int error;
+
+	/* Should never happen, but just in case */
+	DBG_ASSERT(nbp);
+	if ((nbp == NULL) || (nbp->nbp_state != NBST_SESSION)) {
+		error = ENOTCONN;
+		goto abort;
+	}
+	
+	for (m = m0; m != NULL; m = next) {
+		next = mbuf_nextpkt(m);
+		mbuf_setnextpkt(m, NULL);
+		
+		/* Add in the NetBIOS 4 byte header */
+		if (mbuf_prepend(&m, 4, MBUF_WAITOK)) {
+			m0 = next;
+			error = ENOBUFS;
+			goto abort;
+		}
+		len = m_fixhdr(m);
+		nb_sethdr(nbp, m, NB_SSN_MESSAGE, (uint32_t)(len - 4));
+		total += len;
+		nmsgs++;
+		
+		if (chain == NULL) {
+			chain = m;
+		}
+		else {
+			chain = mbuf_concatenate(chain, m);
+		}
+	}
+	m_fixhdr(chain);
+	
+	error = sock_sendmbuf(nbp->nbp_tso, NULL, chain, 0, NULL);
+	if (!error) {
+		OSAddAtomic64(total, (SInt64 *) &vcp->vc_bytes_sent);
+		OSAddAtomic64(nmsgs, (SInt64 *) &vcp->vc_msgs_sent);
+		OSIncrementAtomic64((SInt64 *) &vcp->vc_send_calls);
+	}
+	return (error);
+abort:
+	/* Free what we already chained up and whatever is left in the list */
+	if (chain)
+		mbuf_freem(chain);
+	for (m = m0; m != NULL; m = next) {
+		next = mbuf_nextpkt(m);
+		mbuf_setnextpkt(m, NULL);
+		mbuf_freem(m);
+	}
+	return (error);
+}
+
 
 static int
 smb_nbst_recv(struct smb_vc *vcp, mbuf_t *mpp)
@@ -844,6 +1063,10 @@ smb_nbst_recv(struct smb_vc *vcp, mbuf_t *mpp)
 	error = nbssn_recv(nbp, mpp, &rplen, &rpcode, NULL);
     
     if (!error) {
+        /* rplen does not include the NetBIOS 4 byte header */
+        OSAddAtomic64(rplen + 4, (SInt64 *) &vcp->vc_bytes_recvd);
+        OSIncrementAtomic64((SInt64 *) &vcp->vc_msgs_recvd);
+
         /* Handle case when first mbuf is zero-length */
         error = mbuf_pullup(mpp, 1);
     }
@@ -956,7 +1179,7 @@ struct smb_tran_desc smb_tran_nbtcp_desc = {
 	SMBT_NBTCP,
 	smb_nbst_create, smb_nbst_done,
 	smb_nbst_bind, smb_nbst_connect, smb_nbst_disconnect,
-	smb_nbst_send, smb_nbst_recv,
+	smb_nbst_send, smb_nbst_sendbatch, smb_nbst_recv,
 	smb_nbst_timo,
 	smb_nbst_getparam, smb_nbst_setparam,
 	smb_nbst_fatal,
@@ -58,6 +58,7 @@ enum nbstate {
 #define	NBF_RECVLOCK	0x0004
 #define	NBF_UPCALLED	0x0010
 #define	NBF_NETBIOS		0x0020	
+#define	NBF_RCVWAIT		0x0040		/* nbssn_recv sleeping on nbp_flags */
 
 
 /*
@@ -75,6 +76,7 @@ struct nbpcb {
 	uint32_t		nbp_sndbuf;
 	uint32_t		nbp_rcvbuf;
 	uint32_t		nbp_rcvchunk;
+	uint64_t		nbp_rcvtotal;	/* body bytes read since connect */
 	void *		nbp_selectid;
 	void		(* nbp_upcall)(void *);
 	lck_mtx_t	nbp_lock;
@@ -90,6 +92,13 @@ struct nbpcb {
  */
 #define NB_SORECEIVE_CHUNK	(8 * 1024)
 
+/*
+ * Once this much has been read on the connection the sender is well past
+ * slow start. From then on nbssn_recv drains whatever the socket has without
+ * blocking, and sleeps for the upcall when it runs dry.
+ */
+#define NB_RCV_WARMUP		(1024 * 1024)
+
 extern lck_grp_attr_t *nbp_grp_attr;
 extern lck_grp_t *nbp_lck_group;
 extern lck_attr_t *nbp_lck_attr;
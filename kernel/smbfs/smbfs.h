@@ -149,6 +149,18 @@ struct UniqueSMBShareID {
 #define smbfsGetVCSockaddrFSCTL			_IOR('z', 20, struct sockaddr_storage)
 #define smbfsGetVCSockaddrFSCTL_BASECMD		IOCBASECMD(smbfsGetVCSockaddrFSCTL)
 
+/*
+ * Attribute cache timeout policies, picked per mount with attr_cache_policy.
+ * Whatever the policy, the timeout stays between attr_cache_min and
+ * attr_cache_max.
+ */
+enum {
+	SMBFS_ATTRCACHE_MTIME = 0,	/* longer the older the file is, like NFS */
+	SMBFS_ATTRCACHE_FIXED = 1,	/* always attr_cache_max */
+	SMBFS_ATTRCACHE_ADAPTIVE = 2,	/* shorter the more change notifies we see */
+	SMBFS_ATTRCACHE_NPOLICIES
+};
+
 /* Layout of the mount control block for an smb file system. */
 struct smb_mount_args {
 	int32_t		version;
@@ -167,6 +179,9 @@ struct smb_mount_args {
 	char		volume_name[MAXPATHLEN] __attribute((aligned(8))); /* The starting path they want used for the mount */
 	uint64_t	ioc_reserved __attribute((aligned(8))); /* Force correct size always */
 	int32_t		max_resp_timeout;
+	int32_t		attr_cache_policy;	/* SMBFS_ATTRCACHE_* */
+	int32_t		attr_cache_min;		/* seconds, zero means SMB_MINATTRTIMO */
+	int32_t		attr_cache_max;		/* seconds, zero means SMB_MAXATTRTIMO */
 };
 
 #define SMBFS_SYSCTL_REMOUNT 1
@@ -245,6 +260,16 @@ struct smbfs_notify_change;
 #define SVRMSG_RCVD_GOING_DOWN	0x0000000000000001
 #define SVRMSG_RCVD_SHUTDOWN_CANCEL	0x0000000000000002
 
+/*
+ * The node hash table starts with SMBFS_HASH_INITSIZE buckets and doubles
+ * whenever the average chain gets longer than SMBFS_HASH_MAXLOAD. Buckets are
+ * protected by SMBFS_HASH_NLOCKS striped locks, bucket n uses lock
+ * n & (SMBFS_HASH_NLOCKS - 1) which stays the same after the table grows.
+ */
+#define SMBFS_HASH_INITSIZE	1024
+#define SMBFS_HASH_MAXLOAD	2
+#define SMBFS_HASH_NLOCKS	64
+
 struct smbmount {
 	uint64_t		ntwrk_uid;
 	uint64_t		ntwrk_gid;
@@ -259,19 +284,36 @@ struct smbmount {
 	struct smb_share * 	sm_share;
 	lck_rw_t		sm_rw_sharelock;
 	int			sm_flags;
-	lck_mtx_t		*sm_hashlock;
+	lck_rw_t		*sm_hash_rwlock;	/* exclusive to resize or walk the whole table */
+	lck_mtx_t		*sm_hashlock[SMBFS_HASH_NLOCKS];	/* striped bucket locks */
 	LIST_HEAD(smbnode_hashhead, smbnode) *sm_hash;
-	u_long			sm_hashlen;
+	u_long			sm_hashlen;		/* hash mask, number of buckets - 1 */
+	SInt32			sm_hashcnt;		/* nodes in the hash table */
 	uint32_t		sm_status; /* status bits for this mount */
 	time_t			sm_statfstime; /* sm_statfsbuf cache time */
 	lck_mtx_t		sm_statfslock; /* sm_statsbuf lock */
 	struct vfsstatfs	sm_statfsbuf; /* cached statfs data */
 	lck_mtx_t		sm_reclaim_lock; /* mount reclaim lock */
 	void			*notify_thread;	/* pointer to the notify thread structure */
+	void			*sm_aio;	/* async strategy completion thread */
 	int32_t			tooManyNotifies;
 	lck_mtx_t		sm_svrmsg_lock;		/* protects svrmsg fields */
 	uint64_t		sm_svrmsg_pending;	/* svrmsg replies pending (bits defined above) */
 	uint32_t		sm_svrmsg_shutdown_delay;  /* valid when SVRMSG_GOING_DOWN is set */
+	SInt64			sm_lease_attr_hits;	/* attr lookups answered under a read lease */
+	SInt64			sm_lease_open_hits;	/* opens that reused a deferred close */
+	SInt64			sm_lease_breaks;	/* lease breaks on the shared open */
+	struct smb_lat_hist	sm_vop_stats[SMBFS_VOP_MAX];	/* latency by VNOP */
+	uint32_t		sm_attr_policy;		/* SMBFS_ATTRCACHE_* */
+	time_t			sm_attr_min;		/* attribute cache timeout bounds */
+	time_t			sm_attr_max;
+	SInt64			sm_attr_changes;	/* change notifies and lease breaks seen */
+	SInt64			sm_attr_rate_changes;	/* sm_attr_changes at sm_attr_rate_time */
+	SInt64			sm_attr_rate_time;	/* uptime the change rate was last sampled */
+	uint32_t		sm_attr_rate;		/* changes per minute, smoothed */
+	SInt64			sm_attr_hits;		/* attr lookups answered from the cache */
+	SInt64			sm_attr_misses;		/* attr cache was invalidated */
+	SInt64			sm_attr_expired;	/* attr cache timed out */
 };
 
 #define VFSTOSMBFS(mp)		((struct smbmount *)(vfs_fsprivate(mp)))
@@ -308,6 +350,8 @@ int smbfs_fsync(struct smb_share *share, vnode_t vp, int waitfor, int ubc_flags,
  */
 void smbfs_notify_change_create_thread(struct smbmount *smp);
 void smbfs_notify_change_destroy_thread(struct smbmount *smp);
+void smbfs_aio_create_thread(struct smbmount *smp);
+void smbfs_aio_destroy_thread(struct smbmount *smp);
 int smbfs_start_change_notify(struct smb_share *share, struct smbnode *np, 
 			      vfs_context_t context, int *releaseLock);
 int smbfs_start_svrmsg_notify(struct smbmount *smp);
@@ -316,6 +360,11 @@ int smbfs_stop_change_notify(struct smb_share *share, struct smbnode *np,
 int smbfs_stop_svrmsg_notify(struct smbmount *smp);
 void smbfs_restart_change_notify(struct smb_share *share, struct smbnode *np, 
 				 vfs_context_t context);
+int smbfs_notify_lease_break(struct smbmount *smp, uint64_t lease_key_hi,
+			     uint64_t lease_key_low, uint32_t flags,
+			     uint32_t new_lease_state);
+int smbfs_notify_lease_close_retry(struct smbmount *smp, uint64_t lease_key_hi,
+				   uint64_t lease_key_low);
 
 #define SMB_IOMIN (1024 * 1024)
 #define SMB_IOMAXCACHE (SMB_IOMIN * 4)
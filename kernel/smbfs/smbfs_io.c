@@ -43,6 +43,8 @@
 #include <sys/dirent.h>
 #include <sys/sysctl.h>
 #include <sys/kauth.h>
+#include <sys/buf.h>
+#include <libkern/OSAtomic.h>
 
 #include <sys/smb_apple.h>
 #include <netsmb/smb.h>
@@ -64,6 +66,17 @@ static int smbfs_fastlookup = 1;
 SYSCTL_DECL(_net_smb_fs);
 SYSCTL_INT(_net_smb_fs, OID_AUTO, fastlookup, CTLFLAG_RW, &smbfs_fastlookup, 0, "");
 
+/* Max number of entries we will cache per directory, zero turns it off */
+static uint32_t smbfs_dircache_max = 16384;
+SYSCTL_INT(_net_smb_fs, OID_AUTO, dircache_max, CTLFLAG_RW, &smbfs_dircache_max, 0, "");
+
+/* Issue async cluster I/O from VNOP_STRATEGY without waiting on the network */
+static int smbfs_async_strategy = 1;
+SYSCTL_INT(_net_smb_fs, OID_AUTO, async_strategy, CTLFLAG_RW, &smbfs_async_strategy, 0, "");
+
+#define SMB_DIRCACHE_INIT_ENTRIES 128
+#define SMB_DIRCACHE_INIT_NAMES (SMB_DIRCACHE_INIT_ENTRIES * 32)
+
 /*
  * In the future I would like to move all the read directory code into
  * its own file, but for now lets leave it here.
@@ -166,6 +179,171 @@ done:
 	return error;
 }
 
+/*
+ * Free the directory entry cache. The calling routine must hold the
+ * smbnode lock exclusive.
+ */
+void
+smbfs_dircache_free(struct smbnode *dnp)
+{
+	struct smbfs_dircache *dcp = dnp->d_dcache;
+	
+	if (dcp == NULL)
+		return;
+	dnp->d_dcache = NULL;
+	if (dcp->dc_entries)
+		SMB_FREE(dcp->dc_entries, M_TEMP);
+	if (dcp->dc_names)
+		SMB_FREE(dcp->dc_names, M_TEMP);
+	SMB_FREE(dcp, M_TEMP);
+}
+
+/*
+ * Can we still use the cached entries? Any local change to the directory,
+ * a change notification or a directory lease break bumps d_changecnt. If we
+ * have no read lease and no one is getting change notifications on the 
+ * directory, then we only trust it as long as we would trust the directory's
+ * attributes.
+ */
+static int
+smbfs_dircache_valid(struct smbnode *dnp, struct smbfs_dircache *dcp)
+{
+	struct timespec ts;
+	time_t attrtimeo;
+	
+	if (dcp->dc_changecnt != dnp->d_changecnt)
+		return FALSE;
+	
+	if (dnp->d_leaseState & SMB2_LEASE_READ_CACHING)
+		return TRUE;
+	
+	if (dnp->d_kqrefcnt && dnp->d_fid && !dnp->d_needReopen)
+		return TRUE;
+	
+	SMB_CACHE_TIME(ts, dnp, attrtimeo);
+	if ((ts.tv_sec - dcp->dc_timestamp.tv_sec) > attrtimeo)
+		return FALSE;
+	return TRUE;
+}
+
+/*
+ * Grow one of the cache arrays, there is no realloc.
+ */
+static int
+smbfs_dircache_grow(void **bufp, size_t cur_len, size_t new_len)
+{
+	void *newbuf;
+	
+	SMB_MALLOC(newbuf, void *, new_len, M_TEMP, M_WAITOK);
+	if (newbuf == NULL)
+		return ENOMEM;
+	if (*bufp) {
+		bcopy(*bufp, newbuf, cur_len);
+		SMB_FREE(*bufp, M_TEMP);
+	}
+	*bufp = newbuf;
+	return 0;
+}
+
+/*
+ * Add the entry at readdir offset dnp->d_offset to the end of the cache. We
+ * only cache a directory we are enumerating from the start and entries have
+ * to come in order, otherwise stop caching. Running out of memory or going
+ * over smbfs_dircache_max just means the cache only has the first part of
+ * the directory.
+ */
+static void
+smbfs_dircache_add(struct smbnode *dnp, const char *name, size_t nmlen,
+				   uint8_t dtype, uint64_t ino)
+{
+	struct smbfs_dircache *dcp = dnp->d_dcache;
+	struct smbfs_dircache_entry *dep;
+	size_t new_len;
+	
+	if (dcp == NULL) {
+		if ((dnp->d_offset != 2) || (smbfs_dircache_max == 0))
+			return;
+		SMB_MALLOC(dcp, struct smbfs_dircache *, sizeof(*dcp), M_TEMP, 
+				   M_WAITOK | M_ZERO);
+		if (dcp == NULL)
+			return;
+		dcp->dc_changecnt = dnp->d_changecnt;
+		nanouptime(&dcp->dc_timestamp);
+		dnp->d_dcache = dcp;
+	}
+	
+	if (dcp->dc_complete || ((dcp->dc_count + 2) != dnp->d_offset) || 
+		(dcp->dc_count >= smbfs_dircache_max))
+		return;
+	
+	if (dcp->dc_count == dcp->dc_max) {
+		new_len = (dcp->dc_max) ? dcp->dc_max * 2 : SMB_DIRCACHE_INIT_ENTRIES;
+		if (smbfs_dircache_grow((void **)&dcp->dc_entries, 
+								dcp->dc_max * sizeof(*dep),
+								new_len * sizeof(*dep)))
+			return;
+		dcp->dc_max = (uint32_t)new_len;
+	}
+	
+	if ((dcp->dc_names_len + nmlen) > dcp->dc_names_max) {
+		new_len = (dcp->dc_names_max) ? dcp->dc_names_max * 2 : SMB_DIRCACHE_INIT_NAMES;
+		while (new_len < (dcp->dc_names_len + nmlen))
+			new_len *= 2;
+		if (smbfs_dircache_grow((void **)&dcp->dc_names, dcp->dc_names_len, 
+								new_len))
+			return;
+		dcp->dc_names_max = new_len;
+	}
+	
+	dep = &dcp->dc_entries[dcp->dc_count];
+	dep->de_ino = ino;
+	dep->de_nameoff = (uint32_t)dcp->dc_names_len;
+	dep->de_namelen = (uint16_t)nmlen;
+	dep->de_type = dtype;
+	bcopy(name, dcp->dc_names + dcp->dc_names_len, nmlen);
+	dcp->dc_names_len += nmlen;
+	dcp->dc_count++;
+}
+
+/*
+ * Fill the users buffer from the cache starting at *offset. Returns zero when
+ * we run out of cached entries and need to go to the server, EJUSTRETURN
+ * when the users buffer is full and ENOENT when we have returned the last
+ * entry in the directory.
+ */
+static int
+smbfs_dircache_readdir(struct smbfs_dircache *dcp, uio_t uio, int flags, 
+					   off_t *offset, int32_t *numdirent)
+{
+	union {
+		struct dirent de32;
+		struct direntry de64;		
+	}de;
+	struct smbfs_dircache_entry *dep;
+	uint32_t delen;
+	int error;
+	
+	while ((*offset - 2) < dcp->dc_count) {
+		if (uio_resid(uio) == 0)
+			return EJUSTRETURN;
+		
+		dep = &dcp->dc_entries[*offset - 2];
+		delen = smbfs_fill_direntry(&de, dcp->dc_names + dep->de_nameoff, 
+									dep->de_namelen, dep->de_type, 
+									dep->de_ino, flags);
+		if (delen) {
+			if (uio_resid(uio) < delen)
+				return EJUSTRETURN;
+			error = uiomove((void *)&de, delen, uio);
+			if (error)
+				return error;
+			(*numdirent)++;
+		}
+		(*offset)++;
+	}
+	return (dcp->dc_complete) ? ENOENT : 0;
+}
+
 int 
 smbfs_readvdir(vnode_t dvp, uio_t uio, vfs_context_t context, int flags, 
 			   int32_t *numdirent)
@@ -180,30 +358,16 @@ smbfs_readvdir(vnode_t dvp, uio_t uio, vfs_context_t context, int flags,
 	uint8_t dtype;
 	uint32_t delen;
 	int error = 0;
+	int from_server = FALSE;
 	struct smb_share * share = NULL;
     uint64_t node_ino;
 		
-	/* Do we need to start or restarting the directory listing */
 	offset = uio_offset(uio);
 	
-	share = smb_get_share_with_reference(VTOSMBFS(dvp));
-	if (!dnp->d_fctx || (dnp->d_fctx->f_share != share) || (offset == 0) || 
-		(offset != dnp->d_offset)) {
-        
-		smbfs_closedirlookup(dnp, context);
-		error = smbfs_smb_findopen(share, dnp, "*", 1, &dnp->d_fctx, TRUE, 
-                                   context);
-	}
-	/* 
-	 * The directory fctx keeps a reference on the share so we can release our 
-	 * reference on the share now.
-	 */ 
-	smb_share_rele(share, context);
-	
-	if (error) {
-		goto done;
+	/* Toss the cached entries if they could be out of date */
+	if (dnp->d_dcache && !smbfs_dircache_valid(dnp, dnp->d_dcache)) {
+		smbfs_dircache_free(dnp);
 	}
-	ctx = dnp->d_fctx;
 	
 	/*
 	 * SMB servers will return the dot and dotdot in most cases. If the share is a 
@@ -233,10 +397,52 @@ smbfs_readvdir(vnode_t dvp, uio_t uio, vfs_context_t context, int flags,
 			if (error)
 				goto done;
 			(*numdirent)++;
-			dnp->d_offset++;
 			offset++;
 		}
 	}
+	
+	/*
+	 * Return what we can from the directory cache. Rewinding or seeking
+	 * within what we have already enumerated never has to go to the server.
+	 */
+	if (dnp->d_dcache && (offset >= 2)) {
+		error = smbfs_dircache_readdir(dnp->d_dcache, uio, flags, &offset, 
+									   numdirent);
+		if (error)
+			goto done;
+		
+		/* The entry left over from the last call came from the cache */
+		if (dnp->d_nextEntry && (offset == (dnp->d_offset + 1))) {
+			SMB_FREE(dnp->d_nextEntry, M_TEMP);
+			dnp->d_nextEntry = NULL;
+			dnp->d_nextEntryLen = 0;
+			dnp->d_offset++;
+		}
+	}
+	
+	/* Do we need to start or restarting the directory listing */
+	from_server = TRUE;
+	share = smb_get_share_with_reference(VTOSMBFS(dvp));
+	if (!dnp->d_fctx || (dnp->d_fctx->f_share != share) || 
+		(offset != dnp->d_offset)) {
+        
+		smbfs_closedirlookup(dnp, context);
+		error = smbfs_smb_findopen(share, dnp, "*", 1, &dnp->d_fctx, TRUE, 
+                                   context);
+		/* We already handled dot and dotdot */
+		if (error == 0)
+			dnp->d_offset = 2;
+	}
+	/* 
+	 * The directory fctx keeps a reference on the share so we can release our 
+	 * reference on the share now.
+	 */ 
+	smb_share_rele(share, context);
+	
+	if (error) {
+		goto done;
+	}
+	ctx = dnp->d_fctx;
 
 	/* 
 	 * They are continuing from some point ahead of us in the buffer. Skip all
@@ -263,6 +469,11 @@ smbfs_readvdir(vnode_t dvp, uio_t uio, vfs_context_t context, int flags,
 	while (uio_resid(uio)) {
 		error = smbfs_findnext(ctx, context);
 		if (error) {
+			/* Got to the end, the cache now has the whole directory */
+			if ((error == ENOENT) && dnp->d_dcache && 
+				((dnp->d_dcache->dc_count + 2) == dnp->d_offset)) {
+				dnp->d_dcache->dc_complete = TRUE;
+			}
 			break;
         }
         
@@ -282,8 +493,9 @@ smbfs_readvdir(vnode_t dvp, uio_t uio, vfs_context_t context, int flags,
         }
         
 		dtype = (ctx->f_attr.fa_attr & SMB_EFA_DIRECTORY) ? DT_DIR : DT_REG;
+		node_ino = ctx->f_attr.fa_ino;
 		delen = smbfs_fill_direntry(&de, ctx->f_LocalName, ctx->f_LocalNameLen, 
-									dtype, ctx->f_attr.fa_ino, flags);
+									dtype, node_ino, flags);
 		if (smbfs_fastlookup) {
 			vnode_t vp = NULL;
 			
@@ -308,6 +520,7 @@ smbfs_readvdir(vnode_t dvp, uio_t uio, vfs_context_t context, int flags,
 				 * number to the inode number that was used when the node was 
                  * created.
 				 */
+				node_ino = np->n_ino;
 				if (flags & VNODE_READDIR_EXTENDED)
 					de.de64.d_fileno = np->n_ino;
 				else
@@ -331,6 +544,8 @@ smbfs_readvdir(vnode_t dvp, uio_t uio, vfs_context_t context, int flags,
 		/* Name wouldn't fit in the directory entry just drop it nothing else we can do */
 		if (delen == 0)
 			continue;
+		smbfs_dircache_add(dnp, ctx->f_LocalName, ctx->f_LocalNameLen, dtype, 
+						   node_ino);
 		if (uio_resid(uio) >= delen) {
 			error = uiomove((void *)&de, delen, uio);
 			if (error)
@@ -348,30 +563,40 @@ smbfs_readvdir(vnode_t dvp, uio_t uio, vfs_context_t context, int flags,
 		}
 	}
 done: 
+	/* The users buffer is full */
+	if (error == EJUSTRETURN)
+		error = 0;
 	/*
 	 * We use the uio offset to store the last directory index count. Since 
 	 * the uio offset is really never used, we can set it without causing any 
 	 * issues. Got this idea from the NFS code and it makes things a 
 	 * lot simplier. 
 	 */
-	uio_setoffset(uio, dnp->d_offset);
+	uio_setoffset(uio, (from_server) ? dnp->d_offset : offset);
 
 	return error;
 }
 
 /* 
- * This routine will zero fill the data between from and to. We may want to allocate
- * smbzeroes in the future.
+ * This routine will zero fill the data between from and to. Each write is made
+ * of SMBFS_ZERO_FILL_IOVS iovecs that all point at smbzeroes, so we can hand
+ * the write code as much as it can use without allocating a big zero buffer.
+ * For SMB 2/3 smb_smb_write splits that into max size writes and keeps a
+ * window of them in flight. SMB 1 still waits for each write, but they are
+ * max size instead of 4K.
  *
  * The calling routine must hold a reference on the share
  */
 static char smbzeroes[4096] = { 0 };
 
+#define SMBFS_ZERO_FILL_IOVS	2048	/* 8 MB per smb_smb_write */
+
 static int
 smbfs_zero_fill(struct smb_share *share, SMBFID fid, u_quad_t from,
                 u_quad_t to, int ioflag, vfs_context_t context)
 {
-	user_size_t len;
+	user_size_t len, iov_len;
+	user_size_t left;
 	int error = 0;
 	uio_t uio;
 
@@ -379,11 +604,17 @@ smbfs_zero_fill(struct smb_share *share, SMBFID fid, u_quad_t from,
 	 * Coherence callers must prevent VM from seeing the file size
 	 * grow until this loop is complete.
 	 */
-	uio = uio_create(1, from, UIO_SYSSPACE, UIO_WRITE);
+	uio = uio_create(SMBFS_ZERO_FILL_IOVS, from, UIO_SYSSPACE, UIO_WRITE);
+	if (uio == NULL) {
+		return (ENOMEM);
+	}
 	while (from < to) {
-		len = MIN((to - from), sizeof(smbzeroes));
+		len = MIN((to - from), SMBFS_ZERO_FILL_IOVS * sizeof(smbzeroes));
 		uio_reset(uio, from, UIO_SYSSPACE, UIO_WRITE );
-		uio_addiov(uio, CAST_USER_ADDR_T(&smbzeroes[0]), len);
+		for (left = len; left > 0; left -= iov_len) {
+			iov_len = MIN(left, sizeof(smbzeroes));
+			uio_addiov(uio, CAST_USER_ADDR_T(&smbzeroes[0]), iov_len);
+		}
 		error = smb_smb_write(share, fid, uio, ioflag, context);
 		if (error)
 			break;
@@ -516,3 +747,424 @@ smbfs_dowrite(struct smb_share *share, off_t endOfFile, uio_t uiop,
 
 	return error;
 }
+
+/*
+ * Asynchronous strategy
+ *
+ * The cluster layer hands us B_ASYNC bufs expecting VNOP_STRATEGY to return
+ * once the I/O is started, so it can keep more of them going. Instead of
+ * waiting for the replies on the calling thread, split the buf into SMB 2/3
+ * Read/Write requests, queue them to the iod and return. Each reply calls
+ * smbfs_aio_callback on the iod thread, and once the last one is in the buf
+ * is queued to the per mount aio thread which parses the replies and calls
+ * buf_biodone. Anything out of the ordinary, an error, a short transfer or a
+ * reconnect, gets handed to smbfs_strategy_sync which redoes the whole buf
+ * the old way and knows how to reopen the file.
+ */
+#define SMBFS_AIO_MAX_RQ	16
+
+#define kAioThreadStarting	1
+#define kAioThreadRunning	2
+#define kAioThreadStopping	3
+#define kAioThreadStop		4
+
+struct smbfs_aio;
+struct smbfs_aio_thread;
+
+struct smbfs_aio_rq {
+	struct smbfs_aio	*ar_aio;
+	struct smb_rq		*ar_rqp;
+	struct smb2_rw_rq	ar_rw;
+	int					ar_queued;	/* handed to the iod, callback will fire */
+	UInt32				ar_done;	/* callback has fired */
+};
+
+struct smbfs_aio {
+	STAILQ_ENTRY(smbfs_aio) aio_next;
+	struct smbfs_aio_thread	*aio_thread;
+	struct buf			*aio_bp;
+	struct smb_share	*aio_share;
+	caddr_t				aio_addr;
+	off_t				aio_offset;
+	user_ssize_t		aio_len;	/* reads stop at the eof */
+	int					aio_read;
+	int					aio_error;
+	SInt32				aio_pending;	/* requests outstanding plus one for the submitter */
+	int					aio_cnt;
+	struct smbfs_aio_rq	aio_rq[SMBFS_AIO_MAX_RQ];
+};
+
+struct smbfs_aio_thread {
+	struct smbmount		*smp;
+	uint32_t			aio_state;
+	SInt32				aio_inflight;	/* bufs not yet completed */
+	lck_mtx_t			aio_lock;
+	STAILQ_HEAD(, smbfs_aio) aio_done_list;
+};
+
+static void
+smbfs_aio_queue_done(struct smbfs_aio *aiop)
+{
+	struct smbfs_aio_thread *aiot = aiop->aio_thread;
+	
+	lck_mtx_lock(&aiot->aio_lock);
+	STAILQ_INSERT_TAIL(&aiot->aio_done_list, aiop, aio_next);
+	lck_mtx_unlock(&aiot->aio_lock);
+	wakeup(&aiot->aio_state);
+}
+
+/*
+ * Called from the iod thread with the request lock held, so just count the
+ * reply and leave the real work to the aio thread.
+ */
+static void
+smbfs_aio_callback(void *arg)
+{
+	struct smbfs_aio_rq *arp = arg;
+	struct smbfs_aio *aiop = arp->ar_aio;
+	
+	/* A reconnect can notify a request that has already replied */
+	if (!OSCompareAndSwap(0, 1, &arp->ar_done)) {
+		return;
+	}
+	
+	if (OSAddAtomic(-1, &aiop->aio_pending) == 1) {
+		smbfs_aio_queue_done(aiop);
+	}
+}
+
+/*
+ * All the requests for this buf have replied, or were never sent. Reap them
+ * and finish the buf.
+ */
+static void
+smbfs_aio_complete(struct smbfs_aio *aiop)
+{
+	struct buf *bp = aiop->aio_bp;
+	struct smbnode *np = VTOSMB(buf_vnode(bp));
+	struct smbfs_aio_rq *arp;
+	user_ssize_t resid;
+	int error = aiop->aio_error;
+	int rw_error, i;
+	
+	for (i = 0; i < aiop->aio_cnt; i++) {
+		arp = &aiop->aio_rq[i];
+		
+		if (arp->ar_queued) {
+			rw_error = smb2_smb_rw_async_reply(arp->ar_rqp, &arp->ar_rw,
+											   aiop->aio_read, &resid);
+			if ((error == 0) && (rw_error == 0) &&
+				(resid != arp->ar_rw.io_len)) {
+				/* Let the sync path sort out a short read or write */
+				rw_error = EIO;
+			}
+			if (error == 0) {
+				error = rw_error;
+			}
+		}
+		
+		if (arp->ar_rqp != NULL) {
+			smb_rq_done(arp->ar_rqp);
+			arp->ar_rqp = NULL;
+		}
+		if (arp->ar_rw.auio != NULL) {
+			uio_free(arp->ar_rw.auio);
+			arp->ar_rw.auio = NULL;
+		}
+	}
+	smb_share_rele(aiop->aio_share, NULL);
+	
+	if (error) {
+		lck_rw_lock_shared(&np->n_name_rwlock);
+		SMB_LOG_IO("%s: async %s at %lld failed %d, retrying sync\n",
+				   np->n_name, (aiop->aio_read) ? "READ" : "WRITE",
+				   aiop->aio_offset, error);
+		lck_rw_unlock_shared(&np->n_name_rwlock);
+		
+		if ((error = buf_unmap(bp))) {
+			panic("smbfs_aio_complete: buf_unmap() failed with (%d)", error);
+		}
+		
+		/* Redoes the whole buf and calls buf_biodone */
+		(void) smbfs_strategy_sync(bp);
+		goto done;
+	}
+	
+	if (aiop->aio_read) {
+		/* Zero out the part of the buf past the end of the file */
+		if (aiop->aio_len < (user_ssize_t)buf_count(bp)) {
+			bzero(aiop->aio_addr + aiop->aio_len, 
+				  (size_t)(buf_count(bp) - aiop->aio_len));
+		}
+	} else {
+		/* Save last time we wrote data */
+		nanouptime(&np->n_last_write_time);
+		
+		lck_mtx_lock(&np->f_clusterWriteLock);
+		if ((u_quad_t)(aiop->aio_offset + aiop->aio_len) >= np->n_size) {
+			/* We finished writing past the eof reset the flag */
+			nanouptime(&np->n_sizetime);
+			np->waitOnClusterWrite = FALSE;
+		}
+		lck_mtx_unlock(&np->f_clusterWriteLock);
+	}
+	
+	buf_seterror(bp, 0);
+	buf_setresid(bp, 0);
+	if ((error = buf_unmap(bp))) {
+		panic("smbfs_aio_complete: buf_unmap() failed with (%d)", error);
+	}
+	buf_biodone(bp);
+	
+done:
+	SMB_FREE(aiop, M_SMBTEMP);
+}
+
+/*
+ * Start an async cluster read/write. Returns zero if the buf now belongs to
+ * the aio thread, otherwise the caller needs to do the I/O synchronously.
+ */
+int
+smbfs_strategy_async(struct buf *bp)
+{
+	vnode_t vp = buf_vnode(bp);
+	int32_t bflags = buf_flags(bp);
+	struct smbnode *np = VTOSMB(vp);
+	struct smbfs_aio_thread *aiot = VTOSMBFS(vp)->sm_aio;
+	struct smbfs_aio *aiop = NULL;
+	struct smbfs_aio_rq *arp;
+	struct smb_share *share;
+	uio_t uio;
+	caddr_t io_addr = 0;
+	SMBFID fid = 0;
+	off_t offset = ((off_t)buf_blkno(bp)) * PAGE_SIZE;
+	user_ssize_t len, piece;
+	uint32_t quantum;
+	int do_read = (bflags & B_READ) ? 1 : 0;
+	int error = 0;
+	
+	if ((!smbfs_async_strategy) || (!(bflags & B_ASYNC)) || (aiot == NULL) ||
+		(aiot->aio_state != kAioThreadRunning)) {
+		return (ENOTSUP);
+	}
+	
+	/* Reopens, revokes and reads past the eof are left to the sync path */
+	if ((np->f_openState & (kNeedRevoke | kNeedReopen | kInReopen)) ||
+		(np->f_refcnt == 0)) {
+		return (ENOTSUP);
+	}
+	
+	if (do_read) {
+		if (offset >= (off_t)np->n_size) {
+			return (ENOTSUP);
+		}
+		len = MIN(buf_count(bp), (off_t)np->n_size - offset);
+	} else {
+		/* Holes need smbfs_0extend */
+		if (offset > (off_t)np->n_size) {
+			return (ENOTSUP);
+		}
+		len = buf_count(bp);
+	}
+	
+	share = smb_get_share_with_reference(VTOSMBFS(vp));
+	if (!(SSTOVC(share)->vc_flags & SMBV_SMB2)) {
+		smb_share_rele(share, NULL);
+		return (ENOTSUP);
+	}
+	
+	quantum = (do_read) ? SSTOVC(share)->vc_rxmax : SSTOVC(share)->vc_wxmax;
+	if ((quantum == 0) || (len > ((user_ssize_t) quantum * SMBFS_AIO_MAX_RQ))) {
+		smb_share_rele(share, NULL);
+		return (ENOTSUP);
+	}
+	
+	SMB_MALLOC(aiop,
+			   struct smbfs_aio *,
+			   sizeof(struct smbfs_aio),
+			   M_SMBTEMP,
+			   M_WAITOK | M_ZERO);
+	if (aiop == NULL) {
+		smb_share_rele(share, NULL);
+		return (ENOMEM);
+	}
+	
+	if ((error = buf_map(bp, &io_addr))) {
+		panic("smbfs_strategy_async: buf_map() failed with (%d)", error);
+	}
+	
+	uio = uio_create(1, offset, UIO_SYSSPACE, (do_read) ? UIO_READ : UIO_WRITE);
+	if (!uio) {
+		panic("smbfs_strategy_async: uio_create() failed");
+	}
+	uio_addiov(uio, CAST_USER_ADDR_T(io_addr), len);
+	
+	/* See smbfs_strategy_sync for why buf_proc can be NULL */
+	if (FindFileRef(vp, buf_proc(bp), (do_read) ? kAccessRead : kAccessWrite,
+					kCheckDenyOrLocks, offset, len, NULL, &fid)) {
+		fid = np->f_fid;
+	}
+	DBG_ASSERT(fid);
+	
+	aiop->aio_thread = aiot;
+	aiop->aio_bp = bp;
+	aiop->aio_share = share;
+	aiop->aio_addr = io_addr;
+	aiop->aio_offset = offset;
+	aiop->aio_len = len;
+	aiop->aio_read = do_read;
+	aiop->aio_pending = 1;
+	OSAddAtomic(1, &aiot->aio_inflight);
+	
+	lck_rw_lock_shared(&np->n_name_rwlock);
+	SMB_LOG_IO("%s: async %s offset %lld, size %lld, bflags 0x%x\n",
+			   np->n_name, (do_read) ? "Read" : "Write", offset, len, bflags);
+	lck_rw_unlock_shared(&np->n_name_rwlock);
+	
+	while (uio_resid(uio)) {
+		if (aiop->aio_cnt == SMBFS_AIO_MAX_RQ) {
+			/* Low on credits, pieces came out smaller than a quantum */
+			error = ENOBUFS;
+			break;
+		}
+		
+		arp = &aiop->aio_rq[aiop->aio_cnt++];
+		arp->ar_aio = aiop;
+		arp->ar_rw.fid = fid;
+		arp->ar_rw.auio = uio_duplicate(uio);
+		if (arp->ar_rw.auio == NULL) {
+			error = ENOMEM;
+			break;
+		}
+		
+		piece = uio_resid(uio);
+		error = smb2_smb_rw_async_build(share, &arp->ar_rw, &piece, do_read,
+										smbfs_aio_callback, arp, &arp->ar_rqp,
+										NULL);
+		if (error) {
+			break;
+		}
+		
+		OSAddAtomic(1, &aiop->aio_pending);
+		error = smb_iod_rq_enqueue(arp->ar_rqp);
+		if (error) {
+			OSAddAtomic(-1, &aiop->aio_pending);
+			break;
+		}
+		arp->ar_queued = 1;
+		
+		uio_update(uio, piece);
+	}
+	uio_free(uio);
+	
+	/* Anything that went wrong gets redone by the aio thread synchronously */
+	aiop->aio_error = error;
+	
+	/* Drop the submitter's count, the last reply may already be in */
+	if (OSAddAtomic(-1, &aiop->aio_pending) == 1) {
+		smbfs_aio_queue_done(aiop);
+	}
+	
+	return (0);
+}
+
+/*
+ * smbfs_aio_main
+ *
+ * Aio thread main routine, finish bufs whose replies have all arrived.
+ */
+static void
+smbfs_aio_main(void *arg)
+{
+	struct smbfs_aio_thread *aiot = arg;
+	struct smbfs_aio *aiop;
+	
+	lck_mtx_lock(&aiot->aio_lock);
+	if (aiot->aio_state == kAioThreadStarting) {
+		aiot->aio_state = kAioThreadRunning;
+	}
+	
+	for (;;) {
+		while ((aiop = STAILQ_FIRST(&aiot->aio_done_list)) != NULL) {
+			STAILQ_REMOVE_HEAD(&aiot->aio_done_list, aio_next);
+			lck_mtx_unlock(&aiot->aio_lock);
+			
+			smbfs_aio_complete(aiop);
+			OSAddAtomic(-1, &aiot->aio_inflight);
+			
+			lck_mtx_lock(&aiot->aio_lock);
+		}
+		
+		/* Don't leave until every buf we started has been finished */
+		if ((aiot->aio_state == kAioThreadStopping) &&
+			(OSAddAtomic(0, &aiot->aio_inflight) == 0)) {
+			break;
+		}
+		msleep(&aiot->aio_state, &aiot->aio_lock, PWAIT, "smbfs aio idle", 0);
+	}
+	
+	aiot->aio_state = kAioThreadStop;
+	lck_mtx_unlock(&aiot->aio_lock);
+	wakeup(aiot);
+}
+
+/*
+ * smbfs_aio_create_thread
+ *
+ * Create and start the thread used to complete async strategy requests
+ */
+void
+smbfs_aio_create_thread(struct smbmount *smp)
+{
+	struct smbfs_aio_thread *aiot;
+	kern_return_t result;
+	thread_t thread;
+	
+	SMB_MALLOC(aiot, struct smbfs_aio_thread *, sizeof(*aiot), M_TEMP, 
+			   M_WAITOK | M_ZERO);
+	
+	aiot->smp = smp;
+	lck_mtx_init(&aiot->aio_lock, smbfs_mutex_group, smbfs_lock_attr);
+	STAILQ_INIT(&aiot->aio_done_list);
+	aiot->aio_state = kAioThreadStarting;
+	
+	result = kernel_thread_start((thread_continue_t)smbfs_aio_main, aiot, &thread);
+	if (result != KERN_SUCCESS) {
+		/* Strategy will just stay synchronous */
+		SMBERROR("can't start aio thread: result = %d\n", result);
+		lck_mtx_destroy(&aiot->aio_lock, smbfs_mutex_group);
+		SMB_FREE(aiot, M_TEMP);
+		return;
+	}
+	thread_deallocate(thread);
+	smp->sm_aio = aiot;
+}
+
+/*
+ * smbfs_aio_destroy_thread
+ *
+ * Wait for any async strategy requests still out to finish, then stop the
+ * aio thread. Outstanding requests should have been errored out already.
+ */
+void
+smbfs_aio_destroy_thread(struct smbmount *smp)
+{
+	struct smbfs_aio_thread *aiot = smp->sm_aio;
+	
+	if (aiot == NULL) {
+		return;
+	}
+	smp->sm_aio = NULL;
+	
+	lck_mtx_lock(&aiot->aio_lock);
+	aiot->aio_state = kAioThreadStopping;
+	wakeup(&aiot->aio_state);
+	while (aiot->aio_state != kAioThreadStop) {
+		msleep(aiot, &aiot->aio_lock, PWAIT, "smbfs aio exit", 0);
+	}
+	lck_mtx_unlock(&aiot->aio_lock);
+	
+	DBG_ASSERT(STAILQ_EMPTY(&aiot->aio_done_list));
+	lck_mtx_destroy(&aiot->aio_lock, smbfs_mutex_group);
+	SMB_FREE(aiot, M_TEMP);
+}
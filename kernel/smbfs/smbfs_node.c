@@ -71,8 +71,31 @@
 #include <smbclient/smbclient_internal.h>
 
 #define	SMBFS_NOHASH(smp, hval)	(&(smp)->sm_hash[(hval) & (smp)->sm_hashlen])
-#define	smbfs_hash_lock(smp)	(lck_mtx_lock((smp)->sm_hashlock))
-#define	smbfs_hash_unlock(smp)	(lck_mtx_unlock((smp)->sm_hashlock))
+#define	SMBFS_HASHLOCK(smp, hval)	((smp)->sm_hashlock[(hval) & (SMBFS_HASH_NLOCKS - 1)])
+/* Locks the whole table, used when walking all the nodes */
+#define	smbfs_hash_lock(smp)	(lck_rw_lock_exclusive((smp)->sm_hash_rwlock))
+#define	smbfs_hash_unlock(smp)	(lck_rw_unlock_exclusive((smp)->sm_hash_rwlock))
+
+extern lck_grp_t *hash_lck_grp;
+extern lck_attr_t *hash_lck_attr;
+
+/* Node hash table statistics, for all mounts */
+static uint64_t smbfs_hash_lookups = 0;
+static uint64_t smbfs_hash_chain_walked = 0;
+static uint32_t smbfs_hash_max_chain = 0;
+static uint64_t smbfs_hash_lock_contended = 0;
+static uint32_t smbfs_hash_resizes = 0;
+
+SYSCTL_DECL(_net_smb_fs);
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, hash_lookups, CTLFLAG_RD, &smbfs_hash_lookups, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, hash_chain_walked, CTLFLAG_RD, &smbfs_hash_chain_walked, "");
+SYSCTL_INT(_net_smb_fs, OID_AUTO, hash_max_chain, CTLFLAG_RW, &smbfs_hash_max_chain, 0, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, hash_lock_contended, CTLFLAG_RD, &smbfs_hash_lock_contended, "");
+SYSCTL_INT(_net_smb_fs, OID_AUTO, hash_resizes, CTLFLAG_RD, &smbfs_hash_resizes, 0, "");
+
+/* Cache file data and attributes for as long as we hold an SMB 2/3 lease */
+static int smbfs_lease_cache = 1;
+SYSCTL_INT(_net_smb_fs, OID_AUTO, lease_cache, CTLFLAG_RW, &smbfs_lease_cache, 0, "");
 
 extern vnop_t **smbfs_vnodeop_p;
 
@@ -374,6 +397,28 @@ smbnode_lock(struct smbnode *np, enum smbfslocktype locktype)
 	return (0);
 }
 
+/*
+ * Lock a smbnode only if we can get it without blocking. Returns EBUSY if
+ * someone else holds the lock.
+ */
+int 
+smbnode_trylock(struct smbnode *np, enum smbfslocktype locktype)
+{
+	if (locktype == SMBFS_SHARED_LOCK) {
+		if (!lck_rw_try_lock(&np->n_rwlock, LCK_RW_TYPE_SHARED))
+			return (EBUSY);
+	} else {
+		if (!lck_rw_try_lock(&np->n_rwlock, LCK_RW_TYPE_EXCLUSIVE))
+			return (EBUSY);
+	}
+
+	np->n_lockState = locktype;
+	
+	if (locktype != SMBFS_SHARED_LOCK) {
+		np->n_activation = (void *) current_thread();
+	}
+	return (0);
+}
 
 /*
  * Lock a pair of smbnodes
@@ -476,27 +521,182 @@ smbfs_hash(struct smb_share *share, uint64_t ino,
 	return v;
 }
 
+int
+smbfs_hash_init(struct smbmount *smp)
+{
+	int ii;
+	
+	smp->sm_hash = hashinit(SMBFS_HASH_INITSIZE, M_SMBFSHASH, &smp->sm_hashlen);
+	if (smp->sm_hash == NULL)
+		return ENOMEM;
+	smp->sm_hashcnt = 0;
+	smp->sm_hash_rwlock = lck_rw_alloc_init(hash_lck_grp, hash_lck_attr);
+	for (ii = 0; ii < SMBFS_HASH_NLOCKS; ii++)
+		smp->sm_hashlock[ii] = lck_mtx_alloc_init(hash_lck_grp, hash_lck_attr);
+	return 0;
+}
+
+void
+smbfs_hash_destroy(struct smbmount *smp)
+{
+	int ii;
+	
+	/* Was malloced by hashinit */
+	if (smp->sm_hash) {
+		SMB_FREE(smp->sm_hash, M_SMBFSHASH);
+		smp->sm_hash = (void *)0xDEAD5AB0;
+	}
+	if (smp->sm_hash_rwlock) {
+		lck_rw_free(smp->sm_hash_rwlock, hash_lck_grp);
+		smp->sm_hash_rwlock = NULL;
+	}
+	for (ii = 0; ii < SMBFS_HASH_NLOCKS; ii++) {
+		if (smp->sm_hashlock[ii]) {
+			lck_mtx_free(smp->sm_hashlock[ii], hash_lck_grp);
+			smp->sm_hashlock[ii] = NULL;
+		}
+	}
+}
+
+/*
+ * Lock the bucket for this hash value. Holding the table lock shared keeps
+ * the table from being resized under us, while other buckets can be used by
+ * other threads.
+ */
+static lck_mtx_t *
+smbfs_hash_lock_bucket(struct smbmount *smp, uint64_t hashval)
+{
+	lck_mtx_t *mtx;
+	
+	lck_rw_lock_shared(smp->sm_hash_rwlock);
+	mtx = SMBFS_HASHLOCK(smp, hashval);
+	if (!lck_mtx_try_lock(mtx)) {
+		OSIncrementAtomic64((SInt64 *)&smbfs_hash_lock_contended);
+		lck_mtx_lock(mtx);
+	}
+	return mtx;
+}
+
+static void
+smbfs_hash_unlock_bucket(struct smbmount *smp, lck_mtx_t *mtx)
+{
+	lck_mtx_unlock(mtx);
+	lck_rw_unlock_shared(smp->sm_hash_rwlock);
+}
+
+/*
+ * Wait for the node to finish being allocated or reclaimed. Drops both
+ * bucket locks. We can't sleep holding the table lock, someone may be
+ * waiting to resize the table and reclaim needs the table lock to remove
+ * the node.
+ */
+static void
+smbfs_hash_sleep(struct smbmount *smp, struct smbnode *np, lck_mtx_t *mtx,
+				 const char *wmesg)
+{
+	lck_rw_unlock_shared(smp->sm_hash_rwlock);
+	(void)msleep((caddr_t)np, mtx, PINOD|PDROP, wmesg, 0);
+}
+
+/*
+ * Keep track of the chain lengths we are seeing
+ */
+static void
+smbfs_hash_lookup_done(uint32_t walked)
+{
+	uint32_t max_chain;
+	
+	OSIncrementAtomic64((SInt64 *)&smbfs_hash_lookups);
+	OSAddAtomic64(walked, (SInt64 *)&smbfs_hash_chain_walked);
+	
+	/* Lookups in other buckets can race us, never move it backwards */
+	do {
+		max_chain = smbfs_hash_max_chain;
+		if (walked <= max_chain)
+			break;
+	} while (!OSCompareAndSwap(max_chain, walked, &smbfs_hash_max_chain));
+}
+
+/*
+ * Double the number of buckets. We allocate the new table before taking
+ * the table lock, so the lookups are only held off while we move the nodes.
+ */
+static void
+smbfs_hash_grow(struct smbmount *smp)
+{
+	struct smbnode_hashhead *new_hash, *old_hash;
+	u_long new_hashlen, old_hashlen, ii;
+	struct smbnode *np;
+	
+	if ((smp->sm_hashlen + 1) >= (u_long)desiredvnodes)
+		return;
+	
+	new_hash = hashinit((int)((smp->sm_hashlen + 1) * 2), M_SMBFSHASH, &new_hashlen);
+	if (new_hash == NULL)
+		return;
+	
+	smbfs_hash_lock(smp);
+	
+	/* Someone else already grew it */
+	if (new_hashlen <= smp->sm_hashlen) {
+		smbfs_hash_unlock(smp);
+		SMB_FREE(new_hash, M_SMBFSHASH);
+		return;
+	}
+	
+	old_hash = smp->sm_hash;
+	old_hashlen = smp->sm_hashlen;
+	for (ii = 0; ii < (old_hashlen + 1); ii++) {
+		while ((np = LIST_FIRST(&old_hash[ii])) != NULL) {
+			LIST_REMOVE(np, n_hash);
+			LIST_INSERT_HEAD(&new_hash[np->n_hashval & new_hashlen], np, n_hash);
+		}
+	}
+	smp->sm_hash = new_hash;
+	smp->sm_hashlen = new_hashlen;
+	
+	smbfs_hash_unlock(smp);
+	
+	SMB_FREE(old_hash, M_SMBFSHASH);
+	OSIncrementAtomic((SInt32 *)&smbfs_hash_resizes);
+	SMBDEBUG("node hash now has %lu buckets, %d nodes\n", new_hashlen + 1,
+			 smp->sm_hashcnt);
+}
+
 void
 smb_vhashrem(struct smbnode *np)
 {
-	smbfs_hash_lock(np->n_mount);
+	struct smbmount *smp = np->n_mount;
+	lck_mtx_t *mtx;
+	
+	mtx = smbfs_hash_lock_bucket(smp, np->n_hashval);
 	if (np->n_hash.le_prev) {
 		LIST_REMOVE(np, n_hash);
 		np->n_hash.le_prev = NULL;
+		OSDecrementAtomic(&smp->sm_hashcnt);
 	}
-	smbfs_hash_unlock(np->n_mount);
+	smbfs_hash_unlock_bucket(smp, mtx);
 	return;
 }
 
 void 
 smb_vhashadd(struct smbnode *np, uint64_t hashval)
 {
+	struct smbmount *smp = np->n_mount;
 	struct smbnode_hashhead	*nhpp;
+	lck_mtx_t *mtx;
+	SInt32 cnt;
 	
-	smbfs_hash_lock(np->n_mount);
-	nhpp = SMBFS_NOHASH(np->n_mount, hashval);
+	mtx = smbfs_hash_lock_bucket(smp, hashval);
+	np->n_hashval = hashval;
+	nhpp = SMBFS_NOHASH(smp, hashval);
 	LIST_INSERT_HEAD(nhpp, np, n_hash);
-	smbfs_hash_unlock(np->n_mount);
+	cnt = OSIncrementAtomic(&smp->sm_hashcnt) + 1;
+	smbfs_hash_unlock_bucket(smp, mtx);
+	
+	/* Chains are getting long, time to grow */
+	if ((u_long)cnt > ((smp->sm_hashlen + 1) * SMBFS_HASH_MAXLOAD))
+		smbfs_hash_grow(smp);
 	return;
 	
 }
@@ -536,6 +736,8 @@ smb_hashget(struct smbmount *smp, struct smbnode *dnp, uint64_t hashval,
 	uint32_t vid;
 	size_t snmlen = (sname) ? strnlen(sname, maxfilenamelen+1) : 0;
     struct smb_vc *vcp = NULL;
+	lck_mtx_t *mtx;
+	uint32_t walked = 0;
     
     if (smp->sm_share == NULL) {
         SMBERROR("smp->sm_share is NULL? \n");
@@ -545,9 +747,10 @@ smb_hashget(struct smbmount *smp, struct smbnode *dnp, uint64_t hashval,
     vcp = SSTOVC(smp->sm_share);
     
 loop:
-	smbfs_hash_lock(smp);
+	mtx = smbfs_hash_lock_bucket(smp, hashval);
 	nhpp = SMBFS_NOHASH(smp, hashval);
 	LIST_FOREACH(np, nhpp, n_hash) {
+		walked++;
 		/* 
 		 * If we are only looking for a stream node then skip any other nodes. 
 		 * If we are look for a directory or data node then skip any stream nodes.
@@ -609,20 +812,21 @@ loop:
         
 		if (ISSET(np->n_flag, NALLOC)) {
 			SET(np->n_flag, NWALLOC);
-			(void)msleep((caddr_t)np, smp->sm_hashlock, PINOD|PDROP, "smb_ngetalloc", 0);
+			smbfs_hash_sleep(smp, np, mtx, "smb_ngetalloc");
 			goto loop;
 		}
         
 		if (ISSET(np->n_flag, NTRANSIT)) {
 			SET(np->n_flag, NWTRANSIT);
-			(void)msleep((caddr_t)np, smp->sm_hashlock, PINOD|PDROP, "smb_ngettransit", 0);
+			smbfs_hash_sleep(smp, np, mtx, "smb_ngettransit");
 			goto loop;
 		}
         
 		vp = SMBTOV(np);
 		vid = vnode_vid(vp);
         
-		smbfs_hash_unlock(smp);
+		smbfs_hash_unlock_bucket(smp, mtx);
+		smbfs_hash_lookup_done(walked);
         
 		if (vnode_getwithvid(vp, vid)) {
 			return (NULL);
@@ -638,7 +842,8 @@ loop:
 		return (vp);
 	}
     
-	smbfs_hash_unlock(smp);
+	smbfs_hash_unlock_bucket(smp, mtx);
+	smbfs_hash_lookup_done(walked);
 	return (NULL);
 }
 
@@ -1809,7 +2014,7 @@ smbfs_attr_cacheenter(struct smb_share *share, vnode_t vp, struct smbfattr *fap,
 			np->n_flag &= ~NNEGNCENTRIES;
 			cache_purge_negatives(vp);			
                 
-            VTOSMB(vp)->d_changecnt++;
+            OSIncrementAtomic((SInt32 *)&VTOSMB(vp)->d_changecnt);
 		}
 		/*
 		 * Don't allow mtime to go backwards.
@@ -1949,6 +2154,138 @@ vnode_notify_needed:
 	}
 }
 
+/*
+ * Attribute cache timeout policies. Each one picks a timeout for the node,
+ * smbfs_attr_cachetimeo clamps it to the mount's sm_attr_min/sm_attr_max.
+ */
+#define SMBFS_ATTR_RATE_WINDOW	10	/* seconds between change rate samples */
+
+struct smbfs_attrcache_policy {
+	const char *name;
+	time_t (*timeo)(struct smbmount *smp, struct smbnode *np);
+};
+
+/*
+ * Recently modified files have a short timeout and files that haven't been
+ * modified in a long time have a long timeout. This is the same algorithm
+ * used by NFS.
+ */
+static time_t
+smbfs_attrcache_mtime_timeo(struct smbmount *smp, struct smbnode *np)
+{
+#pragma unused(smp)
+	struct timespec ts;
+	
+	nanotime(&ts);
+	return ((ts.tv_sec - np->n_mtime.tv_sec) / 10);
+}
+
+static time_t
+smbfs_attrcache_fixed_timeo(struct smbmount *smp, struct smbnode *np)
+{
+#pragma unused(np)
+	return (smp->sm_attr_max);
+}
+
+/*
+ * Scale the timeout by how busy the share is. Every change notify or lease
+ * break counts as a change, and the smoothed changes per minute divide the
+ * max timeout. A quiet share caches for sm_attr_max, a busy one drops
+ * towards sm_attr_min.
+ */
+static time_t
+smbfs_attrcache_adaptive_timeo(struct smbmount *smp, struct smbnode *np)
+{
+#pragma unused(np)
+	struct timespec ts;
+	SInt64 last_time, changes;
+	uint32_t rate;
+	
+	nanouptime(&ts);
+	last_time = smp->sm_attr_rate_time;
+	if ((ts.tv_sec - last_time) >= SMBFS_ATTR_RATE_WINDOW) {
+		/* Whoever swaps the time in gets to take the sample */
+		if (OSCompareAndSwap64(last_time, ts.tv_sec,
+							   (volatile UInt64 *) &smp->sm_attr_rate_time)) {
+			changes = smp->sm_attr_changes;
+			rate = (uint32_t) ((changes - smp->sm_attr_rate_changes) * 60 /
+							   (ts.tv_sec - last_time));
+			smp->sm_attr_rate_changes = changes;
+			/* Smooth with a gain of 1/4 so one burst doesn't stick around */
+			smp->sm_attr_rate = (smp->sm_attr_rate * 3 + rate) / 4;
+		}
+	}
+	
+	return (smp->sm_attr_max / (1 + smp->sm_attr_rate));
+}
+
+static const struct smbfs_attrcache_policy smbfs_attrcache_policies[SMBFS_ATTRCACHE_NPOLICIES] = {
+	{ "mtime", smbfs_attrcache_mtime_timeo },		/* SMBFS_ATTRCACHE_MTIME */
+	{ "fixed", smbfs_attrcache_fixed_timeo },		/* SMBFS_ATTRCACHE_FIXED */
+	{ "adaptive", smbfs_attrcache_adaptive_timeo }	/* SMBFS_ATTRCACHE_ADAPTIVE */
+};
+
+/*
+ * Return how many seconds the attributes of np can be cached for.
+ */
+time_t
+smbfs_attr_cachetimeo(struct smbnode *np)
+{
+	struct smbmount *smp = np->n_mount;
+	time_t attrtimeo;
+	
+	attrtimeo = smbfs_attrcache_policies[smp->sm_attr_policy].timeo(smp, np);
+	if (attrtimeo < smp->sm_attr_min)
+		attrtimeo = smp->sm_attr_min;
+	else if (attrtimeo > smp->sm_attr_max)
+		attrtimeo = smp->sm_attr_max;
+	return (attrtimeo);
+}
+
+/*
+ * Something changed on the server behind our back, let the adaptive policy
+ * know about it.
+ */
+void
+smbfs_attr_cachechanged(struct smbmount *smp)
+{
+	OSAddAtomic64(1, &smp->sm_attr_changes);
+}
+
+/*
+ * Check and sanitize the attribute cache settings from the mount args.
+ */
+void
+smbfs_attr_cacheinit(struct smbmount *smp, struct smb_mount_args *args)
+{
+	struct timespec ts;
+	
+	if ((args->attr_cache_policy < 0) ||
+		(args->attr_cache_policy >= SMBFS_ATTRCACHE_NPOLICIES)) {
+		SMBWARNING("Unknown attribute cache policy %d, using %s\n",
+				   args->attr_cache_policy,
+				   smbfs_attrcache_policies[SMBFS_ATTRCACHE_MTIME].name);
+		smp->sm_attr_policy = SMBFS_ATTRCACHE_MTIME;
+	}
+	else {
+		smp->sm_attr_policy = args->attr_cache_policy;
+	}
+	
+	smp->sm_attr_min = (args->attr_cache_min > 0) ? args->attr_cache_min : SMB_MINATTRTIMO;
+	smp->sm_attr_max = (args->attr_cache_max > 0) ? args->attr_cache_max : SMB_MAXATTRTIMO;
+	if (smp->sm_attr_max > SMB_ATTRTIMO_LIMIT)
+		smp->sm_attr_max = SMB_ATTRTIMO_LIMIT;
+	if (smp->sm_attr_min > smp->sm_attr_max)
+		smp->sm_attr_min = smp->sm_attr_max;
+	
+	nanouptime(&ts);
+	smp->sm_attr_rate_time = ts.tv_sec;
+	
+	SMBDEBUG("Attribute cache policy %s, min %ld max %ld\n",
+			 smbfs_attrcache_policies[smp->sm_attr_policy].name,
+			 (long) smp->sm_attr_min, (long) smp->sm_attr_max);
+}
+
 /*
  * The calling routine must hold a reference on the share
  */
@@ -1977,8 +2314,29 @@ smbfs_attr_cachelookup(struct smb_share *share, vnode_t vp, struct vnode_attr *v
 		 *       of the open file.
 		 */
 	}
-	else if ((ts.tv_sec - np->attribute_cache_timer) > attrtimeo)
-		return (ENOENT);
+	else if ((ts.tv_sec - np->attribute_cache_timer) > attrtimeo) {
+		/*
+		 * While we hold a read lease nobody else can change the file or
+		 * the directory without the server breaking our lease first, so the
+		 * cache stays good. A zero timer means we invalidated it ourselves.
+		 */
+		if (smbfs_lease_cache && (np->attribute_cache_timer != 0) &&
+			((vnode_isreg(vp) && (np->f_leaseState & SMB2_LEASE_READ_CACHING)) ||
+			 (vnode_isdir(vp) && (np->d_leaseState & SMB2_LEASE_READ_CACHING)))) {
+			OSAddAtomic64(1, &smp->sm_lease_attr_hits);
+			OSAddAtomic64(1, &smp->sm_attr_hits);
+		}
+		else {
+			if (np->attribute_cache_timer == 0)
+				OSAddAtomic64(1, &smp->sm_attr_misses);
+			else
+				OSAddAtomic64(1, &smp->sm_attr_expired);
+			return (ENOENT);
+		}
+	}
+	else {
+		OSAddAtomic64(1, &smp->sm_attr_hits);
+	}
 
 	if (!va)
 		return (0);
@@ -3258,9 +3616,27 @@ smb2fs_reconnect(struct smbmount *smp)
             }
 
             if (np->n_dosattr & SMB_EFA_DIRECTORY) {
+                /* Directory leases don't survive a reconnect either */
+                if (np->d_leaseFid != 0) {
+                    if ((np->d_fctx == NULL) || !np->d_fctx->f_lease_fid) {
+                        /* Remove the open fid from the fid table */
+                        smb_fid_get_kernel_fid(smp->sm_share, np->d_leaseFid,
+                                               1, &temp_fid);
+                    }
+                    np->d_leaseFid = 0;
+                }
+                if (np->d_leaseState & SMB2_LEASE_READ_CACHING) {
+                    np->attribute_cache_timer = 0;
+                    OSIncrementAtomic((SInt32 *)&np->d_changecnt);
+                }
+                np->d_leaseState = 0;
+                np->d_leaseKeyHi = 0;
+                np->d_leaseKeyLow = 0;
+                
                 if (np->d_fctx != NULL) {
                     /* Enumeration open dir is now closed, lazily reopen it */
                     np->d_fctx->f_need_close = FALSE;
+                    np->d_fctx->f_lease_fid = FALSE;
                     
                     /* Remove the open fid from the fid table */
                     smb_fid_get_kernel_fid(smp->sm_share,
@@ -3276,6 +3652,29 @@ smb2fs_reconnect(struct smbmount *smp)
              * Only files from here on
              */
             
+            /* Leases don't survive a reconnect */
+            if (np->f_leaseKeyHi != 0) {
+                if (np->f_leaseState & SMB2_LEASE_READ_CACHING) {
+                    np->f_leaseFlags |= kLeaseStaleCache;
+                }
+                np->f_leaseState = 0;
+                np->f_leaseKeyHi = 0;
+                np->f_leaseKeyLow = 0;
+                np->attribute_cache_timer = 0;
+            }
+            
+            if (np->f_leaseFlags & kLeaseDeferClose) {
+                /* The deferred close went away with the old session */
+                np->f_leaseFlags &= ~kLeaseDeferClose;
+                
+                /* Remove the open fid from the fid table */
+                smb_fid_get_kernel_fid(smp->sm_share, np->f_fid,
+                                       1, &temp_fid);
+                np->f_fid = 0;
+                np->f_accessMode = 0;
+                np->f_rights = 0;
+            }
+            
             if (np->f_refcnt == 0) {
                 /* No open files, so done with this file */
                 continue;
@@ -3660,9 +4059,516 @@ smbfs_ClearChildren(struct smbmount *smp, struct smbnode *parent)
     smbfs_hash_unlock(smp);
 }
 
+/*
+ * smbfs_node_has_lease
+ *
+ * Does this node own the lease key? Files keep their lease on the shared
+ * open, directories on the directory lease open.
+ */
+static int
+smbfs_node_has_lease(struct smbnode *np, uint64_t lease_key_hi,
+                     uint64_t lease_key_low)
+{
+    vnode_t vp = SMBTOV(np);
+    
+    if (vnode_isreg(vp)) {
+        return ((np->f_leaseKeyHi == lease_key_hi) &&
+                (np->f_leaseKeyLow == lease_key_low));
+    }
+    
+    if (vnode_isdir(vp)) {
+        return ((np->d_leaseKeyHi == lease_key_hi) &&
+                (np->d_leaseKeyLow == lease_key_low));
+    }
+    
+    return (FALSE);
+}
+
+/*
+ * smbfs_lease_vget
+ *
+ * Find the file or directory that holds this lease key and return its vnode
+ * with an iocount. The node lock is not taken, see smbfs_handle_lease_break.
+ */
+static vnode_t
+smbfs_lease_vget(struct smbmount *smp, uint64_t lease_key_hi,
+                 uint64_t lease_key_low)
+{
+    uint32_t tree_id = 0;
+    uint64_t hash_val = 0;
+	vnode_t	vp;
+	struct smbnode_hashhead	*nhpp;
+	struct smbnode *np;
+	uint32_t vid;
+	lck_mtx_t *mtx;
+
+    smb2_smb_dur_handle_parse_lease_key(lease_key_hi, lease_key_low,
+                                        &tree_id, &hash_val);
+loop:
+	mtx = smbfs_hash_lock_bucket(smp, hash_val);
+    
+	nhpp = SMBFS_NOHASH(smp, hash_val);
+	LIST_FOREACH(np, nhpp, n_hash) {
+        if (np->n_ino != hash_val) {
+            continue;
+        }
+        
+		if (ISSET(np->n_flag, NALLOC)) {
+			SET(np->n_flag, NWALLOC);
+			smbfs_hash_sleep(smp, np, mtx, "smb_ngetalloc");
+			goto loop;
+		}
+        
+		if (ISSET(np->n_flag, NTRANSIT)) {
+			SET(np->n_flag, NWTRANSIT);
+			smbfs_hash_sleep(smp, np, mtx, "smb_ngettransit");
+			goto loop;
+		}
+        
+		vp = SMBTOV(np);
+        if (!smbfs_node_has_lease(np, lease_key_hi, lease_key_low)) {
+            continue;
+        }
+        
+		vid = vnode_vid(vp);
+		if (vnode_getwithvid(vp, vid)) {
+            continue;
+        }
+        
+        smbfs_hash_unlock_bucket(smp, mtx);
+        return (vp);
+	}
+    
+	smbfs_hash_unlock_bucket(smp, mtx);
+    return (NULL);
+}
+
+/*
+ * smbfs_lease_open_file
+ *
+ * Open the shared file and ask for a read/write/handle lease on it. Falls
+ * back to a plain open if the server or the file can't do leases.
+ *
+ * The node must be locked and the calling routine must hold a reference on 
+ * the share.
+ */
+int
+smbfs_lease_open_file(struct smb_share *share, struct smbnode *np,
+                      uint32_t rights, uint32_t shareMode, SMBFID *fidp,
+                      struct smbfattr *fap, vfs_context_t context)
+{
+    struct smb2_durable_handle lease;
+    uint32_t disp;
+    int do_create;
+    int error;
+    
+    if (!smbfs_lease_cache ||
+        (np->n_flag & N_ISSTREAM) ||
+        (smb2_smb_lease_init(share, np, SMB2_LEASE_READ_CACHING |
+                             SMB2_LEASE_WRITE_CACHING |
+                             SMB2_LEASE_HANDLE_CACHING, &lease) != 0)) {
+        return (smbfs_smb_open_file(share, np, rights, shareMode, fidp,
+                                    NULL, 0, FALSE, fap, context));
+    }
+    
+    if (np->n_flag & N_ISRSRCFRK) {
+        disp = FILE_OPEN_IF;
+        do_create = TRUE;
+    } else {
+        disp = FILE_OPEN;
+        do_create = FALSE;
+    }
+    
+    error = smbfs_smb_ntcreatex(share, np,
+                                rights, shareMode, VREG,
+                                fidp, NULL, 0,
+                                disp, FALSE, fap,
+                                do_create, &lease, context);
+    if (error) {
+        return (error);
+    }
+    
+    np->f_leaseKeyHi = lease.lease_key_hi;
+    np->f_leaseKeyLow = lease.lease_key_low;
+    if (lease.flags & SMB2_LEASE_GRANTED) {
+        np->f_leaseState = lease.lease_state;
+    } else {
+        np->f_leaseState = 0;
+    }
+    
+    return (0);
+}
+
+/*
+ * smbfs_lease_can_defer_close
+ *
+ * On the last close of a file we can keep the shared open around as long as
+ * the server lets us cache the handle and nothing else depends on the close
+ * actually happening.
+ *
+ * The node must be locked.
+ */
+int
+smbfs_lease_can_defer_close(struct smbnode *np)
+{
+    if (!smbfs_lease_cache ||
+        (np->f_fid == 0) ||
+        !(np->f_leaseState & SMB2_LEASE_HANDLE_CACHING)) {
+        return (FALSE);
+    }
+    
+    if ((np->n_flag & (NDELETEONCLOSE | NMARKEDFORDLETE | NISMAPPED)) ||
+        (np->f_openDenyList != NULL) ||
+        (np->f_smbflock != NULL) ||
+        (np->f_openState != 0)) {
+        return (FALSE);
+    }
+    
+    return (TRUE);
+}
+
+/*
+ * smbfs_lease_close_deferred
+ *
+ * Close the shared open that we kept after the last close. That was our only
+ * open so the lease is gone with it. Any data still in UBC gets thrown away 
+ * the next time the file is opened.
+ *
+ * The node must be locked and the calling routine must hold a reference on 
+ * the share.
+ */
+void
+smbfs_lease_close_deferred(struct smb_share *share, struct smbnode *np,
+                           vfs_context_t context)
+{
+    SMBFID fid;
+    int error;
+    
+    if (!(np->f_leaseFlags & kLeaseDeferClose) || (np->f_refcnt != 0)) {
+        return;
+    }
+    
+    fid = np->f_fid;
+    np->f_fid = 0;
+    np->f_accessMode = 0;
+    np->f_rights = 0;
+    np->f_leaseFlags &= ~kLeaseDeferClose;
+    if (np->f_leaseState & SMB2_LEASE_READ_CACHING) {
+        np->f_leaseFlags |= kLeaseStaleCache;
+    }
+    np->f_leaseState = 0;
+    
+    if (fid != 0) {
+        error = smbfs_smb_close(share, fid, context);
+        if (error) {
+            SMBWARNING("close file failed %d on fid %llx\n", error, fid);
+        }
+    }
+}
+
+/*
+ * smbfs_dir_lease_init
+ *
+ * Set up a read/handle lease request for opening a directory we are about to
+ * enumerate or search. Returns ENOTSUP if the server can't do directory
+ * leases.
+ *
+ * The directory node must be locked.
+ */
+int
+smbfs_dir_lease_init(struct smb_share *share, struct smbnode *dnp,
+                     struct smb2_durable_handle *lease)
+{
+    struct smb_vc *vcp = SSTOVC(share);
+    
+    if (!smbfs_lease_cache ||
+        !SMBV_SMB3_OR_LATER(vcp) ||
+        !(vcp->vc_sopt.sv_capabilities & SMB2_GLOBAL_CAP_DIRECTORY_LEASING)) {
+        return (ENOTSUP);
+    }
+    
+    return (smb2_smb_lease_init(share, dnp,
+                                SMB2_LEASE_READ_CACHING | SMB2_LEASE_HANDLE_CACHING,
+                                lease));
+}
+
+/*
+ * smbfs_dir_lease_opened
+ *
+ * The directory open that asked for a lease worked, save what the server
+ * gave us. The lease only lasts as long as we have the directory open, so
+ * the first open with a handle lease becomes the directory's lease open.
+ * Returns TRUE if the caller should leave the open to the directory.
+ *
+ * The directory node must be locked.
+ */
+int
+smbfs_dir_lease_opened(struct smbnode *dnp, struct smb2_durable_handle *lease,
+                       SMBFID fid)
+{
+    uint32_t lease_state = 0;
+    
+    if (lease->flags & SMB2_LEASE_GRANTED) {
+        lease_state = lease->lease_state;
+    }
+    
+    /*
+     * Anything we cached before we had the lease could already be out of
+     * date, start over with what we know now.
+     */
+    if ((lease_state & SMB2_LEASE_READ_CACHING) &&
+        !(dnp->d_leaseState & SMB2_LEASE_READ_CACHING)) {
+        dnp->attribute_cache_timer = 0;
+        OSIncrementAtomic((SInt32 *)&dnp->d_changecnt);
+        if (dnp->n_flag & NNEGNCENTRIES) {
+            dnp->n_flag &= ~NNEGNCENTRIES;
+            cache_purge_negatives(SMBTOV(dnp));
+        }
+    }
+    
+    dnp->d_leaseKeyHi = lease->lease_key_hi;
+    dnp->d_leaseKeyLow = lease->lease_key_low;
+    dnp->d_leaseState = lease_state;
+    
+    if ((lease_state & SMB2_LEASE_HANDLE_CACHING) && (dnp->d_leaseFid == 0)) {
+        dnp->d_leaseFid = fid;
+        return (TRUE);
+    }
+    
+    return (FALSE);
+}
+
+/*
+ * smbfs_dir_lease_close
+ *
+ * Give up the directory lease by closing the directory lease open. If an
+ * enumeration is still using that open, it gets closed when the enumeration
+ * is done instead.
+ *
+ * The directory node must be locked and the calling routine must hold a 
+ * reference on the share.
+ */
+void
+smbfs_dir_lease_close(struct smb_share *share, struct smbnode *dnp,
+                      vfs_context_t context)
+{
+    SMBFID fid = dnp->d_leaseFid;
+    int error;
+    
+    dnp->d_leaseFid = 0;
+    dnp->d_leaseState = 0;
+    
+    if (fid == 0) {
+        return;
+    }
+    
+    if ((dnp->d_fctx != NULL) && dnp->d_fctx->f_lease_fid) {
+        dnp->d_fctx->f_lease_fid = FALSE;
+        return;
+    }
+    
+    error = smbfs_smb_close(share, fid, context);
+    if (error) {
+        SMBWARNING("close dir failed %d on fid %llx\n", error, fid);
+    }
+}
+
+/*
+ * smbfs_dir_lease_check
+ *
+ * A lease break that lost handle caching could not get the node lock, so it
+ * left the directory lease open for us. A lease open without handle caching
+ * is how that gets recorded, close it now.
+ *
+ * The directory node must be locked.
+ */
+void
+smbfs_dir_lease_check(struct smbnode *dnp, vfs_context_t context)
+{
+    struct smb_share *share;
+    
+    if ((dnp->d_leaseFid == 0) ||
+        (dnp->d_leaseState & SMB2_LEASE_HANDLE_CACHING)) {
+        return;
+    }
+    
+    share = smb_get_share_with_reference(dnp->n_mount);
+    smbfs_dir_lease_close(share, dnp, context);
+    smb_share_rele(share, context);
+}
+
+/*
+ * smbfs_lease_break_process
+ *
+ * Called from the notify change thread for a lease break on the shared open
+ * of a file or on a directory. Give up what the server took away, then send 
+ * the ack.
+ *
+ * Losing write caching pushes our dirty data, losing read caching throws away 
+ * the cached data and attributes and losing handle caching closes a deferred 
+ * close. For a directory, losing read caching throws away the negative name 
+ * cache entries and the cached enumeration. We only try for the node lock,
+ * since the node can be locked by an open that is waiting on the server to
+ * finish this break. If we don't get it, the lease state is still updated
+ * atomically and the deferred close is retried once the ack lets that open
+ * finish, see smbfs_lease_close_retry. For a directory, the next open, lookup
+ * or readdir closes the lease open, see smbfs_dir_lease_check.
+ */
+void
+smbfs_lease_break_process(struct smbmount *smp, uint64_t lease_key_hi,
+                          uint64_t lease_key_low, uint32_t flags,
+                          uint32_t new_lease_state, vfs_context_t context)
+{
+    struct smb_share *share;
+    struct smbnode *np;
+	vnode_t	vp;
+    uint32_t lost, ret_lease_state;
+    int error;
+    int locked;
+    int retry_close = FALSE;
+    
+    share = smb_get_share_with_reference(smp);
+    
+    vp = smbfs_lease_vget(smp, lease_key_hi, lease_key_low);
+    if ((vp != NULL) && vnode_isdir(vp)) {
+        np = VTOSMB(vp);
+        /*
+         * We may not get the node lock, so anything we change without it
+         * has to be atomic.
+         */
+        lost = OSBitAndAtomic(new_lease_state, (UInt32 *)&np->d_leaseState) &
+               ~new_lease_state;
+        
+        if (lost & SMB2_LEASE_READ_CACHING) {
+            /* Something in the directory changed */
+            np->attribute_cache_timer = 0;
+            OSIncrementAtomic((SInt32 *)&np->d_changecnt);
+            cache_purge_negatives(vp);
+        }
+        
+        if (smbnode_trylock(np, SMBFS_EXCLUSIVE_LOCK) == 0) {
+            if (lost & SMB2_LEASE_READ_CACHING) {
+                np->n_flag &= ~NNEGNCENTRIES;
+                smbfs_dircache_free(np);
+            }
+            
+            smbfs_dir_lease_check(np, context);
+            smbnode_unlock(np);
+        }
+        
+        OSAddAtomic64(1, &smp->sm_lease_breaks);
+        smbfs_attr_cachechanged(smp);
+        vnode_put(vp);
+    }
+    else if (vp != NULL) {
+        np = VTOSMB(vp);
+        /* Other writers hold the node lock, which we may not get */
+        lost = OSBitAndAtomic(new_lease_state, (UInt32 *)&np->f_leaseState) &
+               ~new_lease_state;
+        
+        locked = (smbnode_trylock(np, SMBFS_EXCLUSIVE_LOCK) == 0);
+        
+        if (lost & SMB2_LEASE_READ_CACHING) {
+            ubc_msync(vp, 0, ubc_getsize(vp), NULL,
+                      UBC_PUSHDIRTY | UBC_SYNC | UBC_INVALIDATE);
+            np->attribute_cache_timer = 0;
+        }
+        else if (lost & SMB2_LEASE_WRITE_CACHING) {
+            ubc_msync(vp, 0, ubc_getsize(vp), NULL, UBC_PUSHDIRTY | UBC_SYNC);
+        }
+        
+        if (locked) {
+            if (lost & (SMB2_LEASE_READ_CACHING | SMB2_LEASE_WRITE_CACHING)) {
+                /* Do any pending set eof or flushes */
+                smbfs_smb_fsync(share, np, context);
+            }
+            
+            if (!(np->f_leaseState & SMB2_LEASE_HANDLE_CACHING)) {
+                smbfs_lease_close_deferred(share, np, context);
+            }
+            smbnode_unlock(np);
+        }
+        else if ((lost & SMB2_LEASE_HANDLE_CACHING) &&
+                 (np->f_leaseFlags & kLeaseDeferClose)) {
+            /* The server thinks it's closed, don't wait for the next open */
+            retry_close = TRUE;
+        }
+        
+        OSAddAtomic64(1, &smp->sm_lease_breaks);
+        smbfs_attr_cachechanged(smp);
+        vnode_put(vp);
+    }
+    
+    if (flags & SMB2_NOTIFY_BREAK_LEASE_FLAG_ACK_REQUIRED) {
+        error = smb2_smb_lease_break_ack(share, lease_key_hi, lease_key_low,
+                                         new_lease_state, &ret_lease_state,
+                                         context);
+        if (error) {
+            SMBDEBUG("lease break ack failed %d\n", error);
+        }
+    }
+    
+    if (retry_close) {
+        (void) smbfs_notify_lease_close_retry(smp, lease_key_hi, lease_key_low);
+    }
+    
+    smb_share_rele(share, context);
+}
+
+/*
+ * smbfs_lease_close_retry
+ *
+ * Called from the notify change thread to retry a deferred close that
+ * smbfs_lease_break_process couldn't do because the node was locked. Still
+ * only try for the lock, and queue another retry if we don't get it. If the
+ * node is gone, the reclaim did the close.
+ */
+void
+smbfs_lease_close_retry(struct smbmount *smp, uint64_t lease_key_hi,
+                        uint64_t lease_key_low, vfs_context_t context)
+{
+    struct smb_share *share;
+    struct smbnode *np;
+	vnode_t	vp;
+    
+    vp = smbfs_lease_vget(smp, lease_key_hi, lease_key_low);
+    if (vp == NULL) {
+        return;
+    }
+    
+    np = VTOSMB(vp);
+    if (!vnode_isreg(vp) || !(np->f_leaseFlags & kLeaseDeferClose)) {
+        /* Someone else already closed it */
+        vnode_put(vp);
+        return;
+    }
+    
+    if (smbnode_trylock(np, SMBFS_EXCLUSIVE_LOCK) == 0) {
+        /* A new open may have gotten a new handle lease */
+        if (!(np->f_leaseState & SMB2_LEASE_HANDLE_CACHING)) {
+            share = smb_get_share_with_reference(smp);
+            smbfs_lease_close_deferred(share, np, context);
+            smb_share_rele(share, context);
+        }
+        smbnode_unlock(np);
+    }
+    else {
+        (void) smbfs_notify_lease_close_retry(smp, lease_key_hi, lease_key_low);
+    }
+    
+    vnode_put(vp);
+}
+
+/*
+ * smbfs_handle_lease_break
+ *
+ * Called from the iod thread. Returns EJUSTRETURN if the break was handed
+ * to the notify change thread, which will send the ack.
+ */
 int
 smbfs_handle_lease_break(struct smbmount *smp, uint64_t lease_key_hi,
-                         uint64_t lease_key_low, uint32_t new_lease_state)
+                         uint64_t lease_key_low, uint32_t flags,
+                         uint32_t new_lease_state)
 {
     int error = 0;
     uint32_t tree_id = 0;
@@ -3672,11 +4578,60 @@ smbfs_handle_lease_break(struct smbmount *smp, uint64_t lease_key_hi,
 	struct smbnode_hashhead	*nhpp;
 	struct smbnode *np;
 	uint32_t vid;
+	lck_mtx_t *mtx;
+    int found = FALSE;
 
     /* Get hash value from lease key */
     smb2_smb_dur_handle_parse_lease_key(lease_key_hi, lease_key_low,
                                         &tree_id, &hash_val);
 
+    /*
+     * First see if this is the caching lease on the shared open of a file
+     * or on a directory. Flushing and closing can take a while and need the network, so that
+     * work is done by the notify change thread.
+     */
+	mtx = smbfs_hash_lock_bucket(smp, hash_val);
+	nhpp = SMBFS_NOHASH(smp, hash_val);
+	LIST_FOREACH(np, nhpp, n_hash) {
+        if ((np->n_ino == hash_val) &&
+            !ISSET(np->n_flag, NALLOC | NTRANSIT) &&
+            smbfs_node_has_lease(np, lease_key_hi, lease_key_low)) {
+            found = TRUE;
+            break;
+        }
+    }
+    
+    if (found) {
+        smbfs_hash_unlock_bucket(smp, mtx);
+        if (smbfs_notify_lease_break(smp, lease_key_hi, lease_key_low,
+                                     flags, new_lease_state) == 0) {
+            return (EJUSTRETURN);
+        }
+        
+        /* No notify thread, so just stop caching */
+        mtx = smbfs_hash_lock_bucket(smp, hash_val);
+        nhpp = SMBFS_NOHASH(smp, hash_val);
+        LIST_FOREACH(np, nhpp, n_hash) {
+            if ((np->n_ino == hash_val) &&
+                !ISSET(np->n_flag, NALLOC | NTRANSIT) &&
+                smbfs_node_has_lease(np, lease_key_hi, lease_key_low)) {
+                if (vnode_isdir(SMBTOV(np))) {
+                    (void) OSBitAndAtomic(new_lease_state,
+                                          (UInt32 *)&np->d_leaseState);
+                    OSIncrementAtomic((SInt32 *)&np->d_changecnt);
+                }
+                else {
+                    (void) OSBitAndAtomic(new_lease_state,
+                                          (UInt32 *)&np->f_leaseState);
+                }
+                np->attribute_cache_timer = 0;
+            }
+        }
+        smbfs_hash_unlock_bucket(smp, mtx);
+        return (0);
+    }
+	smbfs_hash_unlock_bucket(smp, mtx);
+
     /* 
      * Server must support File IDs as we have no name/name_len to use.
      * Find vnode using hash value, but SKIP locking it!
@@ -3686,7 +4641,7 @@ smbfs_handle_lease_break(struct smbmount *smp, uint64_t lease_key_hi,
      * take a node lock in processing the lease break, you end up deadlocked.
      */
 loop:
-	smbfs_hash_lock(smp);
+	mtx = smbfs_hash_lock_bucket(smp, hash_val);
     
 	nhpp = SMBFS_NOHASH(smp, hash_val);
 	LIST_FOREACH(np, nhpp, n_hash) {
@@ -3696,13 +4651,13 @@ loop:
         
 		if (ISSET(np->n_flag, NALLOC)) {
 			SET(np->n_flag, NWALLOC);
-			(void) msleep((caddr_t)np, smp->sm_hashlock, PINOD | PDROP, "smb_ngetalloc", 0);
+			smbfs_hash_sleep(smp, np, mtx, "smb_ngetalloc");
 			goto loop;
 		}
         
 		if (ISSET(np->n_flag, NTRANSIT)) {
 			SET(np->n_flag, NWTRANSIT);
-			(void) msleep((caddr_t)np, smp->sm_hashlock, PINOD | PDROP, "smb_ngettransit", 0);
+			smbfs_hash_sleep(smp, np, mtx, "smb_ngettransit");
 			goto loop;
 		}
         
@@ -3720,10 +4675,8 @@ loop:
         /* See if this vnode has the file ref entry that matches lease key */
         if (FindFileEntryByLeaseKey(vp, lease_key_hi, lease_key_low, &entry) == TRUE) {
             /*
-             * At this time, we do nothing with the lease, its just used for
-             * getting durable handles. Later when we actually use the leases for
-             * local caching, the lease break handling code should be moved to the
-             * change notify thread instead of using the iod thread.
+             * Leases on deny mode opens are only used for getting durable
+             * handles, we don't cache anything with them.
              */
             entry->dur_handle.lease_state = new_lease_state;
             error = 0;
@@ -3737,7 +4690,7 @@ loop:
         }
 	}
     
-	smbfs_hash_unlock(smp);
+	smbfs_hash_unlock_bucket(smp, mtx);
 
     return (error);
 }
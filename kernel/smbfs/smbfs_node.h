@@ -79,6 +79,10 @@ enum smbfslocktype {SMBFS_SHARED_LOCK = 1, SMBFS_EXCLUSIVE_LOCK = 2, SMBFS_RECLA
 #define kNeedReopen	0x02
 #define kInReopen   0x04  // Reopen in progress, don't update metadata
 
+/* SMB 2/3 caching lease on the shared open. Look at leaseFlags. */
+#define kLeaseDeferClose	0x01	/* Last close was deferred, fid still open */
+#define kLeaseStaleCache	0x02	/* Lease lost while closed, flush UBC on open */
+
 enum {
     kAnyMatch = 1,
     kCheckDenyOrLocks = 2,
@@ -118,6 +122,30 @@ struct fileRefEntry {
     struct fileRefEntry	*next;
 };
 
+/*
+ * Directory enumeration cache. Entry i is the directory entry at readdir
+ * offset i + 2, dot and dotdot are never cached. Names are packed into
+ * dc_names.
+ */
+struct smbfs_dircache_entry {
+	uint64_t		de_ino;
+	uint32_t		de_nameoff;		/* offset of the name in dc_names */
+	uint16_t		de_namelen;
+	uint8_t			de_type;
+};
+
+struct smbfs_dircache {
+	uint32_t		dc_changecnt;	/* d_changecnt when we started filling */
+	struct timespec	dc_timestamp;	/* when we started filling */
+	int32_t			dc_complete;	/* have all the entries in the directory */
+	uint32_t		dc_count;
+	uint32_t		dc_max;
+	struct smbfs_dircache_entry *dc_entries;
+	char			*dc_names;
+	size_t			dc_names_len;
+	size_t			dc_names_max;
+};
+
 struct smb_open_dir {
 	uint32_t		refcnt;
 	uint32_t		kq_refcnt;
@@ -130,6 +158,11 @@ struct smb_open_dir {
 	uint32_t		needReopen;		/* Need to reopen the notification */
 	uint32_t		needsUpdate;
     u_int32_t       dirchangecnt;	/* changes each insert/delete. used by readdirattr */
+	struct smbfs_dircache *dcache;	/* cached directory entries */
+	SMBFID			leaseFid;		/* open that keeps the directory lease */
+	uint64_t		leaseKeyHi;		/* directory lease key */
+	uint64_t		leaseKeyLow;
+	uint32_t		leaseState;		/* R/H caching the server granted us */
 };
 
 struct smb_open_file {
@@ -150,6 +183,10 @@ struct smb_open_file {
 	lck_mtx_t		openDenyListLock;	/* Locks the open deny list */
 	struct fileRefEntry	*openDenyList;
 	struct smbfs_flock	*smbflock;	/*  Our flock structure */
+	uint64_t		leaseKeyHi;	/* lease key used for the shared open */
+	uint64_t		leaseKeyLow;
+	uint32_t		leaseState;	/* R/W/H caching the server granted us */
+	uint32_t		leaseFlags;	/* Deferred close, stale cache */
 };
 
 struct smbnode {
@@ -205,6 +242,7 @@ struct smbnode {
 	size_t				n_snmlen;	/* if a stream then the legnth of the stream name */
 	char				*n_sname;	/* if a stream then the the name of the stream */
 	LIST_ENTRY(smbnode)	n_hash;
+	uint64_t			n_hashval;	/* hash value we were added with */
 	uint32_t			maxAccessRights;
 	struct timespec		maxAccessRightChTime;	/* change time */
 	uint32_t			n_reparse_tag;
@@ -227,6 +265,11 @@ struct smbnode {
 #define d_fid open_type.dir.fid
 #define d_needsUpdate open_type.dir.needsUpdate
 #define d_changecnt open_type.dir.dirchangecnt
+#define d_dcache open_type.dir.dcache
+#define d_leaseFid open_type.dir.leaseFid
+#define d_leaseKeyHi open_type.dir.leaseKeyHi
+#define d_leaseKeyLow open_type.dir.leaseKeyLow
+#define d_leaseState open_type.dir.leaseState
 
 /* File items */
 #define f_refcnt open_type.file.refcnt
@@ -246,24 +289,23 @@ struct smbnode {
 #define f_clusterWriteLock open_type.file.clusterWriteLock
 #define f_openDenyListLock open_type.file.openDenyListLock
 #define f_clusterCloseError open_type.file.clusterCloseError
+#define f_leaseKeyHi open_type.file.leaseKeyHi
+#define f_leaseKeyLow open_type.file.leaseKeyLow
+#define f_leaseState open_type.file.leaseState
+#define f_leaseFlags open_type.file.leaseFlags
 
 /* Attribute cache timeouts in seconds */
 #define	SMB_MINATTRTIMO 2
 #define	SMB_MAXATTRTIMO 30
+#define	SMB_ATTRTIMO_LIMIT 3600	/* largest attr_cache_max we allow */
 
 /*
- * Determine attrtimeo. It will be something between SMB_MINATTRTIMO and
- * SMB_MAXATTRTIMO where recently modified files have a short timeout
- * and files that haven't been modified in a long time have a long
- * timeout. This is the same algorithm used by NFS.
+ * Determine attrtimeo. It will be something between the mount's sm_attr_min
+ * and sm_attr_max as decided by its attribute cache policy, see
+ * smbfs_attr_cachetimeo. Leaves ts set to the current uptime.
  */
 #define SMB_CACHE_TIME(ts, np, attrtimeo) { \
-	nanotime(&ts);	\
-	attrtimeo = (ts.tv_sec - np->n_mtime.tv_sec) / 10; \
-	if (attrtimeo < SMB_MINATTRTIMO)	\
-		attrtimeo = SMB_MINATTRTIMO;	\
-	else if (attrtimeo > SMB_MAXATTRTIMO) \
-	attrtimeo = SMB_MAXATTRTIMO; \
+	attrtimeo = smbfs_attr_cachetimeo(np);	\
 	nanouptime(&ts);	\
 }
 
@@ -292,6 +334,7 @@ extern lck_grp_t *smbfs_rwlock_group;
 struct smbfattr;
 
 int smbnode_lock(struct smbnode *np, enum smbfslocktype);
+int smbnode_trylock(struct smbnode *np, enum smbfslocktype);
 int smbnode_lockpair(struct smbnode *np1, struct smbnode *np2, enum smbfslocktype);
 void smbnode_unlock(struct smbnode *np);
 void smbnode_unlockpair(struct smbnode *np1, struct smbnode *np2);
@@ -299,6 +342,8 @@ uint64_t smbfs_hash(struct smb_share *share, uint64_t ino,
                     const char *name, size_t nmlen);
 void smb_vhashrem (struct smbnode *np);
 void smb_vhashadd(struct smbnode *np, uint64_t hashval);
+int smbfs_hash_init(struct smbmount *smp);
+void smbfs_hash_destroy(struct smbmount *smp);
 int smbfs_nget(struct smb_share *share, struct mount *mp,
                vnode_t dvp, const char *name, size_t nmlen,
                struct smbfattr *fap, vnode_t *vpp,
@@ -318,6 +363,9 @@ void smbfs_attr_cacheenter(struct smb_share *share, vnode_t vp, struct smbfattr
 int smbfs_attr_cachelookup(struct smb_share *share, vnode_t vp, struct vnode_attr *va, 
 						   vfs_context_t context, int useCacheDataOnly);
 void smbfs_attr_touchdir(struct smbnode *dnp, int fatShare);
+time_t smbfs_attr_cachetimeo(struct smbnode *np);
+void smbfs_attr_cachechanged(struct smbmount *smp);
+void smbfs_attr_cacheinit(struct smbmount *smp, struct smb_mount_args *args);
 
 int smbfsIsCacheable(vnode_t vp);
 void smbfs_setsize(vnode_t vp, off_t size);
@@ -347,17 +395,39 @@ void smb_get_uid_gid_mode(struct smb_share *share, struct smbmount *smp,
 /* smbfs_io.c prototypes */
 int smbfs_readvdir(vnode_t vp, uio_t uio, vfs_context_t context, int flags, 
 				   int32_t *numdirent);
+void smbfs_dircache_free(struct smbnode *dnp);
 int smbfs_0extend(struct smb_share *share, SMBFID fid, u_quad_t from,
                   u_quad_t to, int ioflag, vfs_context_t context);
 int smbfs_doread(struct smb_share *share, off_t endOfFile, uio_t uiop,
                  SMBFID fid, vfs_context_t context);
 int smbfs_dowrite(struct smb_share *share, off_t endOfFile, uio_t uiop, 
 				  SMBFID fid, int ioflag, vfs_context_t context);
+int smbfs_strategy_async(struct buf *bp);
+int smbfs_strategy_sync(struct buf *bp);
 void smbfs_reconnect(struct smbmount *smp);
 int32_t smbfs_IObusy(struct smbmount *smp);
 void smbfs_ClearChildren(struct smbmount *smp, struct smbnode * parent);
 int smbfs_handle_lease_break(struct smbmount *smp, uint64_t lease_key_hi,
-                             uint64_t lease_key_low, uint32_t new_lease_state);
+                             uint64_t lease_key_low, uint32_t flags,
+                             uint32_t new_lease_state);
+int smbfs_lease_open_file(struct smb_share *share, struct smbnode *np,
+                          uint32_t rights, uint32_t shareMode, SMBFID *fidp,
+                          struct smbfattr *fap, vfs_context_t context);
+int smbfs_lease_can_defer_close(struct smbnode *np);
+void smbfs_lease_close_deferred(struct smb_share *share, struct smbnode *np,
+                                vfs_context_t context);
+void smbfs_lease_break_process(struct smbmount *smp, uint64_t lease_key_hi,
+                               uint64_t lease_key_low, uint32_t flags,
+                               uint32_t new_lease_state, vfs_context_t context);
+void smbfs_lease_close_retry(struct smbmount *smp, uint64_t lease_key_hi,
+                             uint64_t lease_key_low, vfs_context_t context);
+int smbfs_dir_lease_init(struct smb_share *share, struct smbnode *dnp,
+                         struct smb2_durable_handle *lease);
+int smbfs_dir_lease_opened(struct smbnode *dnp, 
+                           struct smb2_durable_handle *lease, SMBFID fid);
+void smbfs_dir_lease_close(struct smb_share *share, struct smbnode *dnp,
+                           vfs_context_t context);
+void smbfs_dir_lease_check(struct smbnode *dnp, vfs_context_t context);
 
 #define smb_ubc_getsize(v) (vnode_vtype(v) == VREG ? ubc_getsize(v) : (off_t)0)
 
@@ -44,6 +44,7 @@ extern lck_grp_t *smbfs_mutex_group;
 
 #define NOTIFY_CHANGE_SLEEP_TIMO	15
 #define NOTIFY_THROTTLE_SLEEP_TIMO	5
+#define NOTIFY_LEASE_RETRY_TIMO		1
 #define SMBFS_MAX_RCVD_NOTIFY		4
 #define SMBFS_MAX_RCVD_NOTIFY_TIME	1
 
@@ -167,8 +168,15 @@ smbfs_notified_vnode(struct smbnode *np, int throttleBack, uint32_t events,
          * where we want to return cached meta data if possible. When we stop
          * throttling, we will do an update at that time.
          */
+        
+        /*
+         * Something in the directory changed, don't trust the cached
+         * entries. We only hold the shared lock, so it has to be atomic.
+         */
+        OSIncrementAtomic((SInt32 *)&np->d_changecnt);
         np->attribute_cache_timer = 0;
         np->n_symlink_cache_timer = 0;
+        smbfs_attr_cachechanged(np->n_mount);
     }
     
 	/* 
@@ -862,6 +870,48 @@ process_notify_items(struct smbfs_notify_change *notify, vfs_context_t context)
 		OSAddAtomic(moveToPollCnt, &smp->tooManyNotifies);
 }
 
+/*
+ * process_lease_breaks
+ *
+ * Handle the lease breaks the iod thread passed to us. Each one can flush,
+ * close and ack on the network, so drop the list lock while doing it. A
+ * deferred close that still can't get the node lock goes back on the list,
+ * so only take what is queued now and retry the rest on the next pass.
+ * Returns TRUE if anything is left on the list.
+ */
+static int
+process_lease_breaks(struct smbfs_notify_change *notify, vfs_context_t context)
+{
+	STAILQ_HEAD(, lease_break_item) lease_list;
+	struct lease_break_item *leaseItem;
+	int pending;
+	
+	STAILQ_INIT(&lease_list);
+	lck_mtx_lock(&notify->lease_list_lock);
+	STAILQ_CONCAT(&lease_list, &notify->lease_list);
+	lck_mtx_unlock(&notify->lease_list_lock);
+	
+	while ((leaseItem = STAILQ_FIRST(&lease_list)) != NULL) {
+		STAILQ_REMOVE_HEAD(&lease_list, entries);
+		
+		if (leaseItem->close_retry) {
+			smbfs_lease_close_retry(notify->smp, leaseItem->lease_key_hi,
+									leaseItem->lease_key_low, context);
+		}
+		else {
+			smbfs_lease_break_process(notify->smp, leaseItem->lease_key_hi,
+									  leaseItem->lease_key_low, leaseItem->flags,
+									  leaseItem->new_lease_state, context);
+		}
+		SMB_FREE(leaseItem, M_TEMP);
+	}
+	
+	lck_mtx_lock(&notify->lease_list_lock);
+	pending = !STAILQ_EMPTY(&notify->lease_list);
+	lck_mtx_unlock(&notify->lease_list_lock);
+	return (pending);
+}
+
 /*
  * notify_main
  *
@@ -872,6 +922,7 @@ notify_main(void *arg)
 {
 	struct smbfs_notify_change	*notify = arg;
 	vfs_context_t		context;
+	int					leasePending;
 	
 	context = vfs_context_create((vfs_context_t)0);
 
@@ -884,7 +935,12 @@ notify_main(void *arg)
 	while (notify->notify_state == kNotifyThreadRunning) {
 		notify->sleeptimespec.tv_sec = NOTIFY_CHANGE_SLEEP_TIMO;
 		notify->haveMoreWork = FALSE;
+		leasePending = process_lease_breaks(notify, context);
 		process_notify_items(notify, context);
+		if (leasePending) {
+			/* A deferred close is waiting on a node lock, try again soon */
+			notify->sleeptimespec.tv_sec = NOTIFY_LEASE_RETRY_TIMO;
+		}
 		if (!notify->haveMoreWork)
 			msleep(&notify->notify_state, 0, PWAIT, "notify change idle", 
 				   &notify->sleeptimespec);	
@@ -919,6 +975,8 @@ smbfs_notify_change_create_thread(struct smbmount *smp)
 	lck_mtx_init(&notify->notify_statelock, smbfs_mutex_group, smbfs_lock_attr);	
 	lck_mtx_init(&notify->watch_list_lock, smbfs_mutex_group, smbfs_lock_attr);	
 	STAILQ_INIT(&notify->watch_list);
+	lck_mtx_init(&notify->lease_list_lock, smbfs_mutex_group, smbfs_lock_attr);
+	STAILQ_INIT(&notify->lease_list);
 
 	notify->notify_state = kNotifyThreadStarting;
 	
@@ -945,6 +1003,7 @@ void
 smbfs_notify_change_destroy_thread(struct smbmount *smp)
 {
 	struct smbfs_notify_change	*notify = smp->notify_thread;
+	struct lease_break_item *leaseItem;
 
 	if (smp->notify_thread == NULL)
 		return;
@@ -965,11 +1024,82 @@ smbfs_notify_change_destroy_thread(struct smbmount *smp)
 		}
 		msleep(notify, &notify->notify_statelock, PWAIT | PDROP, "notify change exit", 0);
 	}
+	/*
+	 * Any breaks or close retries still queued are for files we are
+	 * unmounting, no ack needed and the reclaim does the close.
+	 */
+	while ((leaseItem = STAILQ_FIRST(&notify->lease_list)) != NULL) {
+		STAILQ_REMOVE_HEAD(&notify->lease_list, entries);
+		SMB_FREE(leaseItem, M_TEMP);
+	}
 	lck_mtx_destroy(&notify->notify_statelock, smbfs_mutex_group);
 	lck_mtx_destroy(&notify->watch_list_lock, smbfs_mutex_group);
+	lck_mtx_destroy(&notify->lease_list_lock, smbfs_mutex_group);
 	SMB_FREE(notify, M_TEMP);
 }
 
+/*
+ * smbfs_notify_lease_break
+ *
+ * Called from the iod thread to pass a lease break on the shared open of a
+ * file to the notify thread. Returns ENOTSUP if the notify thread can't take
+ * it, the caller must do the ack in that case.
+ */
+int
+smbfs_notify_lease_break(struct smbmount *smp, uint64_t lease_key_hi,
+						 uint64_t lease_key_low, uint32_t flags,
+						 uint32_t new_lease_state)
+{
+	struct smbfs_notify_change *notify = smp->notify_thread;
+	struct lease_break_item *leaseItem;
+	
+	if ((notify == NULL) || (notify->notify_state > kNotifyThreadRunning)) {
+		return ENOTSUP;
+	}
+	
+	SMB_MALLOC(leaseItem, struct lease_break_item *, sizeof(*leaseItem), M_TEMP, M_WAITOK | M_ZERO);
+	leaseItem->lease_key_hi = lease_key_hi;
+	leaseItem->lease_key_low = lease_key_low;
+	leaseItem->flags = flags;
+	leaseItem->new_lease_state = new_lease_state;
+	
+	lck_mtx_lock(&notify->lease_list_lock);
+	STAILQ_INSERT_TAIL(&notify->lease_list, leaseItem, entries);
+	lck_mtx_unlock(&notify->lease_list_lock);
+	notify_wakeup(notify);
+	return 0;
+}
+
+/*
+ * smbfs_notify_lease_close_retry
+ *
+ * Called from the notify thread when a lease break that took away handle
+ * caching couldn't get the node lock to close the deferred close. The break
+ * has been acked, so just try the close again on a later pass. Returns
+ * ENOTSUP if the notify thread is going away, the reclaim does the close then.
+ */
+int
+smbfs_notify_lease_close_retry(struct smbmount *smp, uint64_t lease_key_hi,
+							   uint64_t lease_key_low)
+{
+	struct smbfs_notify_change *notify = smp->notify_thread;
+	struct lease_break_item *leaseItem;
+	
+	if ((notify == NULL) || (notify->notify_state > kNotifyThreadRunning)) {
+		return ENOTSUP;
+	}
+	
+	SMB_MALLOC(leaseItem, struct lease_break_item *, sizeof(*leaseItem), M_TEMP, M_WAITOK | M_ZERO);
+	leaseItem->lease_key_hi = lease_key_hi;
+	leaseItem->lease_key_low = lease_key_low;
+	leaseItem->close_retry = TRUE;
+	
+	lck_mtx_lock(&notify->lease_list_lock);
+	STAILQ_INSERT_TAIL(&notify->lease_list, leaseItem, entries);
+	lck_mtx_unlock(&notify->lease_list_lock);
+	return 0;
+}
+
 /*
  * enqueue_notify_change_request
  *
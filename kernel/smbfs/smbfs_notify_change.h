@@ -56,6 +56,16 @@ struct watch_item {
 	STAILQ_ENTRY(watch_item) entries;
 };
 
+/* Lease break handed off by the iod thread */
+struct lease_break_item {
+	uint64_t		lease_key_hi;
+	uint64_t		lease_key_low;
+	uint32_t		flags;
+	uint32_t		new_lease_state;
+	int				close_retry;	/* already acked, just retry the deferred close */
+	STAILQ_ENTRY(lease_break_item) entries;
+};
+
 struct smbfs_notify_change {
 	struct smbmount		*smp;
 	struct watch_item   *svrmsg_item;   /* SMB 2/3, for server messages */
@@ -68,6 +78,8 @@ struct smbfs_notify_change {
 	lck_mtx_t			notify_statelock;
 	lck_mtx_t			watch_list_lock;
 	STAILQ_HEAD(, watch_item) watch_list;
+	lck_mtx_t			lease_list_lock;
+	STAILQ_HEAD(, lease_break_item) lease_list;
 };
 
 #endif // _SMBFS_NOTIFY_CHANGE_H_
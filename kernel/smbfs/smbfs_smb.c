@@ -5533,6 +5533,8 @@ smbfs_findnext(struct smbfs_fctx *ctx, vfs_context_t context)
 {
 	int error;
 	struct timespec save_reqtime;
+	int usingUnicode;
+	size_t local_len;
 
 	for (;;) {
         /* save time that enumerate was done at */
@@ -5579,13 +5581,26 @@ smbfs_findnext(struct smbfs_fctx *ctx, vfs_context_t context)
      * Successfully parsed out one entry from the search buffer
      * so return that one entry.
      */
-    if (ctx->f_LocalName) {
-        SMB_FREE(ctx->f_LocalName, M_TEMP);	/* Free any old name we may have */
+    usingUnicode = SMB_UNICODE_STRINGS(SSTOVC(ctx->f_share));
+    local_len = smbfs_ntwrkname_tolocal_len(ctx->f_NetworkNameLen, usingUnicode) + 1;
+    if (ctx->f_LocalNameAllocSize < local_len) {
+        /* Grow the name buffer, it gets reused for the rest of the entries */
+        if (ctx->f_LocalName) {
+            SMB_FREE(ctx->f_LocalName, M_TEMP);
+        }
+        ctx->f_LocalNameAllocSize = 0;
+        SMB_MALLOC(ctx->f_LocalName, char *, local_len, M_TEMP, M_WAITOK);
+        if (ctx->f_LocalName == NULL) {
+            ctx->f_LocalNameLen = 0;
+            return ENOMEM;
+        }
+        ctx->f_LocalNameAllocSize = local_len;
     }
-	ctx->f_LocalNameLen = ctx->f_NetworkNameLen;
-	ctx->f_LocalName = smbfs_ntwrkname_tolocal(ctx->f_NetworkNameBuffer, 
-                                               &ctx->f_LocalNameLen,
-                                               SMB_UNICODE_STRINGS(SSTOVC(ctx->f_share)));
+	ctx->f_LocalNameLen = smbfs_ntwrkname_tolocal_buf(ctx->f_NetworkNameBuffer, 
+                                                      ctx->f_NetworkNameLen,
+                                                      usingUnicode,
+                                                      ctx->f_LocalName,
+                                                      ctx->f_LocalNameAllocSize);
 
     if (!(SSTOVC(ctx->f_share)->vc_misc_flags & SMBV_HAS_FILEIDS)) {
         /* Server does not support File IDs */
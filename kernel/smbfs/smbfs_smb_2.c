@@ -23,6 +23,7 @@
 
 #include <sys/smb_apple.h>
 #include <sys/syslog.h>
+#include <sys/sysctl.h>
 
 #include <sys/msfscc.h>
 #include <netsmb/smb.h>
@@ -96,6 +97,24 @@ static int
 smb2fs_smb_set_eof(struct smb_share *share, SMBFID fid, uint64_t newsize,
                    vfs_context_t context);
 
+/*
+ * Directory enumerations ask for up to querydir_maxbuf bytes per Query Dir,
+ * if the server's max transact size allows it, and send the next Query Dir
+ * while the current reply is still being parsed.
+ */
+static uint32_t smbfs_querydir_maxbuf = 4 * kSMB_MAX_TX;
+static int smbfs_querydir_prefetch = 1;
+static uint64_t smbfs_querydir_enums = 0;
+static uint64_t smbfs_querydir_round_trips = 0;
+static uint64_t smbfs_querydir_prefetch_hits = 0;
+
+SYSCTL_DECL(_net_smb_fs);
+SYSCTL_INT(_net_smb_fs, OID_AUTO, querydir_maxbuf, CTLFLAG_RW, &smbfs_querydir_maxbuf, 0, "");
+SYSCTL_INT(_net_smb_fs, OID_AUTO, querydir_prefetch, CTLFLAG_RW, &smbfs_querydir_prefetch, 0, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, querydir_enums, CTLFLAG_RD, &smbfs_querydir_enums, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, querydir_round_trips, CTLFLAG_RD, &smbfs_querydir_round_trips, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, querydir_prefetch_hits, CTLFLAG_RD, &smbfs_querydir_prefetch_hits, "");
+
 
 /*
  * Note:  The _smbfs_smb_ in the function name indicates that these functions 
@@ -1118,7 +1137,7 @@ parse_read:
     }
     
     /* Parse the Read response */
-    tmp_error = smb2_smb_parse_read_one(mdp, &rresid, readp);
+    tmp_error = smb2_smb_parse_read_one(read_rqp, mdp, &rresid, readp);
     if (tmp_error) {
         /* Read parsing got an error, try parsing the Close */
         if (!error) {
@@ -1750,27 +1769,74 @@ bad:
     return error;
 }
 
+/*
+ * A Create/QueryInfo/Close compound request that has been sent but whose
+ * replies have not been parsed yet. Splitting the send from the reply lets
+ * a caller have several of these in flight at the same time.
+ */
+struct smb2fs_cmpd_query_pb {
+    struct smb_share *share;
+    struct smbnode *create_np;
+    struct smbfattr *fap;
+    struct smb2_create_rq *createp;
+    struct smb2_query_info_rq *queryp;
+    struct smb2_close_rq *closep;
+	struct smb_rq *create_rqp;
+	struct smb_rq *query_rqp;
+	struct smb_rq *close_rqp;
+    int send_error;
+};
+
+static void
+smb2fs_smb_cmpd_query_done(struct smb2fs_cmpd_query_pb *pb)
+{
+    if (pb->create_rqp != NULL) {
+        smb_rq_done(pb->create_rqp);
+        pb->create_rqp = NULL;
+    }
+    if (pb->query_rqp != NULL) {
+        smb_rq_done(pb->query_rqp);
+        pb->query_rqp = NULL;
+    }
+    if (pb->close_rqp != NULL) {
+        smb_rq_done(pb->close_rqp);
+        pb->close_rqp = NULL;
+    }
+
+    if (pb->createp != NULL) {
+        SMB_FREE(pb->createp, M_SMBTEMP);
+    }
+    if (pb->queryp != NULL) {
+        SMB_FREE(pb->queryp, M_SMBTEMP);
+    }
+    if (pb->closep != NULL) {
+        SMB_FREE(pb->closep, M_SMBTEMP);
+    }
+
+    if (pb->fap != NULL) {
+        SMB_FREE(pb->fap, M_SMBTEMP);
+    }
+}
+
+/*
+ * Build the Create/QueryInfo/Close compound request and hand it to the iod.
+ * The replies are picked up by smb2fs_smb_cmpd_query_reply. No matter what
+ * is returned, the caller must call smb2fs_smb_cmpd_query_done on pb.
+ */
 static int
-smb2fs_smb_cmpd_query(struct smb_share *share, struct smbnode *create_np, enum vtype vnode_type,
-                      const char *create_namep, size_t create_name_len,
-                      uint32_t create_xattr, uint32_t create_desired_access,
-                      uint8_t query_info_type, uint8_t query_file_info_class,
-                      uint32_t query_add_info, uint32_t *max_accessp,
-                      uint32_t *query_output_buffer_len, uint8_t *query_output_buffer,
-                      vfs_context_t context)
+smb2fs_smb_cmpd_query_send(struct smb_share *share, struct smbnode *create_np,
+                           enum vtype vnode_type,
+                           const char *create_namep, size_t create_name_len,
+                           uint32_t create_xattr, uint32_t create_desired_access,
+                           uint8_t query_info_type, uint8_t query_file_info_class,
+                           uint32_t query_add_info,
+                           uint32_t query_output_buffer_len, uint8_t *query_output_buffer,
+                           struct smb2fs_cmpd_query_pb *pb,
+                           vfs_context_t context)
 {
-	int error, tmp_error;
+	int error;
     SMBFID fid = 0;
-    struct smbfattr *fap = NULL;
-    struct smb2_create_rq *createp = NULL;
     struct smb2_query_info_rq *queryp = NULL;
-    struct smb2_close_rq *closep = NULL;
-	struct smb_rq *create_rqp = NULL;
-	struct smb_rq *query_rqp = NULL;
-	struct smb_rq *close_rqp = NULL;
-	struct mdchain *mdp;
-    size_t next_cmd_offset = 0;
-    uint32_t need_delete_fid = 0;
     uint32_t share_access = NTCREATEX_SHARE_ACCESS_ALL;
     uint64_t create_flags = create_xattr ? SMB2_CREATE_IS_NAMED_STREAM : 0;
     char *file_namep = NULL, *stream_namep = NULL;
@@ -1785,33 +1851,36 @@ smb2fs_smb_cmpd_query(struct smb_share *share, struct smbnode *create_np, enum v
      */
 
     /*
-     * Note: Be careful as 
+     * Note: Be careful as
      * (1) share->ss_mount can be null
      * (2) create_np can be null
      */
-    
-    SMB_MALLOC(fap,
-               struct smbfattr *, 
-               sizeof(struct smbfattr), 
-               M_SMBTEMP, 
+    pb->share = share;
+    pb->create_np = create_np;
+
+    SMB_MALLOC(pb->fap,
+               struct smbfattr *,
+               sizeof(struct smbfattr),
+               M_SMBTEMP,
                M_WAITOK | M_ZERO);
-    if (fap == NULL) {
+    if (pb->fap == NULL) {
         SMBERROR("SMB_MALLOC failed\n");
         error = ENOMEM;
         goto bad;
     }
 
-    SMB_MALLOC(queryp,
+    SMB_MALLOC(pb->queryp,
                struct smb2_query_info_rq *,
                sizeof(struct smb2_query_info_rq),
                M_SMBTEMP,
                M_WAITOK | M_ZERO);
-    if (queryp == NULL) {
+    if (pb->queryp == NULL) {
         SMBERROR("SMB_MALLOC failed\n");
         error = ENOMEM;
         goto bad;
     }
-    
+    queryp = pb->queryp;
+
     if ((create_np == NULL) && (create_namep != NULL) &&
         ((query_file_info_class == FileFsAttributeInformation) ||
          (query_file_info_class == FileFsSizeInformation))) {
@@ -1823,16 +1892,15 @@ smb2fs_smb_cmpd_query(struct smb_share *share, struct smbnode *create_np, enum v
             add_submount_path = 1;
         }
 
-resend:
     /*
-     * Build the Create call 
+     * Build the Create call
      */
     create_flags |= SMB2_CREATE_GET_MAX_ACCESS;
-    
+
     if (add_submount_path == 1) {
         create_flags |= SMB2_CREATE_NAME_IS_PATH;
     }
-    
+
     /* Should we check to see if the server is OS X based? */
     if (!(SSTOVC(share)->vc_misc_flags & (SMBV_OSX_SERVER | SMBV_OTHER_SERVER))) {
         if ((create_np != NULL) &&
@@ -1843,7 +1911,7 @@ resend:
             create_flags |= SMB2_CREATE_AAPL_QUERY;
         }
     }
-    
+
     if (!(create_flags & SMB2_CREATE_IS_NAMED_STREAM)) {
         file_namep = (char *) create_namep;
         file_name_len = create_name_len;
@@ -1869,115 +1937,139 @@ resend:
                                  create_desired_access, vnode_type,
                                  share_access, disposition,
                                  create_flags, create_options,
-                                 &fid, fap,
-                                 &create_rqp, &createp, 
+                                 &fid, pb->fap,
+                                 &pb->create_rqp, &pb->createp,
                                  NULL, context);
     if (error) {
         SMBERROR("smb2fs_smb_ntcreatex failed %d\n", error);
         goto bad;
     }
-    
+
     if (add_submount_path == 1) {
         /* Clear DFS Operation flag that got set */
-        *create_rqp->sr_flagsp &= ~(htolel(SMB2_FLAGS_DFS_OPERATIONS));
+        *pb->create_rqp->sr_flagsp &= ~(htolel(SMB2_FLAGS_DFS_OPERATIONS));
     }
-    
+
     /* Update Create hdr */
-    error = smb2_rq_update_cmpd_hdr(create_rqp, SMB2_CMPD_FIRST);
+    error = smb2_rq_update_cmpd_hdr(pb->create_rqp, SMB2_CMPD_FIRST);
     if (error) {
         SMBERROR("smb2_rq_update_cmpd_hdr failed %d\n", error);
         goto bad;
     }
-    
-    /* 
-     * Build the Query Info request 
+
+    /*
+     * Build the Query Info request
      */
     queryp->info_type = query_info_type;
     queryp->file_info_class = query_file_info_class;
     queryp->add_info = query_add_info;
     queryp->flags = 0;
-    queryp->output_buffer_len = *query_output_buffer_len;
+    queryp->output_buffer_len = query_output_buffer_len;
     queryp->output_buffer = query_output_buffer;
     queryp->input_buffer_len = 0;
     queryp->input_buffer = NULL;
     queryp->ret_buffer_len = 0;
     fid = 0xffffffffffffffff;   /* fid is -1 for compound requests */
     queryp->fid = fid;
-    
-    error = smb2_smb_query_info(share, queryp, &query_rqp, context);
+
+    error = smb2_smb_query_info(share, queryp, &pb->query_rqp, context);
     if (error) {
         SMBERROR("smb2_smb_query_info failed %d\n", error);
         goto bad;
     }
-    
+
     /* Update Query hdr */
-    error = smb2_rq_update_cmpd_hdr(query_rqp, SMB2_CMPD_MIDDLE);
+    error = smb2_rq_update_cmpd_hdr(pb->query_rqp, SMB2_CMPD_MIDDLE);
     if (error) {
         SMBERROR("smb2_rq_update_cmpd_hdr failed %d\n", error);
         goto bad;
     }
 
     /* Chain Query Info to the Create */
-    create_rqp->sr_next_rqp = query_rqp;
-    
-    /* 
-     * Build the Close request 
+    pb->create_rqp->sr_next_rqp = pb->query_rqp;
+
+    /*
+     * Build the Close request
      */
-    error = smb2_smb_close_fid(share, fid, &close_rqp, &closep, context);
+    error = smb2_smb_close_fid(share, fid, &pb->close_rqp, &pb->closep, context);
     if (error) {
         SMBERROR("smb2_smb_close_fid failed %d\n", error);
         goto bad;
     }
-    
+
     /* Update Close hdr */
-    error = smb2_rq_update_cmpd_hdr(close_rqp, SMB2_CMPD_LAST);
+    error = smb2_rq_update_cmpd_hdr(pb->close_rqp, SMB2_CMPD_LAST);
     if (error) {
         SMBERROR("smb2_rq_update_cmpd_hdr failed %d\n", error);
         goto bad;
     }
-    
+
     /* Chain Close to the Query Info */
-    query_rqp->sr_next_rqp = close_rqp;
-    
-    /* 
-     * Send the compound request of Create/Query/Close 
+    pb->query_rqp->sr_next_rqp = pb->close_rqp;
+
+    /*
+     * Send the compound request of Create/Query/Close. Same as smb_rq_simple
+     * except we do not wait for the reply here.
      */
-    error = smb_rq_simple(create_rqp);
-    
+    pb->create_rqp->sr_timo = pb->create_rqp->sr_vc->vc_timo;
+    pb->create_rqp->sr_state = SMBRQ_NOTSENT;
+    pb->send_error = smb_iod_rq_enqueue(pb->create_rqp);
+
+bad:
+	return error;
+}
+
+/*
+ * Wait for and parse the replies to a compound sent by
+ * smb2fs_smb_cmpd_query_send. If the request got caught in a reconnect,
+ * *reconnectedp is set and the caller needs to build and send it again.
+ */
+static int
+smb2fs_smb_cmpd_query_reply(struct smb2fs_cmpd_query_pb *pb,
+                            uint32_t *max_accessp,
+                            uint32_t *query_output_buffer_len,
+                            int *reconnectedp,
+                            vfs_context_t context)
+{
+	int error, tmp_error;
+    SMBFID fid = 0;
+    struct smb_share *share = pb->share;
+    struct smbfattr *fap = pb->fap;
+    struct smb2_create_rq *createp = pb->createp;
+    struct smb2_query_info_rq *queryp = pb->queryp;
+    struct smb2_close_rq *closep = pb->closep;
+	struct smb_rq *create_rqp = pb->create_rqp;
+	struct smb_rq *query_rqp = pb->query_rqp;
+	struct smb_rq *close_rqp = pb->close_rqp;
+	struct mdchain *mdp;
+    size_t next_cmd_offset = 0;
+    uint32_t need_delete_fid = 0;
+
+    error = pb->send_error;
+    if (!error) {
+        error = smb_rq_reply(create_rqp);
+    }
+
     if ((error) && (create_rqp->sr_flags & SMBR_RECONNECTED)) {
-        /* Rebuild and try sending again */
-        smb_rq_done(create_rqp);
-        create_rqp = NULL;
-        
-        smb_rq_done(query_rqp);
-        query_rqp = NULL;
-        
-        smb_rq_done(close_rqp);
-        close_rqp = NULL;
-        
-        SMB_FREE(createp, M_SMBTEMP);
-        createp = NULL;
-        
-        SMB_FREE(closep, M_SMBTEMP);
-        closep = NULL;
-        
-        goto resend;
+        /* Caller has to rebuild and try sending again */
+        *reconnectedp = 1;
+        return error;
     }
 
     createp->ret_ntstatus = create_rqp->sr_ntstatus;
 
     /* Get pointer to response data */
     smb_rq_getreply(create_rqp, &mdp);
-    
+
     if (error) {
         /* Create failed, try parsing the Query Info */
         if ((error != ENOENT) && (error != EACCES)) {
             SMBDEBUG("smb_rq_simple failed %d id %lld\n",
                      error, create_rqp->sr_messageid);
         }
-        
-        /* 
-         * Some servers return an error with the AAPL Create context instead 
+
+        /*
+         * Some servers return an error with the AAPL Create context instead
          * of just ignoring the context like it says in the MS-SMB doc.
          * Obviously must be a non OS X Server.
          */
@@ -1985,32 +2077,32 @@ resend:
             SMBDEBUG("Found a NON OS X server\n");
             SSTOVC(share)->vc_misc_flags |= SMBV_OTHER_SERVER;
         }
-        
+
         goto parse_query;
     }
-    
-    /* 
+
+    /*
      * Parse the Create response.
      */
     error = smb2_smb_parse_create(share, mdp, createp);
     if (error) {
         /* Create parsing failed, try parsing the Query Info */
-        SMBERROR("smb2_smb_parse_create failed %d id %lld\n", 
+        SMBERROR("smb2_smb_parse_create failed %d id %lld\n",
                  error, create_rqp->sr_messageid);
         goto parse_query;
     }
-    
+
     /* At this point, fid has been entered into fid table */
     need_delete_fid = 1;
-    
+
     /*
      * Fill in fap and possibly update vnode's meta data caches
      */
-    error = smb2fs_smb_parse_ntcreatex(share, create_np, createp, 
+    error = smb2fs_smb_parse_ntcreatex(share, pb->create_np, createp,
                                        &fid, fap, context);
     if (error) {
         /* Updating meta data cache failed, try parsing the Query Info */
-        SMBERROR("smb2fs_smb_parse_ntcreatex failed %d id %lld\n", 
+        SMBERROR("smb2fs_smb_parse_ntcreatex failed %d id %lld\n",
                  error, create_rqp->sr_messageid);
     }
     else {
@@ -2020,20 +2112,20 @@ resend:
             *max_accessp = fap->fa_max_access;
         }
     }
-    
+
 parse_query:
     /* Consume any pad bytes */
     tmp_error = smb2_rq_next_command(create_rqp, &next_cmd_offset, mdp);
     if (tmp_error) {
         /* Failed to find next command, so can't parse rest of the responses */
-        SMBERROR("create smb2_rq_next_command failed %d id %lld\n", 
+        SMBERROR("create smb2_rq_next_command failed %d id %lld\n",
                  tmp_error, create_rqp->sr_messageid);
         error = error ? error : tmp_error;
         goto bad;
     }
-    
-    /* 
-     * Parse Query Info SMB 2/3 header 
+
+    /*
+     * Parse Query Info SMB 2/3 header
      */
     tmp_error = smb2_rq_parse_header(query_rqp, &mdp);
     queryp->ret_ntstatus = query_rqp->sr_ntstatus;
@@ -2046,14 +2138,14 @@ parse_query:
         }
         goto parse_close;
     }
-    
+
     /* Parse the Query Info response */
     tmp_error = smb2_smb_parse_query_info(mdp, queryp);
     if (tmp_error) {
         /* Query Info parsing got an error, try parsing the Close */
         if (!error) {
             if (tmp_error != ENOATTR) {
-                SMBERROR("smb2_smb_parse_query_info failed %d id %lld\n", 
+                SMBERROR("smb2_smb_parse_query_info failed %d id %lld\n",
                          tmp_error, query_rqp->sr_messageid);
             }
             error = tmp_error;
@@ -2063,21 +2155,21 @@ parse_query:
     else {
         *query_output_buffer_len = queryp->ret_buffer_len;
     }
-    
+
 parse_close:
     /* Update closep fid so it gets freed from FID table */
     closep->fid = createp->ret_fid;
-    
+
     /* Consume any pad bytes */
     tmp_error = smb2_rq_next_command(query_rqp, &next_cmd_offset, mdp);
     if (tmp_error) {
         /* Failed to find next command, so can't parse rest of the responses */
         SMBERROR("query smb2_rq_next_command failed %d\n", tmp_error);
         error = error ? error : tmp_error;
-        goto bad;    
+        goto bad;
     }
-    
-    /* 
+
+    /*
      * Parse Close SMB 2/3 header
      */
     tmp_error = smb2_rq_parse_header(close_rqp, &mdp);
@@ -2089,24 +2181,24 @@ parse_close:
                      tmp_error, close_rqp->sr_messageid);
             error = tmp_error;
         }
-        goto bad;    
+        goto bad;
     }
-    
+
     /* Parse the Close response */
     tmp_error = smb2_smb_parse_close(mdp, closep);
     if (tmp_error) {
         /* Close parsing got an error */
         if (!error) {
-            SMBERROR("smb2_smb_parse_close failed %d id %lld\n", 
+            SMBERROR("smb2_smb_parse_close failed %d id %lld\n",
                      tmp_error, close_rqp->sr_messageid);
             error = tmp_error;
         }
-        goto bad;    
+        goto bad;
     }
-    
+
     /* At this point, fid has been removed from fid table */
     need_delete_fid = 0;
-    
+
 bad:
     if (need_delete_fid == 1) {
         /*
@@ -2119,29 +2211,45 @@ bad:
             SMBERROR("Second close failed %d\n", tmp_error);
         }
     }
-    
-    if (create_rqp != NULL) {
-        smb_rq_done(create_rqp);
-    }
-    if (query_rqp != NULL) {
-        smb_rq_done(query_rqp);
-    }
-    if (close_rqp != NULL) {
-        smb_rq_done(close_rqp);
-    }
-    
-    if (createp != NULL) {
-        SMB_FREE(createp, M_SMBTEMP);
-    }
-    if (queryp != NULL) {
-        SMB_FREE(queryp, M_SMBTEMP);
-    }
-    if (closep != NULL) {
-        SMB_FREE(closep, M_SMBTEMP);
+
+	return error;
+}
+
+static int
+smb2fs_smb_cmpd_query(struct smb_share *share, struct smbnode *create_np, enum vtype vnode_type,
+                      const char *create_namep, size_t create_name_len,
+                      uint32_t create_xattr, uint32_t create_desired_access,
+                      uint8_t query_info_type, uint8_t query_file_info_class,
+                      uint32_t query_add_info, uint32_t *max_accessp,
+                      uint32_t *query_output_buffer_len, uint8_t *query_output_buffer,
+                      vfs_context_t context)
+{
+	int error;
+    int reconnected;
+    struct smb2fs_cmpd_query_pb pb;
+
+resend:
+    bzero(&pb, sizeof(pb));
+    reconnected = 0;
+
+    error = smb2fs_smb_cmpd_query_send(share, create_np, vnode_type,
+                                       create_namep, create_name_len,
+                                       create_xattr, create_desired_access,
+                                       query_info_type, query_file_info_class,
+                                       query_add_info,
+                                       *query_output_buffer_len, query_output_buffer,
+                                       &pb, context);
+    if (!error) {
+        error = smb2fs_smb_cmpd_query_reply(&pb, max_accessp,
+                                            query_output_buffer_len,
+                                            &reconnected, context);
     }
-    
-    if (fap != NULL) {
-        SMB_FREE(fap, M_SMBTEMP);
+
+    smb2fs_smb_cmpd_query_done(&pb);
+
+    if (reconnected) {
+        /* Rebuild and try sending again */
+        goto resend;
     }
 
 	return error;
@@ -2166,6 +2274,8 @@ smb2fs_smb_cmpd_query_dir(struct smbfs_fctx *ctx,
     uint32_t disposition = FILE_OPEN;
     enum vtype vnode_type = VDIR;
     int n_parent_locked = 0;
+    struct smb2_durable_handle lease;
+    int want_lease = 0;
     
     /*
      * For this function, vnode_type is VDIR as the Open will be done on the
@@ -2210,6 +2320,19 @@ resend:
     /* fid is -1 for compound requests */
     ctx->f_create_fid = 0xffffffffffffffff;
     
+    /*
+     * Ask for a directory lease when opening the dir we are searching, the
+     * caller holds its node lock. With a lease, the enumeration results and
+     * negative name cache entries stay good until the server breaks it.
+     */
+    create_flags = 0;
+    want_lease = 0;
+    if ((create_np == ctx->f_dnp) &&
+        (smbfs_dir_lease_init(ctx->f_share, create_np, &lease) == 0)) {
+        create_flags |= SMB2_CREATE_LEASE;
+        want_lease = 1;
+    }
+    
     create_options = smb2fs_smb_get_create_options(ctx->f_share, create_np,
                                                    NULL, NULL,
                                                    vnode_type, 0);
@@ -2221,7 +2344,7 @@ resend:
                                  create_flags, create_options,
                                  &ctx->f_create_fid, NULL,
                                  &create_rqp, &createp,
-                                 NULL, context);
+                                 (want_lease) ? &lease : NULL, context);
     if (error) {
         SMBERROR("smb2fs_smb_ntcreatex failed %d\n", error);
         goto bad;
@@ -2303,6 +2426,12 @@ resend:
     /* At this point, the dir was successfully opened */
     ctx->f_need_close = TRUE;
     ctx->f_create_fid = createp->ret_fid;
+    
+    if (want_lease) {
+        /* If the dir keeps this open for its lease, it closes it */
+        ctx->f_lease_fid = smbfs_dir_lease_opened(create_np, &lease,
+                                                  createp->ret_fid);
+    }
 
 parse_query:
     /* Consume any pad bytes */
@@ -4326,26 +4455,319 @@ smbfs_smb_close(struct smb_share *share, SMBFID fid, vfs_context_t context)
 	return error;
 }
 
+/* Max number of FSCTL_SRV_COPYCHUNK requests we keep in flight */
+#define kCOPYCHUNK_MAX_INFLIGHT 8
+
 /*
- * This routine is used for both Mac-to-Mac and Mac-to-Windows copyfile
- * operations.  For Mac-to-Mac, the FSCTL_SRV_COPYCHUNK ioctl is sent with
- * a chunk count of zero, because the server uses copyfile(3) and doesn't need
- * a list of chunks from the client.  To specify Mac-to-Mac semantics, the
- * mac_to_mac parameter should be set to TRUE.
+ * One FSCTL_SRV_COPYCHUNK request of a pipelined copy
+ */
+struct smb2_copychunk_pb {
+    struct smb2_ioctl_rq    ioctl;
+    struct smb_rq           *rqp;
+    uint64_t                offset;     /* src and target offset of the first chunk */
+    uint64_t                len;        /* bytes covered by all the chunks */
+    uint32_t                chunk_count;
+    char                    sendbuf[sizeof(struct smb2_copychunk) +
+                                    (sizeof(struct smb2_copychunk_chunk) * SMB2_COPYCHUNK_ARR_SIZE)];
+};
+
+/*
+ * Fill in one copychunk request starting at offset and send it off. Returns
+ * without waiting for the reply.
  */
 static int
-smb2fs_smb_copychunks(struct smb_share *share, SMBFID src_fid,
-                      SMBFID targ_fid, uint64_t src_file_len,
-                      int mac_to_mac, vfs_context_t context)
+smb2fs_smb_copychunk_send(struct smb_share *share, struct smb2_copychunk_pb *pb,
+                          u_char *resume_key, SMBFID targ_fid,
+                          uint64_t offset, uint64_t len,
+                          uint32_t max_chunk_len, uint32_t max_chunks,
+                          uint32_t max_data_len, vfs_context_t context)
 {
-    struct smb2_ioctl_rq            *ioctlp = NULL;
-    struct smb2_copychunk           *copychunk_hdr;
-    struct smb2_copychunk_chunk     *copychunk_element;
-    struct smb2_copychunk_result    *copychunk_result;
-    char                            *sendbuf = NULL;
-    uint32_t                        sendbuf_len, src_offset, chunk_count;
-    uint32_t                        max_chunk_len, retry;
-    uint64_t                        remaining_len, this_len;
+    struct smb2_copychunk *copychunk_hdr = (struct smb2_copychunk *) pb->sendbuf;
+    struct smb2_copychunk_chunk *copychunk_element;
+    int error;
+    
+    copychunk_element = (struct smb2_copychunk_chunk *)(pb->sendbuf + sizeof(struct smb2_copychunk));
+    
+    /* Fillup the chunk array */
+    error = smb2fs_smb_fillchunk_arr(copychunk_element, max_chunks,
+                                     MIN(len, max_data_len), max_chunk_len,
+                                     offset, offset,
+                                     &pb->chunk_count, &pb->len);
+    if (error) {
+        return (error);
+    }
+    pb->offset = offset;
+    
+    memcpy(copychunk_hdr->source_key, resume_key, SMB2_RESUME_KEY_LEN);
+    copychunk_hdr->chunk_count = pb->chunk_count;
+    copychunk_hdr->reserved = 0;
+    
+    bzero(&pb->ioctl, sizeof(pb->ioctl));
+    pb->ioctl.share = share;
+    pb->ioctl.ctl_code = FSCTL_SRV_COPYCHUNK;
+    pb->ioctl.fid = targ_fid;
+    pb->ioctl.snd_input_buffer = (uint8_t *) pb->sendbuf;
+    /* snd_input_len depends on how many chunks we're sending */
+    pb->ioctl.snd_input_len = sizeof(struct smb2_copychunk) +
+        (sizeof(struct smb2_copychunk_chunk) * pb->chunk_count);
+    pb->ioctl.rcv_output_len = sizeof(struct smb2_copychunk_result);
+    
+    /* Just build the request, we send it ourselves */
+    error = smb2_smb_ioctl(share, &pb->ioctl, &pb->rqp, context);
+    if (error) {
+        SMBDEBUG("smb2_smb_ioctl error: %d, offset: %llu, len: %llu\n",
+                 error, pb->offset, pb->len);
+        return (error);
+    }
+    
+    pb->rqp->sr_flags &= ~SMBR_COMPOUND_RQ;
+	pb->rqp->sr_state = SMBRQ_NOTSENT;
+    
+    error = smb_iod_rq_enqueue(pb->rqp);
+    if (error) {
+        SMBERROR("smb_iod_rq_enqueue failed %d\n", error);
+        /* Never queued, so there is no reply to wait for */
+        smb_rq_done(pb->rqp);
+        pb->rqp = NULL;
+    }
+    
+    return (error);
+}
+
+/*
+ * Wait for a copychunk request to finish and parse its reply.
+ * Returns ERESTART if the request was lost to a reconnect.
+ */
+static int
+smb2fs_smb_copychunk_wait(struct smb2_copychunk_pb *pb)
+{
+    struct mdchain *mdp;
+    int error, parse_error;
+    
+    if (pb->rqp == NULL) {
+        return (0);
+    }
+    
+    error = smb_rq_reply(pb->rqp);
+    pb->ioctl.ret_ntstatus = pb->rqp->sr_ntstatus;
+    
+    if ((error) && (pb->rqp->sr_flags & SMBR_RECONNECTED)) {
+        error = ERESTART;
+    }
+    else if ((error == 0) || (error == EINVAL)) {
+        /*
+         * On STATUS_INVALID_PARAMETER the reply carries the server's
+         * copychunk limits, so parse it in that case too.
+         */
+        smb_rq_getreply(pb->rqp, &mdp);
+        parse_error = smb2_smb_parse_ioctl(mdp, &pb->ioctl);
+        if (error == 0) {
+            error = parse_error;
+        }
+    }
+    
+    smb_rq_done(pb->rqp);
+    pb->rqp = NULL;
+    
+    return (error);
+}
+
+/*
+ * Server side copy of src_file_len bytes using FSCTL_SRV_COPYCHUNK.
+ *
+ * Keeps up to kCOPYCHUNK_MAX_INFLIGHT requests in flight, limited by the
+ * credits we have, so large copies are not bound by the round trip time.
+ * Requests are reaped in the order they were sent, so everything below
+ * done_offset has been copied. If the server rejects our chunk sizes it
+ * returns its limits, we switch to those once and redo the copy from
+ * done_offset. Same after a reconnect.
+ */
+static int
+smb2fs_smb_copychunks_async(struct smb_share *share, u_char *resume_key,
+                            SMBFID targ_fid, uint64_t src_file_len,
+                            vfs_context_t context)
+{
+    struct smb_vc *vcp = SSTOVC(share);
+    struct smb2_copychunk_pb *pb_arr = NULL, *pb;
+    struct smb2_copychunk_result *copychunk_result;
+    uint64_t next_offset = 0, done_offset = 0;
+    uint32_t max_chunk_len = SMB2_COPYCHUNK_MAX_CHUNK_LEN;
+    uint32_t max_chunks = SMB2_COPYCHUNK_ARR_SIZE;
+    uint32_t max_data_len = SMB2_COPYCHUNK_MAX_CHUNK_LEN * SMB2_COPYCHUNK_ARR_SIZE;
+    uint32_t head = 0, count = 0, window, i;
+    int32_t curr_credits;
+    int limited = 0, restart;
+    int error = 0;
+    
+    SMB_MALLOC(pb_arr,
+               struct smb2_copychunk_pb *,
+               sizeof(struct smb2_copychunk_pb) * kCOPYCHUNK_MAX_INFLIGHT,
+               M_SMBTEMP,
+               M_WAITOK | M_ZERO);
+    if (pb_arr == NULL) {
+		SMBERROR("SMB_MALLOC failed\n");
+        return (ENOMEM);
+    }
+    
+    while (done_offset < src_file_len) {
+        /* Fill the pipe, leaving some credits for everyone else */
+        curr_credits = OSAddAtomic(0, &vcp->vc_credits_granted);
+        window = (curr_credits > kCREDIT_LOW_WATER) ? curr_credits - kCREDIT_LOW_WATER : 1;
+        window = MIN(window, kCOPYCHUNK_MAX_INFLIGHT);
+        
+        while ((count < window) && (next_offset < src_file_len)) {
+            pb = &pb_arr[(head + count) % kCOPYCHUNK_MAX_INFLIGHT];
+            error = smb2fs_smb_copychunk_send(share, pb, resume_key, targ_fid,
+                                              next_offset,
+                                              src_file_len - next_offset,
+                                              max_chunk_len, max_chunks,
+                                              max_data_len, context);
+            if (error) {
+                goto out;
+            }
+            next_offset += pb->len;
+            count++;
+        }
+        
+        /* Reap the oldest one */
+        pb = &pb_arr[head];
+        head = (head + 1) % kCOPYCHUNK_MAX_INFLIGHT;
+        count--;
+        restart = 0;
+        
+        error = smb2fs_smb_copychunk_wait(pb);
+        if (error == ERESTART) {
+            SMBDEBUG("reconnected at offset %llu\n", pb->offset);
+            error = 0;
+            restart = 1;
+            goto check_restart;
+        }
+        
+        if ((error) && (pb->ioctl.ret_ntstatus != STATUS_INVALID_PARAMETER)) {
+            SMBDEBUG("smb2_smb_ioctl error: %d, offset: %llu, max_chunk: %u, count: %u, len: %llu\n",
+                     error, pb->offset, max_chunk_len, pb->chunk_count, pb->len);
+            goto out;
+        }
+        
+        /* sanity check */
+        if ( (pb->ioctl.rcv_output_len < sizeof(struct smb2_copychunk_result)) ||
+            (pb->ioctl.rcv_output_buffer == NULL) ) {
+            /* big problem, response too small, nothing we can do */
+            SMBERROR("rcv_output_buffer too small, expected: %lu, got: %u\n",
+                     sizeof(struct smb2_copychunk_result), pb->ioctl.rcv_output_len);
+            error = EINVAL;
+            goto out;
+        }
+        
+        // Check results
+        copychunk_result = (struct smb2_copychunk_result *)pb->ioctl.rcv_output_buffer;
+        
+        if ((pb->ioctl.ret_ntstatus == STATUS_INVALID_PARAMETER) && !limited) {
+            /*
+             * Exceeded one of the server's limits. The server returns its
+             * max chunk count in chunks_written, its max chunk length in
+             * chunk_bytes_written and the max bytes per request in
+             * total_bytes_written. Use those from now on.
+             * See <rdar://problem/14750992>.
+             */
+            SMBDEBUG("server limits: chunks %u chunk len %u total len %u\n",
+                     copychunk_result->chunks_written,
+                     copychunk_result->chunk_bytes_written,
+                     copychunk_result->total_bytes_written);
+            
+            if ((copychunk_result->chunks_written != 0) &&
+                (copychunk_result->chunks_written < max_chunks)) {
+                max_chunks = copychunk_result->chunks_written;
+                restart = 1;
+            }
+            if ((copychunk_result->chunk_bytes_written != 0) &&
+                (copychunk_result->chunk_bytes_written < max_chunk_len)) {
+                max_chunk_len = copychunk_result->chunk_bytes_written;
+                restart = 1;
+            }
+            if ((copychunk_result->total_bytes_written != 0) &&
+                (copychunk_result->total_bytes_written < max_data_len)) {
+                max_data_len = copychunk_result->total_bytes_written;
+                restart = 1;
+            }
+            
+            if (restart) {
+                limited = 1;
+                error = 0;
+                SMB_FREE(pb->ioctl.rcv_output_buffer, M_SMBTEMP);
+                goto check_restart;
+            }
+        }
+        
+        if (pb->ioctl.ret_ntstatus != STATUS_SUCCESS) {
+            SMBDEBUG("smb2_smb_ioctl result: nt_stat: 0x%0x\n", pb->ioctl.ret_ntstatus);
+            
+            /* map the nt_status to an errno */
+            error = smb_ntstatus_to_errno(pb->ioctl.ret_ntstatus);
+            goto out;
+        }
+        
+        if (copychunk_result->chunks_written != pb->chunk_count) {
+            SMBERROR("copychunk error: chunks_written: %u, expected: %u\n",
+                     copychunk_result->chunks_written, pb->chunk_count);
+            error = EIO;
+            goto out;
+        }
+        
+        if (copychunk_result->total_bytes_written != pb->len) {
+            SMBERROR("copychunk error: total_bytes_written: %u, expected: %llu\n",
+                     copychunk_result->total_bytes_written, pb->len);
+            error = EIO;
+            goto out;
+        }
+        
+        SMB_FREE(pb->ioctl.rcv_output_buffer, M_SMBTEMP);
+        done_offset += pb->len;
+        
+check_restart:
+        if (restart) {
+            /* Let the rest finish, then start over from the oldest one */
+            for (i = 0; i < kCOPYCHUNK_MAX_INFLIGHT; i++) {
+                (void) smb2fs_smb_copychunk_wait(&pb_arr[i]);
+                if (pb_arr[i].ioctl.rcv_output_buffer != NULL) {
+                    SMB_FREE(pb_arr[i].ioctl.rcv_output_buffer, M_SMBTEMP);
+                }
+            }
+            head = 0;
+            count = 0;
+            next_offset = done_offset;
+        }
+    }
+    
+out:
+    for (i = 0; i < kCOPYCHUNK_MAX_INFLIGHT; i++) {
+        /* If it has not finished, then wait for it to finish */
+        (void) smb2fs_smb_copychunk_wait(&pb_arr[i]);
+        if (pb_arr[i].ioctl.rcv_output_buffer != NULL) {
+            SMB_FREE(pb_arr[i].ioctl.rcv_output_buffer, M_SMBTEMP);
+        }
+    }
+    SMB_FREE(pb_arr, M_SMBTEMP);
+    
+    return (error);
+}
+
+/*
+ * This routine is used for both Mac-to-Mac and Mac-to-Windows copyfile
+ * operations.  For Mac-to-Mac, the FSCTL_SRV_COPYCHUNK ioctl is sent with
+ * a chunk count of zero, because the server uses copyfile(3) and doesn't need
+ * a list of chunks from the client.  To specify Mac-to-Mac semantics, the
+ * mac_to_mac parameter should be set to TRUE.
+ */
+static int
+smb2fs_smb_copychunks(struct smb_share *share, SMBFID src_fid,
+                      SMBFID targ_fid, uint64_t src_file_len,
+                      int mac_to_mac, vfs_context_t context)
+{
+    struct smb2_ioctl_rq            *ioctlp = NULL;
+    struct smb2_copychunk           *copychunk_hdr;
+    char                            *sendbuf = NULL;
+    uint32_t                        sendbuf_len;
     u_char                          resume_key[SMB2_RESUME_KEY_LEN];
     int error = 0;
     
@@ -4434,99 +4856,8 @@ smb2fs_smb_copychunks(struct smb_share *share, SMBFID src_fid,
         }
     } else {
         /* Non Mac-to-Mac case */
-        
-        retry = 0;
-        copychunk_element = (struct smb2_copychunk_chunk *)(sendbuf + sizeof(struct smb2_copychunk));
-        max_chunk_len = SMB2_COPYCHUNK_MAX_CHUNK_LEN;
-
-again:
-        remaining_len = src_file_len;
-        src_offset = 0;
-        while (remaining_len) {
-            
-            /* Fillup the chunk array */
-            error = smb2fs_smb_fillchunk_arr(copychunk_element,
-                                    SMB2_COPYCHUNK_ARR_SIZE,
-                                    remaining_len, max_chunk_len,
-                                    src_offset, src_offset,
-                                     &chunk_count, &this_len);
-            if (error) {
-                goto out;
-            }
-            
-            remaining_len -= this_len;
-            src_offset += this_len;
-            copychunk_hdr->chunk_count = chunk_count;
-            
-            /* snd_input_len depends on how many chunks we're sending */
-            ioctlp->snd_input_len = sizeof(struct smb2_copychunk) +
-                (sizeof(struct smb2_copychunk_chunk) * chunk_count);
-        
-            error = smb2_smb_ioctl(share, ioctlp, NULL, context);
-        
-            if (error) {
-                SMBDEBUG("smb2_smb_ioctl error: %d, remain: %llu, max_chunk: %u, count: %u, this_len: %llu\n",
-                         error, remaining_len, max_chunk_len, chunk_count, this_len);
-                
-                if (ioctlp->ret_ntstatus != STATUS_INVALID_PARAMETER) {
-                    goto out;
-                }
-            }
-        
-            /* sanity check */
-            if ( (ioctlp->rcv_output_len < sizeof(struct smb2_copychunk_result)) ||
-                (ioctlp->rcv_output_buffer == NULL) ) {
-                /* big problem, response too small, nothing we can do */
-                SMBERROR("rcv_output_buffer too small, expected: %lu, got: %u\n",
-                     sizeof(struct smb2_copychunk_result), ioctlp->rcv_output_len);
-                error = EINVAL;
-                goto out;
-            }
-            
-            // Check results
-            copychunk_result = (struct smb2_copychunk_result *)ioctlp->rcv_output_buffer;
-        
-            if (ioctlp->ret_ntstatus == STATUS_INVALID_PARAMETER && !retry) {
-                /*
-                 * Exceeded server's maximum chunk length.  We will try
-                 * once more using the server's value, which is
-                 * returned by the server in chunk_bytes_written.
-                 * See <rdar://problem/14750992>.
-                 */
-                
-                if (copychunk_result->chunk_bytes_written < max_chunk_len) {
-                    max_chunk_len = copychunk_result->chunk_bytes_written;
-                    retry = 1;
-  
-                    SMB_FREE(ioctlp->rcv_output_buffer, M_SMBTEMP);
-                    goto again;
-                }
-            }
-            
-            if (ioctlp->ret_ntstatus != STATUS_SUCCESS) {
-                SMBDEBUG("smb2_smb_ioctl result: nt_stat: 0x%0x\n", ioctlp->ret_ntstatus);
-            
-                /* map the nt_status to an errno */
-                error = smb_ntstatus_to_errno(ioctlp->ret_ntstatus);
-                goto out;
-            }
-        
-            if (copychunk_result->chunks_written != copychunk_hdr->chunk_count) {
-                SMBERROR("copychunk error: chunks_written: %u, expected: %u\n",
-                         copychunk_result->chunks_written, copychunk_hdr->chunk_count);
-                error = EIO;
-                goto out;
-            }
-        
-            if (copychunk_result->total_bytes_written != this_len) {
-                SMBERROR("copychunk error: total_bytes_written: %u, expected: %llu\n",
-                         copychunk_result->total_bytes_written, this_len);
-                error = EIO;
-                goto out;
-            }
-        
-            SMB_FREE(ioctlp->rcv_output_buffer, M_SMBTEMP);
-        }
+        error = smb2fs_smb_copychunks_async(share, resume_key, targ_fid,
+                                            src_file_len, context);
     }
 out:
     // clean house
@@ -5148,8 +5479,22 @@ smbfs_smb_findclose(struct smbfs_fctx *ctx, vfs_context_t context)
             ctx->f_query_rqp = NULL;
         }
         
-        /* Close Create FID if we need to */
-        if (ctx->f_need_close == TRUE) {
+        /* Enumeration stopped early, wait out the Query Dir we sent ahead */
+        if (ctx->f_prefetch_rqp) {
+            (void) smb_rq_reply(ctx->f_prefetch_rqp);
+            smb_rq_done(ctx->f_prefetch_rqp);
+            ctx->f_prefetch_rqp = NULL;
+        }
+        
+        if (ctx->f_round_trips) {
+            OSIncrementAtomic64((SInt64 *) &smbfs_querydir_enums);
+            OSAddAtomic64(ctx->f_round_trips, (SInt64 *) &smbfs_querydir_round_trips);
+            SMB_LOG_IO("enumeration took %u Query Dir round trips\n",
+                       ctx->f_round_trips);
+        }
+        
+        /* Close Create FID if we need to, unless the dir kept it for its lease */
+        if ((ctx->f_need_close == TRUE) && !ctx->f_lease_fid) {
             error = smb2_smb_close_fid(ctx->f_share, ctx->f_create_fid, 
                                        NULL, NULL, context);
             if (error) {
@@ -5183,6 +5528,90 @@ smbfs_smb_findclose(struct smbfs_fctx *ctx, vfs_context_t context)
     
 }
 
+/*
+ * Send the next Query Dir of an enumeration without waiting for the reply,
+ * so the server is working on it while we parse the current one. Only done
+ * once the dir is open since the Query Dir has to use its fid. Not getting
+ * it sent is fine, smb2fs_smb_findnext will just send it itself.
+ */
+static void
+smb2fs_smb_query_dir_prefetch(struct smbfs_fctx *ctx,
+                              struct smb2_query_dir_rq *queryp,
+                              vfs_context_t context)
+{
+    struct smb_rq *rqp;
+    int error;
+    
+    if ((!smbfs_querydir_prefetch) ||
+        (ctx->f_flags & (SMBFS_RDD_EOF | SMBFS_RDD_FINDSINGLE)) ||
+        (ctx->f_need_close == FALSE) ||
+        (ctx->f_prefetch_rqp != NULL)) {
+        return;
+    }
+    
+    /* Continue the search from where this reply left off */
+    queryp->flags = 0;
+    queryp->file_index = 0;
+    queryp->fid = ctx->f_create_fid;
+    
+    /* Just build the request, we send it ourselves */
+    error = smb2_smb_query_dir(ctx->f_share, queryp, &rqp, context);
+    if (error) {
+        if (queryp->ret_rqp != NULL) {
+            smb_rq_done(queryp->ret_rqp);
+            queryp->ret_rqp = NULL;
+        }
+        return;
+    }
+    
+    rqp->sr_flags &= ~SMBR_COMPOUND_RQ;
+	rqp->sr_state = SMBRQ_NOTSENT;
+    
+    nanouptime(&ctx->f_prefetch_time);
+    error = smb_iod_rq_enqueue(rqp);
+    if (error) {
+        SMBDEBUG("smb_iod_rq_enqueue failed %d\n", error);
+        smb_rq_done(rqp);
+        return;
+    }
+    
+    ctx->f_prefetch_rqp = rqp;
+}
+
+/*
+ * Wait for the Query Dir sent by smb2fs_smb_query_dir_prefetch and parse its
+ * reply. On success the reply becomes ctx->f_query_rqp. Any error other than
+ * ENOENT means the caller should just send the Query Dir again.
+ */
+static int
+smb2fs_smb_query_dir_wait(struct smbfs_fctx *ctx,
+                          struct smb2_query_dir_rq *queryp)
+{
+    struct smb_rq *rqp = ctx->f_prefetch_rqp;
+    struct mdchain *mdp;
+    int error;
+    
+    ctx->f_prefetch_rqp = NULL;
+    
+    error = smb_rq_reply(rqp);
+    queryp->ret_ntstatus = rqp->sr_ntstatus;
+    if (!error) {
+        smb_rq_getreply(rqp, &mdp);
+        error = smb2_smb_parse_query_dir(mdp, queryp);
+    }
+    
+    if (error) {
+        if (error != ENOENT) {
+            SMBDEBUG("prefetched Query Dir failed %d, resending\n", error);
+        }
+        smb_rq_done(rqp);
+        return (error);
+    }
+    
+    ctx->f_query_rqp = rqp;
+    return (0);
+}
+
 static int
 smb2fs_smb_findnext(struct smbfs_fctx *ctx, vfs_context_t context)
 {
@@ -5285,10 +5714,15 @@ again:
         if (SSTOVC(ctx->f_share)->vc_misc_flags & SMBV_64K_QUERY_DIR) {
             queryp->output_buffer_len = kSMB_64K;
         }
-        else {
+        else if (ctx->f_flags & SMBFS_RDD_FINDSINGLE) {
             queryp->output_buffer_len = MIN(SSTOVC(ctx->f_share)->vc_txmax,
                                             kSMB_MAX_TX);
         }
+        else {
+            /* Enumerations get fewer round trips with bigger replies */
+            queryp->output_buffer_len = MIN(SSTOVC(ctx->f_share)->vc_txmax,
+                                            MAX(smbfs_querydir_maxbuf, kSMB_64K));
+        }
 
         /* 
          * Copy in whether to use UTF_SFM_CONVERSIONS or not 
@@ -5300,6 +5734,20 @@ again:
         queryp->namep = (char*) ctx->f_lookupName;
         queryp->name_len = (uint32_t) ctx->f_lookupNameLen;
 
+        if (ctx->f_prefetch_rqp != NULL) {
+            /* The next reply may already be here */
+            error = smb2fs_smb_query_dir_wait(ctx, queryp);
+            if (error == 0) {
+                OSIncrementAtomic64((SInt64 *) &smbfs_querydir_prefetch_hits);
+                ts = ctx->f_prefetch_time;
+                goto have_reply;
+            }
+            if (error == ENOENT) {
+                ctx->f_flags |= SMBFS_RDD_EOF;
+                goto bad;
+            }
+        }
+
         if (ctx->f_need_close == FALSE) {
             /* Build and send a Create/Query dir */
             error = smb2fs_smb_cmpd_query_dir(ctx, queryp, context);
@@ -5340,7 +5788,9 @@ again:
             goto bad;
         }
 
+have_reply:
         ctx->f_output_buf_len = queryp->ret_buffer_len;
+        ctx->f_round_trips++;
         
         if (ctx->f_flags & SMBFS_RDD_FINDFIRST) {
             /* next find will be a Find Next */
@@ -5349,6 +5799,9 @@ again:
         
         ctx->f_eofs = 0;
         ctx->f_attr.fa_reqtime = ts;
+        
+        /* Get the server started on the next batch while we parse this one */
+        smb2fs_smb_query_dir_prefetch(ctx, queryp, context);
 	}
     
     /*
@@ -5407,6 +5860,218 @@ bad:
     return error;
 }
 
+/*
+ * Look ahead in the current Query Dir reply without consuming anything from
+ * ctx. Fills in up to max_entries of the entries that smbfs_findnext will
+ * return next, skipping '.' and '..' like it does. Never sends a Query Dir,
+ * so it stops at the end of the current reply. Entries [0, *countp) are
+ * valid even if an error is returned.
+ */
+int
+smb2fs_smb_findpeek(struct smbfs_fctx *ctx,
+                    struct smbfs_streaminfo_pb *entries,
+                    uint32_t max_entries, uint32_t *countp)
+{
+    struct mdchain md, *mdp;
+    struct smbfs_streaminfo_pb *entryp;
+    uint32_t save_resume_file_index = ctx->f_resume_file_index;
+    uint32_t save_eofs = ctx->f_eofs;
+    uint32_t save_output_buf_len = ctx->f_output_buf_len;
+    char *network_name = NULL;
+    uint32_t network_name_len;
+    size_t name_len;
+    int usingUnicode = SMB_UNICODE_STRINGS(SSTOVC(ctx->f_share));
+    int error = 0;
+
+    *countp = 0;
+
+    if ((max_entries == 0) ||
+        (ctx->f_output_buf_len == 0) ||
+        (ctx->f_query_rqp == NULL)) {
+        return (0);
+    }
+
+    SMB_MALLOC(network_name,
+               char *,
+               ctx->f_MaxNetworkNameBufferSize,
+               M_SMBTEMP,
+               M_WAITOK);
+    if (network_name == NULL) {
+        SMBERROR("SMB_MALLOC failed\n");
+        return (ENOMEM);
+    }
+
+    /* Same reply that smb2fs_smb_findnext is parsing entries out of */
+    if ((ctx->f_create_rqp != NULL) &&
+        !(ctx->f_query_rqp->sr_extflags & SMB2_RESPONSE)) {
+        smb_rq_getreply(ctx->f_create_rqp, &mdp);
+    }
+    else {
+        smb_rq_getreply(ctx->f_query_rqp, &mdp);
+    }
+
+    /* Parse from a copy so the real position in the reply does not move */
+    md = *mdp;
+
+    while ((ctx->f_output_buf_len > 0) && (*countp < max_entries)) {
+        entryp = &entries[*countp];
+        bzero(entryp, sizeof(*entryp));
+        network_name_len = 0;
+
+        error = smb2_smb_parse_query_dir_both_dir_info(ctx->f_share, &md,
+                                                       ctx->f_infolevel,
+                                                       ctx, &entryp->attr,
+                                                       network_name, &network_name_len,
+                                                       ctx->f_MaxNetworkNameBufferSize);
+        if (error) {
+            break;
+        }
+
+		if (usingUnicode) {
+            /* ignore the Unicode '.' and '..' dirs */
+			if ((network_name_len == 2 &&
+			     letohs(*(uint16_t *)network_name) == 0x002e) ||
+			    (network_name_len == 4 &&
+			     letohl(*(uint32_t *)network_name) == 0x002e002e))
+				continue;
+		}
+        else {
+            /* ignore the '.' and '..' dirs */
+			if ((network_name_len == 1 && network_name[0] == '.') ||
+			    (network_name_len == 2 && network_name[0] == '.' &&
+			     network_name[1] == '.'))
+				continue;
+		}
+
+        name_len = network_name_len;
+        entryp->namep = smbfs_ntwrkname_tolocal(network_name, &name_len,
+                                                usingUnicode);
+        if (entryp->namep == NULL) {
+            error = ENOMEM;
+            break;
+        }
+        entryp->name_len = name_len;
+        entryp->attr.fa_reqtime = ctx->f_attr.fa_reqtime;
+
+        if (!(SSTOVC(ctx->f_share)->vc_misc_flags & SMBV_HAS_FILEIDS)) {
+            /* Server does not support File IDs */
+            entryp->attr.fa_ino = smbfs_getino(ctx->f_dnp,
+                                               entryp->namep,
+                                               entryp->name_len);
+        }
+
+        *countp += 1;
+    }
+
+    /* Undo what parsing did to the search position */
+    ctx->f_resume_file_index = save_resume_file_index;
+    ctx->f_eofs = save_eofs;
+    ctx->f_output_buf_len = save_output_buf_len;
+
+    SMB_FREE(network_name, M_SMBTEMP);
+
+    return (error);
+}
+
+/*
+ * Get the named stream info (resource fork size, whether there is any Finder
+ * Info, max access) of several children of dnp. All the Create/QueryInfo/Close
+ * compounds are sent before waiting on any replies, so the whole batch costs
+ * about one round trip. Each entry gets its own error; one that got caught
+ * in a reconnect just returns an error and is left for the caller to retry
+ * the slow way.
+ *
+ * The calling routine must hold a reference on the share
+ */
+int
+smb2fs_smb_qstreaminfo_batch(struct smb_share *share, struct smbnode *dnp,
+                             struct smbfs_streaminfo_pb *entries,
+                             uint32_t count, vfs_context_t context)
+{
+    struct smb2fs_cmpd_query_pb *cmpdp = NULL;
+    struct FILE_STREAM_INFORMATION *stream_infop = NULL;
+    struct smbfs_streaminfo_pb *entryp;
+    uint32_t output_buffer_len;
+    uint32_t i;
+    int reconnected;
+    int error = 0;
+
+    if (count == 0) {
+        return (0);
+    }
+
+    SMB_MALLOC(cmpdp,
+               struct smb2fs_cmpd_query_pb *,
+               sizeof(struct smb2fs_cmpd_query_pb) * count,
+               M_SMBTEMP,
+               M_WAITOK | M_ZERO);
+    SMB_MALLOC(stream_infop,
+               struct FILE_STREAM_INFORMATION *,
+               sizeof(struct FILE_STREAM_INFORMATION) * count,
+               M_SMBTEMP,
+               M_WAITOK | M_ZERO);
+    if ((cmpdp == NULL) || (stream_infop == NULL)) {
+        SMBERROR("SMB_MALLOC failed\n");
+        error = ENOMEM;
+        goto done;
+    }
+
+    /* Get all of them on the wire first */
+    for (i = 0; i < count; i++) {
+        entryp = &entries[i];
+
+        entryp->stream_flags = 0;
+        entryp->rsrc_size = 0;
+        entryp->rsrc_alloc = 0;
+        entryp->max_access = 0;
+
+        /* Same setup as smb2fs_smb_qstreaminfo for the readdirattr case */
+        stream_infop[i].share = share;
+        stream_infop[i].np = dnp;
+        stream_infop[i].namep = entryp->namep;
+        stream_infop[i].name_len = entryp->name_len;
+        stream_infop[i].stream_namep = SFM_RESOURCEFORK_NAME;
+        stream_infop[i].stream_sizep = &entryp->rsrc_size;
+        stream_infop[i].stream_alloc_sizep = &entryp->rsrc_alloc;
+        stream_infop[i].stream_flagsp = &entryp->stream_flags;
+
+        entryp->error = smb2fs_smb_cmpd_query_send(share, dnp,
+                                                   (entryp->attr.fa_attr & SMB_EFA_DIRECTORY) ? VDIR : VREG,
+                                                   entryp->namep, entryp->name_len,
+                                                   0, SMB2_FILE_READ_ATTRIBUTES | SMB2_SYNCHRONIZE,
+                                                   SMB2_0_INFO_FILE, FileStreamInformation,
+                                                   0,
+                                                   64 * 1024, (uint8_t *) &stream_infop[i],
+                                                   &cmpdp[i], context);
+    }
+
+    /* Now collect the replies */
+    for (i = 0; i < count; i++) {
+        entryp = &entries[i];
+
+        if (entryp->error == 0) {
+            output_buffer_len = 64 * 1024;
+            reconnected = 0;
+            entryp->error = smb2fs_smb_cmpd_query_reply(&cmpdp[i],
+                                                        &entryp->max_access,
+                                                        &output_buffer_len,
+                                                        &reconnected, context);
+        }
+
+        smb2fs_smb_cmpd_query_done(&cmpdp[i]);
+    }
+
+done:
+    if (cmpdp != NULL) {
+        SMB_FREE(cmpdp, M_SMBTEMP);
+    }
+    if (stream_infop != NULL) {
+        SMB_FREE(stream_infop, M_SMBTEMP);
+    }
+
+    return (error);
+}
+
 int
 smbfs_smb_findnext(struct smbfs_fctx *ctx, vfs_context_t context)
 {
@@ -5790,7 +6455,7 @@ smb2fs_smb_ntcreatex(struct smb_share *share, struct smbnode *np,
         oplock_level = SMB2_OPLOCK_LEVEL_LEASE;
     }
     else {
-        if (create_flags & SMB2_CREATE_DUR_HANDLE) {
+        if (create_flags & (SMB2_CREATE_DUR_HANDLE | SMB2_CREATE_LEASE)) {
             createp->create_contextp = create_contextp;
             oplock_level = SMB2_OPLOCK_LEVEL_LEASE;
         }
@@ -5905,6 +6570,10 @@ smbfs_smb_ntcreatex(struct smb_share *share, struct smbnode *np,
                 if (dur_handlep->flags & SMB2_DURABLE_HANDLE_REQUEST) {
                     create_flags = SMB2_CREATE_DUR_HANDLE;
                 }
+                else if (dur_handlep->flags & SMB2_LEASE_REQUEST) {
+                    /* Just a caching lease, keep the other contexts */
+                    create_flags |= SMB2_CREATE_LEASE;
+                }
             }
         }
         
@@ -7438,10 +8107,11 @@ smb2fs_smb_validate_neg_info(struct smb_share *share, vfs_context_t context)
     }
     
     /*
-     * Only SMB 3.x and non Anonymous/Guest supports validate negotiate
+     * Only SMB 3.0/3.02 and non Anonymous/Guest supports validate negotiate.
+     * SMB 3.1.1 protects the Negotiate with preauth integrity instead.
      */
     if (!(vcp->vc_flags & SMBV_SMB2) ||
-        (vcp->vc_flags & (SMBV_SMB2002 | SMBV_SMB21)) ||
+        (vcp->vc_flags & (SMBV_SMB2002 | SMBV_SMB21 | SMBV_SMB311)) ||
         (vcp->vc_flags & SMBV_ANONYMOUS_ACCESS) ||
         (vcp->vc_flags & SMBV_GUEST_ACCESS)) {
         return 0;
@@ -373,6 +373,55 @@ smbfs_create_start_path(struct smbmount *smp, struct smb_mount_args *args,
 	}
 }
 
+/*
+ * How big a buffer smbfs_ntwrkname_tolocal needs for a network name of
+ * nmlen bytes, not counting the null terminator.
+ *
+ * In Mac OS X the local name can be larger and in-place conversions are
+ * not supported.
+ * So for UNICODE we can have up to 9 bytes for every UTF16 bytes. So 
+ * normally you would need 3 UTF8 bytes for every UTF16 character point, but 
+ * we also need to deal with preompose/decompose character sets, so make 
+ * sure the buffer is big enough to hanlde these case. That would be nine
+ * times the UTF16 length in bytes.
+ * For code pages cases we only need a buffer 3 times as large.
+ */
+size_t
+smbfs_ntwrkname_tolocal_len(size_t nmlen, int usingUnicode)
+{
+	if (usingUnicode) {
+		return MIN(nmlen * 9, SMB_MAXPKTLEN);
+	} else {
+		return MIN(nmlen * 3, SMB_MAXPKTLEN);
+	}
+}
+
+/*
+ * Converts a network name to a local UTF-8 name in a buffer the caller
+ * supplies, so walking a directory doesn't need an allocation per name.
+ *
+ * Returns the length of the UTF-8 name.
+ *	dst - at least smbfs_ntwrkname_tolocal_len(nmlen) + 1 bytes
+ * NOTE:
+ *	The UTF-8 name is always null terminated.
+ */
+size_t
+smbfs_ntwrkname_tolocal_buf(const char *ntwrk_name, size_t nmlen, 
+							int usingUnicode, char *dst, size_t dstlen)
+{
+	size_t inlen, outlen, length;
+	
+	DBG_ASSERT(dstlen > 0);
+	length = MIN(smbfs_ntwrkname_tolocal_len(nmlen, usingUnicode), dstlen - 1);
+	outlen = length;
+	inlen = nmlen;
+	(void)smb_convert_from_network(&ntwrk_name, &inlen, &dst, &outlen, 
+								   UTF_SFM_CONVERSIONS, usingUnicode);
+	/* dst was advanced past the name */
+	*dst = 0;
+	return (length - outlen);
+}
+
 /*
  * Converts a network name to a local UTF-8 name.
  *
@@ -386,39 +435,21 @@ smbfs_create_start_path(struct smbmount *smp, struct smb_mount_args *args,
 char *
 smbfs_ntwrkname_tolocal(const char *ntwrk_name, size_t *nmlen, int usingUnicode)
 {
-	char *dst, *odst = NULL;
-	size_t inlen, outlen, length;
+	char *dst;
+	size_t length;
 
 	if (!nmlen || (*nmlen == 0))
 		return NULL;
-	/*
-	 * In Mac OS X the local name can be larger and in-place conversions are
-	 * not supported.
-	 * So for UNICODE we can have up to 9 bytes for every UTF16 bytes. So 
-	 * normally you would need 3 UTF8 bytes for every UTF16 character point, but 
-	 * we also need to deal with preompose/decompose character sets, so make 
-	 * sure the buffer is big enough to hanlde these case. That would be nine
-	 * times the UTF16 length in bytes.
-	 * For code pages cases we only need a buffer 3 times as large.
-	 */
-	if (usingUnicode) {
-		length = MIN(*nmlen * 9, SMB_MAXPKTLEN);
-	} else {
-		length = MIN(*nmlen * 3, SMB_MAXPKTLEN);
-	}
+	
+	length = smbfs_ntwrkname_tolocal_len(*nmlen, usingUnicode);
 	SMB_MALLOC(dst, char *, length+1, M_TEMP, M_WAITOK | M_ZERO);
-	outlen = length;
-	inlen = *nmlen;
-	odst = dst;
-	(void)smb_convert_from_network( &ntwrk_name, &inlen, &dst, &outlen, 
-								   UTF_SFM_CONVERSIONS, usingUnicode);
-	*nmlen = length - outlen;
 	/* 
 	 * Always make sure its null terminate, remember we allocated an extra 
 	 * byte so this is always safe. Should we resize the buffer here?
 	 */
-	odst[*nmlen] = 0;
-	return odst;
+	*nmlen = smbfs_ntwrkname_tolocal_buf(ntwrk_name, *nmlen, usingUnicode, 
+										 dst, length+1);
+	return dst;
 }
 
 /*
@@ -115,6 +115,7 @@ struct smbfs_fctx {
 	struct smbfattr	f_attr;		/* current attributes */
 	char *			f_LocalName;
 	size_t			f_LocalNameLen;
+	size_t			f_LocalNameAllocSize;	/* f_LocalName is reused for each entry */
 	char *			f_NetworkNameBuffer;
 	size_t			f_MaxNetworkNameBufferSize;
 	uint32_t		f_NetworkNameLen;
@@ -142,12 +143,40 @@ struct smbfs_fctx {
     struct smb_rq *f_query_rqp;
     int         f_need_close;
     SMBFID      f_create_fid;
+    int         f_lease_fid;    /* f_create_fid is also the dir lease open */
 	uint32_t	f_resume_file_index;
 	uint32_t	f_output_buf_len;   /* bytes left in current response */
+    struct smb_rq *f_prefetch_rqp;  /* next Query Dir, sent but not reaped */
+    struct timespec f_prefetch_time;
+	uint32_t	f_round_trips;      /* Query Dirs done by this enumeration */
 };
 
 #define f_t2	f_urq.uf_t2
 
+/*
+ * One directory entry whose named stream info is fetched by
+ * smb2fs_smb_qstreaminfo_batch. Entries filled in by smb2fs_smb_findpeek
+ * have their namep allocated with M_TEMP, which the caller frees.
+ */
+struct smbfs_streaminfo_pb {
+    char *namep;
+    size_t name_len;
+    struct smbfattr attr;       /* from the enumeration */
+    vnode_t vp;                 /* for the caller's use */
+    int error;
+    uint32_t stream_flags;
+    uint64_t rsrc_size;
+    uint64_t rsrc_alloc;
+    uint32_t max_access;
+};
+
+int smb2fs_smb_findpeek(struct smbfs_fctx *ctx,
+                        struct smbfs_streaminfo_pb *entries,
+                        uint32_t max_entries, uint32_t *countp);
+int smb2fs_smb_qstreaminfo_batch(struct smb_share *share, struct smbnode *dnp,
+                                 struct smbfs_streaminfo_pb *entries,
+                                 uint32_t count, vfs_context_t context);
+
 struct smb_mount_args;
 
 int smbfs_smb_create_unix_symlink(struct smb_share *share, struct smbnode *dnp,
@@ -288,6 +317,9 @@ int smb1fs_setsec(struct smb_share *share, SMBFID fid, uint32_t selector,
                   vfs_context_t context);
 void smb_time_NT2local(uint64_t nsec, struct timespec *tsp);
 void smb_time_local2NT(struct timespec *tsp, uint64_t *nsec, int fat_fstype);
+size_t smbfs_ntwrkname_tolocal_len(size_t nmlen, int usingUnicode);
+size_t smbfs_ntwrkname_tolocal_buf(const char *ntwrk_name, size_t nmlen,
+								   int usingUnicode, char *dst, size_t dstlen);
 char *smbfs_ntwrkname_tolocal(const char *ntwrk_name, size_t *nmlen, int usingUnicode);
 void smbfs_create_start_path(struct smbmount *smp, struct smb_mount_args *args, 
 							 int usingUnicode);
@@ -123,6 +123,10 @@ lck_grp_attr_t *iodrq_grp_attr;
 lck_grp_t *iodrq_lck_group;
 lck_attr_t *iodrq_lck_attr;
 
+lck_grp_attr_t *iodrcv_grp_attr;
+lck_grp_t *iodrcv_lck_group;
+lck_attr_t *iodrcv_lck_attr;
+
 lck_grp_attr_t *iodev_grp_attr;
 lck_grp_t *iodev_lck_group;
 lck_attr_t *iodev_lck_attr;
@@ -172,10 +176,46 @@ extern struct sysctl_oid sysctl__net_smb_fs_kern_hard_deadtimer;
 extern struct sysctl_oid sysctl__net_smb_fs_kern_soft_deadtimer;
 extern struct sysctl_oid sysctl__net_smb_fs_tcpsndbuf;
 extern struct sysctl_oid sysctl__net_smb_fs_tcprcvbuf;
+extern struct sysctl_oid sysctl__net_smb_fs_tcp_rcv_adaptive;
+extern struct sysctl_oid sysctl__net_smb_fs_tcp_rcv_calls;
+extern struct sysctl_oid sysctl__net_smb_fs_tcp_rcv_sleeps;
 extern struct sysctl_oid sysctl__net_smb_fs_maxwrite;
 extern struct sysctl_oid sysctl__net_smb_fs_maxread;
+extern struct sysctl_oid sysctl__net_smb_fs_rw_max_window;
+extern struct sysctl_oid sysctl__net_smb_fs_aes_gcm;
+extern struct sysctl_oid sysctl__net_smb_fs_write_zero_copy;
+extern struct sysctl_oid sysctl__net_smb_fs_write_zero_copy_bytes;
+extern struct sysctl_oid sysctl__net_smb_fs_write_copy_bytes;
+extern struct sysctl_oid sysctl__net_smb_fs_read_direct;
+extern struct sysctl_oid sysctl__net_smb_fs_read_direct_bytes;
+extern struct sysctl_oid sysctl__net_smb_fs_read_copy_bytes;
+extern struct sysctl_oid sysctl__net_smb_fs_dircache_max;
+extern struct sysctl_oid sysctl__net_smb_fs_async_strategy;
+extern struct sysctl_oid sysctl__net_smb_fs_querydir_maxbuf;
+extern struct sysctl_oid sysctl__net_smb_fs_querydir_prefetch;
+extern struct sysctl_oid sysctl__net_smb_fs_querydir_enums;
+extern struct sysctl_oid sysctl__net_smb_fs_querydir_round_trips;
+extern struct sysctl_oid sysctl__net_smb_fs_querydir_prefetch_hits;
+extern struct sysctl_oid sysctl__net_smb_fs_bulk_prefetch;
+extern struct sysctl_oid sysctl__net_smb_fs_bulk_prefetch_batches;
+extern struct sysctl_oid sysctl__net_smb_fs_bulk_prefetch_queries;
+extern struct sysctl_oid sysctl__net_smb_fs_hash_lookups;
+extern struct sysctl_oid sysctl__net_smb_fs_hash_chain_walked;
+extern struct sysctl_oid sysctl__net_smb_fs_hash_max_chain;
+extern struct sysctl_oid sysctl__net_smb_fs_hash_lock_contended;
+extern struct sysctl_oid sysctl__net_smb_fs_hash_resizes;
+extern struct sysctl_oid sysctl__net_smb_fs_lease_cache;
 extern struct sysctl_oid sysctl__net_smb_fs_maxsegreadsize;
 extern struct sysctl_oid sysctl__net_smb_fs_maxsegwritesize;
+extern struct sysctl_oid sysctl__net_smb_fs_iod_rcv_thread;
+extern struct sysctl_oid sysctl__net_smb_fs_iod_send_batch;
+extern struct sysctl_oid sysctl__net_smb_fs_loop_latency;
+extern struct sysctl_oid sysctl__net_smb_fs_loop_bandwidth;
+extern struct sysctl_oid sysctl__net_smb_fs_loop_credits;
+extern struct sysctl_oid sysctl__net_smb_fs_loop_reorder;
+extern struct sysctl_oid sysctl__net_smb_fs_loop_compound;
+extern struct sysctl_oid sysctl__net_smb_fs_loop_maxio;
+extern struct sysctl_oid sysctl__net_smb_fs_loop_file_size;
 
 
 MALLOC_DEFINE(M_SMBFSHASH, "SMBFS hash", "SMBFS hash table");
@@ -241,6 +281,10 @@ smbnet_lock_init()
 	iodrq_grp_attr = lck_grp_attr_alloc_init();
 	iodrq_lck_group = lck_grp_alloc_init("smb-iodrq", iodrq_grp_attr);
 	
+	iodrcv_lck_attr = lck_attr_alloc_init();
+	iodrcv_grp_attr = lck_grp_attr_alloc_init();
+	iodrcv_lck_group = lck_grp_alloc_init("smb-iodrcv", iodrcv_grp_attr);
+	
 	iodev_lck_attr = lck_attr_alloc_init();
 	iodev_grp_attr = lck_grp_attr_alloc_init();
 	iodev_lck_group = lck_grp_alloc_init("smb-iodev", iodev_grp_attr);
@@ -278,6 +322,10 @@ smbnet_lock_uninit()
 	lck_grp_attr_free(iodev_grp_attr);
 	lck_attr_free(iodev_lck_attr);
 	
+	lck_grp_free(iodrcv_lck_group);
+	lck_grp_attr_free(iodrcv_grp_attr);
+	lck_attr_free(iodrcv_lck_attr);
+	
 	lck_grp_free(iodrq_lck_group);
 	lck_grp_attr_free(iodrq_grp_attr);
 	lck_attr_free(iodrq_lck_attr);
@@ -721,10 +769,9 @@ smbfs_mount(struct mount *mp, vnode_t devvp, user_addr_t data, vfs_context_t con
 	vfs_setfsprivate(mp, (void *)smp);	
     
     /* alloc hash stuff */
-	smp->sm_hash = hashinit(desiredvnodes, M_SMBFSHASH, &smp->sm_hashlen);
-	if (smp->sm_hash == NULL)
+	error = smbfs_hash_init(smp);
+	if (error)
 		goto bad;
-	smp->sm_hashlock = lck_mtx_alloc_init(hash_lck_grp, hash_lck_attr);
 
 	lck_rw_init(&smp->sm_rw_sharelock, smbfs_rwlock_group, smbfs_lock_attr);
 	lck_mtx_init(&smp->sm_statfslock, smbfs_mutex_group, smbfs_lock_attr);		
@@ -753,6 +800,7 @@ smbfs_mount(struct mount *mp, vnode_t devvp, user_addr_t data, vfs_context_t con
 	} else {
 		smp->sm_args.volume_name = NULL;
 	}
+	smbfs_attr_cacheinit(smp, args);
 	
 	/* 
      * See if they sent use a submount path to use.
@@ -1079,6 +1127,7 @@ smbfs_mount(struct mount *mp, vnode_t devvp, user_addr_t data, vfs_context_t con
 	}
 	
     smbfs_notify_change_create_thread(smp);
+    smbfs_aio_create_thread(smp);
     if (smp->sm_args.altflags & SMBFS_MNT_COMPOUND_ON) {
         vfs_setcompoundopen(mp);
     }
@@ -1110,10 +1159,7 @@ bad:
 	if (smp) {
 		vfs_setfsprivate(mp, (void *)0);
         
-		/* Was malloced by hashinit */
-		if (smp->sm_hash)
-			SMB_FREE(smp->sm_hash, M_SMBFSHASH);
-		lck_mtx_free(smp->sm_hashlock, hash_lck_grp);
+		smbfs_hash_destroy(smp);
 
 		lck_mtx_destroy(&smp->sm_statfslock, smbfs_mutex_group);
 		lck_mtx_destroy(&smp->sm_reclaim_lock, smbfs_mutex_group);
@@ -1182,6 +1228,7 @@ smbfs_unmount(struct mount *mp, int mntflags, vfs_context_t context)
 	
 	/* We are done with this share shutdown all outstanding I/O requests. */
 	smb_iod_errorout_share_request(share, ENXIO);
+	smbfs_aio_destroy_thread(smp);
 	
 	OSAddAtomic(-1, &SSTOVC(share)->vc_volume_cnt);
 	smbfs_notify_change_destroy_thread(smp);
@@ -1205,11 +1252,7 @@ smbfs_unmount(struct mount *mp, int mntflags, vfs_context_t context)
 	smb_share_rele(share, context);
 	vfs_setfsprivate(mp, (void *)0);
 
-	if (smp->sm_hash) {
-		SMB_FREE(smp->sm_hash, M_SMBFSHASH);
-		smp->sm_hash = (void *)0xDEAD5AB0;
-	}
-	lck_mtx_free(smp->sm_hashlock, hash_lck_grp);
+	smbfs_hash_destroy(smp);
 
 	lck_mtx_destroy(&smp->sm_statfslock, smbfs_mutex_group);
 	lck_mtx_destroy(&smp->sm_reclaim_lock, smbfs_mutex_group);
@@ -2634,13 +2677,50 @@ int smbfs_module_start(kmod_info_t *ki, void *data)
 
 	sysctl_register_oid(&sysctl__net_smb_fs_tcpsndbuf);
 	sysctl_register_oid(&sysctl__net_smb_fs_tcprcvbuf);
+	sysctl_register_oid(&sysctl__net_smb_fs_tcp_rcv_adaptive);
+	sysctl_register_oid(&sysctl__net_smb_fs_tcp_rcv_calls);
+	sysctl_register_oid(&sysctl__net_smb_fs_tcp_rcv_sleeps);
 
 	sysctl_register_oid(&sysctl__net_smb_fs_maxwrite);
 	sysctl_register_oid(&sysctl__net_smb_fs_maxread);
+	sysctl_register_oid(&sysctl__net_smb_fs_rw_max_window);
+	sysctl_register_oid(&sysctl__net_smb_fs_aes_gcm);
+	sysctl_register_oid(&sysctl__net_smb_fs_write_zero_copy);
+	sysctl_register_oid(&sysctl__net_smb_fs_write_zero_copy_bytes);
+	sysctl_register_oid(&sysctl__net_smb_fs_write_copy_bytes);
+	sysctl_register_oid(&sysctl__net_smb_fs_read_direct);
+	sysctl_register_oid(&sysctl__net_smb_fs_read_direct_bytes);
+	sysctl_register_oid(&sysctl__net_smb_fs_read_copy_bytes);
+	sysctl_register_oid(&sysctl__net_smb_fs_dircache_max);
+	sysctl_register_oid(&sysctl__net_smb_fs_async_strategy);
+	sysctl_register_oid(&sysctl__net_smb_fs_querydir_maxbuf);
+	sysctl_register_oid(&sysctl__net_smb_fs_querydir_prefetch);
+	sysctl_register_oid(&sysctl__net_smb_fs_querydir_enums);
+	sysctl_register_oid(&sysctl__net_smb_fs_querydir_round_trips);
+	sysctl_register_oid(&sysctl__net_smb_fs_querydir_prefetch_hits);
+	sysctl_register_oid(&sysctl__net_smb_fs_bulk_prefetch);
+	sysctl_register_oid(&sysctl__net_smb_fs_bulk_prefetch_batches);
+	sysctl_register_oid(&sysctl__net_smb_fs_bulk_prefetch_queries);
+	sysctl_register_oid(&sysctl__net_smb_fs_hash_lookups);
+	sysctl_register_oid(&sysctl__net_smb_fs_hash_chain_walked);
+	sysctl_register_oid(&sysctl__net_smb_fs_hash_max_chain);
+	sysctl_register_oid(&sysctl__net_smb_fs_hash_lock_contended);
+	sysctl_register_oid(&sysctl__net_smb_fs_hash_resizes);
+	sysctl_register_oid(&sysctl__net_smb_fs_lease_cache);
 
 	sysctl_register_oid(&sysctl__net_smb_fs_maxsegreadsize);
 	sysctl_register_oid(&sysctl__net_smb_fs_maxsegwritesize);
 
+	sysctl_register_oid(&sysctl__net_smb_fs_iod_rcv_thread);
+	sysctl_register_oid(&sysctl__net_smb_fs_iod_send_batch);
+	sysctl_register_oid(&sysctl__net_smb_fs_loop_latency);
+	sysctl_register_oid(&sysctl__net_smb_fs_loop_bandwidth);
+	sysctl_register_oid(&sysctl__net_smb_fs_loop_credits);
+	sysctl_register_oid(&sysctl__net_smb_fs_loop_reorder);
+	sysctl_register_oid(&sysctl__net_smb_fs_loop_compound);
+	sysctl_register_oid(&sysctl__net_smb_fs_loop_maxio);
+	sysctl_register_oid(&sysctl__net_smb_fs_loop_file_size);
+
 	smbfs_install_sleep_wake_notifier();
 
 out:
@@ -2676,14 +2756,51 @@ int smbfs_module_stop(kmod_info_t *ki, void *data)
 		SMBERROR("vfs_fsremove failed with %d, may want to reboot!\n", error);
 		goto out;
 	}
+	sysctl_unregister_oid(&sysctl__net_smb_fs_iod_rcv_thread);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_iod_send_batch);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_loop_latency);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_loop_bandwidth);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_loop_credits);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_loop_reorder);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_loop_compound);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_loop_maxio);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_loop_file_size);
+
 	sysctl_unregister_oid(&sysctl__net_smb_fs_maxsegreadsize);
 	sysctl_unregister_oid(&sysctl__net_smb_fs_maxsegwritesize);
 
 	sysctl_unregister_oid(&sysctl__net_smb_fs_maxwrite);
 	sysctl_unregister_oid(&sysctl__net_smb_fs_maxread);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_rw_max_window);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_aes_gcm);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_write_zero_copy);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_write_zero_copy_bytes);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_write_copy_bytes);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_read_direct);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_read_direct_bytes);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_read_copy_bytes);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_dircache_max);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_async_strategy);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_querydir_maxbuf);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_querydir_prefetch);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_querydir_enums);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_querydir_round_trips);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_querydir_prefetch_hits);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_bulk_prefetch);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_bulk_prefetch_batches);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_bulk_prefetch_queries);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_hash_lookups);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_hash_chain_walked);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_hash_max_chain);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_hash_lock_contended);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_hash_resizes);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_lease_cache);
 
 	sysctl_unregister_oid(&sysctl__net_smb_fs_tcpsndbuf);
 	sysctl_unregister_oid(&sysctl__net_smb_fs_tcprcvbuf);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_tcp_rcv_adaptive);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_tcp_rcv_calls);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_tcp_rcv_sleeps);
 	
 	sysctl_unregister_oid(&sysctl__net_smb_fs_kern_deadtimer);
 	sysctl_unregister_oid(&sysctl__net_smb_fs_kern_hard_deadtimer);
@@ -50,6 +50,7 @@
 #include <sys/attr.h>
 #include <sys/kauth.h>
 #include <sys/syslog.h>
+#include <sys/sysctl.h>
 
 #include <sys/smb_apple.h>
 #include <sys/smb_byte_order.h>
@@ -84,6 +85,37 @@ static void smbfs_set_create_vap(struct smb_share *share, struct vnode_attr *vap
 static int smbfs_vnop_compound_open(struct vnop_compound_open_args *ap);
 static int smbfs_vnop_open(struct vnop_open_args *ap);
 
+/*
+ * getattrlistbulk fetches the stream info of up to bulk_prefetch entries at
+ * a time instead of one entry at a time. Zero or one turns it off.
+ */
+#define SMBFS_BULK_PREFETCH_MAX 64
+
+static uint32_t smbfs_bulk_prefetch = 16;
+static uint64_t smbfs_bulk_prefetch_batches = 0;
+static uint64_t smbfs_bulk_prefetch_queries = 0;
+
+SYSCTL_DECL(_net_smb_fs);
+SYSCTL_INT(_net_smb_fs, OID_AUTO, bulk_prefetch, CTLFLAG_RW, &smbfs_bulk_prefetch, 0, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, bulk_prefetch_batches, CTLFLAG_RD, &smbfs_bulk_prefetch_batches, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, bulk_prefetch_queries, CTLFLAG_RD, &smbfs_bulk_prefetch_queries, "");
+
+/*
+ * Record how long a VNOP took in the mount's latency histograms, which get
+ * returned by SMBIOC_OP_STATS.
+ */
+static void
+smbfs_vop_stats_record(vnode_t vp, int op, struct timespec *start_time, int error)
+{
+    mount_t mp = (vp != NULL) ? vnode_mount(vp) : NULL;
+    struct smbmount *smp = (mp != NULL) ? VFSTOSMBFS(mp) : NULL;
+
+    if (smp == NULL) {
+        return;
+    }
+    smb_lat_hist_add(&smp->sm_vop_stats[op], smb_lat_usecs(start_time), error);
+}
+
 /*
  * We were doing an IO and received an error. Was the error caused because we were
  * reconnecting to the server. If yes then see if we can reopen the file. If everything
@@ -227,6 +259,33 @@ smbfs_close(struct smb_share *share, vnode_t vp, int openMode,
 
 	/* Check the number of times Open() was called */
 	if (np->f_refcnt == 1) {
+		if (smbfs_lease_can_defer_close(np)) {
+			/*
+			 * We still hold a handle lease, so keep the shared file open for
+			 * the next open. With a read lease the cached data stays good too.
+			 * The open gets closed when the lease breaks or the vnode goes away.
+			 */
+			if (np->f_leaseState & SMB2_LEASE_READ_CACHING) {
+				ubc_msync(vp, 0, ubc_getsize(vp), NULL, UBC_PUSHDIRTY | UBC_SYNC);
+			} else {
+				ubc_msync(vp, 0, ubc_getsize(vp), NULL, UBC_PUSHDIRTY | UBC_SYNC | UBC_INVALIDATE);
+			}
+			np->f_refcnt = 0;
+			np->f_openRWCnt = 0;
+			np->f_openRCnt = 0;
+			np->f_openWCnt = 0;
+			np->f_openTotalWCnt = 0;
+			np->f_needClose = 0;
+			np->f_clusterCloseError = 0;
+			np->f_leaseFlags |= kLeaseDeferClose;
+
+			if (vnode_isnocache(vp))
+				vnode_clearnocache(vp);
+			if (np->n_flag & NATTRCHANGED)
+				np->attribute_cache_timer = 0;
+			goto exit;
+		}
+
 		ubc_msync(vp, 0, ubc_getsize(vp), NULL, UBC_PUSHDIRTY | UBC_SYNC | UBC_INVALIDATE);
 		/* 
 		 * This is the last Close() we will get, so close sharedForkRef 
@@ -251,6 +310,9 @@ smbfs_close(struct smb_share *share, vnode_t vp, int openMode,
 			np->f_openTotalWCnt = 0;
 			np->f_needClose = 0;
 			np->f_clusterCloseError = 0;
+			/* Closing the shared file ends its lease */
+			np->f_leaseState = 0;
+			np->f_leaseFlags &= ~kLeaseDeferClose;
 			/*
 			 * They didn't unlock the file before closing. A SMB close will remove
 			 * any locks so lets free the memory associated with that lock.
@@ -299,7 +361,7 @@ smbfs_close(struct smb_share *share, vnode_t vp, int openMode,
                 lck_rw_lock_shared(&np->n_parent_rwlock);
                 if (np->n_parent != NULL) {
                     smbfs_attr_touchdir(np->n_parent, (share->ss_fstype == SMB_FS_FAT));
-                    np->n_parent->d_changecnt++;
+                    OSIncrementAtomic((SInt32 *)&np->n_parent->d_changecnt);
                     
                     /* Remove any negative cache entries. */
                     if (np->n_parent->n_flag & NNEGNCENTRIES) {
@@ -482,10 +544,9 @@ smbfs_close(struct smb_share *share, vnode_t vp, int openMode,
             goto exit;
         }
         
-        error = smbfs_smb_open_file(share, np,
-                                    rights, NTCREATEX_SHARE_ACCESS_ALL, &fid,
-                                    NULL, 0, FALSE,
-                                    fap, context);
+        error = smbfs_lease_open_file(share, np,
+                                      rights, NTCREATEX_SHARE_ACCESS_ALL, &fid,
+                                      fap, context);
         SMB_LOG_KTRACE(SMB_DBG_SMBFS_CLOSE | DBG_FUNC_NONE,
                        0xabc005, error, 0, 0, 0);
 		if (error == 0) {
@@ -539,6 +600,7 @@ exit:
 static int 
 smbfs_vnop_close(struct vnop_close_args *ap)
 {
+	struct timespec start_time;
 	vnode_t vp = ap->a_vp;
 	int error = 0;
 	struct smbnode *np;
@@ -546,6 +608,7 @@ smbfs_vnop_close(struct vnop_close_args *ap)
     if (smbnode_lock(VTOSMB(vp), SMBFS_EXCLUSIVE_LOCK) != 0)
         return (0);
     
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_CLOSE | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
 	np = VTOSMB(vp);
@@ -556,6 +619,9 @@ smbfs_vnop_close(struct vnop_close_args *ap)
 			error = 0;
 		} else {
 			smbfs_closedirlookup(np, ap->a_context);
+			/* Under a read lease the cached entries are good for the next open */
+			if (!(np->d_leaseState & SMB2_LEASE_READ_CACHING))
+				smbfs_dircache_free(np);
 		}
 	} else if ( vnode_isreg(vp) || vnode_islnk(vp) ) {
 		int clusterCloseError = np->f_clusterCloseError;
@@ -583,6 +649,7 @@ smbfs_vnop_close(struct vnop_close_args *ap)
 	}
 	smbnode_unlock(np);
 
+    smbfs_vop_stats_record(ap->a_vp, SMBFS_VOP_CLOSE, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_CLOSE | DBG_FUNC_END, 0, 0, 0, 0, 0);
     return (error);
 }
@@ -773,6 +840,9 @@ smbfs_create_open(struct smb_share *share, vnode_t dvp, struct componentname *cn
 			smbfs_update_symlink_cache(np, target, targetlen);
 		}
 	} else if (vnode_isreg(vp)) {
+		/* The node may still have a deferred close, we have a new open now */
+		smbfs_lease_close_deferred(share, np, context);
+
 		/* We opened the file so bump ref count */
 		np->f_refcnt++;
 		
@@ -855,7 +925,7 @@ smbfs_create_open(struct smb_share *share, vnode_t dvp, struct componentname *cn
 		
 		smbfs_attr_touchdir(dnp, (share->ss_fstype == SMB_FS_FAT));
 		
-        dnp->d_changecnt++;
+        OSIncrementAtomic((SInt32 *)&dnp->d_changecnt);
 
 		/* Remove any negative cache entries. */
 		if (dnp->n_flag & NNEGNCENTRIES) {
@@ -910,6 +980,23 @@ smbfs_open(struct smb_share *share, vnode_t vp, int mode,
 		goto exit;
 	}
 	
+	/*
+	 * We kept the shared file open after the last close. We can't reuse it
+	 * once the server took away the handle lease and it would get in the way
+	 * of a deny mode open.
+	 */
+	if ((np->f_leaseFlags & kLeaseDeferClose) &&
+		(!(np->f_leaseState & SMB2_LEASE_HANDLE_CACHING) || 
+		 (mode & (O_EXLOCK | O_SHLOCK)))) {
+		smbfs_lease_close_deferred(share, np, context);
+	}
+	
+	/* Lost the lease while closed, the cached data can't be trusted */
+	if ((np->f_leaseFlags & kLeaseStaleCache) && (np->f_refcnt == 0)) {
+		np->f_leaseFlags &= ~kLeaseStaleCache;
+		ubc_msync(vp, 0, ubc_getsize(vp), NULL, UBC_PUSHDIRTY | UBC_SYNC | UBC_INVALIDATE);
+	}
+	
     SMB_MALLOC(fap,
                struct smbfattr *,
                sizeof(struct smbfattr),
@@ -1054,8 +1141,13 @@ smbfs_open(struct smb_share *share, vnode_t vp, int mode,
 			}
 			break;
 		}
-		if (! needUpgrade)	/*  the existing open is good enough */
+		if (! needUpgrade) {	/*  the existing open is good enough */
+			if (np->f_leaseFlags & kLeaseDeferClose) {
+				/* Saved a close and an open */
+				OSAddAtomic64(1, &VTOSMBFS(vp)->sm_lease_open_hits);
+			}
 			goto ShareOpen;
+		}
 	} else if (accessMode == kAccessWrite) {
         /*
          * If opening with write only, try opening it with read/write. Unix
@@ -1072,10 +1164,9 @@ smbfs_open(struct smb_share *share, vnode_t vp, int mode,
                             0, 0, &fndEntry, &fid);
         if (error != 0) {
             /* Not already open locally, so try to open it */
-            error = smbfs_smb_open_file(share, np,
-                                        rights | SMB2_FILE_READ_DATA, shareMode, &fid,
-                                        NULL, 0, FALSE,
-                                        fap, context);
+            error = smbfs_lease_open_file(share, np,
+                                          rights | SMB2_FILE_READ_DATA, shareMode, &fid,
+                                          fap, context);
             if (error == 0) {
                 np->f_fid = fid;
                 np->f_rights = rights | SMB2_FILE_READ_DATA;
@@ -1097,10 +1188,9 @@ smbfs_open(struct smb_share *share, vnode_t vp, int mode,
         goto exit;
     }
 
-    error = smbfs_smb_open_file(share, np,
-                                rights, shareMode, &fid,
-                                NULL, 0, FALSE,
-                                fap, context);
+    error = smbfs_lease_open_file(share, np,
+                                  rights, shareMode, &fid,
+                                  fap, context);
 	if (error)
 		goto exit;
 		
@@ -1108,7 +1198,7 @@ smbfs_open(struct smb_share *share, vnode_t vp, int mode,
 	 * We already had it open (presumably because it was open with insufficient 
 	 * rights.) So now close the old open, if we already had it open.
 	 */
-	if (np->f_refcnt && 
+	if ((np->f_refcnt || (np->f_leaseFlags & kLeaseDeferClose)) && 
         (np->f_fid != 0)) {
 		warning = smbfs_smb_close(share, np->f_fid, context);
 		if (warning) {
@@ -1131,6 +1221,7 @@ exit:
 	if (!error) {	
         /* We opened the file or pretended too; either way bump the count */
 		np->f_refcnt++;
+		np->f_leaseFlags &= ~kLeaseDeferClose;
         
         /* keep track of how many opens for this file had write access */
         if (mode & FWRITE) {
@@ -1165,6 +1256,7 @@ smbfs_vnop_open_common(vnode_t vp, int mode, vfs_context_t context, void *n_last
 	
 	/* Just mark that the directory was opened */
 	if (vnode_isdir(vp)) {
+		smbfs_dir_lease_check(np, context);
 		np->d_refcnt++;
 		error = 0;
 	} else {
@@ -1369,6 +1461,7 @@ smbfs_vnop_open_common(vnode_t vp, int mode, vfs_context_t context, void *n_last
 static int 
 smbfs_vnop_compound_open(struct vnop_compound_open_args *ap)
 {
+	struct timespec start_time;
 	vnode_t dvp = ap->a_dvp;
 	vnode_t *vpp = ap->a_vpp;
 	vnode_t vp = (ap->a_vpp) ? *ap->a_vpp : NULL;
@@ -1431,6 +1524,7 @@ smbfs_vnop_compound_open(struct vnop_compound_open_args *ap)
 		return (ENOTSUP);
 	}
 	
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_CMPD_OPEN | DBG_FUNC_START, fmode, 0, 0, 0, 0);
 
     SMB_MALLOC(fap,
@@ -1790,6 +1884,7 @@ done:
         SMB_FREE(fap, M_SMBTEMP);
     }
     
+    smbfs_vop_stats_record(ap->a_dvp, SMBFS_VOP_OPEN, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_CMPD_OPEN | DBG_FUNC_END, error, 0, 0, 0, 0);
     return (error);
 }
@@ -1803,12 +1898,15 @@ done:
 static int 
 smbfs_vnop_open(struct vnop_open_args *ap)
 {
+    struct timespec start_time;
     int error;
     
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_OPEN | DBG_FUNC_START, 0, 0, 0, 0, 0);
     
 	error = smbfs_vnop_open_common(ap->a_vp, ap->a_mode, ap->a_context, smbfs_vnop_open);
     
+    smbfs_vop_stats_record(ap->a_vp, SMBFS_VOP_OPEN, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_OPEN | DBG_FUNC_END, error, 0, 0, 0, 0);
 	return (error);
 }
@@ -2001,6 +2099,9 @@ smbfs_vnop_inactive(struct vnop_inactive_args *ap)
 	
 	if (vnode_isdir(vp)) {
 		smbfs_closedirlookup(np, ap->a_context);
+		/* Keep the cached entries while the read lease holds, see smbfs_vnop_close */
+		if (!(np->d_leaseState & SMB2_LEASE_READ_CACHING))
+			smbfs_dircache_free(np);
 		np->d_refcnt = 0;
 		if (np->d_kqrefcnt) {
 			smbfs_stop_change_notify(share, np, TRUE, ap->a_context, &releaseLock);
@@ -2073,6 +2174,25 @@ static int smbfs_vnop_reclaim(struct vnop_reclaim_args *ap)
 	np->n_lastvop = smbfs_vnop_reclaim;
 	smp = VTOSMBFS(vp);
     
+	/* Last chance to close the shared file we kept open under a lease */
+	if (vnode_isreg(vp) && (np->f_leaseFlags & kLeaseDeferClose)) {
+		struct smb_share *share;
+		
+		share = smb_get_share_with_reference(smp);
+		smbfs_lease_close_deferred(share, np, ap->a_context);
+		smb_share_rele(share, ap->a_context);
+	}
+	
+	/* Same for the open that keeps a directory lease */
+	if (vnode_isdir(vp) && (np->d_leaseFid != 0)) {
+		struct smb_share *share;
+		
+		share = smb_get_share_with_reference(smp);
+		smbfs_closedirlookup(np, ap->a_context);
+		smbfs_dir_lease_close(share, np, ap->a_context);
+		smb_share_rele(share, ap->a_context);
+	}
+    
 #ifdef SMB_DEBUG
 	/* We should never have a file open at this point */
 	if (vnode_isreg(vp)) {
@@ -2161,6 +2281,11 @@ static int smbfs_vnop_reclaim(struct vnop_reclaim_args *ap)
 		smp->sm_rvp = NULL;
 	}
     
+	/* Should already be gone, but just in case */
+	if (vnode_isdir(vp)) {
+		smbfs_dircache_free(np);
+	}
+	
 	/* Destroy the lock used for the open state, open deny list and resource size/timer */
 	if (!vnode_isdir(vp)) {
 		lck_mtx_destroy(&np->f_openDenyListLock, smbfs_mutex_group);
@@ -2249,6 +2374,7 @@ smbfs_getattr(struct smb_share *share, vnode_t vp, struct vnode_attr *vap,
 static int 
 smbfs_vnop_getattr(struct vnop_getattr_args *ap)
 {
+	struct timespec start_time;
 	int32_t error = 0;
 	struct smb_share *share;
 	struct smbnode *np;
@@ -2257,6 +2383,7 @@ smbfs_vnop_getattr(struct vnop_getattr_args *ap)
 		return (error);
 	}
 
+	nanouptime(&start_time);
 	SMB_LOG_KTRACE(SMB_DBG_GET_ATTR | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
     np = VTOSMB(ap->a_vp);
@@ -2273,6 +2400,7 @@ smbfs_vnop_getattr(struct vnop_getattr_args *ap)
 	smb_share_rele(share, ap->a_context);
 	smbnode_unlock(np);
     
+    smbfs_vop_stats_record(ap->a_vp, SMBFS_VOP_GETATTR, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_GET_ATTR | DBG_FUNC_END, error, 0, 0, 0, 0);
 	return (error);
 }
@@ -2848,6 +2976,7 @@ out:
 static int 
 smbfs_vnop_setattr(struct vnop_setattr_args *ap)
 {
+	struct timespec start_time;
 	int32_t error = 0;
 	struct smbnode *np;
 	struct smb_share *share;
@@ -2856,6 +2985,7 @@ smbfs_vnop_setattr(struct vnop_setattr_args *ap)
 		return (error);
 	}
     
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_SET_ATTR | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
 	np = VTOSMB(ap->a_vp);
@@ -2873,6 +3003,7 @@ smbfs_vnop_setattr(struct vnop_setattr_args *ap)
 		}	
 	}
 
+	smbfs_vop_stats_record(ap->a_vp, SMBFS_VOP_SETATTR, &start_time, error);
 	SMB_LOG_KTRACE(SMB_DBG_SET_ATTR | DBG_FUNC_END, error, 0, 0, 0, 0);
     return (error);
 }
@@ -2909,14 +3040,14 @@ smbfs_vnop_blockmap(struct vnop_blockmap_args *ap)
 }
 
 /*
- * smbfs_vnop_strategy
+ * smbfs_strategy_sync
  *
- *	struct buf *a_bp;
+ * Do the read/write for the buf and wait for it to finish. Also used by the
+ * aio thread to redo any async strategy that did not go cleanly.
  */
-static int 
-smbfs_vnop_strategy(struct vnop_strategy_args *ap)
+int 
+smbfs_strategy_sync(struct buf *bp)
 {
-	struct buf *bp = ap->a_bp;
 	vnode_t vp = buf_vnode(bp);
 	int32_t bflags = buf_flags(bp);
 	struct smbnode *np = VTOSMB(vp);
@@ -2972,13 +3103,13 @@ smbfs_vnop_strategy(struct vnop_strategy_args *ap)
 	 * into the kernel address space
 	 */
     if ((error = buf_map(bp, &io_addr))) {
-        panic("smbfs_vnop_strategy: buf_map() failed with (%d)", error);
+        panic("smbfs_strategy_sync: buf_map() failed with (%d)", error);
 	}
 	
 	uio = uio_create(1, ((off_t)buf_blkno(bp)) * PAGE_SIZE, UIO_SYSSPACE, 
 					 (bflags & B_READ) ? UIO_READ : UIO_WRITE);
 	if (!uio) {
-        panic("smbfs_vnop_strategy: uio_create() failed");
+        panic("smbfs_strategy_sync: uio_create() failed");
 	}
 	
 	uio_addiov(uio, CAST_USER_ADDR_T(io_addr), buf_count(bp));
@@ -3138,7 +3269,7 @@ smbfs_vnop_strategy(struct vnop_strategy_args *ap)
     buf_setresid(bp, (uint32_t)uio_resid(uio));
 	
     if ((error = buf_unmap(bp)))
-        panic("smbfs_vnop_strategy: buf_unmap() failed with (%d)", error);
+        panic("smbfs_strategy_sync: buf_unmap() failed with (%d)", error);
 	
     
 exit:
@@ -3162,6 +3293,23 @@ exit:
     return (error);
 }
 
+/*
+ * smbfs_vnop_strategy
+ *
+ *	struct buf *a_bp;
+ */
+static int 
+smbfs_vnop_strategy(struct vnop_strategy_args *ap)
+{
+	struct buf *bp = ap->a_bp;
+
+	/* Async cluster I/O completes from the aio thread if it can be started */
+	if (smbfs_strategy_async(bp) == 0) {
+		return (0);
+	}
+	return (smbfs_strategy_sync(bp));
+}
+
 /*
  * smbfs_vnop_read
  *
@@ -3173,6 +3321,7 @@ exit:
 static int 
 smbfs_vnop_read(struct vnop_read_args *ap)
 {
+	struct timespec start_time;
 	vnode_t vp = ap->a_vp;
 	uio_t uio = ap->a_uio;
 	int error = 0;
@@ -3198,6 +3347,7 @@ smbfs_vnop_read(struct vnop_read_args *ap)
 	if ((error = smbnode_lock(VTOSMB(vp), SMBFS_SHARED_LOCK)))
 		return (error);
 	
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_READ | DBG_FUNC_START,
                    uio_offset(uio),
                    uio_resid(uio), 0, 0, 0);
@@ -3357,6 +3507,7 @@ exit:
 	smb_share_rele(share, ap->a_context);
 	smbnode_unlock(np);
 
+	smbfs_vop_stats_record(ap->a_vp, SMBFS_VOP_READ, &start_time, error);
 	SMB_LOG_KTRACE(SMB_DBG_READ | DBG_FUNC_END, error, 0, 0, 0, 0);
     return (error);
 }
@@ -3372,6 +3523,7 @@ exit:
 static int 
 smbfs_vnop_write(struct vnop_write_args *ap)
 {
+	struct timespec start_time;
 	vnode_t vp = ap->a_vp;
 	vnode_t parent_vp = NULL;	/* Always null unless this is a stream node */
 	struct smbnode *np = NULL;
@@ -3400,6 +3552,7 @@ smbfs_vnop_write(struct vnop_write_args *ap)
 	if ((error = smbnode_lock(VTOSMB(vp), SMBFS_EXCLUSIVE_LOCK)))
 		return (error);
 	
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_WRITE | DBG_FUNC_START,
                    uio_offset(uio),
                    uio_resid(uio), 0, 0, 0);
@@ -3669,6 +3822,7 @@ exit:
 		vnode_put(parent_vp);		
 	}	
 	
+    smbfs_vop_stats_record(ap->a_vp, SMBFS_VOP_WRITE, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_WRITE | DBG_FUNC_END, error, 0, 0, 0, 0);
 	return (error);
 }
@@ -3993,7 +4147,7 @@ smbfs_create(struct smb_share *share, struct vnop_create_args *ap, char *target,
 	*vpp = vp;
 	smbnode_unlock(VTOSMB(vp));	/* Done with the smbnode unlock it. */
 	
-    dnp->d_changecnt++;
+    OSIncrementAtomic((SInt32 *)&dnp->d_changecnt);
 
 	/* Remove any negative cache entries. */
 	if (dnp->n_flag & NNEGNCENTRIES) {
@@ -4022,6 +4176,7 @@ bad:
 static int 
 smbfs_vnop_create(struct vnop_create_args *ap)
 {
+	struct timespec start_time;
 	vnode_t 	dvp = ap->a_dvp;
 	int			error;
 	struct smbnode *dnp;
@@ -4031,6 +4186,7 @@ smbfs_vnop_create(struct vnop_create_args *ap)
     if ((error = smbnode_lock(VTOSMB(dvp), SMBFS_EXCLUSIVE_LOCK)))
         return (error);
 
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_CREATE | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
     dnp = VTOSMB(dvp);
@@ -4042,6 +4198,7 @@ smbfs_vnop_create(struct vnop_create_args *ap)
     smb_share_rele(share, ap->a_context);
     smbnode_unlock(dnp);
 
+    smbfs_vop_stats_record(ap->a_dvp, SMBFS_VOP_CREATE, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_CREATE | DBG_FUNC_END, error, 0, 0, 0, 0);
     return (error);
 }
@@ -4113,6 +4270,9 @@ smbfs_remove(struct smb_share *share, vnode_t dvp, vnode_t vp,
             lck_rw_unlock_shared(&np->n_name_rwlock);
         }
 	}
+	
+	/* A deferred close would leave the file delete pending on the server */
+	smbfs_lease_close_deferred(share, np, context);
     
     /*
      * The old code would check vnode_isinuse to see if the file was open,
@@ -4161,7 +4321,7 @@ smbfs_remove(struct smb_share *share, vnode_t dvp, vnode_t vp,
     }
 	
     smbfs_attr_touchdir(dnp, (share->ss_fstype == SMB_FS_FAT));
-    dnp->d_changecnt++;
+    OSIncrementAtomic((SInt32 *)&dnp->d_changecnt);
 	
 	/* Remove any negative cache entries. */
 	if (dnp->n_flag & NNEGNCENTRIES) {
@@ -4205,6 +4365,7 @@ done:
 static int 
 smbfs_vnop_remove(struct vnop_remove_args *ap)
 {
+	struct timespec start_time;
 	vnode_t dvp = ap->a_dvp;
 	vnode_t vp = ap->a_vp;
 	int32_t error;
@@ -4217,6 +4378,7 @@ smbfs_vnop_remove(struct vnop_remove_args *ap)
 	if ((error = smbnode_lockpair(VTOSMB(dvp), VTOSMB(vp), SMBFS_EXCLUSIVE_LOCK)))
 		return (error);
 
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_REMOVE | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
 	VTOSMB(dvp)->n_lastvop = smbfs_vnop_remove;
@@ -4226,6 +4388,7 @@ smbfs_vnop_remove(struct vnop_remove_args *ap)
 	smb_share_rele(share, ap->a_context);
 	smbnode_unlockpair(VTOSMB(dvp), VTOSMB(vp));
 
+	smbfs_vop_stats_record(ap->a_dvp, SMBFS_VOP_REMOVE, &start_time, error);
 	SMB_LOG_KTRACE(SMB_DBG_REMOVE | DBG_FUNC_END, error, 0, 0, 0, 0);
     return (error);
 }
@@ -4254,6 +4417,12 @@ smbfs_rmdir(struct smb_share *share, vnode_t dvp, vnode_t vp,
 		goto bad;
 	}
 
+    /* 
+     * Give up the directory lease, its open would leave the dir delete 
+     * pending. If the enumeration shares that open it gets closed below.
+     */
+    smbfs_dir_lease_close(share, np, context);
+    
     /* Close Query Dir Create FID if we need to */
     if ((np->d_fctx != NULL) && (np->d_fctx->f_need_close == TRUE)) {
         error = smb2_smb_close_fid(np->d_fctx->f_share,
@@ -4303,7 +4472,7 @@ smbfs_rmdir(struct smb_share *share, vnode_t dvp, vnode_t vp,
     }
 
 	smbfs_attr_touchdir(dnp, (share->ss_fstype == SMB_FS_FAT));
-    dnp->d_changecnt++;
+    OSIncrementAtomic((SInt32 *)&dnp->d_changecnt);
     
 	/* Remove any negative cache entries. */
 	if (dnp->n_flag & NNEGNCENTRIES) {
@@ -4330,6 +4499,7 @@ bad:
  */
 static int smbfs_vnop_rmdir(struct vnop_rmdir_args *ap)
 {
+	struct timespec start_time;
 	vnode_t dvp = ap->a_dvp;
 	vnode_t vp = ap->a_vp;
 	int32_t error;
@@ -4345,6 +4515,7 @@ static int smbfs_vnop_rmdir(struct vnop_rmdir_args *ap)
 	if ((error = smbnode_lockpair(VTOSMB(dvp), VTOSMB(vp), SMBFS_EXCLUSIVE_LOCK)))
 		return (error);
 
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_RM_DIR | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
 	VTOSMB(dvp)->n_lastvop = smbfs_vnop_rmdir;
@@ -4354,6 +4525,7 @@ static int smbfs_vnop_rmdir(struct vnop_rmdir_args *ap)
 	smb_share_rele(share, ap->a_context);	
 	smbnode_unlockpair(VTOSMB(dvp), VTOSMB(vp));
 
+    smbfs_vop_stats_record(ap->a_dvp, SMBFS_VOP_RMDIR, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_RM_DIR | DBG_FUNC_END, error, 0, 0, 0, 0);
 	return (error);
 }
@@ -4372,6 +4544,7 @@ static int smbfs_vnop_rmdir(struct vnop_rmdir_args *ap)
 static int 
 smbfs_vnop_rename(struct vnop_rename_args *ap)
 {
+	struct timespec start_time;
 	vnode_t 	fvp = ap->a_fvp;
 	vnode_t 	tvp = ap->a_tvp;
 	vnode_t 	fdvp = ap->a_fdvp;
@@ -4399,6 +4572,7 @@ smbfs_vnop_rename(struct vnop_rename_args *ap)
 	if ( (vtype != VDIR) && (vtype != VREG) && (vtype != VLNK) )
 		return (EINVAL);
 	
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_RENAME | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
 	/*
@@ -4650,6 +4824,11 @@ smbfs_vnop_rename(struct vnop_rename_args *ap)
         }
 	}
 	
+	/* Don't move a file out from under our own deferred close */
+	if (vnode_isreg(fvp)) {
+		smbfs_lease_close_deferred(share, fnp, ap->a_context);
+	}
+	
 	/*
 	 * Windows Servers will not let you move a item that contains open items. So
 	 * if we are moving an folder and the source folder has an open notification
@@ -4663,6 +4842,11 @@ smbfs_vnop_rename(struct vnop_rename_args *ap)
 		fnp->d_fid = 0;
 	}
 	
+	/* Same goes for the open that keeps the directory lease */
+	if (vnode_isdir(fvp) && (fnp->d_leaseFid != 0)) {
+		smbfs_dir_lease_close(share, fnp, ap->a_context);
+	}
+	
 	/* 
 	 * Try to rename the file, this may fail if the file is open. Some 
 	 * SAMBA systems allow us to rename an open file, so try this case
@@ -4771,8 +4955,8 @@ smbfs_vnop_rename(struct vnop_rename_args *ap)
             
             lck_rw_unlock_exclusive(&fnp->n_parent_rwlock);
 
-            VTOSMB(tdvp)->d_changecnt++;
-            VTOSMB(fdvp)->d_changecnt++;
+            OSIncrementAtomic((SInt32 *)&VTOSMB(tdvp)->d_changecnt);
+            OSIncrementAtomic((SInt32 *)&VTOSMB(fdvp)->d_changecnt);
 		}
 		
 		/* 
@@ -4889,6 +5073,7 @@ out:
 		if (lock_order[ii])
 			smbnode_unlock(lock_order[ii]);
 				
+    smbfs_vop_stats_record(ap->a_fdvp, SMBFS_VOP_RENAME, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_RENAME | DBG_FUNC_END, error, 0, 0, 0, 0);
 	return (error);
 }
@@ -5069,6 +5254,7 @@ smbfs_vnop_mknod(struct vnop_mknod_args *ap)
 static int 
 smbfs_vnop_mkdir(struct vnop_mkdir_args *ap)
 {
+	struct timespec start_time;
 	vnode_t 	dvp = ap->a_dvp;
 	struct vnode_attr *vap = ap->a_vap;
 	vnode_t 	vp;
@@ -5088,6 +5274,7 @@ smbfs_vnop_mkdir(struct vnop_mkdir_args *ap)
 	if ((error = smbnode_lock(VTOSMB(dvp), SMBFS_EXCLUSIVE_LOCK)))
 		return (error);
 
+	nanouptime(&start_time);
 	SMB_LOG_KTRACE(SMB_DBG_MKDIR | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
     dnp = VTOSMB(dvp);
@@ -5099,7 +5286,7 @@ smbfs_vnop_mkdir(struct vnop_mkdir_args *ap)
 		goto exit;
 
 	smbfs_attr_touchdir(dnp, (share->ss_fstype == SMB_FS_FAT));
-    dnp->d_changecnt++;
+    OSIncrementAtomic((SInt32 *)&dnp->d_changecnt);
 
 	/* 
 	 * %%%
@@ -5139,6 +5326,7 @@ exit:
 	smb_share_rele(share, ap->a_context);
 	smbnode_unlock(dnp);
     
+    smbfs_vop_stats_record(ap->a_dvp, SMBFS_VOP_MKDIR, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_MKDIR | DBG_FUNC_END, error, 0, 0, 0, 0);
 	return (error);
 }
@@ -5156,6 +5344,7 @@ exit:
 static int 
 smbfs_vnop_readdir(struct vnop_readdir_args *ap)
 {
+	struct timespec start_time;
 	vnode_t	vp = ap->a_vp;
 	uio_t uio = ap->a_uio;
 	int error;
@@ -5176,9 +5365,11 @@ smbfs_vnop_readdir(struct vnop_readdir_args *ap)
 	if ((error = smbnode_lock(VTOSMB(vp), SMBFS_EXCLUSIVE_LOCK)))
 		return (error);
 		
+	nanouptime(&start_time);
 	SMB_LOG_KTRACE(SMB_DBG_READ_DIR | DBG_FUNC_START, VTOSMB(vp)->d_fid, 0, 0, 0, 0);
 
 	VTOSMB(vp)->n_lastvop = smbfs_vnop_readdir;
+	smbfs_dir_lease_check(VTOSMB(vp), ap->a_context);
 	
 	error = smbfs_readvdir(vp, uio, ap->a_context, ap->a_flags, &numdirent);
 	if (error == ENOENT) {
@@ -5194,6 +5385,7 @@ smbfs_vnop_readdir(struct vnop_readdir_args *ap)
     
 	smbnode_unlock(VTOSMB(vp));
     
+    smbfs_vop_stats_record(ap->a_vp, SMBFS_VOP_READDIR, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_READ_DIR | DBG_FUNC_END, error, numdirent, 0, 0, 0);
 	return (error);
 }
@@ -5239,6 +5431,7 @@ smbfs_fsync(struct smb_share *share, vnode_t vp, int waitfor, int ubc_flags,
 static int32_t 
 smbfs_vnop_fsync(struct vnop_fsync_args *ap)
 {
+	struct timespec start_time;
 	int32_t error;
 	struct smb_share *share;
     
@@ -5251,6 +5444,7 @@ smbfs_vnop_fsync(struct vnop_fsync_args *ap)
 	if (error)
 		return (0);
 
+	nanouptime(&start_time);
 	SMB_LOG_KTRACE(SMB_DBG_FSYNC | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
     VTOSMB(ap->a_vp)->n_lastvop = smbfs_vnop_fsync;
@@ -5259,6 +5453,7 @@ smbfs_vnop_fsync(struct vnop_fsync_args *ap)
 	smb_share_rele(share, ap->a_context);
 	smbnode_unlock(VTOSMB(ap->a_vp));
 
+    smbfs_vop_stats_record(ap->a_vp, SMBFS_VOP_FSYNC, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_FSYNC | DBG_FUNC_END, error, 0, 0, 0, 0);
     return (error);
 }
@@ -6082,6 +6277,7 @@ smbfs_pathcheck(struct smb_share *share, const char *name, size_t nmlen,
 static int 
 smbfs_vnop_lookup(struct vnop_lookup_args *ap)
 {
+	struct timespec start_time;
 	vfs_context_t context = ap->a_context;
 	vnode_t dvp = ap->a_dvp;
 	vnode_t *vpp = ap->a_vpp;
@@ -6114,6 +6310,7 @@ smbfs_vnop_lookup(struct vnop_lookup_args *ap)
 	if (islastcn && vfs_isrdonly(mp) && nameiop != LOOKUP)
 		return (EROFS);
     
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_LOOKUP | DBG_FUNC_START,
                    VTOSMB(dvp)->d_fid, 0, 0, 0, 0);
 
@@ -6206,6 +6403,7 @@ smbfs_vnop_lookup(struct vnop_lookup_args *ap)
 	}
 	parent_locked = TRUE;
 	dnp->n_lastvop = smbfs_vnop_lookup;
+	smbfs_dir_lease_check(dnp, context);
 
 	isdot = (nmlen == 1 && name[0] == '.');
 	fap = &fattr;
@@ -6313,6 +6511,7 @@ skipLookup:
 done:
 	smb_share_rele(share, context);
     
+    smbfs_vop_stats_record(ap->a_dvp, SMBFS_VOP_LOOKUP, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_LOOKUP | DBG_FUNC_END, error, 0, 0, 0, 0);
 	return (error);
 }
@@ -6368,6 +6567,7 @@ smbfs_vnop_blktooff(struct vnop_blktooff_args *ap)
 static int 
 smbfs_vnop_pagein(struct vnop_pagein_args *ap)
 {       
+	struct timespec start_time;
 	vnode_t vp = ap->a_vp;
 	struct smb_share *share;
 	size_t size = ap->a_size;
@@ -6375,6 +6575,7 @@ smbfs_vnop_pagein(struct vnop_pagein_args *ap)
 	struct smbnode *np;
 	int error;
 	
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_PAGE_IN | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
 	np = VTOSMB(vp);
@@ -6420,6 +6621,7 @@ smbfs_vnop_pagein(struct vnop_pagein_args *ap)
 	smb_share_rele(share, ap->a_context);
 
 done:
+    smbfs_vop_stats_record(ap->a_vp, SMBFS_VOP_PAGEIN, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_PAGE_IN | DBG_FUNC_END, error, 0, 0, 0, 0);
     return (error);
 }
@@ -6441,6 +6643,7 @@ done:
 static int 
 smbfs_vnop_pageout(struct vnop_pageout_args *ap) 
 {       
+	struct timespec start_time;
 	vnode_t vp = ap->a_vp;
 	struct smbnode *np;
 	struct smb_share *share;
@@ -6452,6 +6655,7 @@ smbfs_vnop_pageout(struct vnop_pageout_args *ap)
 	if (vnode_vfsisrdonly(vp))
 		return(EROFS);
 	
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_PAGE_OUT | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
 	np = VTOSMB(vp);
@@ -6498,6 +6702,7 @@ smbfs_vnop_pageout(struct vnop_pageout_args *ap)
 	}
 
 done:
+    smbfs_vop_stats_record(ap->a_vp, SMBFS_VOP_PAGEOUT, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_PAGE_OUT | DBG_FUNC_END, error, 0, 0, 0, 0);
     return (error);
 }
@@ -6515,6 +6720,7 @@ done:
 static int
 smbfs_vnop_copyfile(struct vnop_copyfile_args *ap)
 {
+	struct timespec start_time;
 	vnode_t 	fvp = ap->a_fvp;
 	vnode_t 	tvp = ap->a_tvp;
 	vnode_t 	tdvp = ap->a_tdvp;
@@ -6535,6 +6741,7 @@ smbfs_vnop_copyfile(struct vnop_copyfile_args *ap)
      * fvp != tdvp
      */
     
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_COPYFILE | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
     /* Check if this is an SMB 2/3 server (need COPYCHUNK IOCTL) */
@@ -6605,6 +6812,7 @@ out:
         smbnode_unlockpair(fnp, tdnp);
     }
     
+    smbfs_vop_stats_record(ap->a_fvp, SMBFS_VOP_COPYFILE, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_COPYFILE | DBG_FUNC_END, error, 0, 0, 0, 0);
 	return (error);
 }
@@ -6692,6 +6900,7 @@ xattr2sfm(const char *xa, enum stream_types *stype)
 static int 
 smbfs_vnop_setxattr(struct vnop_setxattr_args *ap)
 {
+	struct timespec start_time;
 	vnode_t vp = ap->a_vp;
 	const char *sfmname;
 	int error = 0;
@@ -6710,6 +6919,7 @@ smbfs_vnop_setxattr(struct vnop_setxattr_args *ap)
 	if ((error = smbnode_lock(VTOSMB(vp), SMBFS_EXCLUSIVE_LOCK)))
 		return (error);
     
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_SET_XATTR | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
 	np = VTOSMB(vp);
@@ -6937,6 +7147,7 @@ exit:
 	smb_share_rele(share, ap->a_context);
 	smbnode_unlock(np);
 
+	smbfs_vop_stats_record(ap->a_vp, SMBFS_VOP_SETXATTR, &start_time, error);
 	SMB_LOG_KTRACE(SMB_DBG_SET_XATTR | DBG_FUNC_END, error, 0, 0, 0, 0);
     return (error);
 }
@@ -6953,6 +7164,7 @@ exit:
 static int 
 smbfs_vnop_listxattr(struct vnop_listxattr_args *ap)
 {
+	struct timespec start_time;
 	vnode_t vp = ap->a_vp;
 	uio_t uio = ap->a_uio;
 	size_t *sizep = ap->a_size;
@@ -6967,6 +7179,7 @@ smbfs_vnop_listxattr(struct vnop_listxattr_args *ap)
 	if ((error = smbnode_lock(VTOSMB(vp), SMBFS_EXCLUSIVE_LOCK)))
 		return (error);
     
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_LIST_XATTR | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
 	np = VTOSMB(vp);
@@ -7025,6 +7238,7 @@ exit:
 	smb_share_rele(share, ap->a_context);
 	smbnode_unlock(np);
 
+	smbfs_vop_stats_record(ap->a_vp, SMBFS_VOP_LISTXATTR, &start_time, error);
 	SMB_LOG_KTRACE(SMB_DBG_LIST_XATTR | DBG_FUNC_END, error, 0, 0, 0, 0);
     return (error);
 }
@@ -7040,6 +7254,7 @@ exit:
 static int 
 smbfs_vnop_removexattr(struct vnop_removexattr_args *ap)
 {
+	struct timespec start_time;
 	vnode_t vp = ap->a_vp;
 	const char *sfmname;
 	int error = 0, saved_error = 0;
@@ -7053,6 +7268,7 @@ smbfs_vnop_removexattr(struct vnop_removexattr_args *ap)
 	if ((error = smbnode_lock(VTOSMB(vp), SMBFS_EXCLUSIVE_LOCK)))
 		return (error);
 
+	nanouptime(&start_time);
 	SMB_LOG_KTRACE(SMB_DBG_RM_XATTR | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
     np = VTOSMB(vp);
@@ -7211,6 +7427,7 @@ exit:
 	smb_share_rele(share, ap->a_context);
 	smbnode_unlock(np);
 
+    smbfs_vop_stats_record(ap->a_vp, SMBFS_VOP_REMOVEXATTR, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_RM_XATTR | DBG_FUNC_END, error, 0, 0, 0, 0);
     return (error);
 }
@@ -7228,6 +7445,7 @@ exit:
 static int 
 smbfs_vnop_getxattr(struct vnop_getxattr_args *ap)
 {
+	struct timespec start_time;
 	vnode_t vp = ap->a_vp;
 	const char *sfmname;
 	uio_t uio = ap->a_uio;
@@ -7255,6 +7473,7 @@ smbfs_vnop_getxattr(struct vnop_getxattr_args *ap)
 		return (error);
 
 	
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_GET_XATTR | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
     np = VTOSMB(vp);
@@ -7518,6 +7737,7 @@ exit:
 	smb_share_rele(share, ap->a_context);
 	smbnode_unlock(np);
 
+    smbfs_vop_stats_record(ap->a_vp, SMBFS_VOP_GETXATTR, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_GET_XATTR | DBG_FUNC_END, error, 0, 0, 0, 0);
     return (error);
 }
@@ -7973,6 +8193,7 @@ smbfs_vnop_monitor(struct vnop_monitor_args *ap)
 static int 
 smbfs_vnop_access(struct vnop_access_args *ap)
 {
+	struct timespec start_time;
 	vnode_t vp = ap->a_vp;
 	int32_t action = ap->a_action, write_rights;
 	vfs_context_t context = ap->a_context;
@@ -7982,6 +8203,7 @@ smbfs_vnop_access(struct vnop_access_args *ap)
 	uint32_t maxAccessRights;
 	int error = 0;
 	
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_ACCESS | DBG_FUNC_START, action, 0, 0, 0, 0);
 
 	share = smb_get_share_with_reference(VTOSMBFS(vp));
@@ -8291,6 +8513,7 @@ done:
 	}
 	smb_share_rele(share, ap->a_context);
     
+    smbfs_vop_stats_record(ap->a_vp, SMBFS_VOP_ACCESS, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_ACCESS | DBG_FUNC_END, error, 0, 0, 0, 0);
 	return error;
 }
@@ -9245,6 +9468,202 @@ update_caches:
     SMB_LOG_KTRACE(SMB_DBG_UPDATE_CTX | DBG_FUNC_END, 0, 0, 0, 0, 0);
 }
 
+/*
+ * Fetch the stream info that smbfs_update_ctx would otherwise have to get one
+ * entry at a time for the current entry and the ones after it in the same
+ * Query Dir reply. The Create/QueryInfo/Close compounds for the whole window
+ * are sent together and the results are stored in the vnode caches, which is
+ * where smbfs_update_ctx looks first. Returns how many of the following
+ * entries were covered, so the caller knows when to call us again.
+ */
+static uint32_t
+smbfs_getattrlistbulk_prefetch(vnode_t dvp, struct smbfs_fctx *ctx,
+                               struct attrlist *alist, vfs_context_t context)
+{
+    struct smb_share *share = ctx->f_share;
+    struct smbnode *dnp = VTOSMB(dvp);
+    struct smbnode *np;
+    struct smbfs_streaminfo_pb *entries = NULL;
+    struct smbfs_streaminfo_pb *fetch = NULL;
+    struct smbfs_streaminfo_pb *entryp;
+    uint32_t window, peeked = 0, nfetch = 0, i;
+    uint32_t is_dir, need_rsrc_fork, need_finder_info, need_cmn_user_access;
+    vnode_t vp;
+    struct timespec ts;
+    int error;
+
+    window = MIN(smbfs_bulk_prefetch, SMBFS_BULK_PREFETCH_MAX);
+    if ((window < 2) ||
+        !(SSTOVC(share)->vc_flags & SMBV_SMB2)) {
+        return (0);
+    }
+
+    /* Nothing to do if the caller does not want any stream based attrs */
+    if (!(alist->commonattr & (ATTR_CMN_FNDRINFO | ATTR_CMN_USERACCESS)) &&
+        !(alist->fileattr & (ATTR_FILE_TOTALSIZE | ATTR_FILE_ALLOCSIZE |
+                             ATTR_FILE_RSRCLENGTH | ATTR_FILE_RSRCALLOCSIZE))) {
+        return (0);
+    }
+
+    SMB_MALLOC(entries,
+               struct smbfs_streaminfo_pb *,
+               sizeof(struct smbfs_streaminfo_pb) * window,
+               M_SMBTEMP,
+               M_WAITOK | M_ZERO);
+    SMB_MALLOC(fetch,
+               struct smbfs_streaminfo_pb *,
+               sizeof(struct smbfs_streaminfo_pb) * window,
+               M_SMBTEMP,
+               M_WAITOK | M_ZERO);
+    if ((entries == NULL) || (fetch == NULL)) {
+        SMBERROR("SMB_MALLOC failed\n");
+        goto done;
+    }
+
+    /* Entry 0 is the current one, the rest come from the reply */
+    entries[0].namep = ctx->f_LocalName;
+    entries[0].name_len = ctx->f_LocalNameLen;
+    entries[0].attr = ctx->f_attr;
+
+    (void) smb2fs_smb_findpeek(ctx, &entries[1], window - 1, &peeked);
+
+    for (i = 0; i < peeked + 1; i++) {
+        entryp = &entries[i];
+
+        /* Same checks as smbfs_update_ctx */
+        is_dir = (entryp->attr.fa_attr & SMB_EFA_DIRECTORY) ? 1 : 0;
+        need_rsrc_fork = (!is_dir &&
+                          (alist->fileattr & (ATTR_FILE_TOTALSIZE | ATTR_FILE_ALLOCSIZE |
+                                              ATTR_FILE_RSRCLENGTH | ATTR_FILE_RSRCALLOCSIZE)) &&
+                          !(entryp->attr.fa_valid_mask & FA_RSRC_FORK_VALID));
+        need_finder_info = ((alist->commonattr & ATTR_CMN_FNDRINFO) &&
+                            !(entryp->attr.fa_valid_mask & FA_FINDERINFO_VALID));
+        need_cmn_user_access = ((alist->commonattr & ATTR_CMN_USERACCESS) &&
+                                !(entryp->attr.fa_valid_mask & FA_MAX_ACCESS_VALID));
+        if (!need_rsrc_fork && !need_finder_info && !need_cmn_user_access) {
+            /* Enumeration already gave us everything (OS X server) */
+            continue;
+        }
+
+        /* <14430881> Skip a child with the same id as the parent */
+        if ((SSTOVC(share)->vc_misc_flags & SMBV_HAS_FILEIDS) &&
+            (entryp->attr.fa_ino == dnp->n_ino)) {
+            continue;
+        }
+
+        /* Results get cached in the vnode, getattrlistbulk creates it anyways */
+        vp = NULL;
+        error = smbfs_nget(share, vnode_mount(dvp),
+                           dvp, entryp->namep, entryp->name_len,
+                           &entryp->attr, &vp,
+                           MAKEENTRY, SMBFS_NGET_CREATE_VNODE,
+                           context);
+        if ((error) || (vp == NULL)) {
+            continue;
+        }
+        np = VTOSMB(vp);
+
+        /* Anything the vnode already has does not need to be fetched */
+        if (need_rsrc_fork) {
+            lck_mtx_lock(&np->rfrkMetaLock);
+            if (np->rfrk_cache_timer != 0) {
+                need_rsrc_fork = 0;
+            }
+            lck_mtx_unlock(&np->rfrkMetaLock);
+        }
+        if ((need_finder_info) && (np->finfo_cache_timer != 0)) {
+            need_finder_info = 0;
+        }
+        if ((need_cmn_user_access) &&
+            (timespeccmp(&np->maxAccessRightChTime, &np->n_chtime, ==))) {
+            need_cmn_user_access = 0;
+        }
+
+        smbnode_unlock(np);
+
+        if (!need_rsrc_fork && !need_finder_info && !need_cmn_user_access) {
+            vnode_put(vp);
+            continue;
+        }
+
+        /* Keep the iocount until the results are in */
+        fetch[nfetch] = *entryp;
+        fetch[nfetch].vp = vp;
+        nfetch++;
+    }
+
+    if (nfetch == 0) {
+        goto done;
+    }
+
+    OSIncrementAtomic64((SInt64 *) &smbfs_bulk_prefetch_batches);
+    OSAddAtomic64(nfetch, (SInt64 *) &smbfs_bulk_prefetch_queries);
+
+    error = smb2fs_smb_qstreaminfo_batch(share, dnp, fetch, nfetch, context);
+
+    for (i = 0; i < nfetch; i++) {
+        entryp = &fetch[i];
+        vp = entryp->vp;
+        np = VTOSMB(vp);
+
+        /*
+         * Only cache what smbfs_update_ctx would have cached from the same
+         * reply. Anything that failed is left for smbfs_update_ctx to get.
+         */
+        if ((error == 0) &&
+            ((entryp->error == 0) || (entryp->error == ENOATTR)) &&
+            (smbnode_lock(np, SMBFS_EXCLUSIVE_LOCK) == 0)) {
+            /* Update whether there is a named streams or not */
+            np->n_fstatus = (entryp->stream_flags & SMB_NO_SUBSTREAMS) ? kNO_SUBSTREAMS : 0;
+
+            if (!(entryp->attr.fa_attr & SMB_EFA_DIRECTORY)) {
+                lck_mtx_lock(&np->rfrkMetaLock);
+                if (entryp->stream_flags & SMB_NO_RESOURCE_FORK) {
+                    np->rfrk_size = 0;
+                    np->rfrk_alloc_size = 0;
+                }
+                else {
+                    np->rfrk_size = entryp->rsrc_size;
+                    np->rfrk_alloc_size = entryp->rsrc_alloc;
+                }
+                nanouptime(&ts);
+                np->rfrk_cache_timer = ts.tv_sec;
+                lck_mtx_unlock(&np->rfrkMetaLock);
+            }
+
+            if (entryp->stream_flags & SMB_NO_FINDER_INFO) {
+                /* Negative cache the Finder Info */
+                bzero(np->finfo, sizeof(np->finfo));
+                nanouptime(&ts);
+                np->finfo_cache_timer = ts.tv_sec;
+            }
+
+            np->maxAccessRights = entryp->max_access;
+            np->maxAccessRightChTime = entryp->attr.fa_chtime;
+
+            smbnode_unlock(np);
+        }
+
+        vnode_put(vp);
+    }
+
+done:
+    if (entries != NULL) {
+        /* Entry 0 is the ctx's name, the rest belong to us */
+        for (i = 1; i < peeked + 1; i++) {
+            if (entries[i].namep != NULL) {
+                SMB_FREE(entries[i].namep, M_TEMP);
+            }
+        }
+        SMB_FREE(entries, M_SMBTEMP);
+    }
+    if (fetch != NULL) {
+        SMB_FREE(fetch, M_SMBTEMP);
+    }
+
+    return (peeked);
+}
+
 static int
 smbfs_vnop_getattrlistbulk(struct vnop_getattrlistbulk_args *ap)
 /* struct vnop_getattrlistbulk_args {
@@ -9260,6 +9679,7 @@ smbfs_vnop_getattrlistbulk(struct vnop_getattrlistbulk_args *ap)
                                       vfs_context_t a_context;
                                       } *ap; */
 {
+    struct timespec start_time;
     struct vnode *vp = NULL;
     struct vnode *dvp = ap->a_vp;
     uio_t uio = ap->a_uio;
@@ -9276,6 +9696,7 @@ smbfs_vnop_getattrlistbulk(struct vnop_getattrlistbulk_args *ap)
     ssize_t fixedlen = 0, maxfixed_len = 0;
     ssize_t variable_len = 0, acl_len = 0;
     enum vtype vnode_type = VREG;
+    uint32_t prefetched = 0;
 
     /* Check for invalid buffer space. */
     if ((uio_resid(uio) <= 0) || (uio_iovcnt(uio) > 1)) {
@@ -9298,6 +9719,7 @@ smbfs_vnop_getattrlistbulk(struct vnop_getattrlistbulk_args *ap)
     dnp = VTOSMB(dvp);
     smp = VTOSMBFS(dvp);
 
+    nanouptime(&start_time);
     SMB_LOG_KTRACE(SMB_DBG_GET_ATTRLIST_BULK | DBG_FUNC_START, dnp->d_fid, 0, 0, 0, 0);
     
     /* Get Share reference */
@@ -9388,6 +9810,15 @@ smbfs_vnop_getattrlistbulk(struct vnop_getattrlistbulk_args *ap)
             break;
         }
         
+        /* Get the stream info for this entry and the next few in one go */
+        if (prefetched > 0) {
+            prefetched--;
+        }
+        else {
+            prefetched = smbfs_getattrlistbulk_prefetch(dvp, ctx, ap->a_alist,
+                                                        context);
+        }
+        
         /* 
          * Get the vnode type. vfs_setup_vattr_from_attrlist() only cares if
          * its a dir or not.
@@ -9577,6 +10008,7 @@ done:
     
     smbnode_unlock(VTOSMB(dvp));
     
+    smbfs_vop_stats_record(ap->a_vp, SMBFS_VOP_GETATTRLISTBULK, &start_time, error);
     SMB_LOG_KTRACE(SMB_DBG_GET_ATTRLIST_BULK | DBG_FUNC_END,
                    error, *ap->a_actualcount, 0, 0, 0);
 
@@ -509,6 +509,100 @@ int mb_put_uio(mbchain_t mbp, uio_t uiop, size_t size)
 	return 0;
 }
 
+/*
+ * Free routine for the mbufs mb_put_uio_extref attached, the memory belongs
+ * to someone else so just drop the reference.
+ */
+static void
+mb_extref_free(caddr_t buf, u_int size, caddr_t arg)
+{
+#pragma unused(buf, size)
+	struct mb_extref *extref = (struct mb_extref *)arg;
+	
+	lck_mtx_lock(&extref->er_lock);
+	if (--extref->er_refs == 0)
+		wakeup(extref);
+	lck_mtx_unlock(&extref->er_lock);
+}
+
+/*
+ * Same as mb_put_uio, except the uio's kernel memory gets attached to the
+ * chain a page at a time as external clusters instead of being copied. Every
+ * mbuf holds a reference in extref, the caller has to call mb_extref_wait
+ * before it lets go of the memory. User space uios just get copied.
+ */
+int mb_put_uio_extref(mbchain_t mbp, uio_t uiop, size_t size, struct mb_extref *extref)
+{
+	int error;
+	user_addr_t addr;
+	size_t cplen;
+	mbuf_t m;
+	
+	if (uio_isuserspace(uiop))
+		return mb_put_uio(mbp, uiop, size);
+	
+	while ((size > 0) && (uio_resid(uiop))) {
+		addr = uio_curriovbase(uiop);
+		cplen = (size_t)uio_curriovlen(uiop);
+		if (cplen == 0) {
+			/* Empty iovec, go to the next one */
+			uio_update(uiop, 0);
+			continue;
+		}
+		/* Never cross a page, that way each mbuf points at one page */
+		cplen = MIN(cplen, PAGE_SIZE - (addr & PAGE_MASK));
+		cplen = MIN(cplen, size);
+		
+		m = NULL;
+		lck_mtx_lock(&extref->er_lock);
+		extref->er_refs++;
+		lck_mtx_unlock(&extref->er_lock);
+		error = mbuf_attachcluster(MBUF_WAITOK, MBUF_TYPE_DATA, &m,
+								   CAST_DOWN(caddr_t, addr), mb_extref_free,
+								   cplen, (caddr_t)extref);
+		if (error) {
+			lck_mtx_lock(&extref->er_lock);
+			extref->er_refs--;
+			lck_mtx_unlock(&extref->er_lock);
+			return error;
+		}
+		mbuf_setlen(m, cplen);
+		
+		/* Nothing else can go in this mbuf, it's not ours */
+		mbuf_setnext(mbp->mb_cur, m);
+		mbp->mb_cur = m;
+		mbp->mb_mleft = 0;
+		mbp->mb_count += cplen;
+		mbp->mb_len += cplen;
+		
+		uio_update(uiop, cplen);
+		size -= cplen;
+	}
+	return 0;
+}
+
+/*
+ * Wait up to ts for all the mbufs mb_put_uio_extref handed out to be freed.
+ * The socket frees them once the data is acked, which is normally before
+ * the reply shows up, so we rarely end up sleeping here. Returns EWOULDBLOCK
+ * if some are still out, the caller decides how long is too long.
+ */
+int mb_extref_wait(struct mb_extref *extref, struct timespec *ts)
+{
+	int error = 0;
+	
+	lck_mtx_lock(&extref->er_lock);
+	while ((extref->er_refs > 0) && (error == 0)) {
+		error = msleep(extref, &extref->er_lock, PWAIT, "mb_extref_wait", ts);
+	}
+	if (extref->er_refs == 0)
+		error = 0;
+	else
+		error = EWOULDBLOCK;
+	lck_mtx_unlock(&extref->er_lock);
+	return error;
+}
+
 /*
  * Given a user land pointer place the data in a mbuf chain.
  */
@@ -89,8 +89,20 @@ int  mb_put_mem(mbchain_t , const char * , size_t , int );
 int  mb_put_mbuf(mbchain_t , mbuf_t );
 
 #ifdef KERNEL
+/*
+ * Counts the mbufs that point at a caller's memory instead of a copy of it.
+ * The memory has to stay put until mb_extref_wait returns 0. The caller
+ * owns er_lock, it has to be initialized before the first mbuf is attached.
+ */
+struct mb_extref {
+	lck_mtx_t	er_lock;
+	int32_t		er_refs;	/* mbufs not freed yet */
+};
+
 void mbuf_cat_internal(mbuf_t md_top, mbuf_t m0);
 int  mb_put_uio(mbchain_t mbp, uio_t uiop, size_t size);
+int  mb_put_uio_extref(mbchain_t mbp, uio_t uiop, size_t size, struct mb_extref *extref);
+int  mb_extref_wait(struct mb_extref *extref, struct timespec *ts);
 int  mb_put_user_mem(mbchain_t mbp, user_addr_t bufp, int size, off_t offset, vfs_context_t context);
 #endif // KERNEL
 
@@ -2836,6 +2836,9 @@ int smb_mount(struct smb_ctx *ctx, CFStringRef mpoint,  CFDictionaryRef mOptions
 	
 	mdata.KernelLogLevel = ctx->prefs.KernelLogLevel;
     mdata.max_resp_timeout = ctx->prefs.max_resp_timeout;
+    mdata.attr_cache_policy = ctx->prefs.attr_cache_policy;
+    mdata.attr_cache_min = ctx->prefs.attr_cache_min;
+    mdata.attr_cache_max = ctx->prefs.attr_cache_max;
 
 	mdata.dev = dfs_ctx->ct_fd;
 	
@@ -26,6 +26,7 @@
 #include <netsmb/smb_lib.h>
 #include <smbclient/smbclient.h>
 #include <smbclient/smbclient_internal.h>
+#include <smbfs/smbfs.h>
 #include "rcfile.h"
 #include "preference.h"
 #include "smb_preferences.h"
@@ -227,6 +228,20 @@ static void readPreferenceSection(struct rcfile *rcfile, struct smb_prefs *prefs
 		else
 			prefs->altflags &= ~SMBFS_MNT_SOFT;
 	}
+	
+	/* Attribute cache policy, the kernel checks the limits */
+	rc_getstringptr(rcfile, sname, "attr_cache_policy", &p);
+	if (p) {
+		if (strcmp(p, "mtime") == 0) {
+			prefs->attr_cache_policy = SMBFS_ATTRCACHE_MTIME;
+		} else if (strcmp(p, "fixed") == 0) {
+			prefs->attr_cache_policy = SMBFS_ATTRCACHE_FIXED;
+		} else if (strcmp(p, "adaptive") == 0) {
+			prefs->attr_cache_policy = SMBFS_ATTRCACHE_ADAPTIVE;
+		}
+	}
+	rc_getint(rcfile, sname, "attr_cache_min", &prefs->attr_cache_min);
+	rc_getint(rcfile, sname, "attr_cache_max", &prefs->attr_cache_max);
     
     /*
      * Start of the HIDDEN options of nsmb.  
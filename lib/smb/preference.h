@@ -50,6 +50,9 @@ struct smb_prefs {
 	uint32_t			lanman_on;
 	uint32_t			signing_required;
 	int32_t             max_resp_timeout;
+	int32_t             attr_cache_policy;
+	int32_t             attr_cache_min;
+	int32_t             attr_cache_max;
 };
 
 void getDefaultPreferences(struct smb_prefs *prefs);
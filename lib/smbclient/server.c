@@ -793,6 +793,117 @@ SMBGetShareAttributes(SMBHANDLE inConnection, void *outAttrs)
     return STATUS_SUCCESS;
 }
 
+NTSTATUS
+SMBGetShareStatistics(SMBHANDLE inConnection, SMBShareStatistics *outStats)
+{
+    struct smbioc_vc_stats vc_stats;
+    NTSTATUS status;
+    struct smb_ctx *ctx;
+    
+    if (!inConnection || !outStats)
+        return STATUS_INVALID_PARAMETER;
+    
+    status = SMBServerContext(inConnection, (void **)&ctx);
+    if (!NT_SUCCESS(status)) {
+        smb_log_info("%s: failed to get smb_ctx, syserr = %s",
+					 ASL_LEVEL_ERR, __FUNCTION__, strerror(errno));
+        return status;
+    }
+    
+    memset(&vc_stats, 0, sizeof(vc_stats));
+	vc_stats.ioc_version = SMB_IOC_STRUCT_VERSION;
+	if (smb_ioctl_call(ctx->ct_fd, SMBIOC_VC_STATS, &vc_stats) == -1) {
+		smb_log_info("%s: Getting the vc stats failed, syserr = %s",
+					 ASL_LEVEL_ERR, __FUNCTION__, strerror(errno));
+        return errno;
+    }
+    
+    memset(outStats, 0, sizeof(*outStats));
+    outStats->credits_granted = vc_stats.credits_granted;
+    outStats->credits_max = vc_stats.credits_max;
+    outStats->credits_target = vc_stats.credits_target;
+    outStats->credits_inflight = vc_stats.credits_inflight;
+    outStats->credits_wait = vc_stats.credits_wait;
+    outStats->credits_total_granted = vc_stats.credits_total_granted;
+    outStats->credits_total_consumed = vc_stats.credits_total_consumed;
+    outStats->credits_total_requested = vc_stats.credits_total_requested;
+    outStats->credits_wait_cnt = vc_stats.credits_wait_cnt;
+    outStats->credits_wait_usecs = vc_stats.credits_wait_usecs;
+    outStats->credits_wait_max_usecs = vc_stats.credits_wait_max_usecs;
+    outStats->lease_attr_hits = vc_stats.lease_attr_hits;
+    outStats->lease_open_hits = vc_stats.lease_open_hits;
+    outStats->lease_breaks = vc_stats.lease_breaks;
+    outStats->bytes_sent = vc_stats.bytes_sent;
+    outStats->bytes_recvd = vc_stats.bytes_recvd;
+    outStats->msgs_sent = vc_stats.msgs_sent;
+    outStats->msgs_recvd = vc_stats.msgs_recvd;
+    outStats->send_calls = vc_stats.send_calls;
+    outStats->rqs_inflight = vc_stats.rqs_inflight;
+    outStats->srtt_usecs = vc_stats.srtt_usecs;
+    outStats->rtt_min_usecs = vc_stats.rtt_min_usecs;
+    outStats->reconnect_cnt = vc_stats.reconnect_cnt;
+    outStats->reconnect_usecs = vc_stats.reconnect_usecs;
+    outStats->attr_cache_policy = vc_stats.attr_cache_policy;
+    outStats->attr_cache_min = vc_stats.attr_cache_min;
+    outStats->attr_cache_max = vc_stats.attr_cache_max;
+    outStats->attr_cache_rate = vc_stats.attr_cache_rate;
+    outStats->attr_cache_hits = vc_stats.attr_cache_hits;
+    outStats->attr_cache_misses = vc_stats.attr_cache_misses;
+    outStats->attr_cache_expired = vc_stats.attr_cache_expired;
+    
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+SMBGetOpStatistics(SMBHANDLE inConnection, uint32_t inTable,
+                   SMBOpLatency *outHists, uint32_t inMaxHists,
+                   uint32_t *outCount)
+{
+    struct smbioc_op_stats op_stats;
+    NTSTATUS status;
+    struct smb_ctx *ctx;
+    uint32_t ii;
+    
+    if (!inConnection || !outHists || !outCount)
+        return STATUS_INVALID_PARAMETER;
+    
+    status = SMBServerContext(inConnection, (void **)&ctx);
+    if (!NT_SUCCESS(status)) {
+        smb_log_info("%s: failed to get smb_ctx, syserr = %s",
+					 ASL_LEVEL_ERR, __FUNCTION__, strerror(errno));
+        return status;
+    }
+    
+    *outCount = 0;
+    
+    /* The kernel hands the table back a piece at a time */
+    do {
+        memset(&op_stats, 0, sizeof(op_stats));
+        op_stats.ioc_version = SMB_IOC_STRUCT_VERSION;
+        op_stats.ioc_table = inTable;
+        op_stats.ioc_first = *outCount;
+        if (smb_ioctl_call(ctx->ct_fd, SMBIOC_OP_STATS, &op_stats) == -1) {
+            smb_log_info("%s: Getting the op stats failed, syserr = %s",
+                         ASL_LEVEL_ERR, __FUNCTION__, strerror(errno));
+            return errno;
+        }
+        
+        for (ii = 0; (ii < op_stats.ioc_count) && (*outCount < inMaxHists); ii++) {
+            outHists[*outCount].count = op_stats.ioc_hists[ii].lh_count;
+            outHists[*outCount].errors = op_stats.ioc_hists[ii].lh_errors;
+            outHists[*outCount].total_usecs = op_stats.ioc_hists[ii].lh_total_usecs;
+            outHists[*outCount].max_usecs = op_stats.ioc_hists[ii].lh_max_usecs;
+            memcpy(outHists[*outCount].buckets, op_stats.ioc_hists[ii].lh_buckets,
+                   sizeof(outHists[*outCount].buckets));
+            *outCount += 1;
+        }
+    } while ((op_stats.ioc_count != 0) &&
+             (*outCount < op_stats.ioc_total) &&
+             (*outCount < inMaxHists));
+    
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS
 SMBRetainServer(
     SMBHANDLE inConnection)
@@ -304,6 +304,102 @@ SMBGetShareAttributes(
 __OSX_AVAILABLE_STARTING(__MAC_10_9, __IPHONE_NA)
 ;
 
+typedef struct SMBShareStatistics
+{
+    /* SMB 2/3 crediting */
+    uint32_t    credits_granted;
+    uint32_t    credits_max;
+    uint32_t    credits_target;
+    uint32_t    credits_inflight;
+    uint32_t    credits_wait;
+    uint64_t    credits_total_granted;
+    uint64_t    credits_total_consumed;
+    uint64_t    credits_total_requested;
+    uint64_t    credits_wait_cnt;
+    uint64_t    credits_wait_usecs;
+    uint64_t    credits_wait_max_usecs;
+    /* SMB 2/3 lease caching */
+    uint64_t    lease_attr_hits;
+    uint64_t    lease_open_hits;
+    uint64_t    lease_breaks;
+    /* Transport */
+    uint64_t    bytes_sent;
+    uint64_t    bytes_recvd;
+    uint64_t    msgs_sent;
+    uint64_t    msgs_recvd;
+    uint64_t    send_calls;
+    uint32_t    rqs_inflight;
+    uint32_t    srtt_usecs;
+    uint32_t    rtt_min_usecs;
+    uint64_t    reconnect_cnt;
+    uint64_t    reconnect_usecs;
+    /* Attribute cache */
+    uint32_t    attr_cache_policy;
+    uint32_t    attr_cache_min;
+    uint32_t    attr_cache_max;
+    uint32_t    attr_cache_rate;
+    uint64_t    attr_cache_hits;
+    uint64_t    attr_cache_misses;
+    uint64_t    attr_cache_expired;
+} SMBShareStatistics;
+
+/*!
+ * @function SMBGetShareStatistics
+ * @abstract Return the statistics kept in the smb_vc for a particular share.
+ * @param inConnection A SMBHANDLE created by SMBOpenServerEx.
+ * @param outStats is of the type SMBShareStatistics
+ * @result Returns an NTSTATUS error code.
+ */
+SMBCLIENT_EXPORT
+NTSTATUS
+SMBGetShareStatistics(
+        SMBHANDLE	inConnection,
+        SMBShareStatistics *outStats)
+__OSX_AVAILABLE_STARTING(__MAC_10_9, __IPHONE_NA)
+;
+
+/* Latency histograms that SMBGetOpStatistics can return */
+enum {
+    kSMBOpStatsVC = 1,      /* SMB 2/3 commands on the connection, by command */
+    kSMBOpStatsShare = 2,   /* SMB 2/3 commands on the share, by command */
+    kSMBOpStatsVNOP = 3     /* file system calls on the mounted share */
+};
+
+#define kSMBOpLatencyBuckets 24
+
+typedef struct SMBOpLatency
+{
+    uint64_t    count;
+    uint64_t    errors;
+    uint64_t    total_usecs;
+    uint64_t    max_usecs;
+    /* buckets[i] counts operations that took [2^i, 2^(i+1)) usecs */
+    uint64_t    buckets[kSMBOpLatencyBuckets];
+} SMBOpLatency;
+
+/*!
+ * @function SMBGetOpStatistics
+ * @abstract Return the per operation latency histograms kept for a
+ * particular share.
+ * @param inConnection A SMBHANDLE created by SMBOpenServerEx.
+ * @param inTable Which table to return, kSMBOpStatsVC, kSMBOpStatsShare or
+ * kSMBOpStatsVNOP.
+ * @param outHists Array of inMaxHists entries to fill in.
+ * @param inMaxHists Number of entries in outHists.
+ * @param outCount Number of entries filled in.
+ * @result Returns an NTSTATUS error code.
+ */
+SMBCLIENT_EXPORT
+NTSTATUS
+SMBGetOpStatistics(
+        SMBHANDLE	inConnection,
+        uint32_t    inTable,
+        SMBOpLatency *outHists,
+        uint32_t    inMaxHists,
+        uint32_t    *outCount)
+__OSX_AVAILABLE_STARTING(__MAC_10_9, __IPHONE_NA)
+;
+
 /*!
  * @function SMBCreateFile
  * @abstract Create of open a file.
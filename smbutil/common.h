@@ -41,6 +41,8 @@ int  cmd_view(int argc, char *argv[]);
 int  cmd_dfs(int argc, char *argv[]);
 int  cmd_identity(int argc, char *argv[]);
 int  cmd_statshares(int argc, char *argv[]);
+int  cmd_stats(int argc, char *argv[]);
+int  cmd_servercopy(int argc, char *argv[]);
 void lookup_usage(void);
 void status_usage(void);
 void view_usage(void);
@@ -48,6 +50,8 @@ void dfs_usage(void);
 void identity_usage(void);
 void ntstatus_to_err(NTSTATUS status);
 void statshares_usage(void);
+void stats_usage(void);
+void servercopy_usage(void);
 struct statfs *smb_getfsstat(int *fs_cnt);
 CFArrayRef createShareArrayFromShareDictionary(CFDictionaryRef shareDict);
 	
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Apple Inc.
+ * 4. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <copyfile.h>
+#include <err.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <sysexits.h>
+
+#include "common.h"
+
+/*
+ * Both files have to be on the same smbfs mount for the copy to be done
+ * by the server.
+ */
+static void
+check_smb_mount(const char *path, struct statfs *fsp)
+{
+	if (statfs(path, fsp) == -1) {
+		err(EX_NOINPUT, "%s", path);
+	}
+	if (strcmp(fsp->f_fstypename, "smbfs") != 0) {
+		errx(EX_USAGE, "%s is not on a smb mount", path);
+	}
+}
+
+int
+cmd_servercopy(int argc, char *argv[])
+{
+	const char *src, *dst;
+	char *dst_dir, *slash;
+	struct statfs src_fs, dst_fs;
+	struct stat sb;
+	struct timeval start, stop;
+	double secs;
+	copyfile_flags_t flags = COPYFILE_ALL | COPYFILE_EXCL;
+	int opt;
+	
+	while ((opt = getopt(argc, argv, "f")) != EOF) {
+		switch(opt) {
+			case 'f':
+				flags &= ~COPYFILE_EXCL;
+				break;
+			default:
+				servercopy_usage();
+				/*NOTREACHED*/
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2)
+		servercopy_usage();
+	src = argv[0];
+	dst = argv[1];
+	
+	if (stat(src, &sb) == -1) {
+		err(EX_NOINPUT, "%s", src);
+	}
+	if (!S_ISREG(sb.st_mode)) {
+		errx(EX_USAGE, "%s is not a regular file", src);
+	}
+	check_smb_mount(src, &src_fs);
+	
+	/* The target doesn't exist yet, so check its parent */
+	dst_dir = strdup(dst);
+	if (dst_dir == NULL) {
+		err(EX_OSERR, "strdup");
+	}
+	slash = strrchr(dst_dir, '/');
+	if (slash == NULL) {
+		strlcpy(dst_dir, ".", strlen(dst_dir) + 1);
+	} else if (slash == dst_dir) {
+		slash[1] = '\0';
+	} else {
+		*slash = '\0';
+	}
+	check_smb_mount(dst_dir, &dst_fs);
+	free(dst_dir);
+	
+	if (bcmp(&src_fs.f_fsid, &dst_fs.f_fsid, sizeof(src_fs.f_fsid)) != 0) {
+		errx(EX_USAGE, "%s and %s are not on the same share", src, dst);
+	}
+	
+	/*
+	 * The volume has VOL_CAP_INT_COPYFILE, so copyfile(3) ends up in
+	 * smbfs_vnop_copyfile which hands the copy to the server.
+	 */
+	gettimeofday(&start, NULL);
+	if (copyfile(src, dst, NULL, flags) == -1) {
+		err(EX_IOERR, "server side copy of %s to %s failed", src, dst);
+	}
+	gettimeofday(&stop, NULL);
+	
+	timersub(&stop, &start, &stop);
+	secs = stop.tv_sec + (stop.tv_usec / 1000000.0);
+	
+	fprintf(stdout, "%lld bytes copied in %.3f secs", (long long)sb.st_size, secs);
+	if (secs > 0) {
+		fprintf(stdout, " (%.2f MB/sec)", (sb.st_size / (1024.0 * 1024.0)) / secs);
+	}
+	fprintf(stdout, "\n");
+	return 0;
+}
+
+void
+servercopy_usage(void)
+{
+	fprintf(stderr, "usage: smbutil servercopy [-f] source_file target_file\n");
+	fprintf(stderr, "where options are:\n"
+			"    -f    overwrite the target file if it exists\n");
+	exit(1);
+}
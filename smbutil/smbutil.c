@@ -70,6 +70,8 @@ static struct commands {
 	{"dfs",			cmd_dfs,		dfs_usage},
 	{"identity",	cmd_identity,	identity_usage},
     {"statshares",        cmd_statshares,   statshares_usage},
+    {"stats",       cmd_stats,        stats_usage},
+	{"servercopy",	cmd_servercopy,	servercopy_usage},
 	{NULL, NULL, NULL}
 };
 
@@ -190,6 +192,8 @@ help(void) {
 	" dfs		list DFS referrals\n"
 	" identity	identity of the user as known by the specified host\n"
     " statshares	list the attributes of mounted share(s)\n"
+    " stats		list operation latencies of a mounted share\n"
+	" servercopy	copy a file on a mounted share using server side copy\n"
 	"\n");
 	exit(1);
 }
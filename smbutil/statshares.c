@@ -55,6 +55,7 @@
 #include <netsmb/smbio_2.h>
 #include <netsmb/smb_2.h>
 #include <netsmb/smb_conn.h>
+#include <smbfs/smbfs.h>
 
 #include "common.h"
 #include "netshareenum.h"
@@ -126,6 +127,9 @@ interpret_and_display(char *share, SMBShareAttributes *sattrs)
                   "AUTO_NEGOTIATE", &ret);
     
     /* smb version */
+    print_if_attr(stdout, sattrs->vc_flags,
+                  SMBV_SMB311, "SMB_VERSION",
+                  "SMB_3.1.1", &ret);
     print_if_attr(stdout, sattrs->vc_flags,
                   SMBV_SMB302, "SMB_VERSION",
                   "SMB_3.02", &ret);
@@ -260,14 +264,61 @@ interpret_and_display(char *share, SMBShareAttributes *sattrs)
     }
 }
 
+static void
+display_stats(SMBShareStatistics *sstats)
+{
+    /* SMB 2/3 crediting */
+    fprintf(stdout, "%-30s%-30s%u\n", "", "CREDITS_ON_HAND", sstats->credits_granted);
+    fprintf(stdout, "%-30s%-30s%u\n", "", "CREDITS_MAX", sstats->credits_max);
+    fprintf(stdout, "%-30s%-30s%u\n", "", "CREDITS_TARGET", sstats->credits_target);
+    fprintf(stdout, "%-30s%-30s%u\n", "", "CREDITS_IN_FLIGHT", sstats->credits_inflight);
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "CREDITS_GRANTED", sstats->credits_total_granted);
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "CREDITS_CONSUMED", sstats->credits_total_consumed);
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "CREDITS_REQUESTED", sstats->credits_total_requested);
+    fprintf(stdout, "%-30s%-30s%u\n", "", "CREDIT_WAITERS", sstats->credits_wait);
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "CREDIT_WAITS", sstats->credits_wait_cnt);
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "CREDIT_WAIT_TOTAL_USECS", sstats->credits_wait_usecs);
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "CREDIT_WAIT_MAX_USECS", sstats->credits_wait_max_usecs);
+    /* SMB 2/3 lease caching */
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "LEASE_ATTR_HITS", sstats->lease_attr_hits);
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "LEASE_OPEN_HITS", sstats->lease_open_hits);
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "LEASE_BREAKS", sstats->lease_breaks);
+    /* Transport */
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "BYTES_SENT", sstats->bytes_sent);
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "BYTES_RECEIVED", sstats->bytes_recvd);
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "MESSAGES_SENT", sstats->msgs_sent);
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "MESSAGES_RECEIVED", sstats->msgs_recvd);
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "SEND_CALLS", sstats->send_calls);
+    fprintf(stdout, "%-30s%-30s%.2f\n", "", "MESSAGES_PER_SEND",
+            (sstats->send_calls) ? (double) sstats->msgs_sent / sstats->send_calls : 0.0);
+    fprintf(stdout, "%-30s%-30s%u\n", "", "REQUESTS_IN_FLIGHT", sstats->rqs_inflight);
+    fprintf(stdout, "%-30s%-30s%u\n", "", "SMOOTHED_RTT_USECS", sstats->srtt_usecs);
+    fprintf(stdout, "%-30s%-30s%u\n", "", "MIN_RTT_USECS", sstats->rtt_min_usecs);
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "RECONNECTS", sstats->reconnect_cnt);
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "RECONNECT_TOTAL_USECS", sstats->reconnect_usecs);
+    /* Attribute cache */
+    fprintf(stdout, "%-30s%-30s%s\n", "", "ATTR_CACHE_POLICY",
+            (sstats->attr_cache_policy == SMBFS_ATTRCACHE_FIXED) ? "fixed" :
+            (sstats->attr_cache_policy == SMBFS_ATTRCACHE_ADAPTIVE) ? "adaptive" : "mtime");
+    fprintf(stdout, "%-30s%-30s%u\n", "", "ATTR_CACHE_MIN_SECS", sstats->attr_cache_min);
+    fprintf(stdout, "%-30s%-30s%u\n", "", "ATTR_CACHE_MAX_SECS", sstats->attr_cache_max);
+    fprintf(stdout, "%-30s%-30s%u\n", "", "ATTR_CACHE_CHANGES_PER_MIN", sstats->attr_cache_rate);
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "ATTR_CACHE_HITS", sstats->attr_cache_hits);
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "ATTR_CACHE_MISSES", sstats->attr_cache_misses);
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "ATTR_CACHE_EXPIRED", sstats->attr_cache_expired);
+}
+
+/*
+ * Open a connection to the share mounted at share_mp. The share name is
+ * returned in share_name, which has to be MNAMELEN long.
+ */
 static NTSTATUS
-stat_share(char *share_mp, bool disablePrintingHeader)
+open_mounted_share(char *share_mp, char *share_name, SMBHANDLE *outConnection)
 {
-    SMBHANDLE inConnection = NULL;
     NTSTATUS status = STATUS_SUCCESS;
     struct statfs statbuf;
     char tmp_name[MNAMELEN];
-    char *share_name = NULL, *end = NULL;
+    char *name = NULL, *end = NULL;
     
     if ((statfs((const char*)share_mp, &statbuf) == -1) || (strncmp(statbuf.f_fstypename, "smbfs", 5) != 0)) {
         status = STATUS_INVALID_PARAMETER;
@@ -281,13 +332,13 @@ stat_share(char *share_mp, bool disablePrintingHeader)
      * mountpath and skip the initial "//"
      */
     strlcpy(tmp_name, &statbuf.f_mntfromname[2], sizeof(tmp_name));
-    share_name = strchr(tmp_name, '/');
-    if (share_name != NULL) {
+    name = strchr(tmp_name, '/');
+    if (name != NULL) {
         /* skip over the / to point at share name */
-        share_name += 1;
+        name += 1;
         
         /* Check for submount and if found, strip it off */
-        end = strchr(share_name, '/');
+        end = strchr(name, '/');
         if (end != NULL) {
             /* Found submount, just null it out as we only want sharepoint */
             *end = 0x00;
@@ -300,16 +351,29 @@ stat_share(char *share_mp, bool disablePrintingHeader)
         errno = EINVAL;
         return  status;
     }
+    strlcpy(share_name, name, MNAMELEN);
     
     status = SMBOpenServerWithMountPoint(share_mp,
                                          share_name,
-                                         &inConnection,
+                                         outConnection,
                                          0);
     if (!NT_SUCCESS(status)) {
         fprintf(stderr, "%s : SMBOpenServerWithMountPoint() failed for %s <%s>\n",
                 __FUNCTION__, share_mp, share_name);
     }
-    else {
+    
+    return status;
+}
+
+static NTSTATUS
+stat_share(char *share_mp, bool disablePrintingHeader)
+{
+    SMBHANDLE inConnection = NULL;
+    NTSTATUS status = STATUS_SUCCESS;
+    char share_name[MNAMELEN];
+    
+    status = open_mounted_share(share_mp, share_name, &inConnection);
+    if (NT_SUCCESS(status)) {
         SMBShareAttributes sattrs;
         
         status = SMBGetShareAttributes(inConnection, &sattrs);
@@ -322,6 +386,18 @@ stat_share(char *share_mp, bool disablePrintingHeader)
                 print_header(stdout);
 
             interpret_and_display(share_name, &sattrs);
+            
+            if (sattrs.vc_flags & SMBV_SMB2) {
+                SMBShareStatistics sstats;
+                
+                if (NT_SUCCESS(SMBGetShareStatistics(inConnection, &sstats))) {
+                    display_stats(&sstats);
+                }
+                else {
+                    fprintf(stderr, "%s : SMBGetShareStatistics() failed for %s <%s>\n",
+                            __FUNCTION__, share_mp, share_name);
+                }
+            }
             print_delimeter(stdout);
         }
         SMBReleaseServer(inConnection);
@@ -363,32 +439,103 @@ stat_all_shares()
     return error;
 }
 
+/*
+ * Print what changed in the transport stats every interval seconds, like
+ * iostat. Runs until interrupted or the share goes away.
+ */
+static NTSTATUS
+watch_share(char *share_mp, int interval)
+{
+    SMBHANDLE inConnection = NULL;
+    NTSTATUS status = STATUS_SUCCESS;
+    char share_name[MNAMELEN];
+    SMBShareStatistics prev, cur;
+    int lines = 0;
+    
+    status = open_mounted_share(share_mp, share_name, &inConnection);
+    if (!NT_SUCCESS(status))
+        return status;
+    
+    status = SMBGetShareStatistics(inConnection, &prev);
+    while (NT_SUCCESS(status)) {
+        sleep(interval);
+        
+        status = SMBGetShareStatistics(inConnection, &cur);
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "%s : SMBGetShareStatistics() failed for %s <%s>\n",
+                    __FUNCTION__, share_mp, share_name);
+            break;
+        }
+        
+        if ((lines % 20) == 0) {
+            fprintf(stdout, "%9s%9s%11s%11s%9s%9s%10s%7s%12s\n",
+                    "msgs/s", "msgs/s", "KB/s", "KB/s", "credits", "inflight",
+                    "srtt_us", "recon", "recon_ms");
+            fprintf(stdout, "%9s%9s%11s%11s%9s%9s%10s%7s%12s\n",
+                    "out", "in", "out", "in", "", "", "", "", "");
+        }
+        lines++;
+        
+        fprintf(stdout, "%9llu%9llu%11llu%11llu%9u%9u%10u%7llu%12llu\n",
+                (cur.msgs_sent - prev.msgs_sent) / interval,
+                (cur.msgs_recvd - prev.msgs_recvd) / interval,
+                (cur.bytes_sent - prev.bytes_sent) / 1024 / interval,
+                (cur.bytes_recvd - prev.bytes_recvd) / 1024 / interval,
+                cur.credits_granted,
+                cur.rqs_inflight,
+                cur.srtt_usecs,
+                cur.reconnect_cnt - prev.reconnect_cnt,
+                (cur.reconnect_usecs - prev.reconnect_usecs) / 1000);
+        fflush(stdout);
+        
+        prev = cur;
+    }
+    
+    SMBReleaseServer(inConnection);
+    return status;
+}
+
 int
 cmd_statshares(int argc, char *argv[])
 {
     NTSTATUS status = STATUS_SUCCESS;
     int opt;
     bool disablePrintingHeader = 0;
+    bool all_shares = 0;
+    char *share_mp = NULL;
+    int interval = 0;
     
-    if ((opt = getopt(argc, argv, "am:")) != EOF) {
+    while ((opt = getopt(argc, argv, "am:w:")) != EOF) {
 		switch(opt) {
 			case 'a':
-                if (argc != 2)
-                    statshares_usage();
-                status = stat_all_shares();
+                all_shares = 1;
                 break;
             case 'm':
-                if (argc != 3)
+                share_mp = optarg;
+                break;
+            case 'w':
+                interval = atoi(optarg);
+                if (interval <= 0)
                     statshares_usage();
-                status = stat_share(optarg, disablePrintingHeader);
                 break;
             default:
+                statshares_usage();
                 break;
         }
     }
-    else
+    
+    /* -a and -m are mutually exclusive, and -w only works with -m */
+    if ((optind != argc) || (all_shares == (share_mp != NULL)) ||
+        (interval && all_shares))
         statshares_usage();
     
+    if (all_shares)
+        status = stat_all_shares();
+    else if (interval)
+        status = watch_share(share_mp, interval);
+    else
+        status = stat_share(share_mp, disablePrintingHeader);
+    
     if (!NT_SUCCESS(status))
         ntstatus_to_err(status);
     
@@ -398,12 +545,179 @@ cmd_statshares(int argc, char *argv[])
 void
 statshares_usage(void)
 {
-	fprintf(stderr, "usage : smbutil statshares [-m <mount_path>] | [-a]\n");
+	fprintf(stderr, "usage : smbutil statshares [-m <mount_path> [-w <interval>]] | [-a]\n");
     fprintf(stderr, "\
             [\n \
             description :\n \
             -a : attributes of all mounted shares\n \
             -m <mount_path> : attributes of share mounted at mount_path\n \
+            -w <interval> : with -m, print transport stats every interval seconds\n \
+            ]\n");
+    exit(1);
+}
+
+static const char *smb2_cmd_names[SMB_LAT_NCMDS] = {
+    "NEGOTIATE", "SESSION_SETUP", "LOGOFF", "TREE_CONNECT", "TREE_DISCONNECT",
+    "CREATE", "CLOSE", "FLUSH", "READ", "WRITE", "LOCK", "IOCTL", "CANCEL",
+    "ECHO", "QUERY_DIRECTORY", "CHANGE_NOTIFY", "QUERY_INFO", "SET_INFO",
+    "OPLOCK_BREAK"
+};
+
+static const char *vop_names[SMBFS_VOP_MAX] = {
+    [SMBFS_VOP_LOOKUP] = "LOOKUP",
+    [SMBFS_VOP_GETATTR] = "GETATTR",
+    [SMBFS_VOP_SETATTR] = "SETATTR",
+    [SMBFS_VOP_OPEN] = "OPEN",
+    [SMBFS_VOP_CLOSE] = "CLOSE",
+    [SMBFS_VOP_READ] = "READ",
+    [SMBFS_VOP_WRITE] = "WRITE",
+    [SMBFS_VOP_READDIR] = "READDIR",
+    [SMBFS_VOP_GETATTRLISTBULK] = "GETATTRLISTBULK",
+    [SMBFS_VOP_CREATE] = "CREATE",
+    [SMBFS_VOP_MKDIR] = "MKDIR",
+    [SMBFS_VOP_REMOVE] = "REMOVE",
+    [SMBFS_VOP_RMDIR] = "RMDIR",
+    [SMBFS_VOP_RENAME] = "RENAME",
+    [SMBFS_VOP_FSYNC] = "FSYNC",
+    [SMBFS_VOP_PAGEIN] = "PAGEIN",
+    [SMBFS_VOP_PAGEOUT] = "PAGEOUT",
+    [SMBFS_VOP_GETXATTR] = "GETXATTR",
+    [SMBFS_VOP_SETXATTR] = "SETXATTR",
+    [SMBFS_VOP_LISTXATTR] = "LISTXATTR",
+    [SMBFS_VOP_REMOVEXATTR] = "REMOVEXATTR",
+    [SMBFS_VOP_ACCESS] = "ACCESS",
+    [SMBFS_VOP_COPYFILE] = "COPYFILE"
+};
+
+static void
+display_op_stats(const char *title, SMBOpLatency *hists, uint32_t count,
+                 const char **names, uint32_t max_names)
+{
+    uint32_t ii, jj;
+    
+    fprintf(stdout, "%s\n", title);
+    fprintf(stdout, "%-20s%12s%10s%12s%12s\n",
+            "OPERATION", "COUNT", "ERRORS", "AVG_USECS", "MAX_USECS");
+    for (ii = 0; ii < count; ii++) {
+        if (hists[ii].count == 0)
+            continue;
+        
+        fprintf(stdout, "%-20s%12llu%10llu%12llu%12llu\n",
+                ((ii < max_names) && (names[ii] != NULL)) ? names[ii] : "UNKNOWN",
+                hists[ii].count, hists[ii].errors,
+                hists[ii].total_usecs / hists[ii].count,
+                hists[ii].max_usecs);
+        
+        if (!verbose)
+            continue;
+        
+        /* Bucket jj is [2^jj, 2^(jj+1)) usecs, bucket 0 also has < 1 usec */
+        for (jj = 0; jj < kSMBOpLatencyBuckets; jj++) {
+            if (hists[ii].buckets[jj] == 0)
+                continue;
+            fprintf(stdout, "    %10llu - %-10llu usecs %12llu\n",
+                    (jj == 0) ? 0ULL : (1ULL << jj),
+                    (1ULL << (jj + 1)) - 1,
+                    hists[ii].buckets[jj]);
+        }
+    }
+    fprintf(stdout, "\n");
+}
+
+static NTSTATUS
+get_and_display_op_stats(SMBHANDLE inConnection, uint32_t table,
+                         const char *title, const char **names,
+                         uint32_t max_names)
+{
+    SMBOpLatency hists[SMB_LAT_NCMDS > SMBFS_VOP_MAX ? SMB_LAT_NCMDS : SMBFS_VOP_MAX];
+    uint32_t count = 0;
+    NTSTATUS status;
+    
+    memset(hists, 0, sizeof(hists));
+    status = SMBGetOpStatistics(inConnection, table, hists,
+                                sizeof(hists) / sizeof(hists[0]), &count);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "%s : SMBGetOpStatistics() failed for %s\n",
+                __FUNCTION__, title);
+        return status;
+    }
+    
+    display_op_stats(title, hists, count, names, max_names);
+    return status;
+}
+
+int
+cmd_stats(int argc, char *argv[])
+{
+    SMBHANDLE inConnection = NULL;
+    NTSTATUS status = STATUS_SUCCESS;
+    char share_name[MNAMELEN];
+    int opt;
+    int show_vc = 0, show_share = 0, show_vnop = 0;
+    
+    while ((opt = getopt(argc, argv, "csf")) != EOF) {
+		switch(opt) {
+			case 'c':
+                show_vc = 1;
+                break;
+			case 's':
+                show_share = 1;
+                break;
+			case 'f':
+                show_vnop = 1;
+                break;
+            default:
+                stats_usage();
+                break;
+        }
+    }
+    if (optind != (argc - 1))
+        stats_usage();
+    
+    /* Nothing picked, show them all */
+    if (!show_vc && !show_share && !show_vnop) {
+        show_vc = show_share = show_vnop = 1;
+    }
+    
+    status = open_mounted_share(argv[optind], share_name, &inConnection);
+    if (NT_SUCCESS(status)) {
+        fprintf(stdout, "%s\n\n", share_name);
+        
+        if (NT_SUCCESS(status) && show_vc) {
+            status = get_and_display_op_stats(inConnection, kSMBOpStatsVC,
+                                              "SMB 2/3 COMMANDS ON THE CONNECTION",
+                                              smb2_cmd_names, SMB_LAT_NCMDS);
+        }
+        if (NT_SUCCESS(status) && show_share) {
+            status = get_and_display_op_stats(inConnection, kSMBOpStatsShare,
+                                              "SMB 2/3 COMMANDS ON THE SHARE",
+                                              smb2_cmd_names, SMB_LAT_NCMDS);
+        }
+        if (NT_SUCCESS(status) && show_vnop) {
+            status = get_and_display_op_stats(inConnection, kSMBOpStatsVNOP,
+                                              "FILE SYSTEM CALLS ON THE MOUNT",
+                                              vop_names, SMBFS_VOP_MAX);
+        }
+        SMBReleaseServer(inConnection);
+    }
+    
+    if (!NT_SUCCESS(status))
+        ntstatus_to_err(status);
+    
+    return 0;
+}
+
+void
+stats_usage(void)
+{
+	fprintf(stderr, "usage : smbutil [-v] stats [-c] [-s] [-f] <mount_path>\n");
+    fprintf(stderr, "\
+            [\n \
+            description :\n \
+            -c : latency of SMB 2/3 commands on the connection\n \
+            -s : latency of SMB 2/3 commands on the share\n \
+            -f : latency of file system calls on the mount\n \
+            with none of them, all three are listed; -v also lists the histograms\n \
             ]\n");
     exit(1);
 }